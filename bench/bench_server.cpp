@@ -0,0 +1,599 @@
+/**
+ * @file bench_server.cpp
+ * @brief Нагрузочный тест сервера: задержка пересылки сообщений и подключения с историей.
+ *
+ * Запуск: bench_server [--server <путь>] [--clients N] [--messages M] [--port P]
+ *                      [--login-window W] [--auth-workers K] [--threads T]
+ *                      [--timeout <с>] [--json <файл>] [--select|--io-uring] [--binary]
+ *
+ * Механизм:
+ * - Поднимает локальную заглушку Bot API (MockTelegram) и запускает
+ *   console_server во временном каталоге с --telegram-url на неё.
+ * - Открывает N клиентов, говорящих по обычному строковому протоколу,
+ *   и ведёт их всех одним циклом epoll.
+ * - Фазы разделены барьером (следующая начинается, когда все клиенты
+ *   закончили предыдущую): вход по коду из заглушки; /connect + yes;
+ *   обмен M сообщениями в каждой паре с передачей слова (/vote) и /end;
+ *   повторное /connect + yes (теперь с историей) и ещё один обмен.
+ * - Каждое сообщение несёт время отправки, получатель вычисляет задержку
+ *   пересылки. Задержка подключения — от отправки "yes" до получения
+ *   инициатором "Connection accepted" (после истории).
+ * - Результат (пропускная способность, p50/p99/p999) выводится в JSON.
+ */
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "socket_utils.h"
+#include "tests/mock_telegram.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+	struct Options {
+		std::string server = "./console_server";
+		size_t clients = 1000;
+		size_t messages = 20;
+		int port = 19090;
+		size_t login_window = 256;
+		size_t auth_workers = 4;
+		size_t threads = 0;  // 0 — по умолчанию сервера
+		int timeout_s = 120;
+		std::string json;
+		std::string backend = "epoll";  ///< epoll, select или io_uring.
+		bool binary = false;  ///< Клиенты говорят по двоичному протоколу.
+	};
+
+	/// Перцентили выборки задержек (мкс).
+	struct Summary {
+		size_t count = 0;
+		uint64_t p50 = 0, p99 = 0, p999 = 0, max = 0;
+		double avg = 0;
+	};
+
+	Summary summarize(std::vector<uint64_t> samples) {
+		Summary s;
+		s.count = samples.size();
+		if (samples.empty())
+			return s;
+		std::sort(samples.begin(), samples.end());
+		auto at = [&](double q) {
+			size_t rank = static_cast<size_t>(q * static_cast<double>(samples.size()) + 0.999999);
+			return samples[std::min(samples.size(), std::max<size_t>(rank, 1)) - 1];
+		};
+		s.p50 = at(0.5);
+		s.p99 = at(0.99);
+		s.p999 = at(0.999);
+		s.max = samples.back();
+		uint64_t sum = 0;
+		for (uint64_t v : samples)
+			sum += v;
+		s.avg = static_cast<double>(sum) / static_cast<double>(samples.size());
+		return s;
+	}
+
+	std::string to_json(const Summary& s) {
+		std::ostringstream out;
+		out << "{\"count\": " << s.count << ", \"avg\": " << static_cast<uint64_t>(s.avg) << ", \"p50\": " << s.p50
+		    << ", \"p99\": " << s.p99 << ", \"p999\": " << s.p999 << ", \"max\": " << s.max << "}";
+		return out.str();
+	}
+
+	uint64_t micros_since(Clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+	}
+
+	/// Запущенный console_server с консолью на pipe.
+	class ServerProcess {
+	public:
+		bool start(const Options& opt, const std::string& telegram_url) {
+			dir_ = fs::temp_directory_path() / ("bench_server." + std::to_string(getpid()));
+			fs::create_directories(dir_ / "SERVER_SETTINGS");
+			std::ofstream(dir_ / "SERVER_SETTINGS" / "BOT_TOKEN.txt") << "bench-token\n";
+			std::string binary = fs::absolute(opt.server).string();
+
+			std::vector<std::string> args = {binary,
+			                                 "--port",
+			                                 std::to_string(opt.port),
+			                                 "--telegram-url",
+			                                 telegram_url,
+			                                 "--auth-workers",
+			                                 std::to_string(opt.auth_workers),
+			                                 "--history-sync",
+			                                 "none"};
+			if (opt.backend == "select")
+				args.push_back("--select");
+			else if (opt.backend == "io_uring")
+				args.push_back("--io-uring");
+			if (opt.threads > 0) {
+				args.push_back("--threads");
+				args.push_back(std::to_string(opt.threads));
+			}
+
+			int console[2];
+			if (pipe(console) != 0)
+				return false;
+			pid_ = fork();
+			if (pid_ == 0) {
+				dup2(console[0], STDIN_FILENO);
+				close(console[0]);
+				close(console[1]);
+				std::string log = (dir_ / "server.log").string();
+				FILE* out = std::fopen(log.c_str(), "w");
+				if (out != nullptr) {
+					dup2(fileno(out), STDOUT_FILENO);
+					dup2(fileno(out), STDERR_FILENO);
+				}
+				if (chdir(dir_.c_str()) != 0)
+					_exit(127);
+				std::vector<char*> argv;
+				for (std::string& a : args)
+					argv.push_back(a.data());
+				argv.push_back(nullptr);
+				execv(argv[0], argv.data());
+				_exit(127);
+			}
+			close(console[0]);
+			console_ = console[1];
+			return pid_ > 0;
+		}
+
+		/// Дождаться, пока сервер начнёт принимать соединения.
+		bool wait_ready(int port) {
+			for (int attempt = 0; attempt < 100; ++attempt) {
+				if (waitpid(pid_, nullptr, WNOHANG) == pid_) {
+					pid_ = -1;
+					return false;
+				}
+				int fd = connect_to(port);
+				if (fd != -1) {
+					close(fd);
+					return true;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			}
+			return false;
+		}
+
+		/// /shutdown в консоль и ожидание завершения (SIGKILL по таймауту).
+		void stop() {
+			if (console_ != -1) {
+				ssize_t ignored = write(console_, "/shutdown\n", 10);
+				(void)ignored;
+				close(console_);
+				console_ = -1;
+			}
+			for (int attempt = 0; pid_ > 0 && attempt < 200; ++attempt) {
+				if (waitpid(pid_, nullptr, WNOHANG) == pid_)
+					pid_ = -1;
+				else
+					std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			}
+			if (pid_ > 0) {
+				kill(pid_, SIGKILL);
+				waitpid(pid_, nullptr, 0);
+				pid_ = -1;
+			}
+			std::error_code ec;
+			fs::remove_all(dir_, ec);
+		}
+
+		const fs::path& dir() const { return dir_; }
+
+		static int connect_to(int port) {
+			int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			sockaddr_in addr{};
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(static_cast<uint16_t>(port));
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if (fd != -1 && connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0)
+				return fd;
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+
+	private:
+		fs::path dir_;
+		pid_t pid_ = -1;
+		int console_ = -1;
+	};
+
+	struct BenchClient {
+		int fd = -1;
+		std::string id;
+		LineBuffer in;
+		OutputQueue out;
+		bool binary = false;  ///< Сервер подтвердил двоичный протокол.
+		bool want_write = false;
+		size_t partner = 0;
+		bool initiator = false;
+		Clock::time_point login_start;
+		Clock::time_point accept_sent;  ///< Когда партнёр ответил "yes" (у инициатора).
+		size_t pair_sent = 0;           ///< Сообщений пары в текущем раунде (у инициатора).
+	};
+
+	enum class Phase { Login, Connect, Chat, Finished };
+
+	/// Клиенты, фазы и замеры.
+	class LoadGenerator {
+	public:
+		LoadGenerator(const Options& opt, MockTelegram& mock) : opt_(opt), mock_(mock), clients_(opt.clients) {
+			for (size_t i = 0; i < clients_.size(); ++i) {
+				clients_[i].id = std::to_string(700000 + i);
+				clients_[i].partner = i ^ 1;
+				clients_[i].initiator = i % 2 == 0;
+			}
+		}
+
+		~LoadGenerator() {
+			for (BenchClient& c : clients_)
+				if (c.fd != -1)
+					close(c.fd);
+			if (epfd_ != -1)
+				close(epfd_);
+		}
+
+		/// Прогнать все фазы; false и сообщение в error() при сбое.
+		bool run() {
+			epfd_ = epoll_create1(EPOLL_CLOEXEC);
+			auto started = Clock::now();
+			start_login();
+			std::vector<epoll_event> events(1024);
+			while (phase_ != Phase::Finished && error_.empty()) {
+				int n = epoll_wait(epfd_, events.data(), static_cast<int>(events.size()), 1000);
+				if (n < 0 && errno != EINTR)
+					return fail("epoll_wait failed");
+				for (int i = 0; i < n && error_.empty(); ++i) {
+					BenchClient& c = clients_[events[i].data.u64];
+					if (events[i].events & EPOLLOUT)
+						flush(c);
+					if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+						readable(c);
+				}
+				if (error_.empty() && Clock::now() - phase_started_ > std::chrono::seconds(opt_.timeout_s))
+					fail("phase timed out with " + std::to_string(pending_) + " clients pending");
+			}
+			wall_us_ = micros_since(started);
+			return error_.empty();
+		}
+
+		const std::string& error() const { return error_; }
+
+		std::string report() const {
+			double chat_s = static_cast<double>(chat_us_) / 1e6;
+			std::ostringstream out;
+			out << "{\n  \"benchmark\": \"bench_server\",\n  \"backend\": \"" << opt_.backend
+			    << "\",\n  \"protocol\": \"" << (opt_.binary ? "binary" : "text")
+			    << "\",\n  \"threads\": " << opt_.threads << ",\n  \"clients\": " << clients_.size()
+			    << ",\n  \"pairs\": " << clients_.size() / 2
+			    << ",\n  \"messages_per_pair\": " << opt_.messages << ",\n  \"wall_seconds\": " << wall_us_ / 1e6
+			    << ",\n  \"relay_messages\": " << relay_.size()
+			    << ",\n  \"relay_throughput_msgs_per_sec\": "
+			    << (chat_s > 0 ? static_cast<double>(relay_.size()) / chat_s : 0)
+			    << ",\n  \"history_lines_on_reconnect\": " << history_lines_
+			    << ",\n  \"latency_unit\": \"us\",\n  \"login\": " << to_json(summarize(login_))
+			    << ",\n  \"relay\": " << to_json(summarize(relay_))
+			    << ",\n  \"connect\": " << to_json(summarize(connect_[0]))
+			    << ",\n  \"connect_with_history\": " << to_json(summarize(connect_[1])) << "\n}\n";
+			return out.str();
+		}
+
+	private:
+		bool fail(std::string why) {
+			if (error_.empty())
+				error_ = std::move(why);
+			return false;
+		}
+
+		/// Отправить строки (каждая с '\n'); в двоичном режиме — по кадру на строку.
+		void send(BenchClient& c, std::string data) {
+			if (opt_.binary) {
+				std::string frames;
+				std::string_view rest = data;
+				for (size_t nl; (nl = rest.find('\n')) != std::string_view::npos; rest.remove_prefix(nl + 1))
+					frames += encode_frame(FrameType::Text, rest.substr(0, nl));
+				data = std::move(frames);
+			}
+			c.out.push(std::move(data));
+			flush(c);
+		}
+
+		void flush(BenchClient& c) {
+			FlushStatus status = c.out.flush(c.fd);
+			if (status == FlushStatus::Error) {
+				fail("send failed for client " + c.id);
+				return;
+			}
+			bool want = status == FlushStatus::Pending;
+			if (want != c.want_write) {
+				epoll_event ev{};
+				ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+				ev.data.u64 = static_cast<uint64_t>(&c - clients_.data());
+				epoll_ctl(epfd_, EPOLL_CTL_MOD, c.fd, &ev);
+				c.want_write = want;
+			}
+		}
+
+		void readable(BenchClient& c) {
+			while (error_.empty()) {
+				ReadStatus status = c.in.fill(c.fd);
+				std::string_view line;
+				while (error_.empty() && !c.binary && c.in.next_line(line)) {
+					if (line == PROTOCOL_ACK)
+						c.binary = true;
+					else
+						on_line(c, line);
+				}
+				FrameType type;
+				std::string_view payload;
+				while (error_.empty() && c.binary && c.in.next_frame(type, payload)) {
+					size_t nl;
+					while ((nl = payload.find('\n')) != std::string_view::npos) {
+						on_line(c, payload.substr(0, nl));
+						payload.remove_prefix(nl + 1);
+					}
+					if (!payload.empty())
+						on_line(c, payload);
+				}
+				if (c.in.overflow()) {
+					fail("protocol error for client " + c.id);
+					return;
+				}
+				if (status == ReadStatus::Closed || status == ReadStatus::Error) {
+					fail("server closed connection of client " + c.id);
+					return;
+				}
+				if (status == ReadStatus::Drained)
+					return;
+			}
+		}
+
+		void begin_phase(Phase phase) {
+			phase_ = phase;
+			pending_ = clients_.size();
+			phase_started_ = Clock::now();
+		}
+
+		void phase_done() {
+			if (--pending_ > 0)
+				return;
+			if (phase_ == Phase::Login) {
+				start_connect();
+			} else if (phase_ == Phase::Connect) {
+				start_chat();
+			} else if (phase_ == Phase::Chat) {
+				chat_us_ += micros_since(phase_started_);
+				if (++round_ < 2)
+					start_connect();
+				else
+					phase_ = Phase::Finished;
+			}
+		}
+
+		void start_login() {
+			begin_phase(Phase::Login);
+			while (next_login_ < clients_.size() && next_login_ < opt_.login_window)
+				begin_login(clients_[next_login_++]);
+		}
+
+		void begin_login(BenchClient& c) {
+			c.login_start = Clock::now();
+			c.fd = ServerProcess::connect_to(opt_.port);
+			if (c.fd == -1) {
+				fail("cannot connect client " + c.id);
+				return;
+			}
+			fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+			epoll_event ev{};
+			ev.events = EPOLLIN;
+			ev.data.u64 = static_cast<uint64_t>(&c - clients_.data());
+			epoll_ctl(epfd_, EPOLL_CTL_ADD, c.fd, &ev);
+			if (opt_.binary)
+				c.out.push(std::string(PROTOCOL_HELLO) + "\n");
+			send(c, c.id + "\n");
+		}
+
+		void start_connect() {
+			begin_phase(Phase::Connect);
+			for (BenchClient& c : clients_)
+				if (c.initiator)
+					send(c, "/connect " + clients_[c.partner].id + "\n");
+		}
+
+		void start_chat() {
+			begin_phase(Phase::Chat);
+			for (BenchClient& c : clients_) {
+				if (!c.initiator)
+					continue;
+				c.pair_sent = 0;
+				speak(c);
+			}
+		}
+
+		/// Отправить следующее сообщение пары и передать слово либо закончить беседу.
+		void speak(BenchClient& c) {
+			BenchClient& pair = c.initiator ? c : clients_[c.partner];
+			if (pair.pair_sent >= opt_.messages) {
+				send(c, "/end\n");
+				return;
+			}
+			++pair.pair_sent;
+			uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+			send(c, "msg " + std::to_string(pair.pair_sent) + " " + std::to_string(now) + "\n/vote\n");
+		}
+
+		void on_line(BenchClient& c, std::string_view line) {
+			auto has = [&](std::string_view s) { return line.find(s) != std::string_view::npos; };
+
+			if (has("Incorrect code") || has("User not found") || has("User is busy") ||
+			    has("Connection rejected") || has("logged out") || has("shutting down") ||
+			    has("Failed to send Telegram")) {
+				fail("client " + c.id + " got: " + std::string(line));
+				return;
+			}
+
+			size_t msg_pos = line.find(": msg ");
+			if (msg_pos != std::string_view::npos) {
+				if (phase_ == Phase::Chat) {
+					std::istringstream fields(std::string(line.substr(msg_pos + 6)));
+					uint64_t seq = 0, sent_ns = 0;
+					fields >> seq >> sent_ns;
+					uint64_t now =
+					    std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+					relay_.push_back(now > sent_ns ? (now - sent_ns) / 1000 : 0);
+				} else if (phase_ == Phase::Connect && c.initiator) {
+					++history_lines_;
+				}
+				return;
+			}
+
+			if (phase_ == Phase::Login) {
+				if (has("Telegram code sent")) {
+					send(c, mock_.code_for(c.id) + "\n");
+				} else if (has("Too many login attempts")) {
+					send(c, c.id + "\n");
+				} else if (line.starts_with("Welcome, ")) {
+					login_.push_back(micros_since(c.login_start));
+					if (next_login_ < clients_.size())
+						begin_login(clients_[next_login_++]);
+					phase_done();
+				}
+			} else if (phase_ == Phase::Connect) {
+				if (has("wants to connect")) {
+					clients_[c.partner].accept_sent = Clock::now();
+					send(c, "yes\n");
+				} else if (line.starts_with("Connection accepted")) {
+					connect_[round_].push_back(micros_since(c.accept_sent));
+					phase_done();
+				} else if (line.starts_with("Connection established")) {
+					phase_done();
+				}
+			} else if (phase_ == Phase::Chat) {
+				if (line.starts_with("You are now speaking")) {
+					speak(c);
+				} else if (line.starts_with("You have left the conversation") || has("partner has ended")) {
+					phase_done();
+				}
+			}
+		}
+
+		const Options& opt_;
+		MockTelegram& mock_;
+		std::vector<BenchClient> clients_;
+		int epfd_ = -1;
+		Phase phase_ = Phase::Login;
+		size_t pending_ = 0;
+		size_t next_login_ = 0;
+		size_t round_ = 0;
+		Clock::time_point phase_started_;
+		std::string error_;
+
+		std::vector<uint64_t> login_;
+		std::vector<uint64_t> relay_;
+		std::vector<uint64_t> connect_[2];
+		uint64_t history_lines_ = 0;
+		uint64_t chat_us_ = 0;
+		uint64_t wall_us_ = 0;
+	};
+
+	void raise_fd_limit() {
+		rlimit lim{};
+		if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+			lim.rlim_cur = lim.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &lim);
+		}
+	}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--server" && i + 1 < argc) {
+			opt.server = argv[++i];
+		} else if (arg == "--clients" && i + 1 < argc) {
+			opt.clients = std::stoul(argv[++i]);
+		} else if (arg == "--messages" && i + 1 < argc) {
+			opt.messages = std::stoul(argv[++i]);
+		} else if (arg == "--port" && i + 1 < argc) {
+			opt.port = std::stoi(argv[++i]);
+		} else if (arg == "--login-window" && i + 1 < argc) {
+			opt.login_window = std::max<size_t>(std::stoul(argv[++i]), 1);
+		} else if (arg == "--auth-workers" && i + 1 < argc) {
+			opt.auth_workers = std::stoul(argv[++i]);
+		} else if (arg == "--threads" && i + 1 < argc) {
+			opt.threads = std::stoul(argv[++i]);
+		} else if (arg == "--timeout" && i + 1 < argc) {
+			opt.timeout_s = std::stoi(argv[++i]);
+		} else if (arg == "--json" && i + 1 < argc) {
+			opt.json = argv[++i];
+		} else if (arg == "--select") {
+			opt.backend = "select";
+		} else if (arg == "--io-uring") {
+			opt.backend = "io_uring";
+		} else if (arg == "--binary") {
+			opt.binary = true;
+		} else {
+			std::cerr << "Usage: " << argv[0]
+			          << " [--server <path>] [--clients N] [--messages M] [--port P]"
+			             " [--login-window W] [--auth-workers K] [--threads T] [--timeout <s>] [--json <file>]"
+			             " [--select|--io-uring] [--binary]\n";
+			return 1;
+		}
+	}
+	opt.clients = std::max<size_t>(opt.clients - opt.clients % 2, 2);
+
+	raise_fd_limit();
+	std::signal(SIGPIPE, SIG_IGN);
+
+	MockTelegram mock;
+	ServerProcess server;
+	if (!server.start(opt, mock.url()) || !server.wait_ready(opt.port)) {
+		std::cerr << "Failed to start " << opt.server << " (see " << (server.dir() / "server.log") << ")\n";
+		server.stop();
+		return 1;
+	}
+
+	int status = 0;
+	std::string report;
+	{
+		LoadGenerator bench(opt, mock);
+		if (bench.run()) {
+			report = bench.report();
+		} else {
+			std::cerr << "Benchmark failed: " << bench.error() << '\n';
+			status = 1;
+		}
+		server.stop();
+	}
+
+	if (report.empty())
+		return status;
+	if (opt.json.empty()) {
+		std::cout << report;
+	} else {
+		std::ofstream(opt.json) << report;
+		std::cerr << "Results written to " << opt.json << '\n';
+	}
+	return status;
+}
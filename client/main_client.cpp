@@ -1,181 +1,447 @@
-/**
- * @file main_client.cpp
- * @brief Клиент консольного мессенджера: подключение к серверу и обмен сообщениями.
- *
- * Программа читает конфигурацию сервера (IP и порт),
- * устанавливает TCP-соединение, запускает поток
- * для приёма сообщений и отправляет введённые пользователем строки.
- */
-
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
-#include "socket_utils.h"
-#include <filesystem>
-#include <fstream>
-#include <iostream>
-#include <sstream>
-#include <string>
-#include <thread>
-
-/**
- * @brief Максимально допустимая длина сообщения от пользователя.
- */
-static const size_t MAX_LEN_INPUT = 2000;
-
-/**
- * @brief Директория для хранения конфигурационного файла.
- */
-const std::string CFG_DIR = "CLIENT_SETTING";
-
-/**
- * @brief Путь к файлу с настройками (IP и порт сервера).
- */
-const std::string CFG_FILE = "CLIENT_SETTING/ip_port.txt";
-
-/**
- * @struct ServerConf
- * @brief Параметры подключения к серверу.
- *
- * @var ServerConf::ip   IPv4-адрес сервера.
- * @var ServerConf::port Порт сервера.
- */
-struct ServerConf {
-	std::string ip; /**< IPv4-адрес сервера. */
-	int port;       /**< Порт сервера. */
-};
-
-/**
- * @brief Проверить корректность IPv4-адреса и порта.
- *
- * Использует inet_pton() для валидации формата IPv4
- * и проверяет, что порт находится в диапазоне 1..65535.
- *
- * @param ip    Строка с IPv4-адресом.
- * @param port  Номер порта.
- * @return true  если адрес и порт валидны;
- *         false в противном случае.
- *
- * @see
- * https://stackoverflow.com/questions/318236/how-do-you-validate-that-a-string-is-a-valid-ipv4-address-in-c
- *
- * @note Вдохновлено ответом ibodi, лицензия CC BY-SA 4.0.
- */
-
-// BEGIN: Borrowed code
-bool valid_ip_port(const std::string& ip, int port) {
-	sockaddr_in tmp{};
-	return inet_pton(AF_INET, ip.c_str(), &tmp.sin_addr) == 1 && port > 0 && port < 65536;
-}
-// END: Borrowed code
-
-/**
- * @brief Считать или запросить у пользователя настройки сервера.
- *
- * Если файл с конфигурацией существует, пытается прочитать из него строку
- * в формате "IP:порт". Если данные некорректны или файла нет,
- * запрашивает ввод у пользователя до тех пор, пока не будет введена
- * валидная пара.
- * Сохраняет корректные настройки в файл.
- *
- * @return Настройки сервера в виде ServerConf.
- */
-ServerConf get_config() {
-	std::filesystem::create_directories(CFG_DIR);
-	std::ifstream fin(CFG_FILE);
-	std::string ip;
-	int port;
-	bool ok = false;
-	if (fin) {
-		std::getline(fin, ip, ':') && (fin >> port);
-		ok = valid_ip_port(ip, port);
-	}
-	while (!ok) {
-		std::cout << "Enter server IP: ";
-		std::cin >> ip;
-		std::cout << "Enter server port: ";
-		std::cin >> port;
-		std::cin.ignore();
-		ok = valid_ip_port(ip, port);
-		if (!ok)
-			std::cout << "Invalid IP or port. Try again.\n";
-	}
-	std::ofstream(CFG_FILE, std::ios::trunc) << ip << ':' << port << '\n';
-	return {ip, port};
-}
-
-/**
- * @brief Цикл приёма и вывода сообщений от сервера.
- *
- * Читает строки из сокета через recv_line() до разрыва соединения.
- * Выводит каждую строку на консоль. При получении специального
- * маркера "*ENDM*" отображает приглашение ввода.
- *
- * @param fd Дескриптор подключённого сокета сервера.
- */
-void receive_messages(int fd) {
-	std::string line;
-	while (recv_line(fd, line)) {
-		if (line.empty())
-			continue;
-		if (line == "*ENDM*") {
-			std::cout << "> " << std::flush;
-			continue;
-		}
-		std::cout << line << '\n';
-	}
-	std::cout << "\nDisconnected from server.\n";
-	close(fd);
-	exit(0);
-}
-
-/**
- * @brief Точка входа клиентского приложения.
- *
- * Получает конфигурацию сервера, устанавливает TCP-соединение,
- * запускает поток для приёма сообщений и в цикле
- * отправляет введённые пользователем сообщения.
- *
- * @return Код завершения (0 при успехе, иначе 1).
- */
-int main() {
-	ServerConf conf = get_config();
-
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock == -1) {
-		perror("socket");
-		return 1;
-	}
-
-	sockaddr_in addr{};
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(conf.port);
-	inet_pton(AF_INET, conf.ip.c_str(), &addr.sin_addr);
-
-	if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
-		perror("connect");
-		return 1;
-	}
-
-	std::thread(receive_messages, sock).detach();
-
-	std::string input;
-	while (std::getline(std::cin, input)) {
-		if (input.empty())
-			continue;
-		if (input.size() > MAX_LEN_INPUT) {
-			std::cout << "Message longer than 2000 characters. Split it.\n";
-			continue;
-		}
-		if (input == "/exit") {
-			send_line(sock, "/exit");
-			std::cout << "\nExiting...\n";
-			break;
-		}
-		send_line(sock, input);
-	}
-	close(sock);
-	return 0;
-}
+/**
+ * @file main_client.cpp
+ * @brief Клиент консольного мессенджера: подключение к серверу и обмен сообщениями.
+ *
+ * Программа читает конфигурацию сервера (IP и порт),
+ * устанавливает TCP-соединение, запускает поток
+ * для приёма сообщений и отправляет введённые пользователем строки.
+ *
+ * По умолчанию клиент запрашивает двоичный протокол (кадры с длиной,
+ * см. socket_utils.h) и отправляет ввод только после ответа сервера:
+ * без PROTOCOL_ACK остаётся строковый протокол с "*ENDM*" (Handshake).
+ * Флаг --text не запрашивает двоичный протокол вовсе.
+ *
+ * Поток приёма вычитывает сокет до EAGAIN и выводит всё разобранное
+ * одной записью в терминал. Оба потока завершаются сами: main() читает
+ * stdin в собственный буфер строк и ждёт его poll() вместе с сигналом
+ * о разрыве соединения (частично набранная строка ожидание не блокирует),
+ * а поток приёма заканчивает работу по shutdown() сокета и присоединяется join().
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "socket_utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+/**
+ * @brief Максимально допустимая длина сообщения от пользователя.
+ */
+static const size_t MAX_LEN_INPUT = 2000;
+
+/**
+ * @brief Директория для хранения конфигурационного файла.
+ */
+const std::string CFG_DIR = "CLIENT_SETTING";
+
+/**
+ * @brief Путь к файлу с настройками (IP и порт сервера).
+ */
+const std::string CFG_FILE = "CLIENT_SETTING/ip_port.txt";
+
+/**
+ * @struct ServerConf
+ * @brief Параметры подключения к серверу.
+ *
+ * @var ServerConf::ip   IPv4-адрес сервера.
+ * @var ServerConf::port Порт сервера.
+ */
+struct ServerConf {
+	std::string ip; /**< IPv4-адрес сервера. */
+	int port;       /**< Порт сервера. */
+};
+
+/**
+ * @brief Проверить корректность IPv4-адреса и порта.
+ *
+ * Использует inet_pton() для валидации формата IPv4
+ * и проверяет, что порт находится в диапазоне 1..65535.
+ *
+ * @param ip    Строка с IPv4-адресом.
+ * @param port  Номер порта.
+ * @return true  если адрес и порт валидны;
+ *         false в противном случае.
+ *
+ * @see
+ * https://stackoverflow.com/questions/318236/how-do-you-validate-that-a-string-is-a-valid-ipv4-address-in-c
+ *
+ * @note Вдохновлено ответом ibodi, лицензия CC BY-SA 4.0.
+ */
+
+// BEGIN: Borrowed code
+bool valid_ip_port(const std::string& ip, int port) {
+	sockaddr_in tmp{};
+	return inet_pton(AF_INET, ip.c_str(), &tmp.sin_addr) == 1 && port > 0 && port < 65536;
+}
+// END: Borrowed code
+
+/**
+ * @brief Считать или запросить у пользователя настройки сервера.
+ *
+ * Если файл с конфигурацией существует, пытается прочитать из него строку
+ * в формате "IP:порт". Если данные некорректны или файла нет,
+ * запрашивает ввод у пользователя до тех пор, пока не будет введена
+ * валидная пара.
+ * Сохраняет корректные настройки в файл.
+ *
+ * @return Настройки сервера в виде ServerConf.
+ */
+ServerConf get_config() {
+	std::filesystem::create_directories(CFG_DIR);
+	std::ifstream fin(CFG_FILE);
+	std::string ip;
+	int port;
+	bool ok = false;
+	if (fin) {
+		std::getline(fin, ip, ':') && (fin >> port);
+		ok = valid_ip_port(ip, port);
+	}
+	while (!ok) {
+		std::cout << "Enter server IP: ";
+		std::cin >> ip;
+		std::cout << "Enter server port: ";
+		std::cin >> port;
+		std::cin.ignore();
+		ok = valid_ip_port(ip, port);
+		if (!ok)
+			std::cout << "Invalid IP or port. Try again.\n";
+	}
+	std::ofstream(CFG_FILE, std::ios::trunc) << ip << ':' << port << '\n';
+	return {ip, port};
+}
+
+/**
+ * @class Handshake
+ * @brief Итог запроса двоичного протокола, общий для потока приёма и main().
+ *
+ * Сервер, принявший PROTOCOL_HELLO, сразу разбирает ввод клиента как кадры,
+ * а сервер без двоичного протокола — как строки, поэтому ввод отправляется
+ * только после ответа: PROTOCOL_ACK — кадры, второй маркер "*ENDM*" без него
+ * (приветствие и ответ на PROTOCOL_HELLO как на обычную строку) или закрытие
+ * соединения — строки.
+ */
+class Handshake {
+public:
+	enum class Result { Pending, Binary, Text };
+
+	/**
+	 * @brief Зафиксировать итог (повторные вызовы ничего не меняют).
+	 */
+	void settle(Result result) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (result_ == Result::Pending)
+				result_ = result;
+		}
+		cv_.notify_all();
+	}
+
+	/**
+	 * @brief Дождаться итога.
+	 */
+	Result wait() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [this] { return result_ != Result::Pending; });
+		return result_;
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	Result result_ = Result::Pending;
+};
+
+/**
+ * @brief Вывести всё, что сервер прислал и что уже полностью получено.
+ *
+ * До подтверждения PROTOCOL_ACK данные разбираются как строки: каждая
+ * выводится на консоль, а маркер "*ENDM*" отображает приглашение ввода.
+ * После подтверждения остаток буфера и всё последующее разбирается как
+ * кадры: текст и история выводятся как есть, FrameType::End — приглашение.
+ *
+ * @param in      Буфер принятых данных.
+ * @param binary  Перешёл ли сервер на двоичный протокол (обновляется).
+ * @param answers Число принятых маркеров "*ENDM*" строкового протокола (увеличивается).
+ * @param out     Текст для терминала (дописывается).
+ * @return false, если сервер нарушил протокол.
+ */
+bool render_incoming(LineBuffer& in, bool& binary, size_t& answers, std::string& out) {
+	std::string_view line;
+	while (!binary && in.next_line(line)) {
+		if (line == PROTOCOL_ACK) {
+			binary = true;
+		} else if (line == END_MARKER) {
+			++answers;
+			out += "> ";
+		} else if (!line.empty()) {
+			out += line;
+			out += '\n';
+		}
+	}
+
+	FrameType type;
+	std::string_view payload;
+	while (binary && in.next_frame(type, payload)) {
+		if (type == FrameType::End)
+			out += "> ";
+		else
+			out += payload;
+	}
+	return !in.overflow();
+}
+
+/**
+ * @brief Записать текст в дескриптор целиком.
+ *
+ * @return false при ошибке записи.
+ */
+bool write_all(int fd, std::string_view text) {
+	while (!text.empty()) {
+		ssize_t n = ::write(fd, text.data(), text.size());
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		text.remove_prefix(static_cast<size_t>(n));
+	}
+	return true;
+}
+
+/**
+ * @brief Цикл приёма и вывода сообщений от сервера.
+ *
+ * Ждёт данных poll(), вычитывает неблокирующий сокет LineBuffer::fill()
+ * до EAGAIN (или до заполнения буфера) и выводит всё разобранное одним
+ * write(): история в тысячи строк печатается несколькими записями, а не
+ * записью на строку. Возвращается, когда сервер закрыл соединение или
+ * main() вызвал shutdown() сокета, и перед этим будит main() через @p done_fd.
+ *
+ * @param fd        Неблокирующий сокет сервера.
+ * @param out_fd    Дескриптор терминала.
+ * @param done_fd   eventfd, в который пишется 1 при завершении.
+ * @param handshake Итог запроса двоичного протокола; nullptr, если он не запрашивался.
+ */
+void receive_messages(int fd, int out_fd, int done_fd, Handshake* handshake) {
+	LineBuffer in(1024 * 1024);
+	bool binary = false;
+	size_t answers = 0;
+	std::string batch;
+	ReadStatus status = ReadStatus::Drained;
+	while (status != ReadStatus::Closed && status != ReadStatus::Error) {
+		if (status == ReadStatus::Drained) {
+			pollfd pfd{fd, POLLIN, 0};
+			if (::poll(&pfd, 1, -1) < 0 && errno != EINTR)
+				break;
+		}
+		status = in.fill(fd);
+		batch.clear();
+		bool valid = render_incoming(in, binary, answers, batch);
+		if (handshake != nullptr && binary)
+			handshake->settle(Handshake::Result::Binary);
+		else if (handshake != nullptr && answers >= 2)
+			handshake->settle(Handshake::Result::Text);
+		if (!write_all(out_fd, batch) || !valid)
+			break;
+	}
+	if (handshake != nullptr)
+		handshake->settle(Handshake::Result::Text);
+	uint64_t one = 1;
+	(void)!::write(done_fd, &one, sizeof(one));
+}
+
+/**
+ * @struct ConsoleInput
+ * @brief Ввод пользователя, ещё не разобранный на строки.
+ *
+ * @var ConsoleInput::buffer
+ * Прочитанные из stdin байты.
+ * @var ConsoleInput::eof
+ * stdin закрыт.
+ * @var ConsoleInput::skipping
+ * Отбрасывается остаток строки, не поместившейся в буфер.
+ */
+struct ConsoleInput {
+	static constexpr size_t MAX_LINE = 64 * 1024;
+
+	LineBuffer buffer{MAX_LINE};
+	bool eof = false;
+	bool skipping = false;
+};
+
+/**
+ * @enum InputEvent
+ * @brief Результат read_input().
+ */
+enum class InputEvent {
+	Line,          ///< Введена строка.
+	TooLong,       ///< Строка длиннее ConsoleInput::MAX_LINE отброшена.
+	End,           ///< Конец ввода.
+	Disconnected,  ///< Соединение с сервером закрыто.
+};
+
+/**
+ * @brief Дождаться строки ввода или разрыва соединения.
+ *
+ * stdin читается в собственный буфер, и строки выделяются из него,
+ * поэтому poll() ждёт @p fd вместе с @p done_fd, даже когда строка
+ * набрана частично: разрыв соединения замечается сразу, а не после Enter.
+ * Последняя строка без '\n' перед концом ввода тоже возвращается.
+ *
+ * @param fd      Дескриптор ввода (stdin).
+ * @param done_fd eventfd потока приёма.
+ * @param in      Буфер ввода.
+ * @param line    Введённая строка (для InputEvent::Line).
+ */
+InputEvent read_input(int fd, int done_fd, ConsoleInput& in, std::string& line) {
+	// Сообщения main() выводятся до ожидания, а не со следующей строкой ввода.
+	std::cout.flush();
+	std::string_view view;
+	char chunk[4096];
+	while (true) {
+		if (in.buffer.next_line(view)) {
+			if (std::exchange(in.skipping, false))
+				continue;
+			line.assign(view);
+			return InputEvent::Line;
+		}
+		if (in.buffer.overflow()) {
+			in.buffer = LineBuffer(ConsoleInput::MAX_LINE);
+			if (!std::exchange(in.skipping, true))
+				return InputEvent::TooLong;
+			continue;
+		}
+		if (in.eof) {
+			if (in.buffer.size() == 0 || in.skipping)
+				return InputEvent::End;
+			in.buffer.append("\n", 1);
+			continue;
+		}
+
+		pollfd fds[2] = {{fd, POLLIN, 0}, {done_fd, POLLIN, 0}};
+		if (::poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return InputEvent::End;
+		}
+		if (fds[1].revents & POLLIN)
+			return InputEvent::Disconnected;
+		ssize_t n = ::read(fd, chunk, sizeof(chunk));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			in.eof = true;
+		else
+			in.buffer.append(chunk, static_cast<size_t>(n));
+	}
+}
+
+/**
+ * @brief Точка входа клиентского приложения.
+ *
+ * Получает конфигурацию сервера, устанавливает TCP-соединение,
+ * запускает поток для приёма сообщений и в цикле
+ * отправляет введённые пользователем сообщения.
+ *
+ * Аргументы командной строки:
+ *  - --text  не запрашивать двоичный протокол (строковый протокол выбирается и сам,
+ *            если сервер не подтвердил двоичный).
+ *
+ * @return Код завершения (0 при успехе, иначе 1).
+ */
+int main(int argc, char* argv[]) {
+	// Собственный буфер std::cin: прочитанное им вперёд при вводе настроек передаётся в ConsoleInput.
+	std::ios::sync_with_stdio(false);
+	bool binary = true;
+	for (int i = 1; i < argc; ++i) {
+		if (std::string(argv[i]) == "--text") {
+			binary = false;
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--text]\n";
+			return 1;
+		}
+	}
+
+	ServerConf conf = get_config();
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1) {
+		perror("socket");
+		return 1;
+	}
+
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(conf.port);
+	inet_pton(AF_INET, conf.ip.c_str(), &addr.sin_addr);
+
+	if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		return 1;
+	}
+
+	Handshake handshake;
+	bool negotiating = binary;
+	if (binary)
+		send_line(sock, std::string(PROTOCOL_HELLO));
+	auto send_input = [&](const std::string& text) {
+		// До ответа на PROTOCOL_HELLO неизвестно, ждёт ли сервер кадры или строки.
+		if (std::exchange(negotiating, false))
+			binary = handshake.wait() == Handshake::Result::Binary;
+		return binary ? send_frame(sock, FrameType::Text, text) : send_line(sock, text);
+	};
+
+	// Поток приёма вычитывает сокет до EAGAIN; send_all() при заполненном буфере ждёт poll().
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	int done_fd = eventfd(0, EFD_CLOEXEC);
+	if (done_fd == -1) {
+		perror("eventfd");
+		return 1;
+	}
+	std::thread receiver(receive_messages, sock, STDOUT_FILENO, done_fd, binary ? &handshake : nullptr);
+
+	ConsoleInput console;
+	std::streamsize ahead = std::max<std::streamsize>(0, std::cin.rdbuf()->in_avail());
+	std::string buffered(static_cast<size_t>(ahead), '\0');
+	buffered.resize(static_cast<size_t>(std::cin.readsome(buffered.data(), buffered.size())));
+	console.buffer.append(buffered.data(), buffered.size());
+
+	std::string input;
+	InputEvent event;
+	while ((event = read_input(STDIN_FILENO, done_fd, console, input)) != InputEvent::End &&
+	       event != InputEvent::Disconnected) {
+		if (event == InputEvent::Line && input.empty())
+			continue;
+		if (event == InputEvent::TooLong || input.size() > MAX_LEN_INPUT) {
+			std::cout << "Message longer than 2000 characters. Split it.\n";
+			continue;
+		}
+		if (input == "/exit") {
+			send_input("/exit");
+			std::cout << "\nExiting...\n";
+			break;
+		}
+		send_input(input);
+	}
+	::shutdown(sock, SHUT_RDWR);
+	receiver.join();
+	close(sock);
+	close(done_fd);
+	if (event == InputEvent::Disconnected)
+		std::cout << "\nDisconnected from server.\n";
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include "auth_delivery.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+AuthDelivery::AuthDelivery(size_t workers, size_t max_queue, Sender sender, size_t max_batch)
+    : sender_(std::move(sender)),
+      max_queue_(max_queue),
+      max_batch_(std::max<size_t>(max_batch, 1)),
+      worker_count_(std::max<size_t>(workers, 1)),
+      event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+	for (size_t i = 0; i < worker_count_; ++i)
+		workers_.emplace_back(&AuthDelivery::worker_loop, this);
+}
+
+AuthDelivery::~AuthDelivery() {
+	stop();
+	if (event_fd_ != -1)
+		close(event_fd_);
+}
+
+bool AuthDelivery::submit(AuthJob job) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (stopping_ || jobs_.size() >= max_queue_) {
+			++rejected_;
+			return false;
+		}
+		jobs_.push_back(std::move(job));
+	}
+	cv_.notify_one();
+	return true;
+}
+
+std::vector<AuthResult> AuthDelivery::take_results() {
+	uint64_t counter;
+	while (read(event_fd_, &counter, sizeof(counter)) > 0) {
+	}
+
+	std::vector<AuthResult> out;
+	std::lock_guard<std::mutex> lock(mutex_);
+	out.swap(results_);
+	return out;
+}
+
+size_t AuthDelivery::queued() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return jobs_.size();
+}
+
+void AuthDelivery::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+		jobs_.clear();
+	}
+	cv_.notify_all();
+	for (auto& t : workers_)
+		if (t.joinable())
+			t.join();
+	workers_.clear();
+}
+
+AuthDeliveryStats AuthDelivery::stats() const {
+	AuthDeliveryStats st;
+	st.requests = requests_.load(std::memory_order_relaxed);
+	st.failures = failures_.load(std::memory_order_relaxed);
+	st.batches = batches_.load(std::memory_order_relaxed);
+	st.max_batch = max_batch_seen_.load(std::memory_order_relaxed);
+	st.rejected = rejected_.load(std::memory_order_relaxed);
+	if (st.requests == 0)
+		return st;
+
+	st.failure_rate = static_cast<double>(st.failures) / static_cast<double>(st.requests);
+	HistogramSnapshot latency = latency_us_.snapshot();
+	st.avg_latency_us = latency.avg();
+	st.p50_latency_us = latency.p50;
+	st.p99_latency_us = latency.p99;
+	st.max_latency_us = latency.max;
+	return st;
+}
+
+void AuthDelivery::record(uint64_t latency_us, bool delivered) {
+	requests_.fetch_add(1, std::memory_order_relaxed);
+	if (!delivered)
+		failures_.fetch_add(1, std::memory_order_relaxed);
+	latency_us_.record(latency_us);
+}
+
+void AuthDelivery::worker_loop() {
+	std::vector<AuthJob> batch;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+			if (stopping_)
+				return;
+			// Всплеск делится между потоками поровну (но не больше max_batch_ на
+			// поток): каждая доля уходит подряд по тёплому соединению потока.
+			size_t share = (jobs_.size() + worker_count_ - 1) / worker_count_;
+			size_t n = std::min(max_batch_, share);
+			for (size_t i = 0; i < n; ++i) {
+				batch.push_back(std::move(jobs_.front()));
+				jobs_.pop_front();
+			}
+		}
+		batches_.fetch_add(1, std::memory_order_relaxed);
+		uint64_t prev = max_batch_seen_.load(std::memory_order_relaxed);
+		while (prev < batch.size() && !max_batch_seen_.compare_exchange_weak(prev, batch.size())) {
+		}
+
+		for (AuthJob& job : batch) {
+			auto start = std::chrono::steady_clock::now();
+			bool delivered = sender_(job.chat_id, job.code);
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(), delivered);
+			// Результат публикуется сразу; будим цикл событий, только если он ещё
+			// не разбудён ради предыдущих результатов.
+			bool wake;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				wake = results_.empty();
+				results_.push_back({std::move(job), delivered});
+			}
+			if (wake) {
+				uint64_t one = 1;
+				ssize_t ignored = write(event_fd_, &one, sizeof(one));
+				(void)ignored;
+			}
+		}
+		batch.clear();
+	}
+}
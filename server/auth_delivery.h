@@ -0,0 +1,182 @@
+/**
+ * @file auth_delivery.h
+ * @brief Асинхронная доставка кодов авторизации через Telegram.
+ *
+ * Механизм:
+ * - Цикл событий ставит задание (сокет + Telegram ID + код) в ограниченную
+ *   очередь и сразу возвращается к обработке остальных клиентов.
+ * - Пул рабочих потоков выполняет HTTP-запросы; каждый поток держит своё
+ *   keep-alive соединение с Bot API (пул постоянных сессий).
+ * - При всплеске входов поток забирает из очереди сразу пачку заданий и
+ *   отправляет их подряд по уже установленному соединению.
+ * - Результат каждого запроса сразу складывается в очередь завершённых
+ *   заданий, а eventfd будит цикл событий, который переводит клиента
+ *   в pending_auth; пока цикл не забрал результаты, повторно он не будится.
+ * - Для каждого запроса учитываются задержка и успех (AuthDeliveryStats).
+ */
+
+#ifndef AUTH_DELIVERY_H
+#define AUTH_DELIVERY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+/**
+ * @struct AuthJob
+ * @brief Задание на отправку кода одному клиенту.
+ *
+ * @var AuthJob::fd
+ * Сокет клиента, введшего Telegram ID.
+ * @var AuthJob::conn_id
+ * Уникальный номер соединения: защищает от повторного использования fd
+ * другим клиентом, пока запрос был в пути.
+ * @var AuthJob::chat_id
+ * Telegram ID получателя.
+ * @var AuthJob::code
+ * Отправляемый код.
+ */
+struct AuthJob {
+	int fd = -1;
+	uint64_t conn_id = 0;
+	std::string chat_id;
+	std::string code;
+};
+
+/**
+ * @struct AuthResult
+ * @brief Завершённое задание.
+ *
+ * @var AuthResult::job
+ * Исходное задание.
+ * @var AuthResult::delivered
+ * true, если Bot API подтвердил отправку сообщения.
+ */
+struct AuthResult {
+	AuthJob job;
+	bool delivered;
+};
+
+/**
+ * @struct AuthDeliveryStats
+ * @brief Снимок статистики доставки кодов.
+ *
+ * Перцентили оцениваются по гистограмме (Histogram) и равны
+ * верхней границе соответствующей корзины.
+ */
+struct AuthDeliveryStats {
+	uint64_t requests = 0;       ///< Выполнено запросов.
+	uint64_t failures = 0;       ///< Из них неуспешных.
+	uint64_t batches = 0;        ///< Пачек, взятых рабочими потоками.
+	uint64_t max_batch = 0;      ///< Наибольшая пачка.
+	uint64_t rejected = 0;       ///< Заданий, отклонённых из-за переполнения очереди.
+	double failure_rate = 0;     ///< failures / requests.
+	uint64_t avg_latency_us = 0; ///< Средняя задержка запроса.
+	uint64_t p50_latency_us = 0; ///< Медиана задержки.
+	uint64_t p99_latency_us = 0; ///< 99-й перцентиль задержки.
+	uint64_t max_latency_us = 0; ///< Максимальная задержка.
+};
+
+/**
+ * @class AuthDelivery
+ * @brief Пул потоков, отправляющих коды авторизации вне цикла событий.
+ *
+ * submit() и take_results() вызываются из потока цикла событий;
+ * функция отправки — из рабочих потоков.
+ */
+class AuthDelivery {
+public:
+	/// Функция отправки кода; по умолчанию post_telegram_code().
+	using Sender = std::function<bool(const std::string& chat_id, const std::string& code)>;
+
+	/// Сколько заданий рабочий поток забирает из очереди за раз по умолчанию.
+	static constexpr size_t DEFAULT_BATCH = 16;
+
+	/**
+	 * @param workers   Число рабочих потоков (и постоянных HTTP-сессий), не меньше одного.
+	 * @param max_queue Максимум ожидающих заданий; сверх него submit() отказывает.
+	 * @param sender    Функция отправки (подменяется в тестах).
+	 * @param max_batch Максимум заданий, забираемых потоком за раз.
+	 */
+	AuthDelivery(size_t workers, size_t max_queue, Sender sender, size_t max_batch = DEFAULT_BATCH);
+	~AuthDelivery();
+
+	AuthDelivery(const AuthDelivery&) = delete;
+	AuthDelivery& operator=(const AuthDelivery&) = delete;
+
+	/**
+	 * @brief Поставить задание в очередь.
+	 *
+	 * @param job Задание.
+	 * @return false, если очередь заполнена или пул остановлен.
+	 */
+	bool submit(AuthJob job);
+
+	/**
+	 * @brief Дескриптор eventfd, становящийся читаемым при появлении результатов.
+	 *
+	 * Регистрируется в цикле событий на чтение.
+	 */
+	int notify_fd() const { return event_fd_; }
+
+	/**
+	 * @brief Забрать все завершённые задания.
+	 *
+	 * Сбрасывает счётчик eventfd.
+	 *
+	 * @return Результаты в порядке завершения.
+	 */
+	std::vector<AuthResult> take_results();
+
+	/**
+	 * @brief Число заданий в очереди (ещё не взятых рабочими потоками).
+	 */
+	size_t queued() const;
+
+	/**
+	 * @brief Снимок статистики доставки (потокобезопасно).
+	 */
+	AuthDeliveryStats stats() const;
+
+	/**
+	 * @brief Остановить пул: отбросить ожидающие задания и дождаться потоков.
+	 *
+	 * Запросы, уже выполняющиеся в рабочих потоках, завершаются по таймауту HTTP.
+	 */
+	void stop();
+
+private:
+	void worker_loop();
+	void record(uint64_t latency_us, bool delivered);
+
+	Sender sender_;
+	size_t max_queue_;
+	size_t max_batch_;
+	size_t worker_count_;
+	int event_fd_;
+
+	std::atomic<uint64_t> requests_{0};
+	std::atomic<uint64_t> failures_{0};
+	std::atomic<uint64_t> batches_{0};
+	std::atomic<uint64_t> max_batch_seen_{0};
+	std::atomic<uint64_t> rejected_{0};
+	Histogram latency_us_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<AuthJob> jobs_;
+	std::vector<AuthResult> results_;
+	bool stopping_ = false;
+
+	std::vector<std::thread> workers_;
+};
+
+#endif  // AUTH_DELIVERY_H
@@ -0,0 +1,139 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+BufferPool::BufferPool(size_t max_cached) : max_cached_(max_cached) {
+	for (FreeList& list : lists_)
+		list.blocks.reserve(max_cached_);
+}
+
+BufferPool::~BufferPool() {
+	for (size_t c = 0; c < CLASSES; ++c)
+		for (void* block : lists_[c].blocks)
+			::operator delete(block, MIN_BLOCK << c);
+}
+
+size_t BufferPool::class_of(size_t size) {
+	if (size <= MIN_BLOCK)
+		return 0;
+	return static_cast<size_t>(std::bit_width(size - 1)) - std::bit_width(MIN_BLOCK - 1);
+}
+
+size_t BufferPool::block_size(size_t size) {
+	return size > MAX_BLOCK ? size : MIN_BLOCK << class_of(size);
+}
+
+void* BufferPool::allocate(size_t size) {
+	if (size > MAX_BLOCK) {
+		heap_allocs_.fetch_add(1, std::memory_order_relaxed);
+		return ::operator new(size);
+	}
+	size_t c = class_of(size);
+	{
+		FreeList& list = lists_[c];
+		std::lock_guard<std::mutex> lock(list.mutex);
+		if (!list.blocks.empty()) {
+			void* block = list.blocks.back();
+			list.blocks.pop_back();
+			reuses_.fetch_add(1, std::memory_order_relaxed);
+			return block;
+		}
+	}
+	heap_allocs_.fetch_add(1, std::memory_order_relaxed);
+	return ::operator new(MIN_BLOCK << c);
+}
+
+void BufferPool::release(void* block, size_t size) {
+	if (block == nullptr)
+		return;
+	if (size > MAX_BLOCK) {
+		::operator delete(block, size);
+		return;
+	}
+	size_t c = class_of(size);
+	{
+		FreeList& list = lists_[c];
+		std::lock_guard<std::mutex> lock(list.mutex);
+		if (list.blocks.size() < max_cached_) {
+			list.blocks.push_back(block);
+			return;
+		}
+	}
+	::operator delete(block, MIN_BLOCK << c);
+}
+
+BufferPoolStats BufferPool::stats() const {
+	BufferPoolStats st;
+	st.heap_allocs = heap_allocs_.load(std::memory_order_relaxed);
+	st.reuses = reuses_.load(std::memory_order_relaxed);
+	for (size_t c = 0; c < CLASSES; ++c) {
+		FreeList& list = const_cast<FreeList&>(lists_[c]);
+		std::lock_guard<std::mutex> lock(list.mutex);
+		st.cached += list.blocks.size();
+		st.cached_bytes += list.blocks.size() * (MIN_BLOCK << c);
+	}
+	return st;
+}
+
+BufferPool& buffer_pool() {
+	static BufferPool* pool = new BufferPool();
+	return *pool;
+}
+
+PooledBuffer::PooledBuffer(size_t capacity) {
+	size_t bytes = BufferPool::block_size(sizeof(Header) + capacity);
+	block_ = new (buffer_pool().allocate(bytes)) Header{{1}, bytes - sizeof(Header), 0};
+}
+
+PooledBuffer PooledBuffer::share() const {
+	PooledBuffer copy;
+	if (block_) {
+		block_->refs.fetch_add(1, std::memory_order_relaxed);
+		copy.block_ = block_;
+	}
+	return copy;
+}
+
+void PooledBuffer::release_block(void* block) {
+	Header* h = static_cast<Header*>(block);
+	if (h->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+	size_t bytes = sizeof(Header) + h->capacity;
+	h->~Header();
+	buffer_pool().release(h, bytes);
+}
+
+void PooledBuffer::reset() {
+	if (block_)
+		release_block(std::exchange(block_, nullptr));
+}
+
+BufferLease PooledBuffer::lease() && {
+	return BufferLease(&PooledBuffer::release_block, std::exchange(block_, nullptr));
+}
+
+void PooledBuffer::reserve(size_t capacity) {
+	if (capacity <= this->capacity())
+		return;
+	PooledBuffer bigger(std::max(capacity, 2 * this->capacity()));
+	if (block_) {
+		std::memcpy(payload(bigger.block_), payload(block_), block_->size);
+		bigger.block_->size = block_->size;
+	}
+	*this = std::move(bigger);
+}
+
+char* PooledBuffer::extend(size_t n) {
+	reserve(size() + n);
+	char* out = payload(block_) + block_->size;
+	block_->size += n;
+	return out;
+}
+
+void PooledBuffer::append(std::string_view data) {
+	if (data.empty())
+		return;
+	std::memcpy(extend(data.size()), data.data(), data.size());
+}
@@ -0,0 +1,284 @@
+/**
+ * @file buffer_pool.h
+ * @brief Пул блоков памяти по классам размеров для пути пересылки сообщений.
+ *
+ * Механизм:
+ * - BufferPool раздаёт блоки размером степень двойки (64 байта .. 64 КиБ)
+ *   и хранит освобождённые блоки в списке своего класса, поэтому
+ *   в установившемся режиме пересылка не обращается к куче.
+ * - PooledBuffer — перемещаемый (не копируемый) буфер исходящего кадра
+ *   в блоке пула. Вторая ссылка на те же байты берётся явно через share()
+ *   (счётчик ссылок в заголовке блока); блок возвращается в пул один раз,
+ *   при разрушении последней ссылки.
+ * - Ссылка передаётся по цепочке: сборка сообщения -> очередь отправки
+ *   (OutputQueue::push_lease()) и фоновый поток истории.
+ * - PooledTask — перемещаемое замыкание в блоке пула для входящих ящиков
+ *   шардов; MpscQueue берёт узлы из того же пула.
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "socket_utils.h"
+
+/**
+ * @struct BufferPoolStats
+ * @brief Счётчики пула.
+ *
+ * @var BufferPoolStats::heap_allocs
+ * Блоков, взятых из кучи (пул был пуст или размер вне классов).
+ * @var BufferPoolStats::reuses
+ * Блоков, выданных повторно из списков пула.
+ * @var BufferPoolStats::cached
+ * Блоков, лежащих в списках пула сейчас.
+ * @var BufferPoolStats::cached_bytes
+ * Их суммарный размер.
+ */
+struct BufferPoolStats {
+	uint64_t heap_allocs = 0;
+	uint64_t reuses = 0;
+	uint64_t cached = 0;
+	uint64_t cached_bytes = 0;
+};
+
+/**
+ * @class BufferPool
+ * @brief Потокобезопасный пул блоков по классам размеров.
+ *
+ * Блок может быть освобождён в другом потоке, чем выделен (сообщение
+ * собирает шард отправителя, а освобождает шард получателя или поток
+ * истории), поэтому у каждого класса свой список под своим мьютексом.
+ */
+class BufferPool {
+public:
+	/// Наименьший класс (байт).
+	static constexpr size_t MIN_BLOCK = 64;
+	/// Число классов: 64 байта .. 64 КиБ.
+	static constexpr size_t CLASSES = 11;
+	/// Наибольший класс; большие блоки берутся из кучи напрямую.
+	static constexpr size_t MAX_BLOCK = MIN_BLOCK << (CLASSES - 1);
+
+	/**
+	 * @param max_cached Сколько свободных блоков хранить в каждом классе;
+	 *                   лишние возвращаются в кучу.
+	 */
+	explicit BufferPool(size_t max_cached = 1024);
+	~BufferPool();
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	/**
+	 * @brief Выделить блок не меньше @p size байт.
+	 *
+	 * Выравнивание — как у operator new.
+	 */
+	void* allocate(size_t size);
+
+	/**
+	 * @brief Вернуть блок в пул.
+	 *
+	 * @param block Блок из allocate().
+	 * @param size  Размер, запрошенный при выделении.
+	 */
+	void release(void* block, size_t size);
+
+	/**
+	 * @brief Фактический размер блока для запроса @p size байт.
+	 */
+	static size_t block_size(size_t size);
+
+	/**
+	 * @brief Снимок счётчиков.
+	 */
+	BufferPoolStats stats() const;
+
+private:
+	static size_t class_of(size_t size);
+
+	struct FreeList {
+		std::mutex mutex;
+		std::vector<void*> blocks;
+	};
+
+	size_t max_cached_;
+	std::array<FreeList, CLASSES> lists_;
+	std::atomic<uint64_t> heap_allocs_{0};
+	std::atomic<uint64_t> reuses_{0};
+};
+
+/**
+ * @brief Общий пул процесса.
+ *
+ * Никогда не разрушается: буферы могут освобождаться из деструкторов
+ * статических и thread_local объектов при выходе.
+ */
+BufferPool& buffer_pool();
+
+/**
+ * @brief Создать объект в блоке общего пула.
+ */
+template <typename T, typename... Args>
+T* pool_new(Args&&... args) {
+	static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+	void* block = buffer_pool().allocate(sizeof(T));
+	return new (block) T(std::forward<Args>(args)...);
+}
+
+/**
+ * @brief Разрушить объект из pool_new() и вернуть блок в пул.
+ */
+template <typename T>
+void pool_delete(T* object) {
+	object->~T();
+	buffer_pool().release(object, sizeof(T));
+}
+
+/**
+ * @class PooledBuffer
+ * @brief Буфер исходящего сообщения в блоке пула.
+ *
+ * Перемещаемый, не копируемый. Дописывать данные можно, пока ссылка
+ * единственная; после share() содержимое только читается.
+ */
+class PooledBuffer {
+public:
+	PooledBuffer() = default;
+
+	/**
+	 * @brief Выделить буфер ёмкостью не меньше @p capacity байт.
+	 */
+	explicit PooledBuffer(size_t capacity);
+
+	PooledBuffer(PooledBuffer&& other) noexcept : block_(std::exchange(other.block_, nullptr)) {}
+	PooledBuffer& operator=(PooledBuffer&& other) noexcept {
+		if (this != &other) {
+			reset();
+			block_ = std::exchange(other.block_, nullptr);
+		}
+		return *this;
+	}
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+	~PooledBuffer() { reset(); }
+
+	/**
+	 * @brief Ещё одна ссылка на те же байты (счётчик ссылок +1).
+	 */
+	PooledBuffer share() const;
+
+	/**
+	 * @brief Отпустить ссылку; последняя возвращает блок в пул.
+	 */
+	void reset();
+
+	/**
+	 * @brief Передать ссылку очереди отправки.
+	 *
+	 * Буфер становится пустым; блок освобождается, когда очередь
+	 * отправит данные (и остальные ссылки будут отпущены).
+	 */
+	BufferLease lease() &&;
+
+	/// Обеспечить ёмкость не меньше @p capacity (только для единственной ссылки).
+	void reserve(size_t capacity);
+
+	/// Дописать байт.
+	void push_back(char c) { *extend(1) = c; }
+	/// Дописать строку.
+	void append(std::string_view data);
+
+	/**
+	 * @brief Увеличить размер на @p n байт.
+	 *
+	 * @return Указатель на добавленные (неинициализированные) байты.
+	 */
+	char* extend(size_t n);
+
+	const char* data() const { return block_ ? payload(block_) : nullptr; }
+	size_t size() const { return block_ ? block_->size : 0; }
+	size_t capacity() const { return block_ ? block_->capacity : 0; }
+	bool empty() const { return size() == 0; }
+	std::string_view view() const { return {data(), size()}; }
+	/// Число ссылок на блок (0 для пустого буфера).
+	uint32_t use_count() const { return block_ ? block_->refs.load(std::memory_order_relaxed) : 0; }
+
+private:
+	struct Header {
+		std::atomic<uint32_t> refs;
+		size_t capacity;
+		size_t size;
+	};
+
+	static char* payload(Header* h) { return reinterpret_cast<char*>(h + 1); }
+	static void release_block(void* block);
+
+	Header* block_ = nullptr;
+};
+
+/**
+ * @class PooledTask
+ * @brief Перемещаемое замыкание без аргументов в блоке пула.
+ *
+ * В отличие от std::function не требует копируемости замыкания и не
+ * обращается к куче: замыкание лежит в блоке пула. Невыполненное
+ * замыкание освобождается деструктором.
+ */
+class PooledTask {
+public:
+	PooledTask() = default;
+
+	/// Неявное преобразование из замыкания, как у std::function.
+	template <typename F>
+	    requires(!std::is_same_v<std::remove_cvref_t<F>, PooledTask>)
+	PooledTask(F&& fn) {
+		using Fn = std::remove_cvref_t<F>;
+		box_ = pool_new<Fn>(std::forward<F>(fn));
+		invoke_ = [](void* box) { (*static_cast<Fn*>(box))(); };
+		destroy_ = [](void* box) { pool_delete(static_cast<Fn*>(box)); };
+	}
+
+	PooledTask(PooledTask&& other) noexcept
+	    : box_(std::exchange(other.box_, nullptr)),
+	      invoke_(std::exchange(other.invoke_, nullptr)),
+	      destroy_(std::exchange(other.destroy_, nullptr)) {}
+	PooledTask& operator=(PooledTask&& other) noexcept {
+		if (this != &other) {
+			reset();
+			box_ = std::exchange(other.box_, nullptr);
+			invoke_ = std::exchange(other.invoke_, nullptr);
+			destroy_ = std::exchange(other.destroy_, nullptr);
+		}
+		return *this;
+	}
+	PooledTask(const PooledTask&) = delete;
+	PooledTask& operator=(const PooledTask&) = delete;
+	~PooledTask() { reset(); }
+
+	void operator()() { invoke_(box_); }
+	explicit operator bool() const { return box_ != nullptr; }
+
+private:
+	void reset() {
+		if (box_)
+			destroy_(box_);
+		box_ = nullptr;
+	}
+
+	void* box_ = nullptr;
+	void (*invoke_)(void*) = nullptr;
+	void (*destroy_)(void*) = nullptr;
+};
+
+#endif  // BUFFER_POOL_H
@@ -0,0 +1,241 @@
+/**
+ * @file commands.h
+ * @brief Таблица команд клиента, построенная на этапе компиляции.
+ *
+ * Механизм:
+ * - COMMANDS — единственное описание команд: имя, аргументы, подсказка
+ *   и назначение. Из неё на этапе компиляции строятся хеш-таблица
+ *   имён (FNV-1a, открытая адресация), текст /help и сообщение
+ *   о неизвестной команде.
+ * - parse_command() хеширует первое слово сообщения и находит команду
+ *   за O(1) независимо от числа команд, не создавая строк.
+ * - Тексты лежат в статической памяти, поэтому их можно ставить
+ *   в очередь отправки без копирования.
+ */
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * @brief Команда клиента.
+ */
+enum class Command : uint8_t {
+	Unknown,  ///< Не команда из таблицы или неверная форма аргументов.
+	Connect,
+	Vote,
+	End,
+	Room,
+	Rooms,
+	History,
+	Search,
+	Exit,
+	Help
+};
+
+/**
+ * @brief Допустимая форма аргументов команды.
+ */
+enum class CommandArgs : uint8_t {
+	None,      ///< Только имя: "/vote".
+	Required,  ///< Имя, пробел и аргументы: "/connect <ID>".
+	Optional   ///< Любая из двух форм: "/history" или "/history 10".
+};
+
+/**
+ * @struct CommandSpec
+ * @brief Описание команды в таблице.
+ *
+ * @var CommandSpec::name
+ * Имя вместе с '/'.
+ * @var CommandSpec::id
+ * Команда.
+ * @var CommandSpec::args
+ * Форма аргументов.
+ * @var CommandSpec::params
+ * Подсказка по аргументам для /help и сообщения об ошибке.
+ * @var CommandSpec::summary
+ * Назначение команды для /help.
+ */
+struct CommandSpec {
+	std::string_view name;
+	Command id;
+	CommandArgs args;
+	std::string_view params;
+	std::string_view summary;
+};
+
+/// Команды клиента в порядке вывода в /help.
+inline constexpr std::array COMMANDS = {
+    CommandSpec{"/connect", Command::Connect, CommandArgs::Required, "<ID>", "request chat with user"},
+    CommandSpec{"/vote", Command::Vote, CommandArgs::None, "", "pass speaker role"},
+    CommandSpec{"/end", Command::End, CommandArgs::None, "", "end current conversation or leave the room"},
+    CommandSpec{"/room", Command::Room, CommandArgs::Required, "create|join <name>",
+                "create or join a group room (/room leave to leave it)"},
+    CommandSpec{"/rooms", Command::Rooms, CommandArgs::None, "", "list group rooms"},
+    CommandSpec{"/history", Command::History, CommandArgs::Optional, "<n> [before]",
+                "show n messages before message #before"},
+    CommandSpec{"/search", Command::Search, CommandArgs::Required, "<words>",
+                "find messages of the current chat containing all words"},
+    CommandSpec{"/exit", Command::Exit, CommandArgs::None, "", "exit the chat completely"},
+    CommandSpec{"/help", Command::Help, CommandArgs::None, "", "show this message"},
+};
+
+/**
+ * @struct ParsedCommand
+ * @brief Результат разбора сообщения-команды.
+ *
+ * @var ParsedCommand::id
+ * Команда; Command::Unknown, если имя не найдено или форма аргументов
+ * не подходит.
+ * @var ParsedCommand::args
+ * Всё после первого пробела (ссылка на исходное сообщение).
+ */
+struct ParsedCommand {
+	Command id = Command::Unknown;
+	std::string_view args;
+};
+
+namespace command_detail {
+
+	/// Хеш FNV-1a имени команды.
+	constexpr uint32_t hash(std::string_view name) {
+		uint32_t h = 2166136261u;
+		for (char c : name) {
+			h ^= static_cast<uint8_t>(c);
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	/// Число ячеек хеш-таблицы: степень двойки, заполнение не больше половины.
+	inline constexpr size_t SLOTS = 32;
+	inline constexpr uint8_t EMPTY = 0xff;
+	static_assert(COMMANDS.size() * 2 <= SLOTS);
+
+	/// Ячейки хеш-таблицы: номер команды в COMMANDS или EMPTY.
+	inline constexpr std::array<uint8_t, SLOTS> INDEX = [] {
+		std::array<uint8_t, SLOTS> slots{};
+		slots.fill(EMPTY);
+		for (size_t i = 0; i < COMMANDS.size(); ++i) {
+			size_t s = hash(COMMANDS[i].name) & (SLOTS - 1);
+			while (slots[s] != EMPTY)
+				s = (s + 1) & (SLOTS - 1);
+			slots[s] = static_cast<uint8_t>(i);
+		}
+		return slots;
+	}();
+
+	constexpr bool names_unique() {
+		for (size_t i = 0; i < COMMANDS.size(); ++i)
+			for (size_t j = i + 1; j < COMMANDS.size(); ++j)
+				if (COMMANDS[i].name == COMMANDS[j].name)
+					return false;
+		return true;
+	}
+	static_assert(names_unique());
+
+	/// Колонка, с которой в /help начинается назначение команды.
+	inline constexpr size_t HELP_COLUMN = 13;
+
+	/**
+	 * @brief Сборщик строки: при out == nullptr только считает длину.
+	 */
+	struct TextWriter {
+		char* out = nullptr;
+		size_t size = 0;
+
+		constexpr void put(std::string_view s) {
+			for (char c : s) {
+				if (out != nullptr)
+					out[size] = c;
+				++size;
+			}
+		}
+	};
+
+	constexpr void put_usage(TextWriter& w, const CommandSpec& c) {
+		w.put(c.name);
+		if (!c.params.empty()) {
+			w.put(" ");
+			w.put(c.params);
+		}
+	}
+
+	constexpr size_t write_help(char* out) {
+		TextWriter w{out};
+		w.put("Available commands:\n");
+		for (const CommandSpec& c : COMMANDS) {
+			size_t start = w.size;
+			put_usage(w, c);
+			while (w.size - start < HELP_COLUMN)
+				w.put(" ");
+			w.put(" - ");
+			w.put(c.summary);
+			w.put("\n");
+		}
+		return w.size;
+	}
+
+	constexpr size_t write_unknown(char* out) {
+		TextWriter w{out};
+		w.put("Only ");
+		for (size_t i = 0; i < COMMANDS.size(); ++i) {
+			if (i > 0)
+				w.put(", ");
+			put_usage(w, COMMANDS[i]);
+		}
+		w.put(" are allowed.\n");
+		return w.size;
+	}
+
+	template <size_t N>
+	using Text = std::array<char, N>;
+
+	inline constexpr Text<write_help(nullptr)> HELP = [] {
+		Text<write_help(nullptr)> text{};
+		write_help(text.data());
+		return text;
+	}();
+
+	inline constexpr Text<write_unknown(nullptr)> UNKNOWN = [] {
+		Text<write_unknown(nullptr)> text{};
+		write_unknown(text.data());
+		return text;
+	}();
+
+}  // namespace command_detail
+
+/// Ответ на /help.
+inline constexpr std::string_view HELP_TEXT{command_detail::HELP.data(), command_detail::HELP.size()};
+
+/// Ответ на неизвестную команду.
+inline constexpr std::string_view UNKNOWN_COMMAND_TEXT{command_detail::UNKNOWN.data(),
+                                                       command_detail::UNKNOWN.size()};
+
+/**
+ * @brief Найти команду по сообщению клиента.
+ *
+ * @param msg Сообщение без завершающего '\n'.
+ */
+constexpr ParsedCommand parse_command(std::string_view msg) {
+	using namespace command_detail;
+	size_t space = msg.find(' ');
+	std::string_view name = msg.substr(0, space);
+	bool has_args = space != std::string_view::npos;
+	for (size_t s = hash(name) & (SLOTS - 1); INDEX[s] != EMPTY; s = (s + 1) & (SLOTS - 1)) {
+		const CommandSpec& c = COMMANDS[INDEX[s]];
+		if (c.name != name)
+			continue;
+		if ((c.args == CommandArgs::None && has_args) || (c.args == CommandArgs::Required && !has_args))
+			return {};
+		return {c.id, has_args ? msg.substr(space + 1) : std::string_view()};
+	}
+	return {};
+}
+
+#endif  // COMMANDS_H
@@ -0,0 +1,620 @@
+#include "event_loop.h"
+
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "io_ring.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <map>
+
+#ifdef MESSENGER_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+
+#endif
+
+namespace {
+
+	class EpollLoop : public EventLoop {
+	public:
+		EpollLoop() : epfd_(epoll_create1(EPOLL_CLOEXEC)), buf_(256) {}
+		~EpollLoop() override {
+			if (epfd_ != -1)
+				close(epfd_);
+		}
+
+		bool ok() const { return epfd_ != -1; }
+
+		bool add(int fd, uint32_t events) override { return ctl(EPOLL_CTL_ADD, fd, events); }
+
+		bool modify(int fd, uint32_t events) override { return ctl(EPOLL_CTL_MOD, fd, events); }
+
+		void remove(int fd) override { epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr); }
+
+		int wait(std::vector<LoopEvent>& out, int timeout_ms) override {
+			out.clear();
+			int n = epoll_wait(epfd_, buf_.data(), static_cast<int>(buf_.size()), timeout_ms);
+			if (n < 0)
+				return errno == EINTR ? 0 : -1;
+			for (int i = 0; i < n; ++i) {
+				uint32_t ev = 0;
+				if (buf_[i].events & (EPOLLIN | EPOLLRDHUP))
+					ev |= LOOP_READ;
+				if (buf_[i].events & EPOLLOUT)
+					ev |= LOOP_WRITE;
+				if (buf_[i].events & (EPOLLERR | EPOLLHUP))
+					ev |= LOOP_ERROR | LOOP_READ;
+				out.push_back({buf_[i].data.fd, ev});
+			}
+			// Буфер заполнен целиком — в следующий раз забираем больше событий за один вызов.
+			if (n == static_cast<int>(buf_.size()))
+				buf_.resize(buf_.size() * 2);
+			return n;
+		}
+
+		const char* name() const override { return "epoll"; }
+
+	private:
+		bool ctl(int op, int fd, uint32_t events) {
+			epoll_event ev{};
+			ev.data.fd = fd;
+			if (events & LOOP_READ)
+				ev.events |= EPOLLIN | EPOLLRDHUP;
+			if (events & LOOP_WRITE)
+				ev.events |= EPOLLOUT;
+			if (events & LOOP_EDGE)
+				ev.events |= EPOLLET;
+			return epoll_ctl(epfd_, op, fd, &ev) == 0;
+		}
+
+		int epfd_;
+		std::vector<epoll_event> buf_;
+	};
+
+	class SelectLoop : public EventLoop {
+	public:
+		bool add(int fd, uint32_t events) override {
+			if (fd < 0 || fd >= FD_SETSIZE || interest_.count(fd))
+				return false;
+			interest_[fd] = events;
+			return true;
+		}
+
+		bool modify(int fd, uint32_t events) override {
+			auto it = interest_.find(fd);
+			if (it == interest_.end())
+				return false;
+			it->second = events;
+			return true;
+		}
+
+		void remove(int fd) override { interest_.erase(fd); }
+
+		int wait(std::vector<LoopEvent>& out, int timeout_ms) override {
+			out.clear();
+			fd_set read_fds, write_fds;
+			FD_ZERO(&read_fds);
+			FD_ZERO(&write_fds);
+			int fd_max = -1;
+			for (const auto& [fd, events] : interest_) {
+				if (events & LOOP_READ)
+					FD_SET(fd, &read_fds);
+				if (events & LOOP_WRITE)
+					FD_SET(fd, &write_fds);
+				fd_max = std::max(fd_max, fd);
+			}
+
+			timeval tv{};
+			timeval* tvp = nullptr;
+			if (timeout_ms >= 0) {
+				tv.tv_sec = timeout_ms / 1000;
+				tv.tv_usec = (timeout_ms % 1000) * 1000;
+				tvp = &tv;
+			}
+
+			int n = select(fd_max + 1, &read_fds, &write_fds, nullptr, tvp);
+			if (n < 0)
+				return errno == EINTR ? 0 : -1;
+			for (const auto& [fd, events] : interest_) {
+				uint32_t ev = 0;
+				if (FD_ISSET(fd, &read_fds))
+					ev |= LOOP_READ;
+				if (FD_ISSET(fd, &write_fds))
+					ev |= LOOP_WRITE;
+				if (ev)
+					out.push_back({fd, ev});
+			}
+			return static_cast<int>(out.size());
+		}
+
+		const char* name() const override { return "select"; }
+
+	private:
+		std::map<int, uint32_t> interest_;
+	};
+
+
+#ifdef MESSENGER_IO_URING
+	class UringLoop : public EventLoop {
+	public:
+		/// Размер очереди запросов; завершений — в 16 раз больше (многоразовые запросы).
+		static constexpr unsigned SQ_ENTRIES = 256;
+		/// Буферов для приёма данных и размер каждого.
+		static constexpr unsigned BUFFERS = 256;
+		static constexpr unsigned BUFFER_SIZE = 4096;
+
+		static std::unique_ptr<UringLoop> create() {
+			std::unique_ptr<IoRing> ring = IoRing::create(SQ_ENTRIES, SQ_ENTRIES * 16);
+			if (!ring)
+				return nullptr;
+			for (uint8_t op : {IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_ACCEPT, IORING_OP_RECV,
+			                   IORING_OP_SENDMSG, IORING_OP_PROVIDE_BUFFERS})
+				if (!ring->supports(op))
+					return nullptr;
+			std::unique_ptr<UringLoop> loop(new UringLoop(std::move(ring)));
+			if (!loop->init_buffers() || !loop->self_test())
+				return nullptr;
+			return loop;
+		}
+
+		bool add(int fd, uint32_t events) override {
+			if (fd < 0)
+				return false;
+			if (static_cast<size_t>(fd) >= slots_.size())
+				slots_.resize(fd + 1);
+			Slot& s = slots_[fd];
+			if (s.registered)
+				return false;
+			s = Slot{events, true};
+			arm(fd);
+			return true;
+		}
+
+		bool modify(int fd, uint32_t events) override {
+			Slot* s = slot(fd);
+			if (s == nullptr)
+				return false;
+			if (poll_mask(s->events) != poll_mask(events))
+				cancel(fd, s->poll_tag, POLL);
+			if (data_op(s->events) != data_op(events))
+				cancel(fd, s->data_tag, data_op(s->events));
+			s->events = events;
+			arm(fd);
+			return true;
+		}
+
+		void remove(int fd) override {
+			Slot* s = slot(fd);
+			if (s == nullptr)
+				return;
+			cancel(fd, s->poll_tag, POLL);
+			cancel(fd, s->data_tag, data_op(s->events));
+			*s = Slot{};
+			// Дескриптор освобождается: подключение, отложенное из-за EMFILE, может пройти.
+			rearm_.insert(rearm_.end(), starved_.begin(), starved_.end());
+			starved_.clear();
+		}
+
+		int wait(std::vector<LoopEvent>& out, int timeout_ms) override {
+			out.clear();
+			recycle();
+			using Clock = std::chrono::steady_clock;
+			Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(std::max(timeout_ms, 0));
+			while (true) {
+				rearm_.swap(rearming_);
+				for (int fd : rearming_)
+					arm(fd);
+				rearming_.clear();
+				bool ready = !deferred_.empty() || ring_->peek() != nullptr;
+				unsigned wait_for = ready || timeout_ms == 0 ? 0 : 1;
+				if (!ring_->submit(wait_for, timeout_ms))
+					return -1;
+				reap(out);
+				// Служебные завершения (отмена, возврат буферов) будят ядро, но событий не дают.
+				if (!out.empty() || timeout_ms == 0)
+					break;
+				if (timeout_ms > 0) {
+					auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+					if (left.count() <= 0)
+						break;
+					timeout_ms = static_cast<int>(left.count());
+				}
+			}
+			return static_cast<int>(out.size());
+		}
+
+		void send_batch(std::span<LoopSend> sends) override {
+			size_t first = 0;
+			while (first < sends.size()) {
+				// Пачка не больше очереди запросов: заголовки живут до конца её отправки.
+				size_t count = std::min<size_t>(sends.size() - first, SQ_ENTRIES);
+				headers_.assign(count, msghdr{});
+				size_t queued = 0;
+				for (; queued < count; ++queued) {
+					LoopSend& send = sends[first + queued];
+					io_uring_sqe* sqe = ring_->next_sqe();
+					if (sqe == nullptr)
+						break;
+					msghdr& msg = headers_[queued];
+					msg.msg_iov = const_cast<iovec*>(send.iov);
+					msg.msg_iovlen = send.iovcnt;
+					sqe->opcode = IORING_OP_SENDMSG;
+					sqe->fd = send.fd;
+					sqe->addr = reinterpret_cast<uint64_t>(&msg);
+					sqe->len = 1;
+					// MSG_DONTWAIT: полный буфер сокета — это -EAGAIN, а не ожидание в ядре,
+					// поэтому все отправки завершаются внутри одного io_uring_enter.
+					sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+					sqe->user_data = user_data(send.fd, SEND, static_cast<uint32_t>(queued));
+				}
+				done_.assign(queued, false);
+				size_t left = queued;
+				while (left > 0) {
+					if (!ring_->submit(static_cast<unsigned>(left))) {
+						for (size_t i = 0; i < queued; ++i)
+							if (!done_[i])
+								sends[first + i].result = -EIO;
+						return;
+					}
+					while (const io_uring_cqe* cqe = ring_->peek()) {
+						if (op_of(cqe->user_data) == SEND && tag_of(cqe->user_data) < queued) {
+							size_t i = tag_of(cqe->user_data);
+							sends[first + i].result = cqe->res;
+							done_[i] = true;
+							--left;
+						} else {
+							deferred_.push_back({cqe->user_data, cqe->res, cqe->flags});
+						}
+						ring_->pop();
+					}
+				}
+				for (size_t i = queued; i < count; ++i)
+					sends[first + i].result = -EAGAIN;
+				first += count;
+			}
+		}
+
+		void suspend(std::vector<LoopEvent>& out) override {
+			out.clear();
+			recycle();
+			suspended_ = true;
+			for (size_t fd = 0; fd < slots_.size(); ++fd) {
+				Slot& s = slots_[fd];
+				if (!s.registered)
+					continue;
+				request_cancel(static_cast<int>(fd), s.poll_tag, POLL);
+				request_cancel(static_cast<int>(fd), s.data_tag, data_op(s.events));
+			}
+			// Отмена многоразового запроса завершается его последним CQE (без F_MORE).
+			for (int round = 0; round < 100 && armed() > 0; ++round) {
+				ring_->submit(1, 100);
+				reap(out);
+			}
+			ring_->submit();
+			reap(out);
+		}
+
+		void resume() override {
+			suspended_ = false;
+			recycle();
+			for (size_t fd = 0; fd < slots_.size(); ++fd)
+				if (slots_[fd].registered)
+					arm(static_cast<int>(fd));
+		}
+
+		const char* name() const override { return "io_uring"; }
+
+	private:
+		/// Вид запроса, закодированный в user_data вместе с дескриптором и меткой.
+		enum Op : uint8_t { POLL = 1, RECV, ACCEPT, SEND, CANCEL, PROVIDE };
+
+		/**
+		 * Регистрация дескриптора. Метка (tag) — номер текущего запроса
+		 * каждого вида; завершения с чужой меткой относятся к отменённым
+		 * запросам (в том числе прежнего владельца номера дескриптора).
+		 */
+		struct Slot {
+			uint32_t events = 0;
+			bool registered = false;
+			uint32_t poll_tag = 0;
+			uint32_t data_tag = 0;
+		};
+
+		struct Completion {
+			uint64_t user_data;
+			int32_t res;
+			uint32_t flags;
+		};
+
+		explicit UringLoop(std::unique_ptr<IoRing> ring) : ring_(std::move(ring)) {}
+
+		static uint64_t user_data(int fd, Op op, uint32_t tag) {
+			return (uint64_t{static_cast<uint32_t>(fd)} << 32) | (uint64_t{op} << 24) | (tag & 0xffffff);
+		}
+		static int fd_of(uint64_t data) { return static_cast<int>(data >> 32); }
+		static Op op_of(uint64_t data) { return static_cast<Op>((data >> 24) & 0xff); }
+		static uint32_t tag_of(uint64_t data) { return data & 0xffffff; }
+
+		static Op data_op(uint32_t events) {
+			if (!(events & LOOP_READ))
+				return CANCEL;
+			if (events & LOOP_ACCEPT)
+				return ACCEPT;
+			return events & LOOP_RECV ? RECV : CANCEL;
+		}
+
+		/// События poll(2), которые ждёт запрос POLL (чтение — только без приёма данных).
+		static uint32_t poll_mask(uint32_t events) {
+			uint32_t mask = 0;
+			if ((events & LOOP_READ) && data_op(events) == CANCEL)
+				mask |= POLLIN | POLLRDHUP;
+			if (events & LOOP_WRITE)
+				mask |= POLLOUT;
+			return mask;
+		}
+
+		Slot* slot(int fd) {
+			if (fd < 0 || static_cast<size_t>(fd) >= slots_.size() || !slots_[fd].registered)
+				return nullptr;
+			return &slots_[fd];
+		}
+
+		uint32_t next_tag() {
+			next_tag_ = (next_tag_ + 1) & 0xffffff;
+			if (next_tag_ == 0)
+				next_tag_ = 1;
+			return next_tag_;
+		}
+
+		size_t armed() const {
+			size_t n = 0;
+			for (const Slot& s : slots_)
+				n += (s.poll_tag != 0) + (s.data_tag != 0);
+			return n;
+		}
+
+		/// Поставить недостающие запросы дескриптора (после регистрации или окончания многоразового).
+		void arm(int fd) {
+			Slot* s = slot(fd);
+			if (s == nullptr || suspended_)
+				return;
+			Op op = data_op(s->events);
+			if (op != CANCEL && s->data_tag == 0) {
+				io_uring_sqe* sqe = ring_->next_sqe();
+				if (sqe == nullptr) {
+					rearm_.push_back(fd);
+					return;
+				}
+				s->data_tag = next_tag();
+				sqe->opcode = op == ACCEPT ? IORING_OP_ACCEPT : IORING_OP_RECV;
+				sqe->fd = fd;
+				if (op == ACCEPT) {
+					sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+					sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+				} else {
+					sqe->ioprio = IORING_RECV_MULTISHOT;
+					sqe->flags = IOSQE_BUFFER_SELECT;
+					sqe->buf_group = BUFFER_GROUP;
+				}
+				sqe->user_data = user_data(fd, op, s->data_tag);
+			}
+			uint32_t mask = poll_mask(s->events);
+			if (mask != 0 && s->poll_tag == 0) {
+				io_uring_sqe* sqe = ring_->next_sqe();
+				if (sqe == nullptr) {
+					rearm_.push_back(fd);
+					return;
+				}
+				s->poll_tag = next_tag();
+				sqe->opcode = IORING_OP_POLL_ADD;
+				sqe->fd = fd;
+				sqe->poll32_events = mask;
+				// Многоразовый poll срабатывает по фронту, как EPOLLET. Без LOOP_EDGE — одноразовый:
+				// его перезапуск в каждом wait() снова сообщает о готовности, как уровень в epoll.
+				sqe->len = s->events & LOOP_EDGE ? IORING_POLL_ADD_MULTI : 0;
+				sqe->user_data = user_data(fd, POLL, s->poll_tag);
+			}
+		}
+
+		/// Отменить запрос и забыть его метку: дальнейшие завершения будут отброшены.
+		void cancel(int fd, uint32_t& tag, Op op) {
+			request_cancel(fd, tag, op);
+			tag = 0;
+		}
+
+		/// Попросить ядро отменить запрос, сохранив метку (suspend() ждёт его завершения).
+		void request_cancel(int fd, uint32_t tag, Op op) {
+			if (tag == 0 || op == CANCEL)
+				return;
+			io_uring_sqe* sqe = ring_->next_sqe();
+			if (sqe == nullptr)
+				return;
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = user_data(fd, op, tag);
+			sqe->user_data = user_data(fd, CANCEL, 0);
+		}
+
+		void reap(std::vector<LoopEvent>& out) {
+			for (const Completion& c : deferred_)
+				handle(c, out);
+			deferred_.clear();
+			while (const io_uring_cqe* cqe = ring_->peek()) {
+				Completion c{cqe->user_data, cqe->res, cqe->flags};
+				ring_->pop();
+				handle(c, out);
+			}
+		}
+
+		void handle(const Completion& c, std::vector<LoopEvent>& out) {
+			int fd = fd_of(c.user_data);
+			Op op = op_of(c.user_data);
+			uint32_t tag = tag_of(c.user_data);
+			bool more = c.flags & IORING_CQE_F_MORE;
+			Slot* s = slot(fd);
+			if (op == POLL) {
+				if (s == nullptr || s->poll_tag != tag)
+					return;
+				if (!more) {
+					s->poll_tag = 0;
+					rearm_.push_back(fd);
+				}
+				if (c.res <= 0)
+					return;
+				uint32_t ev = 0;
+				if (c.res & (POLLIN | POLLRDHUP))
+					ev |= LOOP_READ;
+				if (c.res & POLLOUT)
+					ev |= LOOP_WRITE;
+				if (c.res & (POLLERR | POLLHUP))
+					ev |= LOOP_ERROR | LOOP_READ;
+				out.push_back({fd, ev});
+				return;
+			}
+			if (op == RECV) {
+				bool current = s != nullptr && s->data_tag == tag;
+				if (current && !more) {
+					s->data_tag = 0;
+					rearm_.push_back(fd);
+				}
+				if (c.flags & IORING_CQE_F_BUFFER) {
+					uint16_t bid = static_cast<uint16_t>(c.flags >> IORING_CQE_BUFFER_SHIFT);
+					if (current && c.res > 0) {
+						std::string_view data(buffer(bid), static_cast<size_t>(c.res));
+						out.push_back({fd, LOOP_READ, data});
+						lent_.push_back(bid);
+					} else if (!provide(bid)) {
+						lent_.push_back(bid);
+					}
+				}
+				// Конец потока или ошибка: приём закончен, перезапуск не нужен.
+				if (current && (c.res == 0 || (c.res < 0 && c.res != -ENOBUFS && c.res != -ECANCELED))) {
+					std::erase(rearm_, fd);
+					out.push_back({fd, LOOP_CLOSED});
+				}
+				return;
+			}
+			if (op == ACCEPT) {
+				bool current = s != nullptr && s->data_tag == tag;
+				if (c.res >= 0) {
+					if (current)
+						out.push_back({fd, LOOP_READ, {}, c.res});
+					else
+						close(c.res);
+				}
+				if (current && !more) {
+					s->data_tag = 0;
+					if (c.res == -EMFILE || c.res == -ENFILE)
+						starved_.push_back(fd);
+					else
+						rearm_.push_back(fd);
+				}
+			}
+		}
+
+		bool init_buffers() {
+			pool_.resize(size_t{BUFFERS} * BUFFER_SIZE);
+			io_uring_sqe* sqe = ring_->next_sqe();
+			if (sqe == nullptr)
+				return false;
+			sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+			sqe->fd = BUFFERS;
+			sqe->addr = reinterpret_cast<uint64_t>(pool_.data());
+			sqe->len = BUFFER_SIZE;
+			sqe->buf_group = BUFFER_GROUP;
+			sqe->user_data = user_data(-1, PROVIDE, 0);
+			return true;
+		}
+
+		char* buffer(uint16_t bid) { return pool_.data() + size_t{bid} * BUFFER_SIZE; }
+
+		/// Вернуть буфер ядру: запрос уходит с ближайшим io_uring_enter, отдельного вызова нет.
+		bool provide(uint16_t bid) {
+			io_uring_sqe* sqe = ring_->next_sqe();
+			if (sqe == nullptr)
+				return false;
+			sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+			sqe->fd = 1;
+			sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+			sqe->len = BUFFER_SIZE;
+			sqe->buf_group = BUFFER_GROUP;
+			sqe->off = bid;
+			sqe->user_data = user_data(-1, PROVIDE, 0);
+			return true;
+		}
+
+		/// Вернуть буферы, отданные в событиях прошлого wait(); не вернувшиеся ждут следующего раза.
+		void recycle() {
+			std::erase_if(lent_, [this](uint16_t bid) { return provide(bid); });
+		}
+
+		/// Проверить многоразовый приём на паре сокетов: он есть только с Linux 6.0.
+		bool self_test() {
+			int sv[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) != 0)
+				return false;
+			bool ok = add(sv[0], LOOP_READ | LOOP_EDGE | LOOP_RECV) && ::write(sv[1], "x", 1) == 1;
+			std::vector<LoopEvent> events;
+			ok = ok && wait(events, 1000) == 1 && events[0].data == "x";
+			remove(sv[0]);
+			wait(events, 0);
+			close(sv[0]);
+			close(sv[1]);
+			return ok;
+		}
+
+		static constexpr uint16_t BUFFER_GROUP = 0;
+
+		std::unique_ptr<IoRing> ring_;
+		std::vector<Slot> slots_;
+		uint32_t next_tag_ = 0;
+		bool suspended_ = false;
+		std::vector<int> rearm_;    ///< Дескрипторы, чьи запросы нужно поставить заново.
+		std::vector<int> rearming_;
+		std::vector<int> starved_;  ///< Слушающие сокеты, ждущие свободного дескриптора.
+		std::vector<Completion> deferred_;  ///< Завершения, прочитанные send_batch() до wait().
+		std::vector<msghdr> headers_;
+		std::vector<bool> done_;
+		std::vector<char> pool_;
+		std::vector<uint16_t> lent_;  ///< Буферы, отданные в событиях.
+	};
+#endif  // MESSENGER_IO_URING
+
+}  // namespace
+
+void EventLoop::send_batch(std::span<LoopSend> sends) {
+	for (LoopSend& send : sends) {
+		msghdr msg{};
+		msg.msg_iov = const_cast<iovec*>(send.iov);
+		msg.msg_iovlen = send.iovcnt;
+		do {
+			send.result = ::sendmsg(send.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while (send.result < 0 && errno == EINTR);
+		if (send.result < 0)
+			send.result = -errno;
+	}
+}
+
+std::unique_ptr<EventLoop> make_event_loop(LoopBackend backend) {
+	if (backend == LoopBackend::Select)
+		return std::make_unique<SelectLoop>();
+	if (backend == LoopBackend::Uring) {
+#ifdef MESSENGER_IO_URING
+		return UringLoop::create();
+#else
+		return nullptr;
+#endif
+	}
+
+	auto loop = std::make_unique<EpollLoop>();
+	if (!loop->ok()) {
+		perror("epoll_create1");
+		return nullptr;
+	}
+	return loop;
+}
@@ -0,0 +1,190 @@
+/**
+ * @file event_loop.h
+ * @brief Абстракция цикла событий сервера (epoll / select / io_uring).
+ *
+ * Механизм:
+ * - Сервер регистрирует дескрипторы с маской интересующих событий
+ *   (чтение, запись, edge-triggered режим).
+ * - Метод wait() возвращает только готовые дескрипторы, поэтому стоимость
+ *   одного пробуждения пропорциональна числу активных сокетов, а не их общему числу.
+ * - Основная реализация — epoll (Linux), запасная — select(), ограниченная
+ *   FD_SETSIZE и используемая в тестах.
+ * - Необязательная реализация io_uring (сборка с MESSENGER_IO_URING) не
+ *   только сообщает о готовности, но и сама выполняет ввод-вывод: принимает
+ *   подключения (LOOP_ACCEPT) и данные (LOOP_RECV) многоразовыми запросами
+ *   и отдаёт их в событиях, а send_batch() отправляет очереди всех сокетов
+ *   одним системным вызовом. Остальные реализации эти флаги игнорируют
+ *   и сообщают о простой готовности, так что код сервера один для всех.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+/// Дескриптор готов к чтению (или закрыт удалённой стороной).
+constexpr uint32_t LOOP_READ = 1u << 0;
+/// Дескриптор готов к записи.
+constexpr uint32_t LOOP_WRITE = 1u << 1;
+/// Ошибка или разрыв соединения (только в результатах wait()).
+constexpr uint32_t LOOP_ERROR = 1u << 2;
+/// Запросить edge-triggered уведомления (только при регистрации).
+constexpr uint32_t LOOP_EDGE = 1u << 3;
+/// Отдавать принятые байты в событиях вместо готовности к чтению (при регистрации; io_uring).
+constexpr uint32_t LOOP_RECV = 1u << 4;
+/// Принимать подключения самому и отдавать их в событиях (при регистрации слушающего сокета; io_uring).
+constexpr uint32_t LOOP_ACCEPT = 1u << 5;
+/// Соединение закрыто или сброшено удалённой стороной (только в результатах для LOOP_RECV).
+constexpr uint32_t LOOP_CLOSED = 1u << 6;
+
+/**
+ * @struct LoopEvent
+ * @brief Событие готовности, возвращаемое EventLoop::wait().
+ *
+ * @var LoopEvent::fd
+ * Дескриптор, на котором произошло событие.
+ * @var LoopEvent::events
+ * Комбинация флагов LOOP_READ, LOOP_WRITE, LOOP_ERROR, LOOP_CLOSED.
+ * @var LoopEvent::data
+ * Байты, принятые с сокета, зарегистрированного с LOOP_RECV; действительны
+ * до следующего вызова wait() (или resume()).
+ * @var LoopEvent::accepted
+ * Подключение, принятое на сокете с LOOP_ACCEPT (неблокирующее, FD_CLOEXEC); -1 — нет.
+ */
+struct LoopEvent {
+	int fd;
+	uint32_t events;
+	std::string_view data = {};
+	int accepted = -1;
+};
+
+/**
+ * @struct LoopSend
+ * @brief Отправка одного сокета для EventLoop::send_batch().
+ *
+ * @var LoopSend::fd
+ * Сокет.
+ * @var LoopSend::iov
+ * Буферы; должны оставаться действительными до возврата из send_batch().
+ * @var LoopSend::iovcnt
+ * Число буферов.
+ * @var LoopSend::result
+ * Результат: принятое ядром число байт или -errno.
+ */
+struct LoopSend {
+	int fd;
+	const iovec* iov;
+	size_t iovcnt;
+	ssize_t result = 0;
+};
+
+/**
+ * @brief Доступные реализации цикла событий.
+ */
+enum class LoopBackend {
+	Epoll,   ///< epoll(7), edge-triggered; без ограничения FD_SETSIZE.
+	Select,  ///< select(2), level-triggered; флаг LOOP_EDGE игнорируется.
+	Uring    ///< io_uring(7): многоразовые accept/recv, пакетная отправка.
+};
+
+/**
+ * @class EventLoop
+ * @brief Интерфейс мультиплексора ввода-вывода.
+ *
+ * В edge-triggered режиме вызывающая сторона обязана вычитывать сокет
+ * до EAGAIN: повторного уведомления о уже имеющихся данных не будет.
+ * Код, корректный для edge-triggered режима, корректен и для select().
+ */
+class EventLoop {
+public:
+	virtual ~EventLoop() = default;
+
+	/**
+	 * @brief Зарегистрировать дескриптор.
+	 *
+	 * @param fd     Дескриптор.
+	 * @param events Маска LOOP_READ / LOOP_WRITE / LOOP_EDGE.
+	 * @return true при успехе; false, если дескриптор нельзя отслеживать
+	 *         (например, fd >= FD_SETSIZE для select или обычный файл для epoll).
+	 */
+	virtual bool add(int fd, uint32_t events) = 0;
+
+	/**
+	 * @brief Изменить маску событий уже зарегистрированного дескриптора.
+	 *
+	 * @param fd     Дескриптор.
+	 * @param events Новая маска.
+	 * @return true при успехе.
+	 */
+	virtual bool modify(int fd, uint32_t events) = 0;
+
+	/**
+	 * @brief Снять дескриптор с наблюдения.
+	 *
+	 * Безопасно вызывать для незарегистрированного дескриптора.
+	 *
+	 * @param fd Дескриптор.
+	 */
+	virtual void remove(int fd) = 0;
+
+	/**
+	 * @brief Дождаться событий.
+	 *
+	 * @param out        Вектор, в который записываются готовые дескрипторы
+	 *                   (предыдущее содержимое очищается).
+	 * @param timeout_ms Таймаут в миллисекундах; -1 — ждать бесконечно.
+	 * @return Число событий; 0 по таймауту или EINTR; -1 при ошибке.
+	 */
+	virtual int wait(std::vector<LoopEvent>& out, int timeout_ms) = 0;
+
+	/**
+	 * @brief Отправить буферы нескольких сокетов, не блокируясь.
+	 *
+	 * Реализация по умолчанию делает sendmsg() для каждого сокета;
+	 * io_uring отправляет всю пачку одним системным вызовом. Частичная
+	 * отправка и -EAGAIN означают, что буфер сокета заполнен.
+	 *
+	 * @param sends Отправки; результаты записываются в LoopSend::result.
+	 */
+	virtual void send_batch(std::span<LoopSend> sends);
+
+	/**
+	 * @brief Прекратить приём на всех дескрипторах (передача сокетов другому процессу).
+	 *
+	 * Данные и подключения, которые ядро уже приняло от имени цикла, но
+	 * wait() ещё не вернул, записываются в @p out. Регистрации сохраняются;
+	 * resume() возобновляет наблюдение. Циклы, не выполняющие ввод-вывод
+	 * сами, ничего не делают.
+	 *
+	 * @param out Вектор для оставшихся событий (предыдущее содержимое очищается).
+	 */
+	virtual void suspend(std::vector<LoopEvent>& out) { out.clear(); }
+
+	/**
+	 * @brief Возобновить наблюдение после suspend().
+	 */
+	virtual void resume() {}
+
+	/**
+	 * @brief Имя реализации ("epoll", "select" или "io_uring") для журналов.
+	 */
+	virtual const char* name() const = 0;
+};
+
+/**
+ * @brief Создать цикл событий заданного типа.
+ *
+ * @param backend Требуемая реализация.
+ * @return Указатель на цикл; nullptr, если реализацию не удалось инициализировать
+ *         (для io_uring — сборка без MESSENGER_IO_URING или ядро без нужных операций).
+ */
+std::unique_ptr<EventLoop> make_event_loop(LoopBackend backend);
+
+#endif  // EVENT_LOOP_H
@@ -0,0 +1,88 @@
+/**
+ * @file fd_table.h
+ * @brief Плоская таблица, индексированная дескриптором сокета.
+ *
+ * Дескрипторы — небольшие плотные числа (ядро выдаёт наименьший
+ * свободный), поэтому вектор слотов по номеру fd дешевле хеш-таблицы:
+ * поиск — одно сравнение и обращение по индексу, без хеширования
+ * и отдельного узла на каждую запись.
+ */
+
+#ifndef FD_TABLE_H
+#define FD_TABLE_H
+
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+/**
+ * @class FdTable
+ * @brief Отображение fd -> T на векторе слотов.
+ *
+ * Как и std::unordered_map, operator[] создаёт запись по умолчанию.
+ * Добавление записи для большего fd может перераспределить вектор:
+ * ссылки на записи действительны только до следующей вставки.
+ */
+template <typename T>
+class FdTable {
+public:
+	/// Есть ли запись для @p fd.
+	bool contains(int fd) const {
+		return fd >= 0 && static_cast<size_t>(fd) < slots_.size() && slots_[fd].has_value();
+	}
+
+	/// Запись для @p fd или nullptr.
+	T* find(int fd) { return contains(fd) ? &*slots_[fd] : nullptr; }
+	const T* find(int fd) const { return contains(fd) ? &*slots_[fd] : nullptr; }
+
+	/// Запись для @p fd; отсутствующая создаётся значением по умолчанию.
+	T& operator[](int fd) {
+		if (static_cast<size_t>(fd) >= slots_.size())
+			slots_.resize(static_cast<size_t>(fd) + 1);
+		if (!slots_[fd]) {
+			slots_[fd].emplace();
+			++size_;
+		}
+		return *slots_[fd];
+	}
+
+	/**
+	 * @brief Удалить запись.
+	 *
+	 * @return true, если запись была.
+	 */
+	bool erase(int fd) {
+		if (!contains(fd))
+			return false;
+		slots_[fd].reset();
+		--size_;
+		return true;
+	}
+
+	/// Число записей.
+	size_t size() const { return size_; }
+	/// Нет ли записей.
+	bool empty() const { return size_ == 0; }
+
+	/// Удалить все записи.
+	void clear() {
+		slots_.clear();
+		size_ = 0;
+	}
+
+	/**
+	 * @brief Вызвать @p f(fd, запись) для каждой записи по возрастанию fd.
+	 */
+	template <typename F>
+	void for_each(F&& f) {
+		for (size_t fd = 0; fd < slots_.size(); ++fd)
+			if (slots_[fd])
+				f(static_cast<int>(fd), *slots_[fd]);
+	}
+
+private:
+	std::vector<std::optional<T>> slots_;
+	size_t size_ = 0;
+};
+
+#endif  // FD_TABLE_H
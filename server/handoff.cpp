@@ -0,0 +1,325 @@
+#include "handoff.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+	constexpr uint32_t MAGIC = 0x4f484d43;  // "CMHO"
+	constexpr uint32_t VERSION = 1;
+
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t fds;
+		uint32_t reserved;
+		uint64_t size;
+	};
+
+	void put_u32(std::string& out, uint32_t v) {
+		for (int i = 0; i < 4; ++i)
+			out.push_back(static_cast<char>(v >> (8 * i)));
+	}
+
+	void put_u64(std::string& out, uint64_t v) {
+		for (int i = 0; i < 8; ++i)
+			out.push_back(static_cast<char>(v >> (8 * i)));
+	}
+
+	void put_str(std::string& out, std::string_view s) {
+		put_u32(out, static_cast<uint32_t>(s.size()));
+		out.append(s);
+	}
+
+	/// Чтение с проверкой границ: после первой ошибки все значения нулевые, ok == false.
+	struct Reader {
+		std::string_view data;
+		size_t pos = 0;
+		bool ok = true;
+
+		uint64_t fixed(size_t bytes) {
+			if (!ok || data.size() - pos < bytes) {
+				ok = false;
+				return 0;
+			}
+			uint64_t v = 0;
+			for (size_t i = 0; i < bytes; ++i)
+				v |= uint64_t{static_cast<uint8_t>(data[pos + i])} << (8 * i);
+			pos += bytes;
+			return v;
+		}
+		uint32_t u32() { return static_cast<uint32_t>(fixed(4)); }
+		uint64_t u64() { return fixed(8); }
+		bool flag() { return fixed(1) != 0; }
+		std::string str() {
+			size_t len = u32();
+			if (!ok || data.size() - pos < len) {
+				ok = false;
+				return {};
+			}
+			std::string s(data.substr(pos, len));
+			pos += len;
+			return s;
+		}
+	};
+
+	bool write_all(int sock, const void* data, size_t len) {
+		const char* p = static_cast<const char*>(data);
+		while (len > 0) {
+			ssize_t n = ::send(sock, p, len, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			len -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	bool read_all(int sock, void* data, size_t len) {
+		char* p = static_cast<char*>(data);
+		while (len > 0) {
+			ssize_t n = ::recv(sock, p, len, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			len -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	bool send_fds(int sock, const int* fds, uint32_t count) {
+		char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)] = {};
+		iovec iov{&count, sizeof(count)};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+		while (true) {
+			ssize_t n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			return n == static_cast<ssize_t>(sizeof(count));
+		}
+	}
+
+	bool recv_fds(int sock, std::vector<int>& out) {
+		uint32_t count = 0;
+		char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)] = {};
+		iovec iov{&count, sizeof(count)};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t n;
+		do {
+			n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		} while (n < 0 && errno == EINTR);
+
+		size_t got = 0;
+		for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+				continue;
+			size_t k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const unsigned char* data = CMSG_DATA(c);
+			for (size_t i = 0; i < k; ++i) {
+				int fd;
+				std::memcpy(&fd, data + i * sizeof(int), sizeof(int));
+				out.push_back(fd);
+			}
+			got += k;
+		}
+		return n == static_cast<ssize_t>(sizeof(count)) && !(msg.msg_flags & MSG_CTRUNC) && got == count;
+	}
+
+	sockaddr_un unix_address(const std::string& path, bool& ok) {
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		ok = !path.empty() && path.size() < sizeof(addr.sun_path);
+		if (ok)
+			std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+		return addr;
+	}
+
+}  // namespace
+
+std::string encode_handoff(const HandoffState& state) {
+	std::string out;
+	put_u32(out, MAGIC);
+	put_u32(out, VERSION);
+	put_u64(out, static_cast<uint64_t>(state.frozen_at_ns));
+	put_u32(out, static_cast<uint32_t>(state.listeners.size()));
+	put_u32(out, static_cast<uint32_t>(state.sessions.size()));
+	for (const HandoffSession& s : state.sessions) {
+		put_u32(out, s.shard);
+		out.push_back(static_cast<char>(s.binary));
+		out.push_back(static_cast<char>(s.is_speaking));
+		out.push_back(static_cast<char>(s.auth_interrupted));
+		put_str(out, s.input);
+		put_str(out, s.output);
+		put_str(out, s.user);
+		put_str(out, s.pending_auth);
+		put_str(out, s.auth_code);
+		put_str(out, s.partner);
+		put_str(out, s.pending_request_from);
+		put_str(out, s.room);
+	}
+	put_u32(out, static_cast<uint32_t>(state.rooms.size()));
+	for (const HandoffRoom& r : state.rooms) {
+		put_str(out, r.name);
+		put_u32(out, r.speaker);
+		put_u32(out, static_cast<uint32_t>(r.members.size()));
+		for (const std::string& m : r.members)
+			put_str(out, m);
+	}
+	return out;
+}
+
+bool decode_handoff(std::string_view data, HandoffState& state) {
+	Reader in{data};
+	if (in.u32() != MAGIC || in.u32() != VERSION)
+		return false;
+	state = HandoffState{};
+	state.frozen_at_ns = static_cast<int64_t>(in.u64());
+	// Каждой записи нужен хотя бы один байт: размер не даёт раздуть резервирование.
+	size_t listeners = in.u32();
+	if (listeners > data.size())
+		return false;
+	state.listeners.assign(listeners, -1);
+	size_t sessions = in.u32();
+	if (sessions > data.size())
+		return false;
+	state.sessions.resize(sessions);
+	for (HandoffSession& s : state.sessions) {
+		s.shard = in.u32();
+		s.binary = in.flag();
+		s.is_speaking = in.flag();
+		s.auth_interrupted = in.flag();
+		s.input = in.str();
+		s.output = in.str();
+		s.user = in.str();
+		s.pending_auth = in.str();
+		s.auth_code = in.str();
+		s.partner = in.str();
+		s.pending_request_from = in.str();
+		s.room = in.str();
+	}
+	size_t rooms = in.u32();
+	if (rooms > data.size())
+		return false;
+	state.rooms.resize(rooms);
+	for (HandoffRoom& r : state.rooms) {
+		r.name = in.str();
+		r.speaker = in.u32();
+		size_t members = in.u32();
+		if (members > data.size())
+			return false;
+		r.members.resize(members);
+		for (std::string& m : r.members)
+			m = in.str();
+	}
+	return in.ok && in.pos == data.size();
+}
+
+int64_t send_handoff(int sock, const HandoffState& state) {
+	std::vector<int> fds = state.listeners;
+	for (const HandoffSession& s : state.sessions)
+		fds.push_back(s.fd);
+	std::string blob = encode_handoff(state);
+
+	Header header{MAGIC, VERSION, static_cast<uint32_t>(fds.size()), 0, blob.size()};
+	if (!write_all(sock, &header, sizeof(header)))
+		return -1;
+	for (size_t i = 0; i < fds.size(); i += HANDOFF_FDS_PER_MESSAGE) {
+		uint32_t count = static_cast<uint32_t>(std::min(HANDOFF_FDS_PER_MESSAGE, fds.size() - i));
+		if (!send_fds(sock, fds.data() + i, count))
+			return -1;
+	}
+	if (!write_all(sock, blob.data(), blob.size()))
+		return -1;
+	return static_cast<int64_t>(blob.size());
+}
+
+int64_t recv_handoff(int sock, HandoffState& state) {
+	Header header{};
+	if (!read_all(sock, &header, sizeof(header)) || header.magic != MAGIC || header.version != VERSION)
+		return -1;
+
+	std::vector<int> fds;
+	bool ok = true;
+	while (ok && fds.size() < header.fds)
+		ok = recv_fds(sock, fds);
+
+	std::string blob;
+	if (ok) {
+		blob.resize(header.size);
+		ok = read_all(sock, blob.data(), blob.size()) && decode_handoff(blob, state) &&
+		     fds.size() == state.listeners.size() + state.sessions.size();
+	}
+	if (!ok) {
+		for (int fd : fds)
+			close(fd);
+		return -1;
+	}
+
+	size_t next = 0;
+	for (int& fd : state.listeners)
+		fd = fds[next++];
+	for (HandoffSession& s : state.sessions)
+		s.fd = fds[next++];
+	return static_cast<int64_t>(blob.size());
+}
+
+int listen_handoff_socket(const std::string& path) {
+	bool ok;
+	sockaddr_un addr = unix_address(path, ok);
+	if (!ok)
+		return -1;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	unlink(path.c_str());
+	if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0 || chmod(path.c_str(), 0600) < 0 ||
+	    listen(sock, 1) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+bool handoff_peer_allowed(int sock) {
+	ucred cred{};
+	socklen_t len = sizeof(cred);
+	return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+}
+
+int connect_handoff_socket(const std::string& path) {
+	bool ok;
+	sockaddr_un addr = unix_address(path, ok);
+	if (!ok)
+		return -1;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
@@ -0,0 +1,180 @@
+/**
+ * @file handoff.h
+ * @brief Передача сокетов и состояния сессий новому процессу сервера (горячий перезапуск).
+ *
+ * Механизм:
+ * - Работающий сервер слушает Unix-сокет передачи. Новый процесс,
+ *   запущенный с --takeover, подключается к нему; старый останавливает
+ *   шарды, сериализует состояние (HandoffState) и отправляет его вместе
+ *   с дескрипторами слушающих и клиентских сокетов (SCM_RIGHTS).
+ * - Дескрипторы идут пачками не больше HANDOFF_FDS_PER_MESSAGE в одном
+ *   sendmsg(), затем — сериализованное состояние одним потоком байт.
+ * - Клиентские TCP-соединения не разрываются: у обоих процессов ссылки
+ *   на одни и те же открытые сокеты, старый просто перестаёт их читать.
+ * - Новый процесс подтверждает приём одним байтом; без подтверждения
+ *   старый продолжает работу как ни в чём не бывало.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Наибольшее число дескрипторов в одном сообщении (ядро допускает до 253).
+constexpr size_t HANDOFF_FDS_PER_MESSAGE = 250;
+/// Байт, которым новый процесс подтверждает, что принял состояние и сокеты.
+constexpr char HANDOFF_ACK = 'A';
+
+/**
+ * @struct HandoffSession
+ * @brief Состояние одного клиентского соединения.
+ *
+ * Пользователи записаны строками Telegram ID: номера UserId
+ * у каждого процесса свои.
+ *
+ * @var HandoffSession::fd
+ * Дескриптор сокета (в принявшем процессе — уже его собственный).
+ * @var HandoffSession::shard
+ * Шард, обслуживавший соединение.
+ * @var HandoffSession::binary
+ * Клиент перешёл на двоичный протокол.
+ * @var HandoffSession::input
+ * Принятые, но ещё не разобранные байты.
+ * @var HandoffSession::output
+ * Байты, ещё не отправленные клиенту.
+ * @var HandoffSession::user
+ * Авторизованный пользователь (пусто, если вход не выполнен).
+ * @var HandoffSession::pending_auth
+ * Telegram ID, для которого отправлен код (пусто, если код не ждём).
+ * @var HandoffSession::auth_code
+ * Отправленный код для pending_auth.
+ * @var HandoffSession::partner
+ * Собеседник (пусто, если беседы нет).
+ * @var HandoffSession::is_speaking
+ * Право голоса в беседе.
+ * @var HandoffSession::pending_request_from
+ * Кто ждёт ответа на /connect (пусто, если запроса нет).
+ * @var HandoffSession::room
+ * Групповая комната (пусто, если клиент не в комнате).
+ * @var HandoffSession::auth_interrupted
+ * Код был в пути к Telegram: клиенту нужно ввести ID заново.
+ */
+struct HandoffSession {
+	int fd = -1;
+	uint32_t shard = 0;
+	bool binary = false;
+	std::string input;
+	std::string output;
+	std::string user;
+	std::string pending_auth;
+	std::string auth_code;
+	std::string partner;
+	bool is_speaking = false;
+	std::string pending_request_from;
+	std::string room;
+	bool auth_interrupted = false;
+};
+
+/**
+ * @struct HandoffRoom
+ * @brief Групповая комната.
+ *
+ * @var HandoffRoom::name
+ * Имя комнаты.
+ * @var HandoffRoom::members
+ * Участники в порядке входа.
+ * @var HandoffRoom::speaker
+ * Номер говорящего в members.
+ */
+struct HandoffRoom {
+	std::string name;
+	std::vector<std::string> members;
+	uint32_t speaker = 0;
+};
+
+/**
+ * @struct HandoffState
+ * @brief Всё, что новый процесс получает от старого.
+ *
+ * @var HandoffState::frozen_at_ns
+ * Момент остановки шардов старого процесса (steady_clock, нс). Часы
+ * CLOCK_MONOTONIC общие для всех процессов, поэтому новый процесс
+ * измеряет по ним паузу обслуживания.
+ * @var HandoffState::listeners
+ * Слушающие сокеты шардов.
+ * @var HandoffState::sessions
+ * Клиентские соединения.
+ * @var HandoffState::rooms
+ * Групповые комнаты.
+ */
+struct HandoffState {
+	int64_t frozen_at_ns = 0;
+	std::vector<int> listeners;
+	std::vector<HandoffSession> sessions;
+	std::vector<HandoffRoom> rooms;
+};
+
+/**
+ * @brief Сериализовать состояние (без самих дескрипторов).
+ */
+std::string encode_handoff(const HandoffState& state);
+
+/**
+ * @brief Разобрать состояние из encode_handoff().
+ *
+ * Номера дескрипторов остаются теми, что были у отправителя.
+ *
+ * @return false, если данные повреждены или другой версии.
+ */
+bool decode_handoff(std::string_view data, HandoffState& state);
+
+/**
+ * @brief Отправить состояние и дескрипторы в Unix-сокет.
+ *
+ * @param sock  Подключённый Unix-сокет (блокирующий).
+ * @param state Состояние; listeners и fd сессий передаются через SCM_RIGHTS.
+ * @return Объём сериализованного состояния в байтах или -1 при ошибке.
+ */
+int64_t send_handoff(int sock, const HandoffState& state);
+
+/**
+ * @brief Принять состояние и дескрипторы из send_handoff().
+ *
+ * Полученные дескрипторы подставляются в listeners и fd сессий
+ * (с флагом FD_CLOEXEC). При ошибке уже полученные дескрипторы закрываются.
+ *
+ * @return Объём сериализованного состояния в байтах или -1 при ошибке.
+ */
+int64_t recv_handoff(int sock, HandoffState& state);
+
+/**
+ * @brief Открыть слушающий Unix-сокет передачи.
+ *
+ * Существующий файл сокета по пути @p path удаляется; новый доступен
+ * только владельцу (0600).
+ *
+ * @return Дескриптор или -1 при ошибке.
+ */
+int listen_handoff_socket(const std::string& path);
+
+/**
+ * @brief Принадлежит ли процесс на другом конце сокета тому же пользователю.
+ *
+ * Передача отдаёт все клиентские соединения, поэтому чужие процессы
+ * отвергаются (SO_PEERCRED), даже если права на файл сокета позволили
+ * подключиться.
+ */
+bool handoff_peer_allowed(int sock);
+
+/**
+ * @brief Подключиться к Unix-сокету передачи работающего сервера.
+ *
+ * @return Дескриптор или -1 при ошибке.
+ */
+int connect_handoff_socket(const std::string& path);
+
+#endif  // HANDOFF_H
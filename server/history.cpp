@@ -1,42 +1,87 @@
 #include "history.h"
 
-#include <algorithm>
-#include <filesystem>
-#include <fstream>
+#include <ctime>
+#include <memory>
 #include <string>
+#include <utility>
 
-namespace fs = std::filesystem;
+namespace {
 
-std::string get_history_filename(const std::string& user1, const std::string& user2) {
-	std::string u1 = user1, u2 = user2;
-	if (u1 > u2)
-		std::swap(u1, u2);
-	return "HISTORY/history_" + u1 + "_" + u2 + ".txt";
-}
+	std::unique_ptr<HistoryWriter> writer;
+	std::unique_ptr<HistoryCompactor> compactor;
+
+}  // namespace
 
-void ensure_history_folder_exists() {
-	if (!fs::exists("HISTORY")) {
-		fs::create_directory("HISTORY");
-	}
+HistoryStore& history_store() {
+	static HistoryStore store;
+	return store;
 }
 
 void append_message_to_history(const std::string& user1, const std::string& user2,
                                const std::string& message) {
-	ensure_history_folder_exists();
-	std::ofstream file(get_history_filename(user1, user2), std::ios::app);
-	if (file) {
-		file << message;
-	}
+	HistoryRecord record = record_from_text(message, static_cast<int64_t>(std::time(nullptr)));
+	if (writer && writer->submit(user1, user2, record))
+		return;
+	history_store().append(user1, user2, record);
+}
+
+void append_line_to_history(const std::string& user1, const std::string& user2, PooledBuffer owner,
+                            std::string_view line) {
+	// Своя ссылка держит строку, если поток уже остановлен и submit() её отверг.
+	if (writer && writer->submit(user1, user2, owner.share(), line))
+		return;
+	history_store().append(user1, user2, record_from_text(line, static_cast<int64_t>(std::time(nullptr))));
 }
 
 std::string load_history_for_users(const std::string& user1, const std::string& user2) {
-	ensure_history_folder_exists();
-	std::ifstream file(get_history_filename(user1, user2));
-	std::string line, text;
-	if (file.is_open()) {
-		while (std::getline(file, line)) {
-			text += line + "\n";
-		}
-	}
-	return text;
+	if (writer)
+		writer->flush(user1, user2);
+	return history_store().load_text(user1, user2);
+}
+
+HistoryView map_history_page(const std::string& user1, const std::string& user2, uint64_t limit,
+                             uint64_t before) {
+	if (writer)
+		writer->flush(user1, user2);
+	return history_store().map_page(user1, user2, limit, before);
+}
+
+HistoryMatches search_history(const std::string& user1, const std::string& user2, std::string_view query,
+                              size_t limit) {
+	if (writer)
+		writer->flush(user1, user2);
+	return history_store().search(user1, user2, query, limit);
+}
+
+void start_history_writer(HistoryDurability durability, std::chrono::milliseconds sync_interval,
+                          Histogram* append_us) {
+	stop_history_writer();
+	writer = std::make_unique<HistoryWriter>(history_store(), durability, sync_interval, append_us);
+}
+
+void stop_history_writer() {
+	writer.reset();
+}
+
+HistoryWriter* history_writer() {
+	return writer.get();
+}
+
+void start_history_compactor(std::chrono::milliseconds interval, HistoryCompactor::Report report) {
+	stop_history_compactor();
+	compactor = std::make_unique<HistoryCompactor>(history_store(), interval, std::move(report));
+}
+
+void stop_history_compactor() {
+	compactor.reset();
+}
+
+HistoryCompactor* history_compactor() {
+	return compactor.get();
+}
+
+void close_history_files() {
+	if (writer)
+		writer->flush();
+	history_store().close_all();
 }
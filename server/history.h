@@ -3,21 +3,41 @@
  * @brief Работа с историей переписки между двумя пользователями.
  *
  * Механизм:
- * - История хранится в каталоге HISTORY.
- * - Название файла истории для пары пользователей формируется
- *   лексикографически: HISTORY/<min>___<max>.txt.
+ * - История хранится в каталоге HISTORY в бинарных журналах с индексом
+ *   (см. history_store.h).
+ * - Название файлов истории для пары пользователей формируется
+ *   лексикографически: HISTORY/history_<min>_<max>.log и .idx.
+ * - После start_history_writer() сообщения пишутся фоновым потоком
+ *   (см. history_writer.h), а функции чтения сначала дожидаются записи
+ *   уже поставленных сообщений.
+ * - После start_history_compactor() политика хранения (HistoryRetention)
+ *   применяется фоновым потоком (см. history_compactor.h).
  */
 
 #ifndef HISTORY_H
 #define HISTORY_H
 
+#include <chrono>
+#include <cstdint>
 #include <string>
+#include <string_view>
+
+#include "buffer_pool.h"
+#include "history_compactor.h"
+#include "history_store.h"
+#include "history_writer.h"
+
+/**
+ * @brief Общее хранилище истории сервера (каталог HISTORY).
+ */
+HistoryStore& history_store();
 
 /**
  * @brief Добавить сообщение в историю чата двух пользователей.
  *
  * Создаёт каталог HISTORY при необходимости и дописывает @p message
- * в файл для пары пользователей.
+ * в журнал пары пользователей (через очередь фонового потока, если он запущен). Отправитель и время извлекаются из
+ * префикса "[YYYY-MM-DD HH:MM] sender: ", если он есть.
  *
  * @param user1 Идентификатор первого пользователя.
  * @param user2 Идентификатор второго пользователя.
@@ -26,10 +46,24 @@
 void append_message_to_history(const std::string& user1, const std::string& user2,
                                const std::string& message);
 
+/**
+ * @brief Добавить в историю строку чата, лежащую в буфере пула.
+ *
+ * Как append_message_to_history(), но фоновому потоку передаётся ссылка
+ * на @p owner, а не копия строки.
+ *
+ * @param user1 Идентификатор первого пользователя.
+ * @param user2 Идентификатор второго пользователя.
+ * @param owner Ссылка на буфер с @p line.
+ * @param line  Строка сообщения, включая символ новой строки.
+ */
+void append_line_to_history(const std::string& user1, const std::string& user2, PooledBuffer owner,
+                            std::string_view line);
+
 /**
  * @brief Загрузить всю историю переписки между двумя пользователями.
  *
- * Открывает файл HISTORY/<min>___<max>.txt и возвращает его содержимое.
+ * Читает журнал HISTORY/history_<min>_<max>.log и склеивает строки всех записей.
  *
  * @param user1 Идентификатор первого пользователя.
  * @param user2 Идентификатор второго пользователя.
@@ -38,4 +72,70 @@ void append_message_to_history(const std::string& user1, const std::string& user
  */
 std::string load_history_for_users(const std::string& user1, const std::string& user2);
 
+/**
+ * @brief Отобразить в память последние @p limit сообщений переписки
+ *        до сообщения @p before.
+ *
+ * @see HistoryStore::map_page
+ */
+HistoryView map_history_page(const std::string& user1, const std::string& user2, uint64_t limit,
+                             uint64_t before = UINT64_MAX);
+
+/**
+ * @brief Найти сообщения переписки, содержащие все слова @p query.
+ *
+ * @see HistoryStore::search
+ */
+HistoryMatches search_history(const std::string& user1, const std::string& user2, std::string_view query,
+                              size_t limit);
+
+/**
+ * @brief Запустить фоновый поток записи истории.
+ *
+ * @param durability    Политика fdatasync().
+ * @param sync_interval Интервал для HistoryDurability::Interval.
+ * @param append_us     Гистограмма длительности записи пачки (см. HistoryWriter).
+ */
+void start_history_writer(HistoryDurability durability,
+                          std::chrono::milliseconds sync_interval = HistoryWriter::DEFAULT_SYNC_INTERVAL,
+                          Histogram* append_us = nullptr);
+
+/**
+ * @brief Дописать очередь, синхронизировать журналы и остановить фоновый поток.
+ *
+ * После вызова сообщения снова пишутся синхронно.
+ */
+void stop_history_writer();
+
+/**
+ * @brief Фоновый поток записи истории; nullptr, если он не запущен.
+ */
+HistoryWriter* history_writer();
+
+/**
+ * @brief Запустить фоновый поток политики хранения истории.
+ *
+ * @param interval Интервал между проходами.
+ * @param report   Обработчик итогов прохода (метрики).
+ */
+void start_history_compactor(std::chrono::milliseconds interval = HistoryCompactor::DEFAULT_INTERVAL,
+                             HistoryCompactor::Report report = nullptr);
+
+/**
+ * @brief Остановить фоновый поток политики хранения (дождавшись текущего прохода).
+ */
+void stop_history_compactor();
+
+/**
+ * @brief Фоновый поток политики хранения; nullptr, если он не запущен.
+ */
+HistoryCompactor* history_compactor();
+
+/**
+ * @brief Закрыть файлы истории, открытые в кэше хранилища.
+ *
+ * Нужно перед удалением или заменой каталога HISTORY.
+ */
+void close_history_files();
+
 #endif  // HISTORY_H
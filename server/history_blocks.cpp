@@ -0,0 +1,328 @@
+#include "history_blocks.h"
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef MESSENGER_ZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+	static_assert(sizeof(HistoryBlock) == 40);
+
+	/// Уровень zlib: текст переписки почти не сжимается сильнее на старших уровнях, а пишется дольше.
+	constexpr int LEVEL = 6;
+
+	bool pwrite_all(int fd, const char* data, size_t len, uint64_t offset) {
+		while (len > 0) {
+			ssize_t n = ::pwrite(fd, data, len, static_cast<off_t>(offset));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			data += n;
+			len -= static_cast<size_t>(n);
+			offset += static_cast<uint64_t>(n);
+		}
+		return true;
+	}
+
+	bool pread_all(int fd, char* data, size_t len, uint64_t offset) {
+		while (len > 0) {
+			ssize_t n = ::pread(fd, data, len, static_cast<off_t>(offset));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			data += n;
+			len -= static_cast<size_t>(n);
+			offset += static_cast<uint64_t>(n);
+		}
+		return true;
+	}
+
+	bool file_size(const std::string& path, uint64_t& size) {
+		struct stat st {};
+		if (::stat(path.c_str(), &st) != 0)
+			return false;
+		size = static_cast<uint64_t>(st.st_size);
+		return true;
+	}
+
+}  // namespace
+
+#ifdef MESSENGER_ZLIB
+bool HistoryBlocks::available() {
+	return true;
+}
+
+bool HistoryBlocks::compress(std::string_view raw, std::string& out) {
+	uLongf len = compressBound(static_cast<uLong>(raw.size()));
+	out.resize(len);
+	if (compress2(reinterpret_cast<Bytef*>(out.data()), &len, reinterpret_cast<const Bytef*>(raw.data()),
+	              static_cast<uLong>(raw.size()), LEVEL) != Z_OK)
+		return false;
+	out.resize(len);
+	return true;
+}
+
+bool HistoryBlocks::decompress(std::string_view packed, size_t raw, std::string& out) {
+	out.resize(raw);
+	uLongf len = static_cast<uLongf>(raw);
+	const Bytef* src = reinterpret_cast<const Bytef*>(packed.data());
+	int rc = uncompress(reinterpret_cast<Bytef*>(out.data()), &len, src, static_cast<uLong>(packed.size()));
+	return rc == Z_OK && len == raw;
+}
+#else
+bool HistoryBlocks::available() {
+	return false;
+}
+
+bool HistoryBlocks::compress(std::string_view, std::string&) {
+	return false;
+}
+
+bool HistoryBlocks::decompress(std::string_view, size_t, std::string&) {
+	return false;
+}
+#endif
+
+void HistoryBlocks::remove(const std::string& base) {
+	::unlink((base + ".bix").c_str());
+	::unlink((base + ".blk").c_str());
+	// Сегменты: <base>.<N>.blk и недоудалённые <base>.<N>.del.
+	fs::path path(base);
+	std::string prefix = path.filename().string() + ".";
+	std::error_code ec;
+	for (const auto& entry : fs::directory_iterator(path.parent_path(), ec)) {
+		std::string name = entry.path().filename().string();
+		std::string ext = entry.path().extension().string();
+		if (name.rfind(prefix, 0) == 0 && (ext == ".blk" || ext == ".del") &&
+		    name.find_first_not_of("0123456789", prefix.size()) == name.size() - ext.size())
+			fs::remove(entry.path(), ec);
+	}
+}
+
+std::string HistoryBlocks::segment_path(const std::string& base, uint32_t segment) {
+	return base + "." + std::to_string(segment) + ".blk";
+}
+
+HistoryBlocks::HistoryBlocks(std::string base) : base_(std::move(base)) {}
+
+HistoryBlocks::~HistoryBlocks() {
+	close_reader();
+	if (blk_fd_ != -1)
+		::close(blk_fd_);
+	if (bix_fd_ != -1)
+		::close(bix_fd_);
+}
+
+bool HistoryBlocks::open_index() {
+	if (bix_fd_ == -1)
+		bix_fd_ = ::open((base_ + ".bix").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	return bix_fd_ != -1;
+}
+
+bool HistoryBlocks::open_segment(uint32_t segment) {
+	if (blk_fd_ != -1 && blk_segment_ == segment)
+		return true;
+	int fd = ::open(segment_path(base_, segment).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+	if (blk_fd_ != -1)
+		::close(blk_fd_);
+	blk_fd_ = fd;
+	blk_segment_ = segment;
+	return true;
+}
+
+void HistoryBlocks::close_reader() const {
+	if (read_fd_ != -1)
+		::close(read_fd_);
+	read_fd_ = -1;
+}
+
+void HistoryBlocks::open() {
+	blocks_.clear();
+	dropped_ = packed_ = segment_raw_ = 0;
+	close_reader();
+	struct stat st {};
+	if (::stat((base_ + ".bix").c_str(), &st) != 0 || !open_index())
+		return;
+	uint64_t size = 0;
+	if (file_size(base_ + ".blk", size) && !file_size(segment_path(base_, 0), size))
+		::rename((base_ + ".blk").c_str(), segment_path(base_, 0).c_str());
+
+	struct stat bix_st {};
+	fstat(bix_fd_, &bix_st);
+	std::vector<HistoryBlock> entries(static_cast<size_t>(bix_st.st_size) / sizeof(HistoryBlock));
+	size_t len = entries.size() * sizeof(HistoryBlock);
+	if (!pread_all(bix_fd_, reinterpret_cast<char*>(entries.data()), len, 0))
+		entries.clear();
+
+	// Удалённые сегменты: элементы освобождены (нули) или их файла уже нет.
+	size_t i = 0;
+	uint32_t segment = UINT32_MAX;
+	uint64_t segment_size = 0;
+	bool exists = false;
+	for (; i < entries.size(); ++i) {
+		if (entries[i].segment != segment) {
+			segment = entries[i].segment;
+			exists = file_size(segment_path(base_, segment), segment_size);
+		}
+		if (entries[i].records != 0 && exists)
+			break;
+	}
+	dropped_ = i;
+
+	// Каждый блок продолжает предыдущий; хвост, не прошедший проверку, — след прерванной записи.
+	HistoryBlock next;
+	for (; i < entries.size(); ++i) {
+		const HistoryBlock& b = entries[i];
+		if (b.segment != segment) {
+			if (b.segment != segment + 1 || !file_size(segment_path(base_, b.segment), segment_size))
+				break;
+			segment = b.segment;
+			next.offset = 0;
+			segment_raw_ = 0;
+		}
+		bool chained = blocks_.empty() || (b.first == next.first && b.log_offset == next.log_offset);
+		if (!chained || b.offset != next.offset || b.records == 0 || b.raw == 0 || b.packed == 0 ||
+		    b.offset + b.packed > segment_size)
+			break;
+		blocks_.push_back(b);
+		next.first = b.first + b.records;
+		next.log_offset = b.log_offset + b.raw;
+		next.offset = b.offset + b.packed;
+		packed_ += b.packed;
+		segment_raw_ += b.raw;
+	}
+	if (i != entries.size() || bix_st.st_size % sizeof(HistoryBlock) != 0)
+		(void)::ftruncate(bix_fd_, static_cast<off_t>((dropped_ + blocks_.size()) * sizeof(HistoryBlock)));
+	if (blocks_.empty())
+		return;
+	// Недописанный блок в конце последнего сегмента и сегмент, начатый без элемента индекса.
+	segment = blocks_.back().segment;
+	if (file_size(segment_path(base_, segment), segment_size) && segment_size != next.offset)
+		(void)::truncate(segment_path(base_, segment).c_str(), static_cast<off_t>(next.offset));
+	::unlink(segment_path(base_, segment + 1).c_str());
+}
+
+uint64_t HistoryBlocks::first() const {
+	return blocks_.empty() ? 0 : blocks_.front().first;
+}
+
+uint64_t HistoryBlocks::records() const {
+	return blocks_.empty() ? 0 : blocks_.back().first + blocks_.back().records;
+}
+
+uint64_t HistoryBlocks::log_bytes() const {
+	return blocks_.empty() ? 0 : blocks_.back().log_offset + blocks_.back().raw;
+}
+
+uint64_t HistoryBlocks::packed_bytes() const {
+	return packed_;
+}
+
+size_t HistoryBlocks::find(uint64_t record) const {
+	auto it = std::upper_bound(blocks_.begin(), blocks_.end(), record,
+	                           [](uint64_t r, const HistoryBlock& b) { return r < b.first; });
+	return static_cast<size_t>(it - blocks_.begin()) - 1;
+}
+
+bool HistoryBlocks::read(size_t i, std::string& raw) const {
+	const HistoryBlock& b = blocks_[i];
+	int fd = blk_fd_ != -1 && blk_segment_ == b.segment ? blk_fd_ : -1;
+	if (fd == -1) {
+		if (read_fd_ == -1 || read_segment_ != b.segment) {
+			close_reader();
+			read_fd_ = ::open(segment_path(base_, b.segment).c_str(), O_RDONLY | O_CLOEXEC);
+			read_segment_ = b.segment;
+		}
+		fd = read_fd_;
+	}
+	if (b.packed == b.raw) {
+		raw.resize(b.raw);
+		return pread_all(fd, raw.data(), raw.size(), b.offset);
+	}
+	std::string packed(b.packed, '\0');
+	return pread_all(fd, packed.data(), packed.size(), b.offset) && decompress(packed, b.raw, raw);
+}
+
+bool HistoryBlocks::append(uint32_t records, std::string_view raw, bool compress, bool new_segment) {
+	if (records == 0 || raw.empty() || !open_index())
+		return false;
+	// Несжавшийся блок хранится как есть: packed == raw отличает его от сжатого.
+	std::string_view data = raw;
+	if (compress && HistoryBlocks::compress(raw, scratch_) && scratch_.size() < raw.size())
+		data = scratch_;
+
+	HistoryBlock b;
+	b.first = this->records();
+	b.log_offset = log_bytes();
+	b.segment = segment();
+	b.offset = blocks_.empty() ? 0 : blocks_.back().offset + blocks_.back().packed;
+	if (new_segment && !blocks_.empty()) {
+		if (blk_fd_ != -1 && ::fdatasync(blk_fd_) != 0)
+			return false;
+		++b.segment;
+		b.offset = 0;
+	}
+	b.packed = static_cast<uint32_t>(data.size());
+	b.raw = static_cast<uint32_t>(raw.size());
+	b.records = records;
+	uint64_t entry = (dropped_ + blocks_.size()) * sizeof(b);
+	if (!open_segment(b.segment) || !pwrite_all(blk_fd_, data.data(), data.size(), b.offset) ||
+	    !pwrite_all(bix_fd_, reinterpret_cast<const char*>(&b), sizeof(b), entry))
+		return false;
+	if (blocks_.empty() || b.segment != blocks_.back().segment)
+		segment_raw_ = 0;
+	blocks_.push_back(b);
+	packed_ += b.packed;
+	segment_raw_ += b.raw;
+	return true;
+}
+
+bool HistoryBlocks::sync() {
+	return blk_fd_ == -1 || (::fdatasync(blk_fd_) == 0 && ::fdatasync(bix_fd_) == 0);
+}
+
+uint64_t HistoryBlocks::drop_segments(uint32_t before, std::vector<std::string>& trash) {
+	before = std::min(before, segment());
+	size_t n = 0;
+	uint64_t bytes = 0;
+	for (; n < blocks_.size() && blocks_[n].segment < before; ++n)
+		bytes += blocks_[n].packed;
+	if (n == 0)
+		return 0;
+
+	// Сначала файлы: после переименования элементы уже не считаются живыми при open().
+	for (uint32_t s = blocks_.front().segment; s < before; ++s) {
+		std::string path = base_ + "." + std::to_string(s) + ".del";
+		if (::rename(segment_path(base_, s).c_str(), path.c_str()) == 0)
+			trash.push_back(std::move(path));
+	}
+	if (read_fd_ != -1 && read_segment_ < before)
+		close_reader();
+	blocks_.erase(blocks_.begin(), blocks_.begin() + static_cast<ptrdiff_t>(n));
+	dropped_ += n;
+	packed_ -= bytes;
+
+	// Освобождаются только целые страницы: элемент на границе остаётся и пропускается при open().
+	uint64_t hole = dropped_ * sizeof(HistoryBlock);
+	hole -= hole % 4096;
+	if (hole > 0)
+		(void)::fallocate(bix_fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(hole));
+	return bytes;
+}
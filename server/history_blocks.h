@@ -0,0 +1,208 @@
+/**
+ * @file history_blocks.h
+ * @brief Сжатые блоки старой части журнала истории, разложенные по сегментам.
+ *
+ * Механизм:
+ * - Старые записи журнала пары (history_<min>_<max>.log) нарезаются
+ *   на блоки не больше BLOCK_BYTES из целых записей; каждый блок
+ *   сжимается zlib (deflate) и дописывается в текущий файл сегмента
+ *   history_<min>_<max>.<N>.blk. Блок, который не сжался (или сборка
+ *   без сжатия), хранится как есть: у такого блока packed == raw.
+ * - Сегмент ограничен по объёму и времени (решает вызывающий, передавая
+ *   new_segment в append()); старые сегменты не меняются и удаляются
+ *   целиком (drop_segments()) — переименованием файла, без перезаписи.
+ * - Индекс блоков history_<min>_<max>.bix — массив HistoryBlock
+ *   фиксированного размера: номер первой записи, смещение блока в журнале,
+ *   сегмент и смещение в нём, длины. Запись N находится двоичным поиском,
+ *   а разжимается только содержащий её блок.
+ * - Блоки только дописываются; порядок записи (сначала сегмент, затем .bix,
+ *   затем fdatasync() обоих) делает недописанный хвост обнаружимым:
+ *   open() отбрасывает элементы индекса, не согласованные с соседями
+ *   и размером файла сегмента.
+ * - Элементы удалённых сегментов остаются в начале .bix (их место
+ *   освобождается fallocate(PUNCH_HOLE)); open() пропускает элементы,
+ *   файла сегмента которых нет. Последний сегмент не удаляется никогда,
+ *   поэтому records() и log_bytes() переживают любое удаление.
+ * - Целостность сжатых данных проверяет сам zlib (контрольная сумма Adler-32).
+ * - В сборке без zlib (MESSENGER_ZLIB) available() возвращает false:
+ *   блоки пишутся несжатыми, а read() сжатых блоков не удаётся.
+ * - Файл history_<min>_<max>.blk прежнего формата (один файл блоков)
+ *   при open() переименовывается в сегмент 0.
+ *
+ * Все числа записываются в порядке байт платформы, как и в журнале.
+ */
+
+#ifndef HISTORY_BLOCKS_H
+#define HISTORY_BLOCKS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @struct HistoryBlock
+ * @brief Элемент индекса блоков.
+ *
+ * @var HistoryBlock::first
+ * Номер первой записи блока.
+ * @var HistoryBlock::log_offset
+ * Смещение первой записи блока в журнале.
+ * @var HistoryBlock::offset
+ * Смещение сжатого блока в файле сегмента.
+ * @var HistoryBlock::packed
+ * Длина сжатого блока (равна raw, если блок не сжат).
+ * @var HistoryBlock::raw
+ * Длина записей блока в журнале.
+ * @var HistoryBlock::records
+ * Число записей в блоке.
+ * @var HistoryBlock::segment
+ * Номер сегмента (history_<min>_<max>.<segment>.blk).
+ */
+struct HistoryBlock {
+	uint64_t first = 0;
+	uint64_t log_offset = 0;
+	uint64_t offset = 0;
+	uint32_t packed = 0;
+	uint32_t raw = 0;
+	uint32_t records = 0;
+	uint32_t segment = 0;
+};
+
+/**
+ * @class HistoryBlocks
+ * @brief Сжатые блоки одного журнала.
+ *
+ * Не потокобезопасен: HistoryStore вызывает его под своим мьютексом.
+ */
+class HistoryBlocks {
+public:
+	/// Наибольший объём записей в одном блоке (запись длиннее занимает блок целиком).
+	static constexpr size_t BLOCK_BYTES = 64 * 1024;
+
+	/// Собран ли сервер со сжатием (zlib).
+	static bool available();
+
+	/**
+	 * @brief Сжать блок.
+	 *
+	 * @return false, если сжатие недоступно.
+	 */
+	static bool compress(std::string_view raw, std::string& out);
+
+	/**
+	 * @brief Разжать блок.
+	 *
+	 * @param packed Сжатые данные.
+	 * @param raw    Ожидаемая длина результата.
+	 * @param out    Результат.
+	 * @return false, если данные повреждены или сжатие недоступно.
+	 */
+	static bool decompress(std::string_view packed, size_t raw, std::string& out);
+
+	/**
+	 * @brief Удалить файлы блоков журнала (например, когда журнал переписан целиком).
+	 */
+	static void remove(const std::string& base);
+
+	/// Путь файла сегмента.
+	static std::string segment_path(const std::string& base, uint32_t segment);
+
+	/**
+	 * @param base Путь журнала без расширения; блоки лежат в base.<N>.blk и base.bix.
+	 */
+	explicit HistoryBlocks(std::string base);
+	~HistoryBlocks();
+
+	HistoryBlocks(const HistoryBlocks&) = delete;
+	HistoryBlocks& operator=(const HistoryBlocks&) = delete;
+
+	/**
+	 * @brief Загрузить индекс блоков; недописанный хвост отрезается.
+	 *
+	 * Если блоков нет, файлы не создаются.
+	 */
+	void open();
+
+	/// Блоки по порядку (без удалённых сегментов).
+	const std::vector<HistoryBlock>& blocks() const { return blocks_; }
+
+	/// Номер первой записи, оставшейся в блоках (записи до неё удалены).
+	uint64_t first() const;
+
+	/// Номер записи, следующей за последним блоком (записи с меньшими номерами сжаты или удалены).
+	uint64_t records() const;
+
+	/// Длина части журнала, перенесённой в блоки (включая удалённые сегменты).
+	uint64_t log_bytes() const;
+
+	/// Суммарная длина оставшихся блоков на диске.
+	uint64_t packed_bytes() const;
+
+	/// Номер текущего (последнего) сегмента.
+	uint32_t segment() const { return blocks_.empty() ? 0 : blocks_.back().segment; }
+
+	/// Длина записей журнала в текущем сегменте.
+	uint64_t segment_raw() const { return segment_raw_; }
+
+	/**
+	 * @brief Номер блока, содержащего запись @p record (< records()).
+	 */
+	size_t find(uint64_t record) const;
+
+	/**
+	 * @brief Прочитать и разжать блок.
+	 *
+	 * @param i   Номер блока.
+	 * @param raw Записи блока в формате журнала.
+	 * @return false при ошибке чтения или повреждённых данных.
+	 */
+	bool read(size_t i, std::string& raw) const;
+
+	/**
+	 * @brief Дописать записи блоком.
+	 *
+	 * @param records     Число записей в @p raw.
+	 * @param raw         Записи, следующие в журнале сразу за log_bytes().
+	 * @param compress    Сжать блок (иначе, как и без zlib, он хранится как есть).
+	 * @param new_segment Начать блоком новый сегмент (предыдущий синхронизируется и закрывается).
+	 * @return false при ошибке (индекс блоков не меняется).
+	 */
+	bool append(uint32_t records, std::string_view raw, bool compress, bool new_segment = false);
+
+	/// fdatasync() текущего сегмента и индекса.
+	bool sync();
+
+	/**
+	 * @brief Удалить сегменты с номерами меньше @p before.
+	 *
+	 * Файлы сегментов атомарно переименовываются в @p trash (их удаляет
+	 * вызывающий, например вне блокировки), затем освобождается место их
+	 * элементов в .bix. Текущий сегмент не удаляется никогда.
+	 *
+	 * @param before Номер первого сохраняемого сегмента.
+	 * @param trash  Пути переименованных файлов.
+	 * @return Суммарная длина удалённых блоков.
+	 */
+	uint64_t drop_segments(uint32_t before, std::vector<std::string>& trash);
+
+private:
+	bool open_index();
+	bool open_segment(uint32_t segment);
+	void close_reader() const;
+
+	std::string base_;
+	int blk_fd_ = -1;       ///< Текущий сегмент (для дописывания).
+	uint32_t blk_segment_ = 0;
+	int bix_fd_ = -1;
+	mutable int read_fd_ = -1;  ///< Последний прочитанный старый сегмент.
+	mutable uint32_t read_segment_ = 0;
+	uint64_t dropped_ = 0;  ///< Элементов .bix удалённых сегментов перед blocks_.
+	uint64_t packed_ = 0;
+	uint64_t segment_raw_ = 0;
+	std::vector<HistoryBlock> blocks_;
+	std::string scratch_;
+};
+
+#endif  // HISTORY_BLOCKS_H
@@ -0,0 +1,60 @@
+#include "history_compactor.h"
+
+#include <algorithm>
+#include <ctime>
+#include <utility>
+
+HistoryCompactor::HistoryCompactor(HistoryStore& store, std::chrono::milliseconds interval, Report report)
+    : store_(store), interval_(std::max(interval, std::chrono::milliseconds(1))), report_(std::move(report)) {
+	thread_ = std::thread(&HistoryCompactor::run, this);
+}
+
+HistoryCompactor::~HistoryCompactor() {
+	stop();
+}
+
+void HistoryCompactor::wake() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	woken_ = true;
+	cv_.notify_one();
+}
+
+void HistoryCompactor::stop() {
+	if (!thread_.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	cv_.notify_one();
+	thread_.join();
+}
+
+HistoryCompactorStats HistoryCompactor::stats() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return stats_;
+}
+
+void HistoryCompactor::run() {
+	using clock = std::chrono::steady_clock;
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!stopping_) {
+		lock.unlock();
+		auto started = clock::now();
+		HistoryCompaction pass = store_.compact(static_cast<int64_t>(std::time(nullptr)));
+		auto took = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - started);
+		if (report_)
+			report_(pass, took);
+		lock.lock();
+
+		uint64_t us = static_cast<uint64_t>(took.count());
+		++stats_.passes;
+		stats_.segments += pass.segments;
+		stats_.reclaimed_bytes += pass.reclaimed_bytes;
+		stats_.bytes = pass.bytes;
+		stats_.last_us = us;
+		stats_.max_us = std::max(stats_.max_us, us);
+		cv_.wait_for(lock, interval_, [this] { return stopping_ || woken_; });
+		woken_ = false;
+	}
+}
@@ -0,0 +1,96 @@
+/**
+ * @file history_compactor.h
+ * @brief Фоновое применение политики хранения истории.
+ *
+ * Механизм:
+ * - Отдельный поток раз в интервал вызывает HistoryStore::compact():
+ *   удаляются старейшие сегменты истории сверх HistoryRetention
+ *   (возраст, объём переписки, общая квота).
+ * - Пересылка сообщений и поток записи истории проход не ждут: хранилище
+ *   берёт мьютекс на короткие шаги, а файлы удаляет уже без него.
+ * - Итог каждого прохода и его длительность передаются в Report
+ *   (сервер превращает их в метрики) и копятся в stats().
+ */
+
+#ifndef HISTORY_COMPACTOR_H
+#define HISTORY_COMPACTOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "history_store.h"
+
+/**
+ * @struct HistoryCompactorStats
+ * @brief Сумма всех проходов фонового применения политики хранения.
+ */
+struct HistoryCompactorStats {
+	uint64_t passes = 0;           ///< Завершённых проходов.
+	uint64_t segments = 0;         ///< Удалено сегментов.
+	uint64_t reclaimed_bytes = 0;  ///< Освобождено байт.
+	uint64_t bytes = 0;            ///< Объём истории после последнего прохода.
+	uint64_t last_us = 0;          ///< Длительность последнего прохода.
+	uint64_t max_us = 0;           ///< Наибольшая длительность прохода.
+};
+
+/**
+ * @class HistoryCompactor
+ * @brief Поток, периодически вызывающий HistoryStore::compact().
+ */
+class HistoryCompactor {
+public:
+	/// Интервал между проходами по умолчанию.
+	static constexpr std::chrono::milliseconds DEFAULT_INTERVAL{60 * 1000};
+
+	/// Вызывается из потока после каждого прохода.
+	using Report = std::function<void(const HistoryCompaction& pass, std::chrono::microseconds took)>;
+
+	/**
+	 * @param store    Хранилище (политика задаётся HistoryStore::set_retention()).
+	 * @param interval Интервал между проходами; первый проход — сразу после запуска.
+	 * @param report   Обработчик итогов прохода (может быть пустым).
+	 */
+	explicit HistoryCompactor(HistoryStore& store, std::chrono::milliseconds interval = DEFAULT_INTERVAL,
+	                          Report report = nullptr);
+	~HistoryCompactor();
+
+	HistoryCompactor(const HistoryCompactor&) = delete;
+	HistoryCompactor& operator=(const HistoryCompactor&) = delete;
+
+	/**
+	 * @brief Начать следующий проход, не дожидаясь интервала.
+	 */
+	void wake();
+
+	/**
+	 * @brief Дождаться конца текущего прохода и остановить поток.
+	 *        Повторный вызов ничего не делает.
+	 */
+	void stop();
+
+	/**
+	 * @brief Снимок статистики (потокобезопасно).
+	 */
+	HistoryCompactorStats stats() const;
+
+private:
+	void run();
+
+	HistoryStore& store_;
+	std::chrono::milliseconds interval_;
+	Report report_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable cv_;
+	bool stopping_ = false;
+	bool woken_ = false;
+	HistoryCompactorStats stats_;
+
+	std::thread thread_;
+};
+
+#endif  // HISTORY_COMPACTOR_H
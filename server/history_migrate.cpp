@@ -0,0 +1,36 @@
+/**
+ * @file history_migrate.cpp
+ * @brief Однократный перенос текстовой истории в бинарные журналы.
+ *
+ * Запуск: history_migrate [--compress] [каталог] (по умолчанию HISTORY).
+ * С --compress старая часть всех журналов после переноса сжимается
+ * (см. HistoryStore::compress_all()).
+ * Выполняется при остановленном сервере.
+ */
+
+#include "history_store.h"
+#include <iostream>
+#include <string>
+
+int main(int argc, char* argv[]) {
+	std::string root = "HISTORY";
+	bool compress = false;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--compress")
+			compress = true;
+		else
+			root = arg;
+	}
+	size_t migrated = migrate_text_history(root);
+	std::cout << "Migrated " << migrated << " conversation(s) in " << root << std::endl;
+	if (compress) {
+		HistoryStore store(root);
+		if (!store.compress_history()) {
+			std::cerr << "history compression is not available in this build" << std::endl;
+			return 1;
+		}
+		std::cout << "Compressed " << store.compress_all() << " block(s)" << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,1107 @@
+#include "history_store.h"
+
+#include "history_blocks.h"
+#include "io_ring.h"
+#include "search_index.h"
+
+#ifdef MESSENGER_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+	/// Гранулярность освобождения места в журнале (блок файловой системы).
+	constexpr uint64_t PUNCH_ALIGN = 4096;
+	/// Несжатый хвост журнала, который seal() не трогает.
+	constexpr uint64_t UNSEALED_TAIL = 2 * HistoryBlocks::BLOCK_BYTES;
+
+	/// Старейший сегмент, если он не текущий: номер, длина блоков и индекс последнего блока.
+	bool head_segment(const HistoryBlocks& blocks, uint32_t& segment, uint64_t& packed, size_t& last) {
+		const std::vector<HistoryBlock>& all = blocks.blocks();
+		if (all.empty() || all.front().segment == blocks.segment())
+			return false;
+		segment = all.front().segment;
+		packed = 0;
+		for (last = 0; all[last].segment == segment; ++last)
+			packed += all[last].packed;
+		--last;
+		return true;
+	}
+
+	bool write_all(int fd, const void* data, size_t len) {
+		const char* p = static_cast<const char*>(data);
+		while (len > 0) {
+			ssize_t n = ::write(fd, p, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			len -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	bool read_at(int fd, char* data, size_t len, uint64_t offset) {
+		size_t got = 0;
+		while (got < len) {
+			ssize_t n = ::pread(fd, data + got, len - got, static_cast<off_t>(offset + got));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			got += static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	bool read_file(const std::string& path, std::string& out, uint64_t from = 0) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return false;
+		struct stat st {};
+		fstat(fd, &st);
+		out.resize(static_cast<uint64_t>(st.st_size) > from ? static_cast<size_t>(st.st_size - from) : 0);
+		size_t got = 0;
+		while (got < out.size()) {
+			ssize_t n = ::pread(fd, out.data() + got, out.size() - got, static_cast<off_t>(from + got));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			got += static_cast<size_t>(n);
+		}
+		out.resize(got);
+		::close(fd);
+		return true;
+	}
+
+	/**
+	 * Открыть блоки журнала @p base. Блоки журнала, который write_log() заменил, но не успел
+	 * удалить их (сбой), удаляются: место последнего блока в журнале освобождено (нули)
+	 * или совпадает с его записями, а в переписанном журнале там другие записи.
+	 */
+	std::unique_ptr<HistoryBlocks> open_blocks(const std::string& base) {
+		auto blocks = std::make_unique<HistoryBlocks>(base);
+		blocks->open();
+		std::string raw;
+		if (blocks->blocks().empty() || !blocks->read(blocks->blocks().size() - 1, raw))
+			return blocks;
+		int fd = ::open((base + ".log").c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return blocks;
+		std::string log(raw.size(), '\0');
+		off_t offset = static_cast<off_t>(blocks->blocks().back().log_offset);
+		ssize_t n = ::pread(fd, log.data(), log.size(), offset);
+		::close(fd);
+		bool stale = false;
+		for (ssize_t i = 0; i < n && !stale; ++i)
+			stale = log[i] != 0 && log[i] != raw[i];
+		if (stale) {
+			blocks.reset();
+			HistoryBlocks::remove(base);
+			blocks = std::make_unique<HistoryBlocks>(base);
+			blocks->open();
+		}
+		return blocks;
+	}
+
+}  // namespace
+
+HistoryStore::HistoryStore(std::string root, size_t max_open) : root_(std::move(root)), max_open_(max_open) {}
+
+HistoryStore::~HistoryStore() {
+	close_all();
+}
+
+bool HistoryStore::use_io_ring() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!ring_)
+		ring_ = IoRing::create(RING_ENTRIES);
+	return ring_ != nullptr;
+}
+
+std::string HistoryStore::conversation_key(const std::string& user1, const std::string& user2) {
+	const std::string& lo = user1 < user2 ? user1 : user2;
+	const std::string& hi = user1 < user2 ? user2 : user1;
+	return "history_" + lo + "_" + hi;
+}
+
+void HistoryStore::encode(const HistoryRecord& record, std::string& out) {
+	uint16_t sender_len = static_cast<uint16_t>(std::min<size_t>(record.sender.size(), UINT16_MAX));
+	uint32_t payload = static_cast<uint32_t>(sender_len + record.text.size());
+	uint16_t reserved = 0;
+	int64_t ts = record.timestamp;
+
+	char header[RECORD_HEADER];
+	std::memcpy(header, &payload, 4);
+	std::memcpy(header + 4, &sender_len, 2);
+	std::memcpy(header + 6, &reserved, 2);
+	std::memcpy(header + 8, &ts, 8);
+	out.append(header, RECORD_HEADER);
+	out.append(record.sender, 0, sender_len);
+	out.append(record.text);
+}
+
+bool HistoryStore::decode(const char* data, size_t len, size_t& pos, HistoryRecord& out) {
+	if (pos > len || len - pos < RECORD_HEADER)
+		return false;
+	uint32_t payload;
+	uint16_t sender_len;
+	std::memcpy(&payload, data + pos, 4);
+	std::memcpy(&sender_len, data + pos + 4, 2);
+	std::memcpy(&out.timestamp, data + pos + 8, 8);
+	if (sender_len > payload || len - pos - RECORD_HEADER < payload)
+		return false;
+
+	const char* body = data + pos + RECORD_HEADER;
+	out.sender.assign(body, sender_len);
+	out.text.assign(body + sender_len, payload - sender_len);
+	pos += RECORD_HEADER + payload;
+	return true;
+}
+
+bool HistoryStore::decode_line(const char* data, size_t len, size_t& pos, std::string_view& line) {
+	if (pos > len || len - pos < RECORD_HEADER)
+		return false;
+	uint32_t payload;
+	uint16_t sender_len;
+	std::memcpy(&payload, data + pos, 4);
+	std::memcpy(&sender_len, data + pos + 4, 2);
+	if (sender_len > payload || len - pos - RECORD_HEADER < payload)
+		return false;
+	line = std::string_view(data + pos + RECORD_HEADER + sender_len, payload - sender_len);
+	pos += RECORD_HEADER + payload;
+	return true;
+}
+
+MappedRegion::MappedRegion(int fd, uint64_t offset, size_t len) {
+	uint64_t page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+	uint64_t aligned = offset - offset % page;
+	size_t map_len = len + static_cast<size_t>(offset - aligned);
+	void* base = ::mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(aligned));
+	if (base == MAP_FAILED)
+		return;
+	base_ = base;
+	offset_ = offset;
+	map_len_ = map_len;
+	data_ = static_cast<const char*>(base) + (offset - aligned);
+	len_ = len;
+}
+
+MappedRegion::~MappedRegion() {
+	if (base_ != nullptr)
+		::munmap(base_, map_len_);
+}
+
+std::shared_ptr<const void> HistoryView::owner() const {
+	if (!unpacked)
+		return region;
+	if (!region)
+		return unpacked;
+	using Both = std::pair<std::shared_ptr<const MappedRegion>, std::shared_ptr<const std::string>>;
+	return std::make_shared<const Both>(region, unpacked);
+}
+
+bool HistoryStore::open_writer(const std::string& key, Writer& w) {
+	std::string base = base_path(key);
+	int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC;
+	w.log_fd = ::open((base + ".log").c_str(), flags, 0644);
+	if (w.log_fd == -1 && errno == ENOENT) {
+		std::error_code ec;
+		fs::create_directories(root_, ec);
+		w.log_fd = ::open((base + ".log").c_str(), flags, 0644);
+	}
+	if (w.log_fd == -1)
+		return false;
+	w.idx_fd = ::open((base + ".idx").c_str(), flags, 0644);
+	if (w.idx_fd == -1) {
+		::close(w.log_fd);
+		return false;
+	}
+
+	struct stat log_st {}, idx_st {};
+	fstat(w.log_fd, &log_st);
+	fstat(w.idx_fd, &idx_st);
+	w.log_size = static_cast<uint64_t>(log_st.st_size);
+	w.count = static_cast<uint64_t>(idx_st.st_size) / INDEX_ENTRY;
+	w.blocks = open_blocks(base);
+	w.mapped = &mapped_[key];
+	uint64_t sealed = w.blocks->records();
+	uint64_t sealed_bytes = w.blocks->log_bytes();
+
+	// Индекс согласован, если последняя запись заканчивается ровно в конце журнала.
+	bool consistent = idx_st.st_size % INDEX_ENTRY == 0 && w.count >= sealed && w.log_size >= sealed_bytes;
+	if (consistent && w.count == sealed) {
+		consistent = w.log_size == sealed_bytes;
+	} else if (consistent) {
+		uint64_t last = 0;
+		char header[RECORD_HEADER];
+		uint32_t payload = 0;
+		consistent = ::pread(w.idx_fd, &last, INDEX_ENTRY, idx_st.st_size - INDEX_ENTRY) == INDEX_ENTRY &&
+		             ::pread(w.log_fd, header, RECORD_HEADER, static_cast<off_t>(last)) == RECORD_HEADER;
+		if (consistent) {
+			std::memcpy(&payload, header, 4);
+			consistent = last + RECORD_HEADER + payload == w.log_size;
+		}
+	}
+	if (!consistent) {
+		// Перестроить индекс по несжатой части журнала, отрезав недописанный хвост;
+		// элементы сжатых записей остаются дырой.
+		std::string data;
+		read_file(base + ".log", data, sealed_bytes);
+		std::string index;
+		size_t pos = 0;
+		HistoryRecord rec;
+		while (true) {
+			uint64_t offset = sealed_bytes + pos;
+			if (!decode(data.data(), data.size(), pos, rec))
+				break;
+			index.append(reinterpret_cast<const char*>(&offset), INDEX_ENTRY);
+		}
+		if (::ftruncate(w.log_fd, static_cast<off_t>(sealed_bytes + pos)) != 0 ||
+		    ::ftruncate(w.idx_fd, 0) != 0 ||
+		    ::ftruncate(w.idx_fd, static_cast<off_t>(sealed * INDEX_ENTRY)) != 0 ||
+		    !write_all(w.idx_fd, index.data(), index.size())) {
+			close_writer(w);
+			return false;
+		}
+		w.log_size = sealed_bytes + pos;
+		w.count = sealed + index.size() / INDEX_ENTRY;
+	}
+	// Сжатие могло прерваться между записью блоков и освобождением места.
+	punch(w);
+
+	w.index = std::make_unique<SearchIndex>(base);
+	w.index->open(w.count);
+	index_tail(w);
+	return true;
+}
+
+template <typename Fn>
+void HistoryStore::scan(Writer& w, uint64_t from, uint64_t to, Fn&& fn, BlockCache* cache) {
+	BlockCache local;
+	BlockCache& c = cache != nullptr ? *cache : local;
+	to = std::min(to, w.count);
+	uint64_t record = std::max(from, w.blocks->first());
+	std::string_view line;
+	while (record < to && record < w.blocks->records()) {
+		size_t i = w.blocks->find(record);
+		if (c.block != i) {
+			c.block = SIZE_MAX;
+			if (!w.blocks->read(i, c.raw))
+				return;
+			c.block = i;
+		}
+		const HistoryBlock& b = w.blocks->blocks()[i];
+		size_t pos = 0;
+		for (uint64_t r = b.first; r < b.first + b.records && r < to; ++r) {
+			if (!decode_line(c.raw.data(), c.raw.size(), pos, line))
+				return;
+			if (r >= record)
+				fn(r, line);
+		}
+		record = b.first + b.records;
+	}
+	if (record >= to)
+		return;
+
+	// Несжатый хвост: границы берутся из индекса, записи читаются через mmap().
+	auto entry = [&](uint64_t n, uint64_t& offset) {
+		return read_at(w.idx_fd, reinterpret_cast<char*>(&offset), INDEX_ENTRY, n * INDEX_ENTRY);
+	};
+	uint64_t begin = 0, end = w.log_size;
+	if (!entry(record, begin) || (to < w.count && !entry(to, end)) || begin >= end || end > w.log_size)
+		return;
+	MappedRegion region(w.log_fd, begin, static_cast<size_t>(end - begin));
+	if (!region.ok())
+		return;
+	size_t pos = 0;
+	for (; record < to; ++record) {
+		if (!decode_line(region.data(), region.size(), pos, line))
+			return;
+		fn(record, line);
+	}
+}
+
+void HistoryStore::index_tail(Writer& w) {
+	// Записи, удалённые политикой хранения, не индексируются.
+	if (w.index->end() < w.blocks->first())
+		w.index->skip_to(w.blocks->first());
+	uint64_t from = w.index->end();
+	if (from >= w.count)
+		return;
+	scan(w, from, w.count, [&](uint64_t record, std::string_view line) { w.index->add(record, line); });
+	w.index->flush();
+}
+
+size_t HistoryStore::seal(Writer& w, size_t max_blocks) {
+	constexpr uint64_t BLOCK = HistoryBlocks::BLOCK_BYTES;
+	constexpr size_t MAX_RECORDS = HistoryBlocks::BLOCK_BYTES / RECORD_HEADER;
+	size_t sealed = 0;
+	std::vector<uint64_t> offsets;
+	std::string raw;
+	while (sealed < max_blocks && w.log_size - w.blocks->log_bytes() > UNSEALED_TAIL) {
+		uint64_t first = w.blocks->records();
+		uint64_t start = w.blocks->log_bytes();
+		if (w.count - first < 2)
+			break;
+		offsets.resize(static_cast<size_t>(std::min<uint64_t>(MAX_RECORDS + 1, w.count - first)));
+		if (!read_at(w.idx_fd, reinterpret_cast<char*>(offsets.data()), offsets.size() * INDEX_ENTRY,
+		             first * INDEX_ENTRY) ||
+		    offsets[0] != start)
+			break;
+		// Целые записи, помещающиеся в блок; запись длиннее блока занимает его одна.
+		size_t n = 1;
+		while (n + 1 < offsets.size() && offsets[n + 1] - start <= BLOCK)
+			++n;
+		raw.resize(static_cast<size_t>(offsets[n] - start));
+		if (!read_at(w.log_fd, raw.data(), raw.size(), start))
+			break;
+
+		// Новый сегмент начинается, когда текущий набрал объём или охватил свой промежуток времени.
+		int64_t time = 0;
+		std::memcpy(&time, raw.data() + 8, 8);
+		const std::vector<HistoryBlock>& blocks = w.blocks->blocks();
+		if (!blocks.empty() && w.segment_time == INT64_MIN) {
+			size_t i = blocks.size() - 1;
+			while (i > 0 && blocks[i - 1].segment == blocks.back().segment)
+				--i;
+			if (!block_time(*w.blocks, i, false, w.segment_time))
+				w.segment_time = time;
+		}
+		bool full = w.blocks->segment_raw() + raw.size() > retention_.segment_bytes;
+		bool expired = retention_.segment_seconds > 0 && time - w.segment_time >= retention_.segment_seconds;
+		bool rotate = !blocks.empty() && (full || expired);
+		if (!w.blocks->append(static_cast<uint32_t>(n), raw, compress_, rotate))
+			break;
+		if (rotate || w.segment_time == INT64_MIN)
+			w.segment_time = time;
+		++sealed;
+	}
+	// Место в журнале освобождается только после того, как блоки на диске.
+	if (sealed > 0 && w.blocks->sync())
+		punch(w);
+	return sealed;
+}
+
+void HistoryStore::punch(Writer& w) {
+	// Место под выданными map_page() отображениями освобождается, когда они закрыты.
+	uint64_t limit = w.blocks->log_bytes();
+	for (const auto& weak : *w.mapped)
+		if (auto region = weak.lock())
+			limit = std::min(limit, region->offset());
+	// Частично занятый блок файловой системы не освобождается: граница выравнивается вниз,
+	// чтобы следующий вызов освободил его целиком.
+	limit -= limit % PUNCH_ALIGN;
+	if (limit > w.punched &&
+	    ::fallocate(w.log_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(w.punched),
+	                static_cast<off_t>(limit - w.punched)) == 0)
+		w.punched = limit;
+	uint64_t idx_limit = w.blocks->records() * INDEX_ENTRY;
+	idx_limit -= idx_limit % PUNCH_ALIGN;
+	if (idx_limit > w.idx_punched &&
+	    ::fallocate(w.idx_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(w.idx_punched),
+	                static_cast<off_t>(idx_limit - w.idx_punched)) == 0)
+		w.idx_punched = idx_limit;
+}
+
+void HistoryStore::close_writer(Writer& w) {
+	if (w.index) {
+		w.index->flush();
+		w.index.reset();
+	}
+	w.blocks.reset();
+	if (w.dirty) {
+		::fdatasync(w.log_fd);
+		::fdatasync(w.idx_fd);
+		w.dirty = false;
+	}
+	if (w.log_fd != -1)
+		::close(w.log_fd);
+	if (w.idx_fd != -1)
+		::close(w.idx_fd);
+	w.log_fd = w.idx_fd = -1;
+}
+
+void HistoryStore::release_mappings(const std::string& key) {
+	auto it = mapped_.find(key);
+	if (it == mapped_.end())
+		return;
+	std::erase_if(it->second, [](const std::weak_ptr<const MappedRegion>& r) { return r.expired(); });
+	if (it->second.empty())
+		mapped_.erase(it);
+}
+
+HistoryStore::Writer* HistoryStore::writer_for(const std::string& key) {
+	auto it = writers_.find(key);
+	if (it != writers_.end()) {
+		lru_.splice(lru_.begin(), lru_, it->second.lru);
+		return &it->second;
+	}
+
+	Writer w;
+	if (!open_writer(key, w)) {
+		release_mappings(key);
+		return nullptr;
+	}
+
+	if (writers_.size() >= max_open_ && !lru_.empty()) {
+		auto victim = writers_.find(lru_.back());
+		close_writer(victim->second);
+		writers_.erase(victim);
+		release_mappings(lru_.back());
+		lru_.pop_back();
+	}
+	lru_.push_front(key);
+	w.lru = lru_.begin();
+	return &writers_.emplace(key, std::move(w)).first->second;
+}
+
+HistoryStore::Writer* HistoryStore::existing_writer(const std::string& key) {
+	// Журнал, которого нет, не создаётся ради пустого ответа.
+	struct stat st {};
+	if (writers_.count(key) == 0 && ::stat((base_path(key) + ".log").c_str(), &st) != 0)
+		return nullptr;
+	return writer_for(key);
+}
+
+bool HistoryStore::compress_history() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	compress_ = HistoryBlocks::available();
+	return compress_;
+}
+
+size_t HistoryStore::compress_all() {
+	if (!HistoryBlocks::available())
+		return 0;
+	std::vector<std::string> keys;
+	std::error_code ec;
+	for (const auto& entry : fs::directory_iterator(root_, ec)) {
+		const fs::path& path = entry.path();
+		if (path.extension() == ".log" && path.filename().string().rfind("history_", 0) == 0)
+			keys.push_back(path.stem().string());
+	}
+	size_t blocks = 0;
+	for (const std::string& key : keys) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (Writer* w = writer_for(key))
+			blocks += seal(*w, SIZE_MAX);
+	}
+	return blocks;
+}
+
+void HistoryStore::set_retention(const HistoryRetention& retention) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	retention_ = retention;
+}
+
+bool HistoryStore::block_time(const HistoryBlocks& blocks, size_t block, bool last, int64_t& time) {
+	std::string raw;
+	if (!blocks.read(block, raw) || raw.empty())
+		return false;
+	size_t pos = 0, at = 0;
+	std::string_view line;
+	while (pos < raw.size()) {
+		at = pos;
+		if (!decode_line(raw.data(), raw.size(), pos, line))
+			return false;
+		if (!last)
+			break;
+	}
+	std::memcpy(&time, raw.data() + at + 8, 8);
+	return true;
+}
+
+HistoryCompaction HistoryStore::compact(int64_t now) {
+	HistoryCompaction result;
+	HistoryRetention policy;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		policy = retention_;
+	}
+	if (!policy.enabled())
+		return result;
+
+	// Переписки каталога; файлы, не удалённые прошлым проходом, удаляются сразу.
+	std::vector<std::string> keys;
+	std::error_code ec;
+	for (const auto& entry : fs::directory_iterator(root_, ec)) {
+		const fs::path& path = entry.path();
+		if (path.filename().string().rfind("history_", 0) != 0)
+			continue;
+		if (path.extension() == ".log")
+			keys.push_back(path.stem().string());
+		else if (path.extension() == ".del")
+			fs::remove(path, ec);
+	}
+
+	// Шаг над блоками переписки под мьютексом: открытого журнала — его, иначе прочитанными с диска.
+	auto locked = [&](const std::string& key, auto&& step) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = writers_.find(key);
+		if (it != writers_.end())
+			return step(*it->second.blocks, it->second.log_size);
+		std::unique_ptr<HistoryBlocks> blocks = open_blocks(base_path(key));
+		struct stat st {};
+		if (::stat((base_path(key) + ".log").c_str(), &st) != 0)
+			st.st_size = 0;
+		return step(*blocks, static_cast<uint64_t>(st.st_size));
+	};
+	// Удалить старейший сегмент, если решает @p drop; файлы удаляются уже без мьютекса.
+	auto drop_head = [&](const std::string& key, auto&& drop) {
+		std::vector<std::string> trash;
+		uint64_t bytes = locked(key, [&](HistoryBlocks& blocks, uint64_t) -> uint64_t {
+			uint32_t segment;
+			uint64_t packed;
+			size_t last;
+			if (!head_segment(blocks, segment, packed, last) || !drop(blocks, packed, last))
+				return 0;
+			return blocks.drop_segments(segment + 1, trash);
+		});
+		for (const std::string& path : trash)
+			::unlink(path.c_str());
+		if (bytes > 0) {
+			++result.segments;
+			result.reclaimed_bytes += bytes;
+		}
+		return bytes > 0;
+	};
+	auto conversation_bytes = [&](const std::string& key) {
+		return locked(key, [](HistoryBlocks& blocks, uint64_t log_size) {
+			return blocks.packed_bytes() + (log_size - std::min(log_size, blocks.log_bytes()));
+		});
+	};
+
+	std::vector<std::pair<std::string, uint64_t>> sizes;
+	for (const std::string& key : keys) {
+		// Журнал, который не пополняется (или писался без политики), переносится в сегменты
+		// здесь, порциями по SEAL_BLOCKS.
+		uint64_t unsealed = locked(key, [](HistoryBlocks& blocks, uint64_t log_size) {
+			return log_size - std::min(log_size, blocks.log_bytes());
+		});
+		if (unsealed > UNSEALED_TAIL + HistoryBlocks::BLOCK_BYTES) {
+			for (size_t n = SEAL_BLOCKS; n == SEAL_BLOCKS;) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				Writer* w = writer_for(key);
+				n = w != nullptr ? seal(*w, SEAL_BLOCKS) : 0;
+				result.sealed_blocks += n;
+			}
+		}
+
+		uint64_t bytes = conversation_bytes(key);
+		auto over_limits = [&](HistoryBlocks& blocks, uint64_t packed, size_t last) {
+			int64_t newest = 0;
+			bool expired = policy.max_age > 0 && block_time(blocks, last, true, newest) &&
+			               newest < now - policy.max_age;
+			if (expired || (policy.max_bytes > 0 && bytes > policy.max_bytes)) {
+				bytes -= std::min(bytes, packed);
+				return true;
+			}
+			return false;
+		};
+		while (drop_head(key, over_limits)) {
+		}
+		sizes.emplace_back(key, bytes);
+		result.bytes += bytes;
+	}
+
+	// Общая квота: удаляются старейшие сегменты среди всех переписок.
+	std::vector<int64_t> heads(sizes.size(), INT64_MIN);
+	while (policy.quota > 0 && result.bytes > policy.quota) {
+		size_t oldest = sizes.size();
+		for (size_t i = 0; i < sizes.size(); ++i) {
+			if (heads[i] == INT64_MIN)
+				heads[i] = locked(sizes[i].first, [](HistoryBlocks& blocks, uint64_t) {
+					uint32_t segment;
+					uint64_t packed;
+					size_t last;
+					int64_t time = INT64_MAX;
+					if (head_segment(blocks, segment, packed, last) && !block_time(blocks, last, true, time))
+						time = INT64_MIN + 1;  // повреждённый сегмент удаляется первым
+					return time;
+				});
+			if (heads[i] != INT64_MAX && (oldest == sizes.size() || heads[i] < heads[oldest]))
+				oldest = i;
+		}
+		if (oldest == sizes.size())
+			break;
+		heads[oldest] = INT64_MIN;
+		uint64_t freed = 0;
+		if (!drop_head(sizes[oldest].first, [&](HistoryBlocks&, uint64_t packed, size_t) {
+			    freed = packed;
+			    return true;
+		    })) {
+			heads[oldest] = INT64_MAX;
+			continue;
+		}
+		result.bytes -= std::min(result.bytes, freed);
+	}
+	return result;
+}
+
+bool HistoryStore::append(const std::string& user1, const std::string& user2, const HistoryRecord& record) {
+	return append_batch(user1, user2, std::span<const HistoryRecord>(&record, 1));
+}
+
+bool HistoryStore::append_batch(const std::string& user1, const std::string& user2,
+                                std::span<const HistoryRecord> records, bool sync) {
+	if (records.empty())
+		return true;
+	std::string buf;
+	std::vector<uint64_t> offsets(records.size());
+	for (size_t i = 0; i < records.size(); ++i) {
+		offsets[i] = buf.size();
+		encode(records[i], buf);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	Writer* w = writer_for(conversation_key(user1, user2));
+	if (w == nullptr)
+		return false;
+
+	for (uint64_t& offset : offsets)
+		offset += w->log_size;
+	std::string_view idx(reinterpret_cast<const char*>(offsets.data()), offsets.size() * INDEX_ENTRY);
+	uint64_t first = w->count;
+	if (ring_) {
+		if (!ring_append(*w, buf, idx, sync))
+			return false;
+		w->log_size += buf.size();
+		w->count += records.size();
+		w->dirty = !sync;
+		index_records(*w, first, records);
+		if (sealing())
+			seal(*w, SEAL_BLOCKS);
+		return true;
+	}
+	if (!write_all(w->log_fd, buf.data(), buf.size()) || !write_all(w->idx_fd, idx.data(), idx.size()))
+		return false;
+	w->log_size += buf.size();
+	w->count += records.size();
+	index_records(*w, first, records);
+	if (sealing())
+		seal(*w, SEAL_BLOCKS);
+	if (sync)
+		return ::fdatasync(w->log_fd) == 0 && ::fdatasync(w->idx_fd) == 0;
+	w->dirty = true;
+	return true;
+}
+
+void HistoryStore::index_records(Writer& w, uint64_t first, std::span<const HistoryRecord> records) {
+	// Индекс отстал (например, после ошибки записи его сегмента) — догнать по журналу.
+	if (w.index->end() != first) {
+		index_tail(w);
+		return;
+	}
+	for (size_t i = 0; i < records.size(); ++i)
+		w.index->add(first + i, records[i].text);
+}
+
+#ifdef MESSENGER_IO_URING
+bool HistoryStore::ring_append(Writer& w, std::string_view log, std::string_view idx, bool sync) {
+	// user_data: 0/1 — запись журнала/индекса, 2/3 — их fdatasync (выполняется только после записи).
+	const int fds[2] = {w.log_fd, w.idx_fd};
+	const std::string_view data[2] = {log, idx};
+	unsigned queued = 0;
+	for (unsigned i = 0; i < 2; ++i) {
+		io_uring_sqe* sqe = ring_->next_sqe();
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fds[i];
+		sqe->addr = reinterpret_cast<uint64_t>(data[i].data());
+		sqe->len = static_cast<uint32_t>(data[i].size());
+		sqe->off = static_cast<uint64_t>(-1);  // O_APPEND: дописать в конец
+		sqe->user_data = i;
+		++queued;
+		if (!sync)
+			continue;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe = ring_->next_sqe();
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = fds[i];
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->user_data = 2 + i;
+		++queued;
+	}
+	int32_t res[4] = {0, 0, 0, 0};
+	for (unsigned got = 0; got < queued;) {
+		if (!ring_->submit(queued - got))
+			return false;
+		for (const io_uring_cqe* cqe; got < queued && (cqe = ring_->peek()) != nullptr; ++got) {
+			res[cqe->user_data & 3] = cqe->res;
+			ring_->pop();
+		}
+	}
+	for (unsigned i = 0; i < 2; ++i) {
+		if (res[i] < 0)
+			return false;
+		// Короткая запись (и отменённый за ней fdatasync) доделываются обычными вызовами.
+		std::string_view rest = data[i].substr(static_cast<size_t>(res[i]));
+		if (!rest.empty() && !write_all(fds[i], rest.data(), rest.size()))
+			return false;
+		if (sync && res[2 + i] != 0 && ::fdatasync(fds[i]) != 0)
+			return false;
+	}
+	return true;
+}
+#else
+bool HistoryStore::ring_append(Writer&, std::string_view, std::string_view, bool) {
+	return false;
+}
+#endif
+
+size_t HistoryStore::sync_all() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	size_t synced = 0;
+	unsigned queued = 0;
+	for (auto& [key, w] : writers_) {
+		if (!w.dirty)
+			continue;
+		w.dirty = false;
+		++synced;
+		if (!ring_) {
+			::fdatasync(w.log_fd);
+			::fdatasync(w.idx_fd);
+			continue;
+		}
+#ifdef MESSENGER_IO_URING
+		for (int fd : {w.log_fd, w.idx_fd}) {
+			// Заполненное кольцо next_sqe() отправляет сам; завершения разбираются в конце.
+			io_uring_sqe* sqe = ring_->next_sqe();
+			if (sqe == nullptr) {
+				::fdatasync(fd);
+				continue;
+			}
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = fd;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			++queued;
+		}
+#endif
+	}
+	for (unsigned got = 0; got < queued;) {
+		if (!ring_->submit(1))
+			break;
+		for (; got < queued && ring_->peek() != nullptr; ++got)
+			ring_->pop();
+	}
+	return synced;
+}
+
+bool HistoryStore::read_raw(const std::string& base, std::string& out) {
+	std::unique_ptr<HistoryBlocks> blocks = open_blocks(base);
+	std::string tail;
+	if (!read_file(base + ".log", tail, blocks->log_bytes()))
+		return false;
+	// Повреждённый блок теряет только свои записи: записи декодируются независимо.
+	out.clear();
+	std::string raw;
+	for (size_t i = 0; i < blocks->blocks().size(); ++i)
+		if (blocks->read(i, raw))
+			out += raw;
+	out += tail;
+	return true;
+}
+
+std::vector<HistoryRecord> HistoryStore::read_log(const std::string& base) {
+	std::vector<HistoryRecord> records;
+	std::string data;
+	if (!read_raw(base, data))
+		return records;
+	size_t pos = 0;
+	HistoryRecord rec;
+	while (decode(data.data(), data.size(), pos, rec))
+		records.push_back(std::move(rec));
+	return records;
+}
+
+std::vector<HistoryRecord> HistoryStore::load_records(const std::string& user1, const std::string& user2) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return read_log(base_path(conversation_key(user1, user2)));
+}
+
+std::string HistoryStore::load_text(const std::string& user1, const std::string& user2) {
+	std::string data;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!read_raw(base_path(conversation_key(user1, user2)), data))
+			return {};
+	}
+
+	std::string text;
+	size_t pos = 0;
+	HistoryRecord rec;
+	while (decode(data.data(), data.size(), pos, rec))
+		text += rec.text;
+	return text;
+}
+
+HistoryPage HistoryStore::load_page(const std::string& user1, const std::string& user2, uint64_t limit,
+                                    uint64_t before, uint64_t max_bytes) {
+	HistoryView view = map_page(user1, user2, limit, before, max_bytes);
+	HistoryPage page;
+	page.text.reserve(view.bytes);
+	for (std::string_view line : view.lines)
+		page.text += line;
+	page.first = view.first;
+	page.count = view.lines.size();
+	page.total = view.total;
+	return page;
+}
+
+HistoryView HistoryStore::map_page(const std::string& user1, const std::string& user2, uint64_t limit,
+                                   uint64_t before, uint64_t max_bytes) {
+	HistoryView view;
+	std::string key = conversation_key(user1, user2);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	Writer* w = existing_writer(key);
+	if (w == nullptr)
+		return view;
+	view.total = w->count;
+	uint64_t end = std::min(before, view.total);
+	// Записи до первой оставшейся удалены политикой хранения.
+	uint64_t start = std::max(end - std::min(limit, end), std::min(w->blocks->first(), end));
+	uint64_t sealed = std::min(std::max(w->blocks->records(), start), end);
+
+	// Строки и их размеры в журнале: сначала из сжатых блоков, затем из хвоста.
+	std::vector<std::string_view> lines;
+	std::vector<uint64_t> sizes;
+	if (start < sealed) {
+		auto unpacked = std::make_shared<std::string>();
+		size_t first_block = w->blocks->find(start);
+		size_t last_block = w->blocks->find(sealed - 1);
+		std::string raw;
+		for (size_t i = first_block; i <= last_block; ++i) {
+			if (!w->blocks->read(i, raw))
+				return view;
+			*unpacked += raw;
+		}
+		size_t pos = 0;
+		std::string_view line;
+		for (uint64_t r = w->blocks->blocks()[first_block].first; r < sealed; ++r) {
+			size_t at = pos;
+			if (!decode_line(unpacked->data(), unpacked->size(), pos, line))
+				return view;
+			if (r < start)
+				continue;
+			lines.push_back(line);
+			sizes.push_back(pos - at);
+		}
+		view.unpacked = std::move(unpacked);
+	}
+
+	// Смещения записей [sealed, end) несжатого хвоста и конец последней из них.
+	std::vector<uint64_t> offsets(end - sealed + 1);
+	size_t want = (end - sealed) * INDEX_ENTRY;
+	if (want > 0 && !read_at(w->idx_fd, reinterpret_cast<char*>(offsets.data()), want, sealed * INDEX_ENTRY))
+		end = sealed;
+	offsets[end - sealed] = w->log_size;
+	if (end < view.total)
+		read_at(w->idx_fd, reinterpret_cast<char*>(&offsets[end - sealed]), INDEX_ENTRY, end * INDEX_ENTRY);
+	for (uint64_t r = sealed; r < end; ++r)
+		sizes.push_back(offsets[r - sealed + 1] - offsets[r - sealed]);
+
+	// Ограничение по объёму: отбрасываем самые старые записи фрагмента.
+	uint64_t bytes = 0;
+	for (uint64_t size : sizes)
+		bytes += size;
+	size_t skip = 0;
+	while (sizes.size() - skip > 1 && bytes > max_bytes)
+		bytes -= sizes[skip++];
+	view.first = start + skip;
+	if (skip >= lines.size())
+		view.unpacked.reset();
+
+	size_t packed_lines = lines.size();
+	uint64_t from = offsets[std::max<uint64_t>(sealed, view.first) - sealed];
+	uint64_t to = std::min<uint64_t>(offsets.back(), w->log_size);
+	if (end > view.first && end > sealed && to > from) {
+		auto region = std::make_shared<MappedRegion>(w->log_fd, from, static_cast<size_t>(to - from));
+		if (region->ok()) {
+			size_t pos = 0;
+			std::string_view line;
+			while (decode_line(region->data(), region->size(), pos, line))
+				lines.push_back(line);
+			// Пока отображение живо, его место в журнале не освобождается (punch()).
+			std::erase_if(*w->mapped, [](const std::weak_ptr<const MappedRegion>& r) { return r.expired(); });
+			w->mapped->push_back(region);
+			view.region = std::move(region);
+		}
+	}
+	// Отброшенные записи хвоста не отображались вовсе.
+	for (size_t i = std::min(skip, packed_lines); i < lines.size(); ++i) {
+		view.lines.push_back(lines[i]);
+		view.bytes += lines[i].size();
+	}
+	return view;
+}
+
+HistoryMatches HistoryStore::search(const std::string& user1, const std::string& user2,
+                                   std::string_view query, size_t limit) {
+	HistoryMatches result;
+	std::lock_guard<std::mutex> lock(mutex_);
+	Writer* w = existing_writer(conversation_key(user1, user2));
+	if (w == nullptr)
+		return result;
+
+	std::vector<uint64_t> found = w->index->search(query, limit, &result.total, w->blocks->first());
+	BlockCache cache;
+	for (auto it = found.rbegin(); it != found.rend(); ++it)
+		scan(
+		    *w, *it, *it + 1,
+		    [&](uint64_t record, std::string_view line) {
+			    result.records.push_back(record);
+			    result.lines.emplace_back(line);
+		    },
+		    &cache);
+	return result;
+}
+
+size_t HistoryStore::merge_indexes(size_t min_segments) {
+	std::vector<std::pair<std::string, std::unique_ptr<SearchMerge>>> plans;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto& [key, w] : writers_)
+			if (auto merge = w.index->plan_merge(min_segments))
+				plans.emplace_back(key, std::move(merge));
+	}
+	size_t merged = 0;
+	for (auto& [key, merge] : plans) {
+		if (!merge->run())
+			continue;
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (merge->commit())
+			++merged;
+		// Журнал мог быть вытеснен и открыт заново: перечитывается текущий индекс.
+		auto it = writers_.find(key);
+		if (it != writers_.end())
+			it->second.index->reload();
+	}
+	return merged;
+}
+
+uint64_t HistoryStore::message_count(const std::string& user1, const std::string& user2) {
+	std::string key = conversation_key(user1, user2);
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = writers_.find(key);
+	if (it != writers_.end())
+		return it->second.count;
+	struct stat st {};
+	if (::stat((base_path(key) + ".idx").c_str(), &st) != 0)
+		return 0;
+	return static_cast<uint64_t>(st.st_size) / INDEX_ENTRY;
+}
+
+void HistoryStore::close_all() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto& [key, w] : writers_)
+		close_writer(w);
+	writers_.clear();
+	for (const std::string& key : lru_)
+		release_mappings(key);
+	lru_.clear();
+}
+
+size_t HistoryStore::open_writers() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return writers_.size();
+}
+
+bool HistoryStore::write_log(const std::string& base, const std::vector<HistoryRecord>& records) {
+	// Номера записей меняются: поисковый индекс удаляется до замены журнала (он строится заново),
+	// а сжатые блоки — только после неё: до этого в старом журнале на их месте дыры.
+	::unlink((base + ".six").c_str());
+	::unlink((base + ".sxd").c_str());
+	std::string log, index;
+	for (const HistoryRecord& rec : records) {
+		uint64_t offset = log.size();
+		index.append(reinterpret_cast<const char*>(&offset), INDEX_ENTRY);
+		encode(rec, log);
+	}
+
+	for (const auto& [ext, data] : {std::pair{".log", &log}, std::pair{".idx", &index}}) {
+		std::string tmp = base + ext + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1)
+			return false;
+		bool ok = write_all(fd, data->data(), data->size()) && ::fsync(fd) == 0;
+		::close(fd);
+		if (!ok)
+			return false;
+	}
+	// Сначала индекс, затем журнал: при сбое между ними индекс будет перестроен.
+	// Блоки, не удалённые из-за сбоя после замены журнала, отбрасывает open_blocks().
+	if (::rename((base + ".idx.tmp").c_str(), (base + ".idx").c_str()) != 0 ||
+	    ::rename((base + ".log.tmp").c_str(), (base + ".log").c_str()) != 0)
+		return false;
+	HistoryBlocks::remove(base);
+	return true;
+}
+
+HistoryRecord record_from_text(std::string_view text, int64_t fallback_time) {
+	HistoryRecord rec;
+	rec.text.assign(text);
+	rec.timestamp = fallback_time;
+
+	// "[YYYY-MM-DD HH:MM] sender: ..."
+	if (text.size() < 20 || text[0] != '[' || text.compare(17, 2, "] ") != 0)
+		return rec;
+	size_t colon = text.find(": ", 19);
+	if (colon == std::string_view::npos)
+		return rec;
+	rec.sender.assign(text.substr(19, colon - 19));
+
+	// Разбор заканчивается на "]" внутри строки, поэтому завершающий ноль не нужен.
+	std::tm tm{};
+	if (strptime(text.data() + 1, "%Y-%m-%d %H:%M", &tm) == text.data() + 17) {
+		tm.tm_isdst = -1;
+		rec.timestamp = static_cast<int64_t>(std::mktime(&tm));
+	}
+	return rec;
+}
+
+size_t migrate_text_history(const std::string& root) {
+	std::error_code ec;
+	if (!fs::is_directory(root, ec))
+		return 0;
+
+	size_t migrated = 0;
+	for (const auto& entry : fs::directory_iterator(root, ec)) {
+		const fs::path& path = entry.path();
+		if (path.extension() != ".txt" || path.filename().string().rfind("history_", 0) != 0)
+			continue;
+
+		struct stat st {};
+		::stat(path.c_str(), &st);
+		std::vector<HistoryRecord> records;
+		std::ifstream in(path);
+		std::string line;
+		while (std::getline(in, line))
+			records.push_back(record_from_text(line + "\n", static_cast<int64_t>(st.st_mtime)));
+
+		std::string base = (path.parent_path() / path.stem()).string();
+		for (HistoryRecord& rec : HistoryStore::read_log(base))
+			records.push_back(std::move(rec));
+
+		if (!HistoryStore::write_log(base, records))
+			continue;
+		fs::rename(path, path.string() + ".migrated", ec);
+		++migrated;
+	}
+	return migrated;
+}
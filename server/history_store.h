@@ -0,0 +1,555 @@
+/**
+ * @file history_store.h
+ * @brief Хранилище истории переписки: бинарный журнал с индексом смещений.
+ *
+ * Механизм:
+ * - Для каждой пары пользователей ведётся журнал HISTORY/history_<min>_<max>.log,
+ *   в который только дописываются записи фиксированного формата:
+ *   заголовок (длина, длина имени отправителя, метка времени), затем
+ *   имя отправителя и готовая к выводу строка сообщения.
+ * - Рядом лежит индекс HISTORY/history_<min>_<max>.idx — массив 64-битных
+ *   смещений начала каждой записи, что даёт доступ к N-й записи без
+ *   просмотра журнала.
+ * - Открытые дескрипторы журналов держатся в LRU-кэше, поэтому запись
+ *   сообщения — это два write() без open()/close().
+ * - При открытии журнала индекс сверяется с журналом и при расхождении
+ *   (например, после аварийного завершения) перестраивается.
+ * - Фрагменты истории для отправки клиентам читаются через mmap()
+ *   (map_page()): строки сообщений не копируются в кучу, а передаются
+ *   в сокет прямо из страничного кэша.
+ * - Несинхронизированные журналы сбрасываются на диск при вызове sync_all()
+ *   и перед закрытием (вытеснением из кэша).
+ * - С use_io_ring() обе записи пачки (и их fdatasync()) уходят ядру одним
+ *   io_uring_enter.
+ * - Каждый открытый журнал ведёт поисковый индекс (search_index.h): записи
+ *   индексируются при дописывании, а недостающие — при открытии журнала.
+ * - С compress_history() старая часть журнала переносится в сжатые блоки
+ *   (history_blocks.h), а её место в .log и .idx освобождается
+ *   (fallocate(PUNCH_HOLE)): смещения записей не меняются, а файлы
+ *   становятся разреженными. Хвост журнала (не меньше двух блоков)
+ *   остаётся несжатым, поэтому последние сообщения читаются, как раньше.
+ * - Блоки складываются в сегменты, ограниченные по объёму и времени
+ *   (HistoryRetention). С политикой хранения (set_retention()) старая часть
+ *   журналов переносится в сегменты и без сжатия, а compact() удаляет
+ *   старейшие сегменты по возрасту, объёму переписки и общей квоте.
+ *   Номера записей при этом не меняются: записи до первой оставшейся
+ *   просто пропадают из map_page(), load_text() и поиска.
+ *
+ * Все числа записываются в порядке байт платформы (little-endian на x86/ARM).
+ */
+
+#ifndef HISTORY_STORE_H
+#define HISTORY_STORE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class HistoryBlocks;
+class IoRing;
+class SearchIndex;
+
+/**
+ * @struct HistoryRecord
+ * @brief Одна запись истории.
+ *
+ * @var HistoryRecord::timestamp
+ * Время сообщения (секунды Unix).
+ * @var HistoryRecord::sender
+ * Идентификатор отправителя (может быть пустым для служебных записей).
+ * @var HistoryRecord::text
+ * Строка в том виде, в каком она выводится клиенту (включая '\n').
+ */
+struct HistoryRecord {
+	int64_t timestamp = 0;
+	std::string sender;
+	std::string text;
+};
+
+/**
+ * @struct HistoryPage
+ * @brief Непрерывный фрагмент истории, прочитанный через индекс.
+ *
+ * @var HistoryPage::text
+ * Склеенные строки записей фрагмента.
+ * @var HistoryPage::first
+ * Номер (с нуля) первой записи фрагмента.
+ * @var HistoryPage::count
+ * Число записей во фрагменте.
+ * @var HistoryPage::total
+ * Всего записей в переписке.
+ */
+struct HistoryPage {
+	std::string text;
+	uint64_t first = 0;
+	uint64_t count = 0;
+	uint64_t total = 0;
+};
+
+/**
+ * @struct HistoryMatches
+ * @brief Результат поиска по истории.
+ *
+ * @var HistoryMatches::records
+ * Номера найденных записей в хронологическом порядке.
+ * @var HistoryMatches::lines
+ * Строки этих записей.
+ * @var HistoryMatches::total
+ * Всего записей, подходящих под запрос.
+ */
+struct HistoryMatches {
+	std::vector<uint64_t> records;
+	std::vector<std::string> lines;
+	uint64_t total = 0;
+};
+
+/**
+ * @struct HistoryRetention
+ * @brief Нарезка истории на сегменты и политика их хранения.
+ *
+ * Ограничения (0 — нет ограничения) применяются к сегментам целиком:
+ * сегмент удаляется, когда самое новое сообщение в нём старше max_age
+ * или когда без него укладываются max_bytes / quota. Текущий сегмент
+ * и несжатый хвост журнала не удаляются никогда.
+ *
+ * @var HistoryRetention::segment_bytes
+ * Объём записей журнала в одном сегменте.
+ * @var HistoryRetention::segment_seconds
+ * Промежуток времени, который охватывает один сегмент, секунды (0 — без ограничения).
+ * @var HistoryRetention::max_age
+ * Наибольший возраст сообщений, секунды.
+ * @var HistoryRetention::max_bytes
+ * Наибольший объём одной переписки на диске.
+ * @var HistoryRetention::quota
+ * Наибольший объём всех переписок на диске.
+ */
+struct HistoryRetention {
+	static constexpr uint64_t DEFAULT_SEGMENT_BYTES = 4 * 1024 * 1024;
+	static constexpr int64_t DEFAULT_SEGMENT_SECONDS = 24 * 3600;
+
+	uint64_t segment_bytes = DEFAULT_SEGMENT_BYTES;
+	int64_t segment_seconds = DEFAULT_SEGMENT_SECONDS;
+	int64_t max_age = 0;
+	uint64_t max_bytes = 0;
+	uint64_t quota = 0;
+
+	/// Задано ли хоть одно ограничение.
+	bool enabled() const { return max_age > 0 || max_bytes > 0 || quota > 0; }
+};
+
+/**
+ * @struct HistoryCompaction
+ * @brief Итог одного прохода HistoryStore::compact().
+ *
+ * @var HistoryCompaction::segments
+ * Удалено сегментов.
+ * @var HistoryCompaction::reclaimed_bytes
+ * Освобождено байт (длина удалённых сегментов).
+ * @var HistoryCompaction::sealed_blocks
+ * Блоков, перенесённых в сегменты из журналов, которые давно не пополнялись.
+ * @var HistoryCompaction::bytes
+ * Объём всех переписок после прохода.
+ */
+struct HistoryCompaction {
+	size_t segments = 0;
+	uint64_t reclaimed_bytes = 0;
+	size_t sealed_blocks = 0;
+	uint64_t bytes = 0;
+};
+
+/**
+ * @class MappedRegion
+ * @brief Отображённый в память фрагмент файла только для чтения.
+ *
+ * Начало отображения выравнивается вниз до границы страницы;
+ * data() указывает на запрошенное смещение.
+ */
+class MappedRegion {
+public:
+	/**
+	 * @param fd     Дескриптор файла (после конструктора может быть закрыт).
+	 * @param offset Смещение начала фрагмента в файле.
+	 * @param len    Длина фрагмента.
+	 */
+	MappedRegion(int fd, uint64_t offset, size_t len);
+	~MappedRegion();
+
+	MappedRegion(const MappedRegion&) = delete;
+	MappedRegion& operator=(const MappedRegion&) = delete;
+
+	/// Удалось ли отобразить фрагмент.
+	bool ok() const { return data_ != nullptr; }
+	/// Начало фрагмента.
+	const char* data() const { return data_; }
+	/// Длина фрагмента.
+	size_t size() const { return len_; }
+	/// Смещение фрагмента в файле.
+	uint64_t offset() const { return offset_; }
+
+private:
+	void* base_ = nullptr;
+	uint64_t offset_ = 0;
+	size_t map_len_ = 0;
+	const char* data_ = nullptr;
+	size_t len_ = 0;
+};
+
+/**
+ * @struct HistoryView
+ * @brief Фрагмент истории, ссылающийся на отображённый журнал.
+ *
+ * Строки указывают внутрь region и unpacked и действительны, пока те живы;
+ * owner() можно передать в OutputQueue::push_shared() как владельца.
+ *
+ * @var HistoryView::region
+ * Отображение несжатого хвоста журнала (nullptr, если строк из него нет).
+ * @var HistoryView::unpacked
+ * Разжатые блоки для строк из сжатой части (nullptr, если таких нет).
+ * @var HistoryView::lines
+ * Строки записей фрагмента по порядку.
+ * @var HistoryView::first
+ * Номер (с нуля) первой записи фрагмента.
+ * @var HistoryView::total
+ * Всего записей в переписке.
+ * @var HistoryView::bytes
+ * Суммарная длина строк.
+ */
+struct HistoryView {
+	std::shared_ptr<const MappedRegion> region;
+	std::shared_ptr<const std::string> unpacked;
+	std::vector<std::string_view> lines;
+	uint64_t first = 0;
+	uint64_t total = 0;
+	size_t bytes = 0;
+
+	/// Владелец всех строк фрагмента.
+	std::shared_ptr<const void> owner() const;
+};
+
+/**
+ * @class HistoryStore
+ * @brief Журналы истории всех пар пользователей в одном каталоге.
+ *
+ * Методы потокобезопасны (внутренний мьютекс).
+ */
+class HistoryStore {
+public:
+	/// Размер заголовка записи: u32 длина, u16 длина отправителя, u16 резерв, i64 время.
+	static constexpr size_t RECORD_HEADER = 16;
+	/// Размер одного элемента индекса.
+	static constexpr size_t INDEX_ENTRY = sizeof(uint64_t);
+	/// Число одновременно открытых журналов по умолчанию.
+	static constexpr size_t DEFAULT_OPEN_WRITERS = 64;
+
+	/**
+	 * @param root       Каталог истории (создаётся при первой записи).
+	 * @param max_open   Ёмкость LRU-кэша открытых журналов.
+	 */
+	explicit HistoryStore(std::string root = "HISTORY", size_t max_open = DEFAULT_OPEN_WRITERS);
+	~HistoryStore();
+
+	HistoryStore(const HistoryStore&) = delete;
+	HistoryStore& operator=(const HistoryStore&) = delete;
+
+	/**
+	 * @brief Дописать запись в журнал пары пользователей.
+	 *
+	 * @return false при ошибке ввода-вывода.
+	 */
+	bool append(const std::string& user1, const std::string& user2, const HistoryRecord& record);
+
+	/**
+	 * @brief Дописать несколько записей одной пары за один write() в журнал
+	 *        и один write() в индекс.
+	 *
+	 * @param user1   Идентификатор первого пользователя.
+	 * @param user2   Идентификатор второго пользователя.
+	 * @param records Записи в порядке следования.
+	 * @param sync    Выполнить fdatasync() журнала и индекса перед возвратом;
+	 *                иначе журнал помечается как требующий sync_all().
+	 * @return false при ошибке ввода-вывода.
+	 */
+	bool append_batch(const std::string& user1, const std::string& user2,
+	                  std::span<const HistoryRecord> records, bool sync = false);
+
+	/**
+	 * @brief Выполнить fdatasync() для всех журналов, записанных после
+	 *        предыдущей синхронизации.
+	 *
+	 * @return Число синхронизированных журналов.
+	 */
+	size_t sync_all();
+
+	/**
+	 * @brief Писать через кольцо io_uring.
+	 *
+	 * append_batch() отдаёт ядру запись журнала и индекса (и их fdatasync(),
+	 * связанные с записью) одним io_uring_enter, sync_all() — все fdatasync()
+	 * одним вызовом вместо двух на журнал.
+	 *
+	 * @return false, если io_uring недоступен (запись идёт как прежде).
+	 */
+	bool use_io_ring();
+
+	/**
+	 * @brief Переносить старые записи журналов в сжатые блоки.
+	 *
+	 * После каждой записанной пачки не больше SEAL_BLOCKS блоков сверх
+	 * несжатого хвоста (два блока) сжимаются и освобождаются в журнале;
+	 * старые большие журналы сжимаются постепенно (или целиком —
+	 * compress_all()). Чтение сжатых журналов работает и без этого режима.
+	 *
+	 * @return false, если сервер собран без zlib.
+	 */
+	bool compress_history();
+
+	/**
+	 * @brief Сжать старую часть всех журналов каталога целиком.
+	 *
+	 * Для history_migrate --compress; журналы открываются через кэш.
+	 *
+	 * @return Число созданных блоков.
+	 */
+	size_t compress_all();
+
+	/**
+	 * @brief Задать нарезку на сегменты и политику хранения.
+	 *
+	 * С включённой политикой (HistoryRetention::enabled()) старая часть
+	 * журналов переносится в сегменты при записи, даже без compress_history().
+	 */
+	void set_retention(const HistoryRetention& retention);
+
+	/**
+	 * @brief Применить политику хранения ко всем перепискам каталога.
+	 *
+	 * Мьютекс берётся на каждую переписку отдельно и только на короткие
+	 * шаги: файлы удаляемых сегментов под ним лишь переименовываются,
+	 * а удаляются (освобождение места файловой системой) уже без него.
+	 * Вызывается одним потоком (HistoryCompactor).
+	 *
+	 * @param now Текущее время (секунды Unix) для HistoryRetention::max_age.
+	 */
+	HistoryCompaction compact(int64_t now);
+
+	/**
+	 * @brief Склеить тексты всех записей пары (формат старых .txt файлов).
+	 */
+	std::string load_text(const std::string& user1, const std::string& user2);
+
+	/**
+	 * @brief Прочитать все записи пары.
+	 */
+	std::vector<HistoryRecord> load_records(const std::string& user1, const std::string& user2);
+
+	/**
+	 * @brief Прочитать последние записи пары, предшествующие записи @p before.
+	 *
+	 * Границы фрагмента берутся из индекса, поэтому стоимость не зависит
+	 * от длины переписки. Строки копируются в HistoryPage::text; для
+	 * отправки клиентам без копирования используется map_page().
+	 *
+	 * @param user1     Идентификатор первого пользователя.
+	 * @param user2     Идентификатор второго пользователя.
+	 * @param limit     Максимум записей.
+	 * @param before    Номер записи, до которой читать (не включая);
+	 *                  по умолчанию — до конца журнала.
+	 * @param max_bytes Ограничение на объём фрагмента в журнале (не меньше
+	 *                  одной записи).
+	 * @return Фрагмент истории; пустой, если записей нет.
+	 */
+	HistoryPage load_page(const std::string& user1, const std::string& user2, uint64_t limit,
+	                      uint64_t before = UINT64_MAX, uint64_t max_bytes = UINT64_MAX);
+
+	/**
+	 * @brief То же, что load_page(), но без копирования: фрагмент журнала
+	 *        отображается в память, а строки ссылаются на отображение.
+	 */
+	HistoryView map_page(const std::string& user1, const std::string& user2, uint64_t limit,
+	                     uint64_t before = UINT64_MAX, uint64_t max_bytes = UINT64_MAX);
+
+	/**
+	 * @brief Найти сообщения пары, содержащие все слова запроса.
+	 *
+	 * Ответ строится по поисковому индексу (см. SearchIndex::search());
+	 * из журнала читаются только найденные записи.
+	 *
+	 * @param user1 Идентификатор первого пользователя.
+	 * @param user2 Идентификатор второго пользователя.
+	 * @param query Слова через пробел.
+	 * @param limit Сколько последних совпадений вернуть.
+	 */
+	HistoryMatches search(const std::string& user1, const std::string& user2, std::string_view query,
+	                      size_t limit);
+
+	/**
+	 * @brief Слить накопившиеся сегменты дельт поисковых индексов.
+	 *
+	 * Объединённые сегменты строятся без мьютекса, под ним только
+	 * подменяются файлы, поэтому запись истории не останавливается.
+	 * Вызывается одним потоком (HistoryWriter).
+	 *
+	 * @param min_segments Сливать индексы, у которых дельт не меньше.
+	 * @return Число слитых индексов.
+	 */
+	size_t merge_indexes(size_t min_segments);
+
+	/**
+	 * @brief Число записей в журнале пары (по размеру индекса).
+	 */
+	uint64_t message_count(const std::string& user1, const std::string& user2);
+
+	/**
+	 * @brief Закрыть все открытые журналы (например, перед удалением каталога).
+	 */
+	void close_all();
+
+	/**
+	 * @brief Число журналов, открытых в LRU-кэше.
+	 */
+	size_t open_writers() const;
+
+	/**
+	 * @brief Каталог истории.
+	 */
+	const std::string& root() const { return root_; }
+
+	/**
+	 * @brief Имя файлов пары без расширения: history_<min>_<max>.
+	 */
+	static std::string conversation_key(const std::string& user1, const std::string& user2);
+
+	/**
+	 * @brief Дописать закодированную запись в конец @p out.
+	 */
+	static void encode(const HistoryRecord& record, std::string& out);
+
+	/**
+	 * @brief Декодировать запись, начинающуюся с data[pos].
+	 *
+	 * @param data Буфер журнала.
+	 * @param len  Длина буфера.
+	 * @param pos  Смещение записи; при успехе сдвигается на следующую.
+	 * @param out  Результат.
+	 * @return false, если запись обрезана или повреждена.
+	 */
+	static bool decode(const char* data, size_t len, size_t& pos, HistoryRecord& out);
+
+	/**
+	 * @brief Как decode(), но возвращает только строку сообщения без копирования.
+	 *
+	 * @param line Строка внутри @p data.
+	 */
+	static bool decode_line(const char* data, size_t len, size_t& pos, std::string_view& line);
+
+	/**
+	 * @brief Перезаписать журнал и индекс с базовым путём @p base целиком.
+	 *
+	 * Записи пишутся во временные файлы, которые затем атомарно
+	 * переименовываются; поисковый индекс удаляется и строится заново
+	 * при следующем открытии, а сжатые блоки — после замены журнала
+	 * (оставшиеся после сбоя блоки отбрасываются при открытии).
+	 * Журнал не должен быть открыт в кэше.
+	 *
+	 * @param base    Путь без расширения (каталог/history_<min>_<max>).
+	 * @param records Новое содержимое.
+	 * @return false при ошибке ввода-вывода.
+	 */
+	static bool write_log(const std::string& base, const std::vector<HistoryRecord>& records);
+
+	/**
+	 * @brief Прочитать все записи журнала по базовому пути.
+	 */
+	static std::vector<HistoryRecord> read_log(const std::string& base);
+
+private:
+	/// Размер очереди запросов кольца io_uring (use_io_ring()).
+	static constexpr unsigned RING_ENTRIES = 64;
+	/// Сколько блоков сжимается после одной пачки (compress_history()).
+	static constexpr size_t SEAL_BLOCKS = 16;
+
+	struct Writer {
+		int log_fd = -1;
+		int idx_fd = -1;
+		uint64_t log_size = 0;
+		uint64_t count = 0;
+		bool dirty = false;  ///< Есть записи, не прошедшие fdatasync().
+		std::list<std::string>::iterator lru;
+		std::unique_ptr<SearchIndex> index;
+		std::unique_ptr<HistoryBlocks> blocks;
+		uint64_t punched = 0;      ///< Начало журнала, место которого уже освобождено.
+		uint64_t idx_punched = 0;  ///< То же для индекса.
+		int64_t segment_time = INT64_MIN;  ///< Время первой записи текущего сегмента (если прочитано).
+		/// Отображения, выданные map_page() (элемент mapped_ этой переписки).
+		std::vector<std::weak_ptr<const MappedRegion>>* mapped = nullptr;
+	};
+
+	/// Последний разжатый блок для scan().
+	struct BlockCache {
+		size_t block = SIZE_MAX;
+		std::string raw;
+	};
+
+	Writer* writer_for(const std::string& key);
+	bool open_writer(const std::string& key, Writer& w);
+	void close_writer(Writer& w);
+	void release_mappings(const std::string& key);
+	void index_tail(Writer& w);
+	Writer* existing_writer(const std::string& key);
+	size_t seal(Writer& w, size_t max_blocks);
+	void punch(Writer& w);
+	template <typename Fn>
+	void scan(Writer& w, uint64_t from, uint64_t to, Fn&& fn, BlockCache* cache = nullptr);
+	static bool read_raw(const std::string& base, std::string& out);
+	static bool block_time(const HistoryBlocks& blocks, size_t block, bool last, int64_t& time);
+	bool sealing() const { return compress_ || retention_.enabled(); }
+	void index_records(Writer& w, uint64_t first, std::span<const HistoryRecord> records);
+	bool ring_append(Writer& w, std::string_view log, std::string_view idx, bool sync);
+	std::string base_path(const std::string& key) const { return root_ + "/" + key; }
+
+	std::string root_;
+	size_t max_open_;
+	mutable std::mutex mutex_;
+	std::unordered_map<std::string, Writer> writers_;
+	std::list<std::string> lru_;  ///< Начало — самый недавно использованный.
+	/// Выданные map_page() отображения по переписке: переживают вытеснение журнала из кэша,
+	/// чтобы punch() при повторном открытии не освободил ещё отображённое место.
+	std::unordered_map<std::string, std::vector<std::weak_ptr<const MappedRegion>>> mapped_;
+	std::unique_ptr<IoRing> ring_;  ///< Кольцо io_uring (use_io_ring()); пусто — обычные write().
+	bool compress_ = false;         ///< compress_history().
+	HistoryRetention retention_;    ///< set_retention().
+};
+
+/**
+ * @brief Построить запись по готовой строке сообщения.
+ *
+ * Из строки вида "[YYYY-MM-DD HH:MM] sender: text" извлекаются время
+ * (локальное) и отправитель; строка сохраняется без изменений. Если
+ * префикса нет, отправитель пустой, а время равно @p fallback_time.
+ *
+ * @param text          Строка сообщения.
+ * @param fallback_time Время, если в строке его нет.
+ * @return Запись истории.
+ */
+HistoryRecord record_from_text(std::string_view text, int64_t fallback_time);
+
+/**
+ * @brief Перенести старые текстовые файлы истории в бинарные журналы.
+ *
+ * Каждый HISTORY/history_<a>_<b>.txt разбирается построчно
+ * ("[YYYY-MM-DD HH:MM] sender: text"), записи ставятся перед уже
+ * существующими в журнале, а исходный файл переименовывается
+ * в .txt.migrated. Повторный запуск ничего не делает.
+ *
+ * @param root Каталог истории.
+ * @return Число перенесённых файлов.
+ */
+size_t migrate_text_history(const std::string& root);
+
+#endif  // HISTORY_STORE_H
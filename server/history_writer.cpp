@@ -0,0 +1,213 @@
+#include "history_writer.h"
+
+#include "search_index.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <ctime>
+#include <utility>
+
+HistoryWriter::HistoryWriter(HistoryStore& store, HistoryDurability durability,
+                             std::chrono::milliseconds sync_interval, Histogram* append_us)
+    : store_(store),
+      durability_(durability),
+      sync_interval_(std::max(sync_interval, std::chrono::milliseconds(1))),
+      event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      append_us_(append_us) {
+	thread_ = std::thread(&HistoryWriter::run, this);
+}
+
+HistoryWriter::~HistoryWriter() {
+	stop();
+	if (event_fd_ != -1)
+		close(event_fd_);
+}
+
+void HistoryWriter::wake() {
+	uint64_t one = 1;
+	ssize_t ignored = write(event_fd_, &one, sizeof(one));
+	(void)ignored;
+}
+
+bool HistoryWriter::submit(std::string user1, std::string user2, HistoryRecord record) {
+	return enqueue(Pending{std::move(user1), std::move(user2), std::move(record)});
+}
+
+bool HistoryWriter::submit(std::string user1, std::string user2, PooledBuffer owner, std::string_view line) {
+	return enqueue(Pending{std::move(user1), std::move(user2), {}, std::move(owner), line,
+	                       static_cast<int64_t>(std::time(nullptr))});
+}
+
+bool HistoryWriter::enqueue(Pending pending) {
+	if (stopping_.load(std::memory_order_acquire))
+		return false;
+	submitted_.fetch_add(1, std::memory_order_relaxed);
+	uint64_t depth = depth_.fetch_add(1, std::memory_order_relaxed) + 1;
+	uint64_t prev_max = max_depth_.load(std::memory_order_relaxed);
+	while (prev_max < depth && !max_depth_.compare_exchange_weak(prev_max, depth)) {
+	}
+
+	// Будим поток только при переходе очереди из пустого состояния.
+	if (queue_.push(std::move(pending)))
+		wake();
+	return true;
+}
+
+void HistoryWriter::flush() {
+	uint64_t target = submitted_.load(std::memory_order_relaxed);
+	std::unique_lock<std::mutex> lock(written_mutex_);
+	written_cv_.wait(lock, [&] { return written_ >= target; });
+}
+
+void HistoryWriter::stop() {
+	if (!thread_.joinable())
+		return;
+	stopping_.store(true, std::memory_order_release);
+	wake();
+	thread_.join();
+	// submit() мог пройти проверку stopping_ до её установки.
+	write_pending();
+	if (durability_ != HistoryDurability::None)
+		syncs_.fetch_add(store_.sync_all(), std::memory_order_relaxed);
+}
+
+void HistoryWriter::flush(const std::string& user1, const std::string& user2) {
+	std::string key = HistoryStore::conversation_key(user1, user2);
+	{
+		std::lock_guard<std::mutex> lock(consume_mutex_);
+		take_queued();
+		auto it = taken_.find(key);
+		if (it == taken_.end())
+			return;
+		std::vector<Pending> group = std::move(it->second);
+		taken_.erase(it);
+		write_group(group);
+	}
+	// fdatasync() по политике и слияние сегментов поиска — в потоке записи.
+	flushed_.store(true, std::memory_order_release);
+	wake();
+}
+
+void HistoryWriter::take_queued() {
+	std::vector<Pending> nodes;
+	queue_.take_all(nodes);
+	for (Pending& n : nodes) {
+		auto [it, inserted] = taken_.try_emplace(HistoryStore::conversation_key(n.user1, n.user2));
+		if (inserted)
+			taken_order_.push_back(it->first);
+		it->second.push_back(std::move(n));
+	}
+}
+
+void HistoryWriter::write_group(std::vector<Pending>& group) {
+	std::vector<HistoryRecord> records;
+	records.reserve(group.size());
+	for (Pending& n : group) {
+		if (!n.line.empty()) {
+			n.record = record_from_text(n.line, n.time);
+			n.owner.reset();
+		}
+		records.push_back(std::move(n.record));
+	}
+	auto start = std::chrono::steady_clock::now();
+	if (!store_.append_batch(group.front().user1, group.front().user2, records))
+		errors_.fetch_add(1, std::memory_order_relaxed);
+	if (append_us_ != nullptr) {
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		append_us_->record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+	}
+	batches_.fetch_add(1, std::memory_order_relaxed);
+	uint64_t prev = max_batch_.load(std::memory_order_relaxed);
+	while (prev < records.size() && !max_batch_.compare_exchange_weak(prev, records.size())) {
+	}
+
+	records_.fetch_add(group.size(), std::memory_order_relaxed);
+	depth_.fetch_sub(group.size(), std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(written_mutex_);
+		written_ += group.size();
+	}
+	written_cv_.notify_all();
+}
+
+size_t HistoryWriter::write_pending() {
+	auto start = std::chrono::steady_clock::now();
+	size_t written = 0;
+	std::unique_lock<std::mutex> lock(consume_mutex_);
+	take_queued();
+	// Пачка пишется под мьютексом потребителя: flush(user1, user2) не обгонит
+	// более ранние записи своей переписки, но ждёт не больше одной пачки.
+	while (!taken_order_.empty()) {
+		auto it = taken_.find(taken_order_.front());
+		taken_order_.pop_front();
+		if (it == taken_.end())
+			continue;
+		std::vector<Pending> group = std::move(it->second);
+		taken_.erase(it);
+		write_group(group);
+		written += group.size();
+		lock.unlock();
+		lock.lock();
+	}
+	if (written == 0)
+		return 0;
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	flush_us_.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+	return written;
+}
+
+void HistoryWriter::run() {
+	using clock = std::chrono::steady_clock;
+	bool dirty = false;
+	auto last_sync = clock::now();
+	while (true) {
+		int timeout = -1;
+		if (dirty && durability_ == HistoryDurability::Interval) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(last_sync + sync_interval_ -
+			                                                                  clock::now());
+			timeout = static_cast<int>(std::max<int64_t>(left.count(), 0));
+		}
+		pollfd pfd{event_fd_, POLLIN, 0};
+		if (timeout != 0)
+			poll(&pfd, 1, timeout);
+		uint64_t counter;
+		while (read(event_fd_, &counter, sizeof(counter)) > 0) {
+		}
+
+		bool stopping = stopping_.load(std::memory_order_acquire);
+		bool flushed = flushed_.exchange(false, std::memory_order_acquire);
+		if (write_pending() > 0 || flushed) {
+			dirty = true;
+			store_.merge_indexes(SearchIndex::MERGE_SEGMENTS);
+		}
+		bool due = durability_ == HistoryDurability::PerBatch ||
+		           (durability_ == HistoryDurability::Interval && clock::now() - last_sync >= sync_interval_);
+		if (dirty && due) {
+			syncs_.fetch_add(store_.sync_all(), std::memory_order_relaxed);
+			last_sync = clock::now();
+			dirty = false;
+		}
+		if (stopping)
+			return;
+	}
+}
+
+HistoryWriterStats HistoryWriter::stats() const {
+	HistoryWriterStats st;
+	st.queued = depth_.load(std::memory_order_relaxed);
+	st.max_queued = max_depth_.load(std::memory_order_relaxed);
+	st.records = records_.load(std::memory_order_relaxed);
+	st.batches = batches_.load(std::memory_order_relaxed);
+	st.max_batch = max_batch_.load(std::memory_order_relaxed);
+	st.syncs = syncs_.load(std::memory_order_relaxed);
+	st.errors = errors_.load(std::memory_order_relaxed);
+	HistogramSnapshot flush = flush_us_.snapshot();
+	st.avg_flush_us = flush.avg();
+	st.p50_flush_us = flush.p50;
+	st.p99_flush_us = flush.p99;
+	st.max_flush_us = flush.max;
+	return st;
+}
@@ -0,0 +1,213 @@
+/**
+ * @file history_writer.h
+ * @brief Фоновая запись истории с групповой фиксацией (group commit).
+ *
+ * Механизм:
+ * - Цикл событий ставит сообщение в очередь без блокировок (MpscQueue:
+ *   производители делают один compare-exchange) и сразу продолжает работу.
+ * - Отдельный поток забирает из очереди всё накопившееся одним exchange,
+ *   восстанавливает порядок поступления и группирует записи по переписке.
+ * - Записи одной переписки дописываются одним write() в журнал и одним
+ *   write() в индекс (HistoryStore::append_batch).
+ * - Порядок внутри переписки сохраняется: поток записи один, а группировка
+ *   не переставляет записи одной пары.
+ * - Долговечность настраивается (HistoryDurability): без fdatasync, fdatasync
+ *   не реже раза в N мс или fdatasync после каждой пачки.
+ * - Поток будится через eventfd, только когда очередь была пуста.
+ * - Чтение истории не ждёт очереди: flush(user1, user2) дописывает записи
+ *   одной переписки в потоке вызывающего без fdatasync(), остальные
+ *   переписки и fdatasync() по политике остаются потоку записи.
+ * - После записи поток же сливает сегменты поисковых индексов
+ *   (HistoryStore::merge_indexes()), не задерживая цикл событий.
+ */
+
+#ifndef HISTORY_WRITER_H
+#define HISTORY_WRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "history_store.h"
+#include "metrics.h"
+#include "mpsc_queue.h"
+
+/**
+ * @brief Политика сброса журналов истории на диск.
+ */
+enum class HistoryDurability {
+	None,      ///< Не вызывать fdatasync(); данные остаются в кэше ОС.
+	Interval,  ///< fdatasync() изменённых журналов не реже раза в интервал.
+	PerBatch   ///< fdatasync() после каждого прохода потока записи.
+};
+
+/**
+ * @struct HistoryWriterStats
+ * @brief Снимок статистики фоновой записи истории.
+ *
+ * Перцентили оцениваются по гистограмме (Histogram) и равны
+ * верхней границе соответствующей корзины.
+ */
+struct HistoryWriterStats {
+	uint64_t queued = 0;        ///< Сообщений в очереди сейчас.
+	uint64_t max_queued = 0;    ///< Наибольшая глубина очереди.
+	uint64_t records = 0;       ///< Записано сообщений.
+	uint64_t batches = 0;       ///< Записано пачек (одна пачка — одна переписка).
+	uint64_t max_batch = 0;     ///< Наибольшая пачка.
+	uint64_t syncs = 0;         ///< Вызовов fdatasync() по политике.
+	uint64_t errors = 0;        ///< Пачек, не записанных из-за ошибки ввода-вывода.
+	uint64_t avg_flush_us = 0;  ///< Среднее время записи одной выборки из очереди.
+	uint64_t p50_flush_us = 0;  ///< Медиана времени записи.
+	uint64_t p99_flush_us = 0;  ///< 99-й перцентиль времени записи.
+	uint64_t max_flush_us = 0;  ///< Максимальное время записи.
+};
+
+/**
+ * @class HistoryWriter
+ * @brief Поток, записывающий историю в HistoryStore вне цикла событий.
+ *
+ * submit() потокобезопасен и не блокируется; flush() и stop() ждут
+ * записи уже поставленных сообщений, flush(user1, user2) записывает
+ * сообщения одной переписки сам.
+ */
+class HistoryWriter {
+public:
+	/// Интервал fdatasync() по умолчанию для HistoryDurability::Interval.
+	static constexpr std::chrono::milliseconds DEFAULT_SYNC_INTERVAL{1000};
+
+	/**
+	 * @param store         Хранилище, в которое пишутся сообщения.
+	 * @param durability    Политика fdatasync().
+	 * @param sync_interval Интервал для HistoryDurability::Interval.
+	 * @param append_us     Гистограмма длительности записи одной пачки
+	 *                      (HistoryStore::append_batch()); nullptr — не вести.
+	 */
+	HistoryWriter(HistoryStore& store, HistoryDurability durability,
+	              std::chrono::milliseconds sync_interval = DEFAULT_SYNC_INTERVAL,
+	              Histogram* append_us = nullptr);
+	~HistoryWriter();
+
+	HistoryWriter(const HistoryWriter&) = delete;
+	HistoryWriter& operator=(const HistoryWriter&) = delete;
+
+	/**
+	 * @brief Поставить запись в очередь.
+	 *
+	 * @param user1  Идентификатор первого пользователя.
+	 * @param user2  Идентификатор второго пользователя.
+	 * @param record Запись.
+	 * @return false, если поток записи уже остановлен.
+	 */
+	bool submit(std::string user1, std::string user2, HistoryRecord record);
+
+	/**
+	 * @brief Поставить в очередь строку чата из буфера пула без копирования.
+	 *
+	 * Запись (отправитель и время, см. record_from_text()) собирается уже
+	 * в потоке записи; ссылка на буфер отпускается после записи.
+	 *
+	 * @param user1 Идентификатор первого пользователя.
+	 * @param user2 Идентификатор второго пользователя.
+	 * @param owner Ссылка на буфер, в котором лежит @p line.
+	 * @param line  Строка "[YYYY-MM-DD HH:MM] sender: text\n".
+	 * @return false, если поток записи уже остановлен.
+	 */
+	bool submit(std::string user1, std::string user2, PooledBuffer owner, std::string_view line);
+
+	/**
+	 * @brief Дождаться записи всех сообщений, поставленных до вызова.
+	 *
+	 * Нужно перед чтением истории, чтобы увидеть свои же сообщения.
+	 */
+	void flush();
+
+	/**
+	 * @brief Записать ещё не записанные сообщения одной переписки
+	 *        в потоке вызывающего.
+	 *
+	 * Нужно перед чтением истории в цикле событий: записи других переписок
+	 * не ждутся, fdatasync() не выполняется (его делает поток записи по
+	 * политике). Ждёт не дольше записи одной пачки, которую пишет поток.
+	 *
+	 * @param user1 Идентификатор первого пользователя.
+	 * @param user2 Идентификатор второго пользователя.
+	 */
+	void flush(const std::string& user1, const std::string& user2);
+
+	/**
+	 * @brief Записать оставшиеся сообщения, синхронизировать журналы
+	 *        и остановить поток. Повторный вызов ничего не делает.
+	 */
+	void stop();
+
+	/**
+	 * @brief Снимок статистики (потокобезопасно).
+	 */
+	HistoryWriterStats stats() const;
+
+	/**
+	 * @brief Текущая политика долговечности.
+	 */
+	HistoryDurability durability() const { return durability_; }
+
+private:
+	struct Pending {
+		std::string user1;
+		std::string user2;
+		HistoryRecord record;
+		PooledBuffer owner{};     ///< Буфер строки для submit() из пула.
+		std::string_view line{};  ///< Строка внутри owner.
+		int64_t time = 0;         ///< Время постановки (если в строке его нет).
+	};
+
+	bool enqueue(Pending pending);
+	void run();
+	size_t write_pending();
+	void take_queued();
+	void write_group(std::vector<Pending>& group);
+	void wake();
+
+	HistoryStore& store_;
+	HistoryDurability durability_;
+	std::chrono::milliseconds sync_interval_;
+	int event_fd_;
+
+	MpscQueue<Pending> queue_;
+	/// Потребитель очереди: запись пачек и разбор очереди по перепискам.
+	std::mutex consume_mutex_;
+	/// Забранные из очереди, но ещё не записанные сообщения по перепискам.
+	std::unordered_map<std::string, std::vector<Pending>> taken_;
+	/// Переписки taken_ в порядке поступления (могут повторяться).
+	std::deque<std::string> taken_order_;
+	/// Пачки, записанные flush(user1, user2): потоку записи нужен fdatasync().
+	std::atomic<bool> flushed_{false};
+	std::atomic<bool> stopping_{false};
+	std::atomic<uint64_t> submitted_{0};
+	std::atomic<uint64_t> depth_{0};
+	std::atomic<uint64_t> max_depth_{0};
+
+	std::atomic<uint64_t> records_{0};
+	std::atomic<uint64_t> batches_{0};
+	std::atomic<uint64_t> max_batch_{0};
+	std::atomic<uint64_t> syncs_{0};
+	std::atomic<uint64_t> errors_{0};
+	Histogram flush_us_;
+	Histogram* append_us_;
+
+	std::mutex written_mutex_;
+	std::condition_variable written_cv_;
+	uint64_t written_ = 0;
+
+	std::thread thread_;
+};
+
+#endif  // HISTORY_WRITER_H
@@ -0,0 +1,195 @@
+#include "io_ring.h"
+
+#ifdef MESSENGER_IO_URING
+
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+	unsigned load_acquire(unsigned* p) {
+		return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+	}
+
+	void store_release(unsigned* p, unsigned v) {
+		std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release);
+	}
+
+	template <typename T>
+	T* at(void* base, size_t offset) {
+		return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+	}
+
+}  // namespace
+
+std::unique_ptr<IoRing> IoRing::create(unsigned entries, unsigned cq_entries) {
+	io_uring_params p{};
+	if (cq_entries > 0) {
+		p.flags |= IORING_SETUP_CQSIZE;
+		p.cq_entries = cq_entries;
+	}
+	int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+	if (fd < 0)
+		return nullptr;
+
+	std::unique_ptr<IoRing> ring(new IoRing());
+	ring->fd_ = fd;
+	// Без NODROP переполненная CQ теряет завершения; без EXT_ARG нельзя ждать с таймаутом.
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG))
+		return nullptr;
+
+	ring->sq_map_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_map_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		ring->sq_map_size_ = ring->cq_map_size_ = std::max(ring->sq_map_size_, ring->cq_map_size_);
+	ring->sq_map_ = mmap(nullptr, ring->sq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	                     IORING_OFF_SQ_RING);
+	if (ring->sq_map_ == MAP_FAILED) {
+		ring->sq_map_ = nullptr;
+		return nullptr;
+	}
+	if (single) {
+		ring->cq_map_ = ring->sq_map_;
+	} else {
+		ring->cq_map_ = mmap(nullptr, ring->cq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                     fd, IORING_OFF_CQ_RING);
+		if (ring->cq_map_ == MAP_FAILED) {
+			ring->cq_map_ = nullptr;
+			return nullptr;
+		}
+	}
+	ring->sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, ring->sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	                  IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return nullptr;
+	ring->sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+	ring->sq_head_ = at<unsigned>(ring->sq_map_, p.sq_off.head);
+	ring->sq_tail_ = at<unsigned>(ring->sq_map_, p.sq_off.tail);
+	ring->sq_flags_ = at<unsigned>(ring->sq_map_, p.sq_off.flags);
+	ring->sq_mask_ = *at<unsigned>(ring->sq_map_, p.sq_off.ring_mask);
+	ring->sq_entries_ = p.sq_entries;
+	ring->cq_head_ = at<unsigned>(ring->cq_map_, p.cq_off.head);
+	ring->cq_tail_ = at<unsigned>(ring->cq_map_, p.cq_off.tail);
+	ring->cq_mask_ = *at<unsigned>(ring->cq_map_, p.cq_off.ring_mask);
+	ring->cqes_ = at<io_uring_cqe>(ring->cq_map_, p.cq_off.cqes);
+	// Запрос i всегда лежит в ячейке i: массив индексов заполняется один раз.
+	unsigned* array = at<unsigned>(ring->sq_map_, p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; ++i)
+		array[i] = i;
+	ring->sqe_tail_ = ring->sqe_flushed_ = *ring->sq_tail_;
+
+	std::vector<char> probe_buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+	auto* probe = reinterpret_cast<io_uring_probe*>(probe_buf.data());
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		for (unsigned i = 0; i < probe->ops_len && i < 256; ++i)
+			if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+				ring->supported_[i / 64] |= uint64_t{1} << (i % 64);
+	}
+	return ring;
+}
+
+IoRing::~IoRing() {
+	if (sqes_ != nullptr)
+		munmap(sqes_, sqes_size_);
+	if (cq_map_ != nullptr && cq_map_ != sq_map_)
+		munmap(cq_map_, cq_map_size_);
+	if (sq_map_ != nullptr)
+		munmap(sq_map_, sq_map_size_);
+	if (fd_ != -1)
+		close(fd_);
+}
+
+io_uring_sqe* IoRing::next_sqe() {
+	if (sqe_tail_ - load_acquire(sq_head_) >= sq_entries_) {
+		submit();
+		if (sqe_tail_ - load_acquire(sq_head_) >= sq_entries_)
+			return nullptr;
+	}
+	io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+	std::memset(sqe, 0, sizeof(*sqe));
+	++sqe_tail_;
+	return sqe;
+}
+
+bool IoRing::submit(unsigned wait_for, int timeout_ms) {
+	unsigned to_submit = sqe_tail_ - sqe_flushed_;
+	if (to_submit > 0) {
+		store_release(sq_tail_, sqe_tail_);
+		sqe_flushed_ = sqe_tail_;
+	}
+	bool overflow = load_acquire(sq_flags_) & IORING_SQ_CQ_OVERFLOW;
+	if (to_submit == 0 && wait_for == 0 && !overflow)
+		return true;
+
+	unsigned flags = IORING_ENTER_GETEVENTS;
+	__kernel_timespec ts{};
+	io_uring_getevents_arg arg{};
+	const void* argp = nullptr;
+	size_t argsz = _NSIG / 8;
+	if (wait_for > 0 && timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+		arg.ts = reinterpret_cast<uint64_t>(&ts);
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		argsz = sizeof(arg);
+	}
+	++enters_;
+	long ret = syscall(__NR_io_uring_enter, fd_, to_submit, wait_for, flags, argp, argsz);
+	return ret >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY;
+}
+
+const io_uring_cqe* IoRing::peek() const {
+	unsigned head = *cq_head_;
+	if (head == load_acquire(cq_tail_))
+		return nullptr;
+	return &cqes_[head & cq_mask_];
+}
+
+void IoRing::pop() {
+	store_release(cq_head_, *cq_head_ + 1);
+}
+
+bool IoRing::supports(uint8_t opcode) const {
+	return supported_[opcode / 64] & (uint64_t{1} << (opcode % 64));
+}
+
+#else  // MESSENGER_IO_URING
+
+std::unique_ptr<IoRing> IoRing::create(unsigned, unsigned) {
+	return nullptr;
+}
+
+IoRing::~IoRing() = default;
+
+io_uring_sqe* IoRing::next_sqe() {
+	return nullptr;
+}
+
+bool IoRing::submit(unsigned, int) {
+	return false;
+}
+
+const io_uring_cqe* IoRing::peek() const {
+	return nullptr;
+}
+
+void IoRing::pop() {}
+
+bool IoRing::supports(uint8_t) const {
+	return false;
+}
+
+#endif  // MESSENGER_IO_URING
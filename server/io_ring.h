@@ -0,0 +1,111 @@
+/**
+ * @file io_ring.h
+ * @brief Кольцо io_uring поверх системных вызовов ядра (без liburing).
+ *
+ * Механизм:
+ * - create() настраивает кольцо вызовом io_uring_setup и отображает
+ *   очередь запросов (SQ) и очередь завершений (CQ) в память процесса.
+ * - Запросы заполняются прямо в отображённой памяти (next_sqe()) и уходят
+ *   ядру пачкой при submit(): один io_uring_enter на любое их число,
+ *   он же при необходимости ждёт завершений.
+ * - Завершения читаются из CQ без системных вызовов (peek() / pop()).
+ * - В сборке без MESSENGER_IO_URING (опция CMake) и на ядрах без io_uring
+ *   create() возвращает nullptr: вызывающая сторона работает по-старому.
+ */
+
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * @class IoRing
+ * @brief Однопоточное кольцо io_uring.
+ *
+ * Не потокобезопасно: запросы заполняет и завершения читает один поток
+ * (или вызывающая сторона держит свою блокировку).
+ */
+class IoRing {
+public:
+	/**
+	 * @brief Создать кольцо.
+	 *
+	 * @param entries    Размер очереди запросов (округляется ядром до степени двойки).
+	 * @param cq_entries Размер очереди завершений; 0 — вдвое больше @p entries.
+	 * @return nullptr, если io_uring недоступен.
+	 */
+	static std::unique_ptr<IoRing> create(unsigned entries, unsigned cq_entries = 0);
+
+	~IoRing();
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+
+	/**
+	 * @brief Обнулённый запрос в конце очереди.
+	 *
+	 * Если очередь заполнена, накопленные запросы сначала отправляются ядру.
+	 *
+	 * @return nullptr, если и после отправки места нет.
+	 */
+	io_uring_sqe* next_sqe();
+
+	/**
+	 * @brief Отправить накопленные запросы и дождаться завершений.
+	 *
+	 * Если отправлять нечего и ждать не нужно, системный вызов не делается.
+	 *
+	 * @param wait_for   Сколько завершений должно лежать в CQ (0 — не ждать).
+	 * @param timeout_ms Предел ожидания; -1 — без предела.
+	 * @return false при ошибке ядра (кроме истечения времени и EINTR).
+	 */
+	bool submit(unsigned wait_for = 0, int timeout_ms = -1);
+
+	/**
+	 * @brief Первое непрочитанное завершение или nullptr.
+	 *
+	 * Запись действительна до pop().
+	 */
+	const io_uring_cqe* peek() const;
+
+	/// Освободить завершение, полученное из peek().
+	void pop();
+
+	/// Поддерживает ли ядро операцию @p opcode (IORING_OP_*).
+	bool supports(uint8_t opcode) const;
+
+	/// Число вызовов io_uring_enter за время жизни кольца.
+	uint64_t enters() const { return enters_; }
+
+private:
+	IoRing() = default;
+
+	int fd_ = -1;
+	void* sq_map_ = nullptr;
+	size_t sq_map_size_ = 0;
+	void* cq_map_ = nullptr;
+	size_t cq_map_size_ = 0;
+	io_uring_sqe* sqes_ = nullptr;
+	size_t sqes_size_ = 0;
+
+	unsigned* sq_head_ = nullptr;
+	unsigned* sq_tail_ = nullptr;
+	unsigned* sq_flags_ = nullptr;
+	unsigned sq_mask_ = 0;
+	unsigned sq_entries_ = 0;
+	unsigned* cq_head_ = nullptr;
+	unsigned* cq_tail_ = nullptr;
+	unsigned cq_mask_ = 0;
+	io_uring_cqe* cqes_ = nullptr;
+
+	unsigned sqe_tail_ = 0;     ///< Заполненные запросы (включая ещё не отданные ядру).
+	unsigned sqe_flushed_ = 0;  ///< Значение хвоста SQ, уже видимое ядру.
+	uint64_t enters_ = 0;
+	uint64_t supported_[4] = {};  ///< Битовая маска поддерживаемых операций.
+};
+
+#endif  // IO_RING_H
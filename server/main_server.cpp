@@ -1,399 +1,2622 @@
-/**
- * @file main_server.cpp
- * @brief Реализация сервера консольного мессенджера.
- *
- * Сервер принимает подключения клиентов по TCP, обеспечивает
- * авторизацию через Telegram-коды, обработку команд клиентов
- * (/connect, /vote, /end, /help, /exit, /shutdown),
- * передачу сообщений между участниками и хранение истории.
- */
-
-#include <netinet/in.h>
-#include <sys/select.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
-#include "telegram_auth.h"
-
-#include "history.h"
-#include "socket_utils.h"
-#include <algorithm>
-#include <cstring>
-#include <ctime>
-#include <iostream>
-#include <map>
-#include <sstream>
-#include <unordered_map>
-#include <vector>
-
-/// Порт, на котором слушает сервер.
-constexpr int PORT = 9090;
-
-/**
- * @struct ClientInfo
- * @brief Информация о подключенном клиенте.
- *
- * @var ClientInfo::fd
- * Дескриптор сокета клиента.
- * @var ClientInfo::id
- * Идентификатор (Telegram ID) клиента.
- * @var ClientInfo::connected_to
- * ID клиента, с которым установлена беседа (пусто, если нет).
- * @var ClientInfo::is_speaking
- * Флаг права голоса (кто может отправлять сообщения).
- * @var ClientInfo::pending_request_from
- * Если не пусто — ID клиента, ожидающего подтверждения соединения.
- */
-struct ClientInfo {
-	int fd;
-	std::string id;
-	std::string connected_to;
-	bool is_speaking = false;
-	std::string pending_request_from;
-};
-
-/// Карта: дескриптор сокета -> информация о клиенте.
-static std::unordered_map<int, ClientInfo> clients;
-/// Карта: Telegram ID клиента -> дескриптор сокета.
-static std::unordered_map<std::string, int> id_to_fd;
-/// Карта: дескриптор сокета -> Telegram ID (ожидающие код).
-static std::unordered_map<int, std::string> pending_auth;
-
-/**
- * @brief Получить текущую дату и время.
- *
- * Возвращает строку в формате "YYYY-MM-DD HH:MM".
- *
- * @return Форматированная метка времени.
- */
-std::string get_timestamp() {
-	time_t now = time(nullptr);
-	char buf[20];
-	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", localtime(&now));
-	return std::string(buf);
-}
-
-/**
- * @brief Отключить клиента и очистить его данные.
- *
- * Завершает соединение, удаляет из наборов клиентов,
- * уведомляет партнера беседы.
- *
- * @param fd Дескриптор сокета клиента для отключения.
- * @param master_fds Ссылка на набор файловых дескрипторов select().
- */
-void disconnect_client(int fd, fd_set& master_fds) {
-	if (clients.count(fd)) {
-		std::string id = clients[fd].id;
-		std::string connected_to = clients[fd].connected_to;
-		std::cout << "\nDisconnecting client: " << id << " (fd: " << fd << ")\n";
-
-		if (!connected_to.empty() && id_to_fd.count(connected_to)) {
-			int target_fd = id_to_fd[connected_to];
-			clients[target_fd].connected_to.clear();
-			clients[target_fd].is_speaking = false;
-			const std::string msg = "\nYour conversation partner has left the chat.\n";
-			send_packet(target_fd, msg.c_str());
-		}
-
-		clients.erase(fd);
-		id_to_fd.erase(id);
-		FD_CLR(fd, &master_fds);
-		close(fd);
-	}
-}
-
-/**
- * @brief Обработать команду клиента в режиме диалога.
- *
- * Поддерживаемые команды:
- *  - /connect <ID>
- *  - /vote
- *  - /end
- *  - /help
- *  - /exit
- *
- * @param fd   Дескриптор сокета отправителя.
- * @param msg  Текст команды (без завершающего \n).
- * @param master_fds Набор дескрипторов select() для обновления.
- */
-void handle_client_command(int fd, const std::string& msg, fd_set& master_fds) {
-	if (msg.starts_with("/connect ")) {
-		std::string target_id = msg.substr(9);
-		if (id_to_fd.count(target_id)) {
-			int target_fd = id_to_fd[target_id];
-
-			if (!clients[target_fd].pending_request_from.empty()) {
-				send_packet(fd, "User is busy with another request.\n");
-				return;
-			}
-
-			if (!clients[target_fd].connected_to.empty()) {
-				const std::string notice = "\nUser '" + clients[fd].id +
-				                           "' attempted to connect to you, but you are "
-				                           "already in a conversation.\n";
-				send_packet(target_fd, notice.c_str());
-				send_packet(fd, "User is already connected.\n");
-				return;
-			}
-
-			clients[target_fd].pending_request_from = clients[fd].id;
-			const std::string prompt = "\nUser '" + clients[fd].id + "' wants to connect. Accept? (yes/no)\n";
-			send_packet(target_fd, prompt.c_str());
-		} else {
-			send_packet(fd, "User not found.\n");
-		}
-	} else if (msg == "/vote") {
-		if (clients[fd].is_speaking) {
-			std::string target_id = clients[fd].connected_to;
-			if (!target_id.empty() && id_to_fd.count(target_id)) {
-				int target_fd = id_to_fd[target_id];
-				clients[fd].is_speaking = false;
-				clients[target_fd].is_speaking = true;
-				send_all(fd, "You passed the microphone.\n");
-				send_packet(target_fd, "You are now speaking.\n");
-			} else {
-				send_packet(fd, "No connected client to pass speaking right.\n");
-			}
-		} else {
-			send_packet(fd, "You are not the current speaker.\n");
-		}
-	} else if (msg == "/end") {
-		std::string partner_id = clients[fd].connected_to;
-		if (!partner_id.empty() && id_to_fd.count(partner_id)) {
-			int partner_fd = id_to_fd[partner_id];
-			clients[partner_fd].connected_to.clear();
-			clients[partner_fd].is_speaking = false;
-			send_packet(partner_fd, "\nYour conversation partner has ended the chat.\n");
-		}
-		clients[fd].connected_to.clear();
-		clients[fd].is_speaking = false;
-		send_packet(fd, "You have left the conversation.\n");
-	} else if (msg == "/help") {
-		const std::string help =
-		    "Available commands:\n"
-		    "/connect <ID> - request chat with user\n"
-		    "/vote         - pass speaker role\n"
-		    "/end          - end current conversation\n"
-		    "/exit         - exit the chat completely\n"
-		    "/help         - show this message\n";
-		send_packet(fd, help.c_str());
-	} else if (msg == "/exit") {
-		disconnect_client(fd, master_fds);
-	} else {
-		send_packet(fd, "Only /connect <ID>, /vote, /end, /exit, /help are allowed.\n");
-	}
-}
-
-/**
- * @brief Обработать ответ клиента на запрос соединения.
- *
- * Если клиент ранее отправил /connect и ожидает ответа,
- * эта функция устанавливает связь и пересылает историю.
- *
- * @param fd  Дескриптор сокета отвечающего клиента.
- * @param msg Сообщение-ответ ("yes"/"no").
- */
-void handle_pending_response(int fd, const std::string& msg) {
-	ClientInfo& responder = clients[fd];
-	if (responder.pending_request_from.empty())
-		return;
-
-	std::string requester_id = responder.pending_request_from;
-	responder.pending_request_from.clear();
-
-	if (!id_to_fd.count(requester_id)) {
-		send_packet(fd, "Requester disconnected.\n");
-		return;
-	}
-
-	int requester_fd = id_to_fd[requester_id];
-	if (msg == "yes") {
-		std::cout << "Clients connected: " << responder.id << " <-> " << requester_id << std::endl;
-		responder.connected_to = requester_id;
-		clients[requester_fd].connected_to = responder.id;
-		clients[requester_fd].is_speaking = true;
-
-		std::string history = load_history_for_users(responder.id, requester_id);
-		if (!history.empty()) {
-			send_all(fd, "Chat history:\n");
-			send_all(fd, history.c_str());
-			send_all(requester_fd, "Chat history:\n");
-			send_all(requester_fd, history.c_str());
-		}
-		send_packet(requester_fd, "Connection accepted. You are now speaking.\n");
-		send_all(fd, "Connection established. You are a listener.\n");
-	} else {
-		send_packet(requester_fd, "Connection rejected.\n");
-		send_packet(fd, "Connection declined.\n");
-	}
-}
-
-/**
- * @brief Точка входа сервера.
- *
- * Запускает прослушивание порта,
- * обрабатывает подключения и команды до получения /shutdown.
- *
- * @return 0 при корректном завершении, иначе код ошибки.
- */
-int main() {
-	ensure_bot_token();
-
-	int listener = socket(AF_INET, SOCK_STREAM, 0);
-	if (listener == -1) {
-		perror("socket");
-		return 1;
-	}
-
-	int opt = 1;
-	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-	sockaddr_in server_addr{};
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(PORT);
-	server_addr.sin_addr.s_addr = INADDR_ANY;
-
-	if (bind(listener, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-		perror("bind");
-		return 1;
-	}
-
-	listen(listener, SOMAXCONN);
-
-	std::cout << "Server listening on port " << PORT << std::endl;
-
-	fd_set master_fds, read_fds;
-	FD_ZERO(&master_fds);
-	FD_SET(listener, &master_fds);
-	FD_SET(STDIN_FILENO, &master_fds);
-	int fd_max = listener;
-
-	while (true) {
-		read_fds = master_fds;
-		if (select(fd_max + 1, &read_fds, nullptr, nullptr, nullptr) == -1) {
-			perror("select");
-			break;
-		}
-
-		for (int fd = 0; fd <= fd_max; ++fd) {
-			if (!FD_ISSET(fd, &read_fds))
-				continue;
-
-			if (fd == STDIN_FILENO) {
-				std::string cmd;
-				std::getline(std::cin, cmd);
-				if (cmd == "/shutdown") {
-					std::cout << "Shutting down server...\n";
-					// BEGIN: Borrowed code
-					for (auto& [cfd, info] : clients)
-						send_all(cfd, "\nServer is shutting down.\n");
-					for (auto& [cfd, info] : clients)
-						close(cfd);
-					// END: Borrowed code
-					close(listener);
-					std::cout << "Server stopped.\n";
-					return 0;
-				}
-				continue;
-			}
-
-			if (fd == listener) {
-				int client_fd = accept(listener, nullptr, nullptr);
-				if (client_fd != -1) {
-					std::cout << "New client connected, fd: " << client_fd << std::endl;
-					FD_SET(client_fd, &master_fds);
-					fd_max = std::max(fd_max, client_fd);
-					const char* ask_id = "Enter your ID\n";
-					send_packet(client_fd, ask_id);
-				}
-			} else {
-				std::string msg;
-				if (!recv_line(fd, msg)) {
-					disconnect_client(fd, master_fds);
-					continue;
-				}
-
-				if (clients.count(fd) == 0 && !pending_auth.count(fd)) {
-					std::string chat_id = msg;
-					if (chat_id.empty()) {
-						send_packet(fd, "Chat ID cannot be empty. Try again\n");
-						continue;
-					}
-
-					std::string code = generate_auth_code();
-					if (send_telegram_code(chat_id, code)) {
-						pending_auth[fd] = chat_id;
-						const char* sent = "Telegram code sent. Enter the code to log in\n";
-						send_packet(fd, sent);
-					} else {
-						send_packet(fd,
-						            "Failed to send Telegram message.\nUse command /exit to "
-						            "exit.\nCheck the telegram ID and write it again");
-					}
-				}
-
-				else if (pending_auth.count(fd)) {
-					std::string entered_code = msg;
-					std::string chat_id = pending_auth[fd];
-					if (verify_auth_code(chat_id, entered_code)) {
-						if (id_to_fd.count(chat_id)) {
-							int old_fd = id_to_fd[chat_id];
-							send_packet(old_fd, "\nYou have been logged out (second login detected).\n");
-							disconnect_client(old_fd, master_fds);
-						}
-
-						clients[fd] = ClientInfo{fd, chat_id};
-						std::cout << "Client authorized: " << chat_id << " (fd: " << fd << ")" << std::endl;
-						id_to_fd[chat_id] = fd;
-						pending_auth.erase(fd);
-
-						std::string welcome =
-						    "Welcome, " + chat_id + "! Use /connect <ID>, /vote, /end, /exit, /help\n";
-						send_packet(fd, welcome.c_str());
-					} else {
-						send_packet(fd, "Incorrect code. Try again\n");
-					}
-				}
-
-				else if (!clients[fd].pending_request_from.empty()) {
-					handle_pending_response(fd, msg);
-				}
-
-				else if (!msg.empty() && msg[0] == '/') {
-					handle_client_command(fd, msg, master_fds);
-				}
-
-				else {
-					if (clients[fd].connected_to.empty()) {
-						send_packet(fd,
-						            "You are not in a conversation.\nUse /connect <ID> to "
-						            "start chatting.\n");
-						continue;
-					}
-					if (!clients[fd].is_speaking) {
-						send_all(fd,
-						         "You cannot send messages unless you're the current "
-						         "speaker.\n");
-						continue;
-					}
-
-					std::string target_id = clients[fd].connected_to;
-					if (!target_id.empty() && id_to_fd.count(target_id)) {
-						int target_fd = id_to_fd[target_id];
-						std::string timestamp = get_timestamp();
-						std::string sender = clients[fd].id;
-						std::string text = "[" + timestamp + "] " + sender + ": " + msg + "\n";
-						send_all(target_fd, text.c_str());
-						append_message_to_history(sender, target_id, text);
-					} else {
-						send_packet(fd, "Not connected. Use /connect <ID>\n");
-					}
-				}
-			}
-		}
-	}
-
-	close(listener);
-	return 0;
-}
+/**
+ * @file main_server.cpp
+ * @brief Реализация сервера консольного мессенджера.
+ *
+ * Сервер принимает подключения клиентов по TCP, обеспечивает
+ * авторизацию через Telegram-коды, обработку команд клиентов
+ * (/connect, /vote, /end, /room, /rooms, /help, /exit, /shutdown),
+ * передачу сообщений между участниками (в том числе в групповых
+ * комнатах) и хранение истории.
+ *
+ * Сервер работает в N потоках-реакторах (шардах). У каждого шарда свой
+ * слушающий сокет на общем порту (SO_REUSEPORT: ядро распределяет новые
+ * соединения между шардами), свой цикл событий и своя часть клиентов.
+ * Состояние клиента меняет только поток его шарда; сообщение, запрос
+ * /connect или /vote собеседнику с другого шарда передаётся задачей
+ * через входящий ящик шарда (ShardInbox). Общие только таблица
+ * Telegram ID -> UserId (user_ids) и справочник "UserId -> шард, сокет,
+ * соединение". Состояние клиентов хранит номера UserId вместо строк
+ * и лежит в плоской таблице по дескриптору сокета (FdTable).
+ *
+ * Сообщение в комнату сериализуется один раз в общий буфер; в очереди
+ * участников попадают ссылки на него, а в каждый шард с участниками
+ * уходит одна задача рассылки.
+ *
+ * Новую версию сервера можно запустить без разрыва соединений
+ * (--takeover): прежний процесс передаёт ей слушающие и клиентские
+ * сокеты через Unix-сокет (SCM_RIGHTS) вместе с состоянием сессий.
+ *
+ * Всё, что имеет срок, обслуживает колесо таймеров шарда (TimerWheel):
+ * время жизни кода авторизации, ожидание ответа на /connect и отключение
+ * клиентов, от которых давно ничего не приходило.
+ *
+ * Метрики (число клиентов, задержка пересылки, время записи истории
+ * и отправки кодов, глубина очередей) доступны командой консоли /stats
+ * и в формате Prometheus на отдельном локальном порту (--metrics-port).
+ */
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "telegram_auth.h"
+
+#include "auth_delivery.h"
+#include "buffer_pool.h"
+#include "commands.h"
+#include "event_loop.h"
+#include "fd_table.h"
+#include "handoff.h"
+#include "history.h"
+#include "message_format.h"
+#include "metrics.h"
+#include "rooms.h"
+#include "search_index.h"
+#include "shard_inbox.h"
+#include "socket_utils.h"
+#include "timer_wheel.h"
+#include "user_ids.h"
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <latch>
+#include <map>
+#include <optional>
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// Порт, на котором слушает сервер по умолчанию (--port).
+constexpr int PORT = 9090;
+/// Локальный порт метрик Prometheus по умолчанию (--metrics-port).
+constexpr int METRICS_PORT = 9091;
+
+/**
+ * @brief Поведение сервера при переполнении очереди исходящих данных клиента.
+ */
+enum class SlowClientPolicy {
+	Disconnect,  ///< Отключить клиента, который не успевает принимать данные.
+	Drop         ///< Отбрасывать новые сообщения, пока очередь не освободится.
+};
+
+/// Порог очереди исходящих данных одного клиента (байт), задаётся --max-queue.
+static size_t max_queue_bytes = 4 * 1024 * 1024;
+/// Реакция на превышение порога, задаётся --slow-policy.
+static SlowClientPolicy slow_client_policy = SlowClientPolicy::Disconnect;
+/// Максимум кодов авторизации, ожидающих отправки в Telegram.
+constexpr size_t AUTH_QUEUE_LIMIT = 1024;
+/// Сколько последних сообщений истории показывается при установке соединения.
+constexpr uint64_t HISTORY_ON_CONNECT = 50;
+/// Максимум сообщений, запрашиваемых одной командой /history.
+constexpr uint64_t HISTORY_PAGE_LIMIT = 500;
+/// Сколько последних совпадений показывает /search.
+constexpr size_t SEARCH_RESULT_LIMIT = 20;
+/// Время жизни отправленного кода авторизации, задаётся --code-ttl (0 — бессрочно).
+static std::chrono::seconds auth_code_ttl{300};
+/// Сколько адресат /connect может не отвечать на запрос, задаётся --connect-timeout (0 — без ограничения).
+static std::chrono::seconds connect_request_timeout{60};
+/// Отключение невошедшего клиента, от которого столько не приходило данных, задаётся --idle-timeout
+/// (0 — не отключать). Вошедший пользователь может просто читать переписку и по простою не отключается.
+static std::chrono::seconds idle_timeout{1800};
+/// Unix-сокет горячего перезапуска, задаётся --handoff-socket ("none" — не слушать).
+static std::string handoff_socket_path = "SERVER_SETTINGS/handoff.sock";
+/// Сколько ждать подтверждения от нового процесса, прежде чем продолжить работу.
+constexpr int HANDOFF_ACK_TIMEOUT_SEC = 10;
+/// Регистрация клиентского сокета: цикл io_uring сам принимает данные, остальные сообщают о готовности.
+constexpr uint32_t CLIENT_EVENTS = LOOP_READ | LOOP_EDGE | LOOP_RECV;
+
+/**
+ * @struct ClientInfo
+ * @brief Информация о подключенном клиенте.
+ *
+ * @var ClientInfo::fd
+ * Дескриптор сокета клиента.
+ * @var ClientInfo::id
+ * Номер пользователя (интернированный Telegram ID) клиента.
+ * @var ClientInfo::connected_to
+ * Собеседник (NO_USER, если беседы нет).
+ * @var ClientInfo::is_speaking
+ * Флаг права голоса (кто может отправлять сообщения).
+ * @var ClientInfo::pending_request_from
+ * Клиент, ожидающий подтверждения соединения (NO_USER, если запроса нет).
+ * @var ClientInfo::partner
+ * Адрес собеседника; если не заполнен, ищется в справочнике по connected_to.
+ * @var ClientInfo::room
+ * Имя групповой комнаты, в которой состоит клиент (пусто, если нет).
+ * @var ClientInfo::request_timer
+ * Таймер истечения запроса pending_request_from.
+ */
+struct ClientInfo {
+	int fd = -1;
+	UserId id = NO_USER;
+	UserId connected_to = NO_USER;
+	bool is_speaking = false;
+	UserId pending_request_from = NO_USER;
+	std::optional<ClientRef> partner{};
+	std::string room{};
+	TimerId request_timer = NO_TIMER;
+};
+
+/// Таблица: дескриптор сокета -> информация о клиенте (клиенты своего шарда).
+static thread_local FdTable<ClientInfo> clients;
+/// Карта: дескриптор сокета -> Telegram ID (ожидающие код).
+static thread_local std::unordered_map<int, std::string> pending_auth;
+/**
+ * @struct Connection
+ * @brief Транспортное состояние открытого клиентского сокета.
+ *
+ * Создаётся при accept() для любого клиента, в том числе ещё
+ * не авторизованного, и удаляется в disconnect_client().
+ *
+ * @var Connection::in
+ * Буфер входящих данных с незавершённой строкой.
+ * @var Connection::out
+ * Очередь исходящих данных, отправляемая по готовности сокета к записи.
+ * @var Connection::dirty
+ * Соединение уже стоит в dirty_fds и будет отправлено в конце итерации цикла.
+ * @var Connection::want_write
+ * В цикле событий включено ожидание готовности к записи.
+ * @var Connection::closing
+ * Клиент превысил max_queue_bytes и будет отключён в конце итерации цикла.
+ * @var Connection::id
+ * Уникальный номер соединения (fd может быть переиспользован после закрытия).
+ * @var Connection::auth_in_flight
+ * Код авторизации отправляется в Telegram, ответ ещё не получен.
+ * @var Connection::binary
+ * Клиент перешёл на двоичный протокол (кадры вместо строк и "*ENDM*").
+ * @var Connection::reported_queue
+ * Объём очереди, уже учтённый в метрике messenger_outbound_queued_bytes.
+ * @var Connection::last_active
+ * Момент последнего чтения из сокета.
+ * @var Connection::idle_timer
+ * Таймер проверки простоя (NO_TIMER, если отключение по простою выключено).
+ */
+struct Connection {
+	LineBuffer in;
+	OutputQueue out;
+	bool dirty = false;
+	bool want_write = false;
+	bool closing = false;
+	uint64_t id = 0;
+	bool auth_in_flight = false;
+	bool binary = false;
+	size_t reported_queue = 0;
+	std::chrono::steady_clock::time_point last_active;
+	TimerId idle_timer = NO_TIMER;
+};
+
+/// Карта: дескриптор сокета -> транспортное состояние (все открытые сокеты шарда).
+static thread_local std::unordered_map<int, Connection> connections;
+/// Сокеты, в очереди которых появились данные за текущую итерацию цикла.
+static thread_local std::vector<int> dirty_fds;
+/// Номер, который получит следующее принятое соединение (общий для всех шардов).
+static std::atomic<uint64_t> next_connection_id{1};
+/// Момент последнего чтения из сокета клиента (начало отсчёта задержки пересылки).
+static thread_local std::chrono::steady_clock::time_point last_read_time;
+
+/// Метрики сервера (общие для всех шардов).
+static MetricsRegistry metrics;
+static Gauge& connections_gauge = metrics.gauge("messenger_connections", "Open client connections");
+static Gauge& authorized_gauge = metrics.gauge("messenger_clients_authorized", "Logged in clients");
+static Gauge& pending_auth_gauge =
+    metrics.gauge("messenger_clients_pending_auth", "Clients waiting to enter a Telegram code");
+static Gauge& queued_bytes_gauge =
+    metrics.gauge("messenger_outbound_queued_bytes", "Bytes waiting in client output queues");
+static Counter& accepted_counter =
+    metrics.counter("messenger_connections_accepted_total", "Accepted client connections");
+static Counter& logins_counter = metrics.counter("messenger_logins_total", "Successful logins");
+static Counter& relayed_counter =
+    metrics.counter("messenger_messages_relayed_total", "Chat messages relayed to a partner");
+static Counter& dropped_counter =
+    metrics.counter("messenger_outbound_dropped_total", "Messages dropped for slow clients");
+static Histogram& relay_latency_us =
+    metrics.histogram("messenger_relay_latency_us", "From socket read to partner's output queue");
+static Histogram& history_append_us =
+    metrics.histogram("messenger_history_append_us", "Duration of one history batch append to the log");
+static Histogram& search_us = metrics.histogram("messenger_search_us", "/search duration");
+static Histogram& telegram_send_us =
+    metrics.histogram("messenger_telegram_send_us", "Telegram sendMessage round trip");
+static Gauge& handoff_pause_us =
+    metrics.gauge("messenger_handoff_pause_us", "Service pause of the hot restart that started this process");
+static Histogram& queue_depth_bytes =
+    metrics.histogram("messenger_outbound_queue_bytes", "Client output queue size before each flush");
+static Counter& history_reclaimed_counter =
+    metrics.counter("messenger_history_reclaimed_bytes_total", "History bytes freed by the retention policy");
+static Counter& history_segments_counter =
+    metrics.counter("messenger_history_segments_deleted_total", "History segments deleted by retention");
+static Histogram& history_compaction_us =
+    metrics.histogram("messenger_history_compaction_us", "Retention pass duration");
+static Gauge& history_bytes_gauge =
+    metrics.gauge("messenger_history_bytes", "History size on disk after the last retention pass");
+/// Пул доставки кодов авторизации шарда (создаётся в main()).
+static thread_local std::unique_ptr<AuthDelivery> auth_delivery;
+
+/**
+ * @struct Shard
+ * @brief Поток-реактор со своим слушающим сокетом и циклом событий.
+ *
+ * @var Shard::listener
+ * Слушающий сокет шарда (SO_REUSEPORT на общем порту).
+ * @var Shard::loop
+ * Цикл событий шарда.
+ * @var Shard::inbox
+ * Задачи от других потоков.
+ * @var Shard::auth
+ * Пул доставки кодов; передаётся в auth_delivery потока шарда.
+ * @var Shard::thread
+ * Поток шарда.
+ */
+struct Shard {
+	int listener = -1;
+	std::unique_ptr<EventLoop> loop;
+	ShardInbox inbox;
+	std::unique_ptr<AuthDelivery> auth;
+	std::thread thread;
+};
+
+/// Все шарды сервера; заполняется в main() до запуска потоков и далее не меняется.
+static std::vector<std::unique_ptr<Shard>> shards;
+/// Номер шарда текущего потока (0 — однопоточный режим и тесты).
+static thread_local size_t shard_index = 0;
+/// Поток шарда продолжает работу, пока флаг не сброшен задачей /shutdown.
+static thread_local bool shard_running = true;
+
+/// Номера пользователей всех шардов: Telegram ID <-> UserId.
+static UserIdTable user_ids;
+/// Справочник авторизованных клиентов всех шардов: UserId -> адрес (fd == -1 — не в сети).
+static std::vector<ClientRef> directory;
+/// Защищает directory: читают все шарды, пишут при входе и отключении.
+static std::shared_mutex directory_mutex;
+/// Групповые комнаты всех шардов.
+static RoomRegistry rooms;
+/// Метка текущей минуты шарда; обновляется циклом событий (run_shard()).
+static thread_local TimestampCache timestamp_cache;
+/// Таймеры шарда; выполняются циклом событий (run_shard()).
+static thread_local TimerWheel timers;
+
+/**
+ * @brief Получить текущую дату и время.
+ *
+ * Возвращает метку в формате "YYYY-MM-DD HH:MM" из кэша шарда,
+ * без обращения к localtime_r() на каждое сообщение.
+ *
+ * @return Форматированная метка времени.
+ */
+const std::string& get_timestamp() {
+	return timestamp_cache.current();
+}
+
+/**
+ * @brief Проверить, помещаются ли @p len байт в очередь отправки клиента.
+ *
+ * Если очередь превысила бы max_queue_bytes, сообщение отбрасывается
+ * либо клиент помечается на отключение — в зависимости от
+ * slow_client_policy. Соединение помечается для отправки в конце
+ * текущей итерации цикла событий.
+ *
+ * @param fd  Дескриптор сокета получателя.
+ * @param len Размер сообщения.
+ * @return Соединение, в очередь которого можно добавить сообщение;
+ *         nullptr, если сообщение нужно отбросить.
+ */
+Connection* admit_output(int fd, size_t len) {
+	auto it = connections.find(fd);
+	if (it == connections.end() || it->second.closing)
+		return nullptr;
+	Connection& conn = it->second;
+
+	bool fits = conn.out.size() + len <= max_queue_bytes;
+	if (!fits && slow_client_policy == SlowClientPolicy::Drop) {
+		conn.out.count_drop();
+		dropped_counter.add();
+		return nullptr;
+	}
+	if (!fits) {
+		std::cout << "Client fd " << fd << " exceeded output queue limit (" << conn.out.size()
+		          << " bytes queued), disconnecting\n";
+		conn.closing = true;
+	}
+
+	if (!conn.dirty) {
+		conn.dirty = true;
+		dirty_fds.push_back(fd);
+	}
+	return fits ? &conn : nullptr;
+}
+
+/**
+ * @brief Поставить готовые байты в очередь отправки клиента как есть.
+ *
+ * @param fd   Дескриптор сокета получателя.
+ * @param data Данные в формате протокола клиента.
+ */
+void queue_raw(int fd, std::string data) {
+	if (Connection* conn = admit_output(fd, data.size()))
+		conn->out.push(std::move(data));
+}
+
+/**
+ * @brief Использует ли клиент двоичный протокол.
+ *
+ * @param fd Дескриптор сокета клиента.
+ */
+bool is_binary(int fd) {
+	auto it = connections.find(fd);
+	return it != connections.end() && it->second.binary;
+}
+
+/**
+ * @brief Поставить данные в очередь отправки клиента.
+ *
+ * Данные будут переданы в конце текущей итерации цикла событий
+ * (или позже, когда сокет станет доступен для записи). Клиенту
+ * с двоичным протоколом данные уходят кадром FrameType::Text.
+ *
+ * @param fd   Дескриптор сокета получателя.
+ * @param data Данные для отправки.
+ */
+void queue_all(int fd, std::string data) {
+	if (is_binary(fd))
+		data = encode_frame(FrameType::Text, data);
+	queue_raw(fd, std::move(data));
+}
+
+/**
+ * @brief Поставить в очередь пакет с маркером конца сообщения.
+ *
+ * Добавляет '\n' при необходимости и маркер "*ENDM*\n"
+ * (в двоичном протоколе — кадр FrameType::End).
+ *
+ * @param fd      Дескриптор сокета получателя.
+ * @param message Текст сообщения.
+ */
+void queue_packet(int fd, std::string message) {
+	if (message.empty() || message.back() != '\n')
+		message.push_back('\n');
+	if (is_binary(fd)) {
+		std::string frames = encode_frame(FrameType::Text, message);
+		append_frame_header(frames, FrameType::End, 0);
+		queue_raw(fd, std::move(frames));
+		return;
+	}
+	message += "*ENDM*\n";
+	queue_raw(fd, std::move(message));
+}
+
+/**
+ * @brief Поставить в очередь пакет с неизменяемым текстом без копирования.
+ *
+ * Как queue_packet(), но текст не копируется: в очередь ставится ссылка
+ * на него. Заголовки кадров двоичного протокола умещаются в короткую
+ * строку и тоже не выделяют памяти.
+ *
+ * @param fd   Дескриптор сокета получателя.
+ * @param text Текст со статическим временем жизни, оканчивающийся '\n'
+ *             (строковый литерал или текст из таблицы команд).
+ */
+void queue_static_packet(int fd, std::string_view text) {
+	static constexpr std::string_view END_LINE = "*ENDM*\n";
+	bool binary = is_binary(fd);
+	std::string header, end;
+	if (binary) {
+		append_frame_header(header, FrameType::Text, text.size());
+		append_frame_header(end, FrameType::End, 0);
+	}
+	Connection* conn =
+	    admit_output(fd, binary ? header.size() + text.size() + end.size() : text.size() + END_LINE.size());
+	if (!conn)
+		return;
+	if (!binary) {
+		conn->out.push_static(text);
+		conn->out.push_static(END_LINE);
+		return;
+	}
+	conn->out.push(std::move(header));
+	conn->out.push_static(text);
+	conn->out.push(std::move(end));
+}
+
+/**
+ * @brief Telegram ID пользователя по его номеру.
+ *
+ * @param id Номер пользователя.
+ */
+const std::string& user_name(UserId id) {
+	return user_ids.name(id);
+}
+
+/**
+ * @brief Зарегистрировать авторизованного клиента в справочнике.
+ *
+ * @param id  Номер пользователя.
+ * @param ref Адрес клиента.
+ * @return Адрес предыдущего входа с тем же ID, если он был.
+ */
+std::optional<ClientRef> register_client(UserId id, ClientRef ref) {
+	std::unique_lock<std::shared_mutex> lock(directory_mutex);
+	if (id >= directory.size())
+		directory.resize(static_cast<size_t>(id) + 1);
+	ClientRef previous = directory[id];
+	directory[id] = ref;
+	if (previous.fd == -1)
+		return std::nullopt;
+	return previous;
+}
+
+/**
+ * @brief Удалить клиента из справочника.
+ *
+ * Запись удаляется, только если она всё ещё указывает на @p ref:
+ * повторный вход мог уже заменить её новым соединением.
+ *
+ * @param id  Номер пользователя.
+ * @param ref Адрес отключаемого клиента.
+ */
+void unregister_client(UserId id, const ClientRef& ref) {
+	std::unique_lock<std::shared_mutex> lock(directory_mutex);
+	if (id < directory.size() && directory[id] == ref)
+		directory[id] = ClientRef{};
+}
+
+/**
+ * @brief Найти авторизованного клиента по номеру пользователя.
+ *
+ * @param id Номер пользователя (NO_USER допустим).
+ * @return Адрес клиента или std::nullopt, если клиент не в сети.
+ */
+std::optional<ClientRef> find_client(UserId id) {
+	std::shared_lock<std::shared_mutex> lock(directory_mutex);
+	if (id >= directory.size() || directory[id].fd == -1)
+		return std::nullopt;
+	return directory[id];
+}
+
+/**
+ * @brief Адрес клиента своего шарда по дескриптору сокета.
+ *
+ * @param fd Дескриптор сокета клиента.
+ */
+ClientRef local_ref(int fd) {
+	auto it = connections.find(fd);
+	return ClientRef{shard_index, fd, it != connections.end() ? it->second.id : 0};
+}
+
+/**
+ * @brief Адрес собеседника клиента.
+ *
+ * Берётся из ClientInfo::partner, а если он не заполнен — из справочника
+ * по connected_to (с запоминанием).
+ *
+ * @param client Клиент своего шарда.
+ * @return Адрес собеседника или std::nullopt, если беседы нет или он не в сети.
+ */
+std::optional<ClientRef> partner_of(ClientInfo& client) {
+	if (client.connected_to == NO_USER)
+		return std::nullopt;
+	if (!client.partner)
+		client.partner = find_client(client.connected_to);
+	return client.partner;
+}
+
+/**
+ * @brief Выполнить задачу в потоке шарда @p shard.
+ *
+ * Задача для своего шарда (и в однопоточном режиме) выполняется сразу,
+ * без обёртки, для чужого — ставится в его входящий ящик (PooledTask
+ * в блоке пула, поэтому замыкание может быть некопируемым).
+ *
+ * @param shard Номер шарда.
+ * @param task  Задача.
+ */
+template <typename Task>
+void run_on_shard(size_t shard, Task&& task) {
+	if (shard == shard_index || shard >= shards.size())
+		task();
+	else
+		shards[shard]->inbox.post(std::forward<Task>(task));
+}
+
+/**
+ * @brief Выполнить действие над клиентом в потоке его шарда.
+ *
+ * Если к моменту выполнения клиент уже отключился (или fd занят
+ * новым соединением), вместо @p action в исходном шарде выполняется
+ * @p missing.
+ *
+ * @param ref     Адрес клиента.
+ * @param action  Действие над ClientInfo клиента.
+ * @param missing Действие, если клиента больше нет (может быть пустым).
+ */
+template <typename Action>
+void with_client(const ClientRef& ref, Action&& action, std::function<void()> missing = {}) {
+	size_t origin = shard_index;
+	run_on_shard(ref.shard, [ref, origin, action = std::forward<Action>(action),
+	                         missing = std::move(missing)]() mutable {
+		auto conn = connections.find(ref.fd);
+		ClientInfo* client = clients.find(ref.fd);
+		if (conn != connections.end() && conn->second.id == ref.conn && client != nullptr) {
+			action(*client);
+			return;
+		}
+		if (missing)
+			run_on_shard(origin, std::move(missing));
+	});
+}
+
+/**
+ * @brief Поставить пакет в очередь клиента любого шарда.
+ *
+ * @param ref     Адрес получателя.
+ * @param message Текст сообщения.
+ */
+void queue_packet_to(const ClientRef& ref, std::string message) {
+	with_client(ref, [message = std::move(message)](ClientInfo& c) { queue_packet(c.fd, message); });
+}
+
+/**
+ * @brief Завершить беседу у собеседника, если он всё ещё говорит с @p id.
+ *
+ * @param partner Адрес собеседника.
+ * @param id      Номер клиента, покидающего беседу.
+ * @param notice  Уведомление собеседнику.
+ */
+void end_conversation_at(const ClientRef& partner, UserId id, const std::string& notice) {
+	with_client(partner, [id, notice](ClientInfo& c) {
+		if (c.connected_to != id)
+			return;
+		c.connected_to = NO_USER;
+		c.partner.reset();
+		c.is_speaking = false;
+		queue_packet(c.fd, notice);
+	});
+}
+
+/**
+ * @struct FanoutBuffer
+ * @brief Сообщение, сериализованное один раз для рассылки многим получателям.
+ *
+ * В буфере пула подряд лежат заголовок кадра FrameType::Text, текст и, для
+ * пакета, маркер "*ENDM*\n" и кадр FrameType::End. Клиентам с текстовым
+ * и двоичным протоколом ставятся в очередь ссылки на разные части
+ * одного буфера. Перемещаемый; ссылку для другого шарда даёт share().
+ */
+struct FanoutBuffer {
+	PooledBuffer data;
+	size_t header = 0;  ///< Длина заголовка кадра.
+	size_t text = 0;    ///< Длина текста.
+	bool packet = false;
+
+	FanoutBuffer share() const { return FanoutBuffer{data.share(), header, text, packet}; }
+	/// Текст сообщения без заголовка кадра и маркера.
+	std::string_view text_view() const { return data.view().substr(header, text); }
+};
+
+/**
+ * @brief Сериализовать сообщение для рассылки.
+ *
+ * @param text   Текст сообщения.
+ * @param packet Завершить маркером конца сообщения (как queue_packet()).
+ */
+FanoutBuffer make_fanout(std::string text, bool packet) {
+	if (packet && (text.empty() || text.back() != '\n'))
+		text.push_back('\n');
+	FanoutBuffer buf;
+	buf.data = PooledBuffer(text.size() + 2 * FRAME_HEADER_MAX + END_MARKER.size() + 1);
+	append_frame_header(buf.data, FrameType::Text, text.size());
+	buf.header = buf.data.size();
+	buf.text = text.size();
+	buf.packet = packet;
+	buf.data.append(text);
+	if (packet) {
+		buf.data.append(END_MARKER);
+		buf.data.push_back('\n');
+		append_frame_header(buf.data, FrameType::End, 0);
+	}
+	return buf;
+}
+
+/**
+ * @brief Сериализовать строку чата для рассылки без промежуточных строк.
+ *
+ * Строка "[метка] отправитель@комната: текст\n" пишется прямо в буфер
+ * пула после заголовка кадра. Тот же буфер уходит и в историю, поэтому
+ * сообщение выделяется один раз.
+ *
+ * @param sender Telegram ID отправителя.
+ * @param room   Имя комнаты; пустое — личная беседа.
+ * @param msg    Текст сообщения.
+ */
+FanoutBuffer make_chat_fanout(std::string_view sender, std::string_view room, std::string_view msg) {
+	const std::string& timestamp = get_timestamp();
+	size_t len = chat_line_size(timestamp, sender, room, msg);
+	FanoutBuffer buf;
+	buf.data = PooledBuffer(FRAME_HEADER_MAX + len);
+	append_frame_header(buf.data, FrameType::Text, len);
+	buf.header = buf.data.size();
+	buf.text = len;
+	append_chat_line(buf.data, timestamp, sender, room, msg);
+	return buf;
+}
+
+/**
+ * @brief Поставить в очередь клиента ссылку на общий буфер рассылки.
+ *
+ * @param fd  Дескриптор сокета получателя.
+ * @param buf Сообщение.
+ */
+void queue_fanout(int fd, const FanoutBuffer& buf) {
+	std::string_view all = buf.data.view();
+	size_t marker = buf.packet ? END_MARKER.size() + 1 : 0;
+	bool binary = is_binary(fd);
+	Connection* conn = admit_output(fd, binary ? all.size() - marker : buf.text + marker);
+	if (!conn)
+		return;
+	if (!binary) {
+		conn->out.push_lease(buf.data.share().lease(), all.substr(buf.header, buf.text + marker));
+		return;
+	}
+	conn->out.push_lease(buf.data.share().lease(), all.substr(0, buf.header + buf.text));
+	conn->out.push_lease(buf.data.share().lease(), all.substr(buf.header + buf.text + marker));
+}
+
+/**
+ * @brief Разослать сообщение участникам комнаты.
+ *
+ * В каждый шард с участниками уходит одна задача, которая ставит ссылки
+ * на общий буфер в очереди его участников. Участники, успевшие
+ * отключиться или выйти из комнаты, пропускаются.
+ *
+ * @param roster   Состав комнаты.
+ * @param buf      Сообщение.
+ * @param except   Кому не отправлять (обычно отправителю).
+ * @param received Момент чтения сообщения беседы (для метрики задержки пересылки).
+ */
+void broadcast_to_room(const std::shared_ptr<const RoomRoster>& roster, const FanoutBuffer& buf,
+                       const ClientRef& except = {},
+                       std::optional<std::chrono::steady_clock::time_point> received = std::nullopt) {
+	for (size_t shard : roster->shards) {
+		run_on_shard(shard, [roster, buf = buf.share(), except, received, shard] {
+			uint64_t queued = 0;
+			for (const RoomMember& m : roster->members) {
+				if (m.ref.shard != shard || m.ref == except)
+					continue;
+				auto conn = connections.find(m.ref.fd);
+				const ClientInfo* client = clients.find(m.ref.fd);
+				if (conn == connections.end() || conn->second.id != m.ref.conn || client == nullptr ||
+				    client->room != roster->name)
+					continue;
+				queue_fanout(m.ref.fd, buf);
+				++queued;
+			}
+			if (!received || queued == 0)
+				return;
+			relayed_counter.add(queued);
+			auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+			    std::chrono::steady_clock::now() - *received);
+			relay_latency_us.record(latency.count());
+		});
+	}
+}
+
+/**
+ * @brief Сообщить участнику комнаты, что право голоса перешло к нему.
+ *
+ * @param speaker Новый говорящий.
+ * @param room    Имя комнаты.
+ */
+void notify_room_speaker(const RoomMember& speaker, const std::string& room) {
+	with_client(speaker.ref, [room](ClientInfo& c) {
+		if (c.room == room)
+			queue_packet(c.fd, "You are now speaking.\n");
+	});
+}
+
+/**
+ * @brief Вывести клиента из его комнаты и уведомить остальных участников.
+ *
+ * @param fd   Дескриптор сокета клиента.
+ * @param self Клиент своего шарда, состоящий в комнате.
+ */
+void leave_room(int fd, ClientInfo& self) {
+	RoomUpdate update = rooms.leave(self.room, local_ref(fd));
+	if (update.roster)
+		broadcast_to_room(update.roster,
+		                  make_fanout("\nUser '" + user_name(self.id) + "' left the room.\n", true));
+	if (update.speaker)
+		notify_room_speaker(*update.speaker, self.room);
+	self.room.clear();
+}
+
+/**
+ * @brief Обработать команду /room.
+ *
+ * Поддерживаемые формы:
+ *  - /room create <имя> — создать комнату и стать её говорящим;
+ *  - /room join <имя>   — войти в комнату слушателем;
+ *  - /room leave        — выйти из комнаты.
+ *
+ * @param fd   Дескриптор сокета отправителя.
+ * @param args Аргументы команды.
+ */
+void handle_room_command(int fd, std::string_view args) {
+	ClientInfo& self = clients[fd];
+	std::istringstream in{std::string(args)};
+	std::string action, name;
+	in >> action >> name;
+
+	if (action == "leave") {
+		if (self.room.empty()) {
+			queue_packet(fd, "You are not in a room.\n");
+			return;
+		}
+		leave_room(fd, self);
+		queue_packet(fd, "You have left the room.\n");
+		return;
+	}
+	if ((action != "create" && action != "join") || name.empty()) {
+		queue_packet(fd, "Usage: /room create <name>, /room join <name>, /room leave\n");
+		return;
+	}
+	if (!self.room.empty() || self.connected_to != NO_USER) {
+		queue_packet(fd, "Leave the current conversation first.\n");
+		return;
+	}
+
+	RoomMember member{self.id, local_ref(fd)};
+	if (action == "create") {
+		if (!rooms.create(name, member)) {
+			queue_packet(fd, "Room '" + name + "' already exists.\n");
+			return;
+		}
+		self.room = name;
+		queue_packet(fd, "Room '" + name + "' created. You are now speaking.\n");
+		return;
+	}
+
+	std::shared_ptr<const RoomRoster> roster = rooms.join(name, member);
+	if (!roster) {
+		queue_packet(fd, "Room not found.\n");
+		return;
+	}
+	self.room = name;
+	queue_packet(fd, "Joined room '" + name + "' (" + std::to_string(roster->members.size()) +
+	                     " members). You are a listener.\n");
+	std::string notice = "\nUser '" + user_name(self.id) + "' joined the room.\n";
+	broadcast_to_room(roster, make_fanout(std::move(notice), true), member.ref);
+}
+
+/**
+ * @brief Вывести клиенту список комнат (/rooms).
+ *
+ * @param fd Дескриптор сокета клиента.
+ */
+void handle_rooms_list(int fd) {
+	std::vector<std::pair<std::string, size_t>> list = rooms.list();
+	if (list.empty()) {
+		queue_packet(fd, "No rooms. Use /room create <name>\n");
+		return;
+	}
+	std::string out = "Rooms:\n";
+	for (const auto& [name, members] : list)
+		out += "  " + name + " (" + std::to_string(members) + " members)\n";
+	queue_packet(fd, out);
+}
+
+/**
+ * @brief Отправить сообщение говорящего всем участникам его комнаты.
+ *
+ * @param fd  Дескриптор сокета отправителя.
+ * @param msg Текст сообщения.
+ */
+void relay_to_room(int fd, const std::string& msg) {
+	ClientInfo& self = clients[fd];
+	ClientRef ref = local_ref(fd);
+	std::shared_ptr<const RoomRoster> roster = rooms.speaker_roster(self.room, ref);
+	if (!roster) {
+		queue_all(fd, "You cannot send messages unless you're the current speaker.\n");
+		return;
+	}
+	broadcast_to_room(roster, make_chat_fanout(user_name(self.id), self.room, msg), ref, last_read_time);
+}
+
+/**
+ * @brief Отключить клиента и очистить его данные.
+ *
+ * Завершает соединение, удаляет из наборов клиентов,
+ * уведомляет партнера беседы. Работает и для неавторизованных
+ * сокетов (в том числе ожидающих код).
+ *
+ * @param fd Дескриптор сокета клиента для отключения.
+ * @param loop Цикл событий, с которого снимается дескриптор.
+ */
+void disconnect_client(int fd, EventLoop& loop) {
+	if (ClientInfo* client = clients.find(fd)) {
+		ClientInfo& info = *client;
+		std::cout << "\nDisconnecting client: " << user_name(info.id) << " (fd: " << fd << ")\n";
+
+		if (std::optional<ClientRef> partner = partner_of(info))
+			end_conversation_at(*partner, info.id, "\nYour conversation partner has left the chat.\n");
+		if (!info.room.empty())
+			leave_room(fd, info);
+
+		unregister_client(info.id, local_ref(fd));
+		timers.cancel(info.request_timer);
+		clients.erase(fd);
+		authorized_gauge.sub(1);
+	}
+
+	if (pending_auth.erase(fd) > 0)
+		pending_auth_gauge.sub(1);
+	auto it = connections.find(fd);
+	if (it != connections.end()) {
+		timers.cancel(it->second.idle_timer);
+		it->second.out.flush(fd);  // без ожидания: что успело уйти в ядро
+		queued_bytes_gauge.sub(static_cast<int64_t>(it->second.reported_queue));
+		connections.erase(it);
+		connections_gauge.sub(1);
+		loop.remove(fd);
+		close(fd);
+	}
+}
+
+void check_idle_client(int fd, EventLoop& loop);
+
+/**
+ * @brief Поставить таймер проверки простоя соединения.
+ *
+ * Чтение из сокета таймер не переставляет: при срабатывании
+ * check_idle_client() сам досчитывает остаток, если клиент был активен.
+ *
+ * @param fd    Дескриптор клиентского сокета.
+ * @param conn  Его соединение.
+ * @param delay Через сколько проверить.
+ * @param loop  Цикл событий шарда.
+ */
+void schedule_idle_check(int fd, Connection& conn, std::chrono::steady_clock::duration delay,
+                         EventLoop& loop) {
+	if (idle_timeout.count() == 0)
+		return;
+	auto ms = std::chrono::ceil<std::chrono::milliseconds>(delay);
+	conn.idle_timer = timers.schedule(ms, [fd, &loop] { check_idle_client(fd, loop); });
+}
+
+/**
+ * @brief Отключить невошедшего клиента, если от него не было данных idle_timeout.
+ *
+ * Обработчик таймера простоя. Таймер отменяется в disconnect_client(),
+ * поэтому fd здесь всегда принадлежит тому же соединению. После входа
+ * проверки прекращаются: у клиента нет keepalive, а читающий пользователь
+ * ничего не отправляет.
+ *
+ * @param fd   Дескриптор клиентского сокета.
+ * @param loop Цикл событий шарда.
+ */
+void check_idle_client(int fd, EventLoop& loop) {
+	auto it = connections.find(fd);
+	if (it == connections.end())
+		return;
+	Connection& conn = it->second;
+	conn.idle_timer = NO_TIMER;
+	if (clients.contains(fd))
+		return;
+	auto idle = timers.now() - conn.last_active;
+	if (idle < idle_timeout) {
+		schedule_idle_check(fd, conn, idle_timeout - idle, loop);
+		return;
+	}
+	std::cout << "Idle client evicted, fd: " << fd << std::endl;
+	queue_packet(fd,
+	             "\nDisconnected: no activity for " + std::to_string(idle_timeout.count()) + " seconds.\n");
+	disconnect_client(fd, loop);
+}
+
+/**
+ * @brief Обновить метрику очереди и интерес к записи после отправки.
+ *
+ * Если ядро приняло не всё, в цикле событий включается ожидание
+ * готовности к записи; когда очередь опустела — выключается.
+ *
+ * @param fd   Дескриптор клиентского сокета.
+ * @param conn Его соединение.
+ * @param loop Цикл событий сервера.
+ */
+void update_write_interest(int fd, Connection& conn, EventLoop& loop) {
+	queued_bytes_gauge.add(static_cast<int64_t>(conn.out.size()) - static_cast<int64_t>(conn.reported_queue));
+	conn.reported_queue = conn.out.size();
+
+	bool want_write = !conn.out.empty();
+	if (want_write != conn.want_write) {
+		conn.want_write = want_write;
+		loop.modify(fd, CLIENT_EVENTS | (want_write ? LOOP_WRITE : 0));
+	}
+}
+
+/**
+ * @brief Отправить очередь клиента и обновить интерес к записи.
+ *
+ * Клиенты, помеченные на отключение, и разорванные соединения
+ * отключаются здесь.
+ *
+ * @param fd   Дескриптор клиентского сокета.
+ * @param loop Цикл событий сервера.
+ */
+void flush_client(int fd, EventLoop& loop) {
+	auto it = connections.find(fd);
+	if (it == connections.end())
+		return;
+	Connection& conn = it->second;
+	if (!conn.out.empty())
+		queue_depth_bytes.record(conn.out.size());
+	if (conn.closing || conn.out.flush(fd) == FlushStatus::Error) {
+		disconnect_client(fd, loop);
+		return;
+	}
+	update_write_interest(fd, conn, loop);
+}
+
+/**
+ * @brief Отправить очереди всех клиентов, получивших данные за итерацию.
+ *
+ * Вызывается один раз после обработки пачки событий, поэтому несколько
+ * сообщений одному клиенту уходят одним системным вызовом, а очереди
+ * всех клиентов — одним EventLoop::send_batch() (в цикле io_uring это
+ * один io_uring_enter на всю пачку).
+ *
+ * @param loop Цикл событий сервера.
+ */
+void flush_dirty_clients(EventLoop& loop) {
+	static thread_local std::vector<int> flushing;
+	static thread_local std::vector<LoopSend> sends;
+	static thread_local std::vector<iovec> iovs;
+	// disconnect_client() может добавить в dirty_fds уведомление собеседнику,
+	// а очередь длиннее IOV_BATCH буферов отправляется по частям: это следующие круги.
+	while (!dirty_fds.empty()) {
+		flushing.swap(dirty_fds);
+		dirty_fds.clear();
+		sends.clear();
+		size_t used = 0;
+		for (int fd : flushing) {
+			auto it = connections.find(fd);
+			if (it == connections.end())
+				continue;
+			Connection& conn = it->second;
+			conn.dirty = false;
+			if (conn.out.empty() || conn.closing)
+				continue;
+			queue_depth_bytes.record(conn.out.size());
+			iovs.resize(std::max(iovs.size(), used + OutputQueue::IOV_BATCH));
+			size_t count = conn.out.gather(iovs.data() + used, OutputQueue::IOV_BATCH);
+			sends.push_back({fd, nullptr, count});
+			used += count;
+		}
+		used = 0;
+		for (LoopSend& send : sends) {
+			send.iov = iovs.data() + used;
+			used += send.iovcnt;
+		}
+		loop.send_batch(sends);
+
+		size_t next = 0;
+		for (int fd : flushing) {
+			auto it = connections.find(fd);
+			if (it == connections.end())
+				continue;
+			Connection& conn = it->second;
+			if (conn.closing) {
+				disconnect_client(fd, loop);
+				continue;
+			}
+			if (next < sends.size() && sends[next].fd == fd) {
+				const LoopSend& send = sends[next++];
+				if (send.result < 0 && send.result != -EAGAIN && send.result != -EWOULDBLOCK &&
+				    send.result != -EINTR) {
+					disconnect_client(fd, loop);
+					continue;
+				}
+				if (send.result > 0) {
+					size_t offered = 0;
+					for (size_t i = 0; i < send.iovcnt; ++i)
+						offered += send.iov[i].iov_len;
+					conn.out.consume(static_cast<size_t>(send.result));
+					// Ядро приняло всё предложенное, но очередь не кончилась: дослать следующим кругом.
+					if (static_cast<size_t>(send.result) == offered && !conn.out.empty() && !conn.dirty) {
+						conn.dirty = true;
+						dirty_fds.push_back(fd);
+						continue;
+					}
+				}
+			}
+			update_write_interest(fd, conn, loop);
+		}
+	}
+	flushing.clear();
+}
+
+/**
+ * @brief Поставить фрагмент истории в очередь отправки клиента без копирования.
+ *
+ * Строки сообщений передаются ссылками на отображённый журнал, поэтому
+ * один и тот же фрагмент можно отправить обоим участникам беседы.
+ * В двоичном протоколе все строки уходят одним кадром FrameType::History.
+ * Если перед фрагментом есть более старые сообщения, добавляется
+ * подсказка, как запросить их командой /history.
+ *
+ * @param fd     Дескриптор сокета получателя.
+ * @param view   Фрагмент истории; пустой фрагмент не отправляется.
+ * @param packet Завершить фрагмент маркером "*ENDM*\n" (как queue_packet()).
+ */
+void queue_history(int fd, const HistoryView& view, bool packet) {
+	if (view.lines.empty())
+		return;
+	std::string header = "Chat history (" + std::to_string(view.first + 1) + "-" +
+	                     std::to_string(view.first + view.lines.size()) + " of " +
+	                     std::to_string(view.total) + "):\n";
+	std::string footer;
+	if (view.first > 0)
+		footer = "Older messages: /history " + std::to_string(HISTORY_ON_CONNECT) + " " +
+		         std::to_string(view.first) + "\n";
+
+	if (is_binary(fd)) {
+		header = encode_frame(FrameType::Text, header);
+		append_frame_header(header, FrameType::History, view.bytes);
+		footer = footer.empty() ? std::string() : encode_frame(FrameType::Text, footer);
+		if (packet)
+			append_frame_header(footer, FrameType::End, 0);
+	} else if (packet) {
+		footer += "*ENDM*\n";
+	}
+
+	Connection* conn = admit_output(fd, header.size() + view.bytes + footer.size());
+	if (conn == nullptr)
+		return;
+	conn->out.push(std::move(header));
+	std::shared_ptr<const void> owner = view.owner();
+	for (std::string_view line : view.lines)
+		conn->out.push_shared(owner, line);
+	conn->out.push(std::move(footer));
+}
+
+/**
+ * @brief Обработать команду /history [n] [before].
+ *
+ * Отправляет до n (по умолчанию HISTORY_ON_CONNECT) сообщений текущей
+ * беседы, предшествующих сообщению с номером before (по умолчанию —
+ * самые последние). Читается только запрошенный фрагмент журнала.
+ *
+ * @param fd   Дескриптор сокета отправителя.
+ * @param args Аргументы команды.
+ */
+void handle_history_command(int fd, std::string_view args) {
+	UserId partner = clients[fd].connected_to;
+	if (partner == NO_USER) {
+		queue_static_packet(fd, "You are not in a conversation.\n");
+		return;
+	}
+
+	std::istringstream in{std::string(args)};
+	uint64_t limit = HISTORY_ON_CONNECT;
+	uint64_t before = UINT64_MAX;
+	if (!(in >> limit))
+		limit = HISTORY_ON_CONNECT;
+	else if (!(in >> before))
+		before = UINT64_MAX;
+	if (limit == 0 || limit > HISTORY_PAGE_LIMIT) {
+		queue_packet(fd,
+		             "Usage: /history <n> [before], 1 <= n <= " + std::to_string(HISTORY_PAGE_LIMIT) + "\n");
+		return;
+	}
+
+	HistoryView view = map_history_page(user_name(clients[fd].id), user_name(partner), limit, before);
+	if (view.lines.empty()) {
+		queue_static_packet(fd, "No messages.\n");
+		return;
+	}
+	queue_history(fd, view, true);
+}
+
+/**
+ * @brief Обработать команду /search <слова>.
+ *
+ * Находит в истории текущей беседы сообщения, содержащие все слова,
+ * по поисковому индексу и отправляет последние SEARCH_RESULT_LIMIT из них
+ * с номерами, которые можно передать /history.
+ *
+ * @param fd   Дескриптор сокета отправителя.
+ * @param args Слова запроса.
+ */
+void handle_search_command(int fd, std::string_view args) {
+	UserId partner = clients[fd].connected_to;
+	if (partner == NO_USER) {
+		queue_static_packet(fd, "You are not in a conversation.\n");
+		return;
+	}
+	std::vector<std::string> words;
+	tokenize(args, words);
+	if (words.empty()) {
+		queue_static_packet(fd, "Usage: /search <words>\n");
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	HistoryMatches found =
+	    search_history(user_name(clients[fd].id), user_name(partner), args, SEARCH_RESULT_LIMIT);
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	search_us.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+	if (found.total == 0) {
+		queue_static_packet(fd, "No messages found.\n");
+		return;
+	}
+	std::string text = "Found " + std::to_string(found.total) + " message(s)";
+	if (found.total > found.records.size())
+		text += ", showing the last " + std::to_string(found.records.size());
+	text += ":\n";
+	for (size_t i = 0; i < found.records.size(); ++i)
+		text += "#" + std::to_string(found.records[i] + 1) + " " + found.lines[i];
+	queue_packet(fd, text);
+}
+
+/**
+ * @brief Снять запрос на беседу, оставшийся без ответа.
+ *
+ * Обработчик таймера, поставленного шардом адресата; отменяется,
+ * когда адресат отвечает или отключается.
+ *
+ * @param fd           Дескриптор сокета адресата.
+ * @param requester    Адрес отправителя запроса.
+ * @param requester_id Отправитель запроса.
+ */
+void expire_connect_request(int fd, const ClientRef& requester, UserId requester_id) {
+	ClientInfo* target = clients.find(fd);
+	if (target == nullptr || target->pending_request_from != requester_id)
+		return;
+	target->pending_request_from = NO_USER;
+	target->request_timer = NO_TIMER;
+	queue_packet(fd, "\nConnection request from '" + user_name(requester_id) + "' expired.\n");
+	queue_packet_to(requester, "User did not respond to your request.\n");
+}
+
+/**
+ * @brief Запомнить запрос на беседу у адресата и поставить таймер его истечения.
+ *
+ * @param target       Адресат (клиент своего шарда).
+ * @param requester    Адрес отправителя запроса.
+ * @param requester_id Отправитель запроса.
+ */
+void arm_connect_request(ClientInfo& target, const ClientRef& requester, UserId requester_id) {
+	target.pending_request_from = requester_id;
+	if (connect_request_timeout.count() == 0)
+		return;
+	int fd = target.fd;
+	target.request_timer = timers.schedule(connect_request_timeout, [=] {
+		expire_connect_request(fd, requester, requester_id);
+	});
+}
+
+/**
+ * @brief Обработать команду /connect <ID>: отправить запрос на беседу.
+ *
+ * Занятость проверяет шард адресата; ответ возвращается задачей
+ * в шард отправителя.
+ *
+ * @param fd Дескриптор сокета отправителя.
+ * @param id Telegram ID адресата.
+ */
+void handle_connect_command(int fd, std::string_view id) {
+	if (!clients[fd].room.empty()) {
+		queue_static_packet(fd, "Leave the room first.\n");
+		return;
+	}
+	std::optional<ClientRef> target = find_client(user_ids.find(id));
+	if (!target) {
+		queue_static_packet(fd, "User not found.\n");
+		return;
+	}
+
+	ClientRef requester = local_ref(fd);
+	UserId requester_id = clients[fd].id;
+	with_client(
+	    *target,
+	    [requester, requester_id](ClientInfo& t) {
+		    if (t.pending_request_from != NO_USER) {
+			    queue_packet_to(requester, "User is busy with another request.\n");
+			    return;
+		    }
+
+		    if (!t.room.empty()) {
+			    queue_packet_to(requester, "User is in a group room.\n");
+			    return;
+		    }
+
+		    if (t.connected_to != NO_USER) {
+			    const std::string notice = "\nUser '" + user_name(requester_id) +
+			                               "' attempted to connect to you, but you are "
+			                               "already in a conversation.\n";
+			    queue_packet(t.fd, notice);
+			    queue_packet_to(requester, "User is already connected.\n");
+			    return;
+		    }
+
+		    arm_connect_request(t, requester, requester_id);
+		    const std::string prompt =
+		        "\nUser '" + user_name(requester_id) + "' wants to connect. Accept? (yes/no)\n";
+		    queue_packet(t.fd, prompt);
+	    },
+	    [requester] { queue_packet_to(requester, "User not found.\n"); });
+}
+
+/**
+ * @brief Обработать команду /vote: передать право голоса.
+ *
+ * В комнате право переходит к следующему участнику, в беседе — собеседнику.
+ *
+ * @param fd Дескриптор сокета отправителя.
+ */
+void handle_vote_command(int fd) {
+	ClientInfo& self = clients[fd];
+	if (!self.room.empty()) {
+		if (!rooms.speaker_roster(self.room, local_ref(fd))) {
+			queue_static_packet(fd, "You are not the current speaker.\n");
+		} else if (std::optional<RoomMember> next = rooms.pass_speaker(self.room, local_ref(fd))) {
+			queue_all(fd, "You passed the microphone.\n");
+			notify_room_speaker(*next, self.room);
+		} else {
+			queue_static_packet(fd, "No other members to pass speaking right.\n");
+		}
+	} else if (self.is_speaking) {
+		if (std::optional<ClientRef> partner = partner_of(self)) {
+			self.is_speaking = false;
+			queue_all(fd, "You passed the microphone.\n");
+			with_client(*partner, [id = self.id](ClientInfo& p) {
+				if (p.connected_to != id)
+					return;
+				p.is_speaking = true;
+				queue_static_packet(p.fd, "You are now speaking.\n");
+			});
+		} else {
+			queue_static_packet(fd, "No connected client to pass speaking right.\n");
+		}
+	} else {
+		queue_static_packet(fd, "You are not the current speaker.\n");
+	}
+}
+
+/**
+ * @brief Обработать команду /end: завершить беседу или выйти из комнаты.
+ *
+ * @param fd Дескриптор сокета отправителя.
+ */
+void handle_end_command(int fd) {
+	ClientInfo& self = clients[fd];
+	if (!self.room.empty()) {
+		leave_room(fd, self);
+		queue_static_packet(fd, "You have left the room.\n");
+		return;
+	}
+	if (std::optional<ClientRef> partner = partner_of(self))
+		end_conversation_at(*partner, self.id, "\nYour conversation partner has ended the chat.\n");
+	self.connected_to = NO_USER;
+	self.partner.reset();
+	self.is_speaking = false;
+	queue_static_packet(fd, "You have left the conversation.\n");
+}
+
+/**
+ * @brief Обработать команду клиента в режиме диалога.
+ *
+ * Команда находится по таблице COMMANDS (commands.h) за O(1);
+ * тексты /help и ошибки построены из той же таблицы при компиляции.
+ *
+ * @param fd   Дескриптор сокета отправителя.
+ * @param msg  Текст команды (без завершающего \n).
+ * @param loop Цикл событий (нужен для отключения по /exit).
+ */
+void handle_client_command(int fd, const std::string& msg, EventLoop& loop) {
+	ParsedCommand cmd = parse_command(msg);
+	switch (cmd.id) {
+	case Command::Connect:
+		handle_connect_command(fd, cmd.args);
+		break;
+	case Command::Vote:
+		handle_vote_command(fd);
+		break;
+	case Command::End:
+		handle_end_command(fd);
+		break;
+	case Command::Room:
+		handle_room_command(fd, cmd.args);
+		break;
+	case Command::Rooms:
+		handle_rooms_list(fd);
+		break;
+	case Command::History:
+		handle_history_command(fd, cmd.args);
+		break;
+	case Command::Search:
+		handle_search_command(fd, cmd.args);
+		break;
+	case Command::Exit:
+		disconnect_client(fd, loop);
+		break;
+	case Command::Help:
+		queue_static_packet(fd, HELP_TEXT);
+		break;
+	case Command::Unknown:
+		queue_static_packet(fd, UNKNOWN_COMMAND_TEXT);
+		break;
+	}
+}
+
+/**
+ * @brief Обработать ответ клиента на запрос соединения.
+ *
+ * Если клиент ранее отправил /connect и ожидает ответа,
+ * эта функция устанавливает связь и пересылает историю.
+ *
+ * @param fd  Дескриптор сокета отвечающего клиента.
+ * @param msg Сообщение-ответ ("yes"/"no").
+ */
+void handle_pending_response(int fd, const std::string& msg) {
+	ClientInfo& responder = clients[fd];
+	if (responder.pending_request_from == NO_USER)
+		return;
+
+	UserId requester_id = responder.pending_request_from;
+	responder.pending_request_from = NO_USER;
+	timers.cancel(std::exchange(responder.request_timer, NO_TIMER));
+
+	std::optional<ClientRef> requester = find_client(requester_id);
+	if (!requester) {
+		queue_packet(fd, "Requester disconnected.\n");
+		return;
+	}
+
+	if (msg == "yes") {
+		std::cout << "Clients connected: " << user_name(responder.id) << " <-> " << user_name(requester_id)
+		          << std::endl;
+		responder.connected_to = requester_id;
+		responder.partner = requester;
+
+		// Только хвост переписки, одно отображение журнала на обоих участников.
+		HistoryView history =
+		    map_history_page(user_name(responder.id), user_name(requester_id), HISTORY_ON_CONNECT);
+		queue_history(fd, history, false);
+		queue_all(fd, "Connection established. You are a listener.\n");
+
+		ClientRef self = local_ref(fd);
+		UserId self_id = responder.id;
+		with_client(
+		    *requester,
+		    [self, self_id, history](ClientInfo& r) {
+			    r.connected_to = self_id;
+			    r.partner = self;
+			    r.is_speaking = true;
+			    queue_history(r.fd, history, false);
+			    queue_packet(r.fd, "Connection accepted. You are now speaking.\n");
+		    },
+		    [self, requester_id] {
+			    with_client(self, [requester_id](ClientInfo& c) {
+				    if (c.connected_to != requester_id)
+					    return;
+				    c.connected_to = NO_USER;
+				    c.partner.reset();
+				    queue_packet(c.fd, "Requester disconnected.\n");
+			    });
+		    });
+	} else {
+		queue_packet_to(*requester, "Connection rejected.\n");
+		queue_packet(fd, "Connection declined.\n");
+	}
+}
+
+/**
+ * @brief Обработать одну строку, полученную от клиента.
+ *
+ * В зависимости от состояния клиента строка трактуется как Telegram ID,
+ * код авторизации, ответ на запрос соединения, команда или сообщение
+ * собеседнику.
+ *
+ * @param fd   Дескриптор сокета отправителя.
+ * @param msg  Полученная строка (без завершающего \n).
+ * @param loop Цикл событий сервера.
+ */
+void handle_client_message(int fd, const std::string& msg, EventLoop& loop) {
+	if (!clients.contains(fd) && !pending_auth.count(fd)) {
+		std::string chat_id = msg;
+		if (chat_id.empty()) {
+			queue_packet(fd, "Chat ID cannot be empty. Try again\n");
+			return;
+		}
+
+		Connection& conn = connections[fd];
+		if (conn.auth_in_flight) {
+			queue_packet(fd, "The code is being sent. Please wait.\n");
+			return;
+		}
+
+		std::string code = generate_auth_code();
+		if (auth_delivery && auth_delivery->submit(AuthJob{fd, conn.id, chat_id, code})) {
+			conn.auth_in_flight = true;
+		} else {
+			queue_packet(fd, "Too many login attempts right now. Try again later\n");
+		}
+	}
+
+	else if (pending_auth.count(fd)) {
+		std::string entered_code = msg;
+		std::string chat_id = pending_auth[fd];
+		UserId id = NO_USER;
+		if (verify_auth_code(chat_id, entered_code) && (id = user_ids.intern(chat_id)) != NO_USER) {
+			// Прежний вход отключает его собственный шард.
+			if (std::optional<ClientRef> old = register_client(id, local_ref(fd))) {
+				with_client(*old, [&loop](ClientInfo& c) {
+					queue_packet(c.fd, "\nYou have been logged out (second login detected).\n");
+					disconnect_client(c.fd, shards.empty() ? loop : *shards[shard_index]->loop);
+				});
+			}
+
+			forget_auth_code(chat_id, entered_code);
+			clients[fd] = ClientInfo{fd, id};
+			std::cout << "Client authorized: " << chat_id << " (fd: " << fd << ")" << std::endl;
+			pending_auth.erase(fd);
+			pending_auth_gauge.sub(1);
+			authorized_gauge.add(1);
+			logins_counter.add();
+
+			std::string welcome = "Welcome, " + chat_id + "! Use /connect <ID>, /vote, /end, /exit, /help\n";
+			queue_packet(fd, welcome);
+		} else {
+			queue_packet(fd, "Incorrect code. Try again\n");
+		}
+	}
+
+	else if (clients[fd].pending_request_from != NO_USER) {
+		handle_pending_response(fd, msg);
+	}
+
+	else if (!msg.empty() && msg[0] == '/') {
+		handle_client_command(fd, msg, loop);
+	}
+
+	else if (!clients[fd].room.empty()) {
+		relay_to_room(fd, msg);
+	}
+
+	else {
+		ClientInfo& self = clients[fd];
+		if (self.connected_to == NO_USER) {
+			queue_packet(fd,
+			             "You are not in a conversation.\nUse /connect <ID> to "
+			             "start chatting.\n");
+			return;
+		}
+		if (!self.is_speaking) {
+			queue_all(fd,
+			          "You cannot send messages unless you're the current "
+			          "speaker.\n");
+			return;
+		}
+
+		if (std::optional<ClientRef> target = partner_of(self)) {
+			UserId sender = self.id;
+			// Один буфер пула: ссылки на него уходят в историю и в очередь получателя.
+			FanoutBuffer buf = make_chat_fanout(user_name(sender), {}, msg);
+			append_line_to_history(user_name(sender), user_name(self.connected_to), buf.data.share(),
+			                       buf.text_view());
+			with_client(*target, [sender, buf = std::move(buf), received = last_read_time](ClientInfo& t) {
+				if (t.connected_to != sender)
+					return;
+				queue_fanout(t.fd, buf);
+				relayed_counter.add();
+				auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+				    std::chrono::steady_clock::now() - received);
+				relay_latency_us.record(latency.count());
+			});
+		} else {
+			queue_packet(fd, "Not connected. Use /connect <ID>\n");
+		}
+	}
+}
+
+/**
+ * @brief Погасить код авторизации по истечении auth_code_ttl.
+ *
+ * Код удаляется из auth_codes; если соединение всё ещё ждёт ввода
+ * этого кода, оно возвращается к вводу Telegram ID.
+ *
+ * @param fd      Дескриптор клиентского сокета.
+ * @param conn_id Номер соединения, которому был отправлен код.
+ * @param chat_id Telegram ID.
+ * @param code    Отправленный код.
+ */
+void expire_login_code(int fd, uint64_t conn_id, const std::string& chat_id, const std::string& code) {
+	forget_auth_code(chat_id, code);
+	auto conn = connections.find(fd);
+	auto pending = pending_auth.find(fd);
+	if (conn == connections.end() || conn->second.id != conn_id || pending == pending_auth.end() ||
+	    pending->second != chat_id)
+		return;
+	pending_auth.erase(pending);
+	pending_auth_gauge.sub(1);
+	queue_packet(fd, "The code has expired. Enter your ID\n");
+}
+
+/**
+ * @brief Перевести соединение в ожидание кода авторизации.
+ *
+ * Код запоминается на auth_code_ttl; по истечении срока его гасит
+ * expire_login_code().
+ *
+ * @param fd      Дескриптор клиентского сокета.
+ * @param conn_id Номер соединения.
+ * @param chat_id Telegram ID.
+ * @param code    Отправленный код.
+ */
+void await_login_code(int fd, uint64_t conn_id, const std::string& chat_id, const std::string& code) {
+	store_auth_code(chat_id, code);
+	if (auth_code_ttl.count() > 0) {
+		timers.schedule(auth_code_ttl, [=] { expire_login_code(fd, conn_id, chat_id, code); });
+	}
+	if (pending_auth.insert_or_assign(fd, chat_id).second)
+		pending_auth_gauge.add(1);
+}
+
+/**
+ * @brief Обработать завершённые задания доставки кодов.
+ *
+ * Вызывается, когда eventfd пула доставки становится читаемым.
+ * При успешной отправке код запоминается на auth_code_ttl, а клиент
+ * переводится в pending_auth. Результаты для уже закрытых соединений
+ * отбрасываются.
+ *
+ * @param delivery Пул доставки кодов.
+ */
+void handle_auth_results(AuthDelivery& delivery) {
+	for (AuthResult& result : delivery.take_results()) {
+		int fd = result.job.fd;
+		auto it = connections.find(fd);
+		if (it == connections.end() || it->second.id != result.job.conn_id)
+			continue;  // клиент отключился, пока код был в пути
+		it->second.auth_in_flight = false;
+
+		if (result.delivered) {
+			await_login_code(fd, result.job.conn_id, result.job.chat_id, result.job.code);
+			const char* sent = "Telegram code sent. Enter the code to log in\n";
+			queue_packet(fd, sent);
+		} else {
+			queue_packet(fd,
+			             "Failed to send Telegram message.\nUse command /exit to "
+			             "exit.\nCheck the telegram ID and write it again");
+		}
+	}
+}
+
+/**
+ * @brief Обработать все завершённые строки (или кадры двоичного протокола) в буфере клиента.
+ *
+ * Незавершённая строка остаётся в буфере до следующих данных.
+ * Первая строка PROTOCOL_HELLO переводит соединение на двоичный
+ * протокол: сервер отвечает строкой PROTOCOL_ACK, а остаток буфера
+ * и всё последующее разбирается как кадры.
+ *
+ * @param fd   Дескриптор клиентского сокета.
+ * @param loop Цикл событий сервера.
+ * @return false, если соединение закрыто (обработчиком или из-за слишком длинной строки).
+ */
+bool handle_client_input(int fd, EventLoop& loop) {
+	auto it = connections.find(fd);
+	if (it == connections.end())
+		return false;
+	std::string_view line;
+	FrameType type = FrameType::Text;
+	while (it->second.binary ? it->second.in.next_frame(type, line) : it->second.in.next_line(line)) {
+		if (type != FrameType::Text)
+			continue;
+		Connection& conn = it->second;
+		if (!conn.binary && line == PROTOCOL_HELLO && !conn.auth_in_flight && !clients.contains(fd) &&
+		    !pending_auth.count(fd)) {
+			queue_raw(fd, std::string(PROTOCOL_ACK) + "\n");
+			conn.binary = true;
+			continue;
+		}
+		handle_client_message(fd, std::string(line), loop);
+		// Обработчик мог отключить клиента (/exit, повторный вход).
+		it = connections.find(fd);
+		if (it == connections.end())
+			return false;
+	}
+	if (it->second.in.overflow()) {
+		disconnect_client(fd, loop);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Обработать готовность клиентского сокета к чтению.
+ *
+ * Вычитывает сокет крупными блоками в буфер соединения и обрабатывает
+ * его (handle_client_input()). Цикл событий работает в edge-triggered
+ * режиме, поэтому чтение продолжается до EAGAIN.
+ *
+ * @param fd   Дескриптор клиентского сокета.
+ * @param loop Цикл событий сервера.
+ */
+void handle_client_readable(int fd, EventLoop& loop) {
+	while (true) {
+		auto it = connections.find(fd);
+		if (it == connections.end())
+			return;
+		ReadStatus status = it->second.in.fill(fd);
+		last_read_time = std::chrono::steady_clock::now();
+		it->second.last_active = last_read_time;
+		if (!handle_client_input(fd, loop))
+			return;
+		if (status == ReadStatus::Closed || status == ReadStatus::Error) {
+			disconnect_client(fd, loop);
+			return;
+		}
+		if (status == ReadStatus::Drained)
+			return;
+	}
+}
+
+/**
+ * @brief Обработать байты, которые цикл событий уже принял с сокета клиента (LOOP_RECV).
+ *
+ * @param fd   Дескриптор клиентского сокета.
+ * @param data Принятые байты.
+ * @param loop Цикл событий сервера.
+ */
+void handle_client_data(int fd, std::string_view data, EventLoop& loop) {
+	auto it = connections.find(fd);
+	if (it == connections.end())
+		return;
+	it->second.in.append(data.data(), data.size());
+	last_read_time = std::chrono::steady_clock::now();
+	it->second.last_active = last_read_time;
+	handle_client_input(fd, loop);
+}
+
+/**
+ * @brief Зарегистрировать принятое подключение и попросить у клиента ID.
+ *
+ * @param client_fd Неблокирующий сокет нового клиента.
+ * @param loop      Цикл событий сервера.
+ */
+void admit_client(int client_fd, EventLoop& loop) {
+	if (!loop.add(client_fd, CLIENT_EVENTS)) {
+		std::cerr << "Cannot watch fd " << client_fd << " with " << loop.name() << ", dropping client\n";
+		close(client_fd);
+		return;
+	}
+	Connection& conn = connections.try_emplace(client_fd).first->second;
+	conn.id = next_connection_id++;
+	conn.last_active = std::chrono::steady_clock::now();
+	schedule_idle_check(client_fd, conn, idle_timeout, loop);
+	connections_gauge.add(1);
+	accepted_counter.add();
+	std::cout << "New client connected, fd: " << client_fd << std::endl;
+	const char* ask_id = "Enter your ID\n";
+	queue_packet(client_fd, ask_id);
+}
+
+/**
+ * @brief Принять все ожидающие подключения на слушающем сокете.
+ *
+ * Слушающий сокет неблокирующий и зарегистрирован в edge-triggered
+ * режиме, поэтому accept() вызывается до EAGAIN.
+ *
+ * @param listener Слушающий сокет.
+ * @param loop     Цикл событий сервера.
+ */
+void accept_clients(int listener, EventLoop& loop) {
+	while (true) {
+		int client_fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		admit_client(client_fd, loop);
+	}
+}
+
+/**
+ * @brief Вывести в консоль сервера состояние очередей отправки клиентов.
+ *
+ * Для каждого открытого сокета печатает объём данных в очереди,
+ * пиковый объём, число отправленных байт и отброшенных сообщений.
+ */
+void print_queue_stats() {
+	size_t total = 0;
+	for (const auto& [fd, conn] : connections) {
+		const ClientInfo* client = clients.find(fd);
+		std::cout << "shard " << shard_index << " fd " << fd << " ["
+		          << (client != nullptr ? user_name(client->id) : "-")
+		          << "]: queued=" << conn.out.size() << " peak=" << conn.out.peak()
+		          << " sent=" << conn.out.sent() << " dropped=" << conn.out.dropped() << '\n';
+		total += conn.out.size();
+	}
+	std::cout << "shard " << shard_index << ": " << connections.size() << " connections, " << total
+	          << " bytes queued\n";
+}
+
+/**
+ * @brief Вывести в консоль сервера статистику доставки кодов в Telegram.
+ *
+ * @param delivery Пул доставки кодов.
+ */
+void print_auth_stats(const AuthDelivery& delivery) {
+	AuthDeliveryStats st = delivery.stats();
+	std::cout << "shard " << shard_index << " auth: requests=" << st.requests << " failures=" << st.failures
+	          << " (" << st.failure_rate * 100 << "%) rejected=" << st.rejected
+	          << " queued=" << delivery.queued()
+	          << "\nauth latency us: avg=" << st.avg_latency_us << " p50<=" << st.p50_latency_us
+	          << " p99<=" << st.p99_latency_us << " max=" << st.max_latency_us
+	          << "\nauth batches=" << st.batches << " max_batch=" << st.max_batch << '\n';
+}
+
+/**
+ * @brief Вывести в консоль сервера статистику фоновой записи истории.
+ *
+ * @param writer Поток записи истории.
+ */
+void print_history_stats(const HistoryWriter& writer) {
+	HistoryWriterStats st = writer.stats();
+	std::cout << "history: records=" << st.records << " queued=" << st.queued
+	          << " max_queued=" << st.max_queued << " errors=" << st.errors
+	          << "\nhistory batches=" << st.batches << " max_batch=" << st.max_batch << " syncs=" << st.syncs
+	          << "\nhistory flush us: avg=" << st.avg_flush_us << " p50<=" << st.p50_flush_us
+	          << " p99<=" << st.p99_flush_us << " max=" << st.max_flush_us << '\n';
+}
+
+/**
+ * @brief Вывести в консоль сервера статистику применения политики хранения истории.
+ *
+ * @param compactor Поток политики хранения.
+ */
+void print_compactor_stats(const HistoryCompactor& compactor) {
+	HistoryCompactorStats st = compactor.stats();
+	std::cout << "history retention: passes=" << st.passes << " segments_deleted=" << st.segments
+	          << " reclaimed=" << st.reclaimed_bytes << " bytes=" << st.bytes
+	          << "\nhistory retention us: last=" << st.last_us << " max=" << st.max_us << '\n';
+}
+
+/**
+ * @brief Записать итог прохода политики хранения в метрики.
+ *
+ * Обработчик HistoryCompactor::Report.
+ */
+void report_compaction(const HistoryCompaction& pass, std::chrono::microseconds took) {
+	history_reclaimed_counter.add(pass.reclaimed_bytes);
+	history_segments_counter.add(pass.segments);
+	history_compaction_us.record(took.count());
+	history_bytes_gauge.set(pass.bytes);
+}
+
+/**
+ * @brief Вывести в консоль сервера статистику пула буферов сообщений.
+ */
+void print_pool_stats() {
+	BufferPoolStats st = buffer_pool().stats();
+	std::cout << "buffer pool: heap_allocs=" << st.heap_allocs << " reuses=" << st.reuses
+	          << " cached=" << st.cached << " (" << st.cached_bytes << " bytes)\n";
+}
+
+/**
+ * @brief Отправить код в Telegram, записав время запроса в метрики.
+ *
+ * Обёртка над post_telegram_code() для пулов доставки кодов.
+ */
+bool timed_post_telegram_code(const std::string& chat_id, const std::string& code) {
+	auto start = std::chrono::steady_clock::now();
+	bool delivered = post_telegram_code(chat_id, code);
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	telegram_send_us.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+	return delivered;
+}
+
+/**
+ * @brief Открыть слушающий сокет шарда.
+ *
+ * Сокеты всех шардов привязываются к одному порту с SO_REUSEPORT,
+ * и ядро распределяет входящие соединения между ними.
+ *
+ * @param port Порт.
+ * @return Неблокирующий слушающий сокет или -1 при ошибке.
+ */
+int open_listener(int port) {
+	int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	int opt = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+		perror("setsockopt(SO_REUSEPORT)");
+
+	sockaddr_in server_addr{};
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(static_cast<uint16_t>(port));
+	server_addr.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(listener, (sockaddr*)&server_addr, sizeof(server_addr)) < 0 || listen(listener, SOMAXCONN) < 0) {
+		perror("bind");
+		close(listener);
+		return -1;
+	}
+	return listener;
+}
+
+/**
+ * @brief Закрыть все соединения шарда и остановить его поток.
+ *
+ * Выполняется в потоке шарда по команде /shutdown.
+ */
+void shutdown_shard() {
+	// BEGIN: Borrowed code
+	clients.for_each([](int cfd, ClientInfo&) { queue_all(cfd, "\nServer is shutting down.\n"); });
+	for (auto& [cfd, conn] : connections) {
+		conn.out.flush(cfd);
+		close(cfd);
+		queued_bytes_gauge.sub(static_cast<int64_t>(conn.reported_queue));
+	}
+	// END: Borrowed code
+	connections_gauge.sub(static_cast<int64_t>(connections.size()));
+	authorized_gauge.sub(static_cast<int64_t>(clients.size()));
+	pending_auth_gauge.sub(static_cast<int64_t>(pending_auth.size()));
+	connections.clear();
+	clients.clear();
+	pending_auth.clear();
+	timers.clear();
+	Shard& shard = *shards[shard_index];
+	close(shard.listener);
+	auth_delivery.reset();
+	shard_running = false;
+}
+
+/**
+ * @brief Выполнить задачу в каждом шарде по очереди и дождаться её.
+ *
+ * Используется консолью сервера (статистика, /shutdown): вывод шардов
+ * не перемешивается.
+ *
+ * @param task Задача.
+ */
+void run_on_each_shard(const std::function<void()>& task) {
+	for (auto& shard : shards) {
+		if (!shard->thread.joinable())
+			continue;
+		std::promise<void> done;
+		shard->inbox.post([&] {
+			task();
+			done.set_value();
+		});
+		done.get_future().wait();
+	}
+}
+
+/**
+ * @struct HandoffFreeze
+ * @brief Остановка шардов на время передачи состояния новому процессу.
+ *
+ * Шарды раундами выполняют задачи своих ящиков (ответ на задачу может
+ * породить задачу для другого шарда), пока раунд не пройдёт без задач,
+ * затем выгружают свои сессии и ждут исхода передачи.
+ *
+ * @var HandoffFreeze::sync
+ * Граница раунда; по её прохождении вычисляется quiet.
+ * @var HandoffFreeze::ran
+ * Задач, выполненных за текущий раунд всеми шардами.
+ * @var HandoffFreeze::quiet
+ * Последний раунд прошёл без задач.
+ * @var HandoffFreeze::exported
+ * Шарды, ещё не выгрузившие сессии.
+ * @var HandoffFreeze::released
+ * Шарды, ещё не узнавшие исход.
+ * @var HandoffFreeze::sessions
+ * Сессии по номерам шардов.
+ * @var HandoffFreeze::outcome
+ * Исход: true — сокеты переданы, шарды завершаются.
+ */
+struct HandoffFreeze {
+	struct RoundDone {
+		HandoffFreeze* freeze;
+		void operator()() noexcept { freeze->quiet = freeze->ran.exchange(0) == 0; }
+	};
+
+	explicit HandoffFreeze(size_t shard_count)
+	    : sync(static_cast<std::ptrdiff_t>(shard_count), RoundDone{this}),
+	      exported(static_cast<std::ptrdiff_t>(shard_count)),
+	      released(static_cast<std::ptrdiff_t>(shard_count)),
+	      sessions(shard_count) {}
+
+	std::barrier<RoundDone> sync;
+	std::atomic<size_t> ran{0};
+	bool quiet = false;
+	std::latch exported;
+	std::latch released;
+	std::vector<std::vector<HandoffSession>> sessions;
+	std::promise<bool> outcome;
+	std::shared_future<bool> result = outcome.get_future().share();
+};
+
+/// Передача, к которой шард присоединится в конце текущей итерации цикла.
+static thread_local HandoffFreeze* pending_freeze = nullptr;
+
+/**
+ * @brief Выгрузить сессии своего шарда для передачи.
+ *
+ * Состояние шарда не меняется: при неудачной передаче он продолжает работу.
+ */
+std::vector<HandoffSession> export_sessions() {
+	std::vector<HandoffSession> out;
+	out.reserve(connections.size());
+	for (const auto& [fd, conn] : connections) {
+		HandoffSession s;
+		s.fd = fd;
+		s.shard = static_cast<uint32_t>(shard_index);
+		s.binary = conn.binary;
+		s.input = std::string(conn.in.pending());
+		s.output = conn.out.contents();
+		s.auth_interrupted = conn.auth_in_flight;
+		if (const ClientInfo* c = clients.find(fd)) {
+			s.user = user_name(c->id);
+			if (c->connected_to != NO_USER)
+				s.partner = user_name(c->connected_to);
+			s.is_speaking = c->is_speaking;
+			if (c->pending_request_from != NO_USER)
+				s.pending_request_from = user_name(c->pending_request_from);
+			s.room = c->room;
+		} else if (auto pending = pending_auth.find(fd); pending != pending_auth.end()) {
+			s.pending_auth = pending->second;
+			s.auth_code = stored_auth_code(pending->second);
+		}
+		out.push_back(std::move(s));
+	}
+	return out;
+}
+
+/**
+ * @brief Остановить шард на время передачи (вызывается из run_shard()).
+ *
+ * После успешной передачи состояние шарда отпускается без close():
+ * сокеты уже принадлежат и новому процессу, и закрытие здесь их не разорвёт,
+ * но шард больше не должен их трогать.
+ *
+ * @param shard Шард текущего потока.
+ * @param loop  Его цикл событий.
+ */
+void freeze_for_handoff(Shard& shard, EventLoop& loop) {
+	HandoffFreeze& freeze = *std::exchange(pending_freeze, nullptr);
+	do {
+		freeze.ran += shard.inbox.run_pending();
+		flush_dirty_clients(loop);
+		freeze.sync.arrive_and_wait();
+	} while (!freeze.quiet);
+
+	// Цикл io_uring принимает данные и подключения сам: останавливаем его, забрав уже принятое.
+	static thread_local std::vector<LoopEvent> received;
+	loop.suspend(received);
+	for (const LoopEvent& ev : received) {
+		if (ev.fd == shard.listener && ev.accepted >= 0) {
+			admit_client(ev.accepted, loop);
+		} else if (!ev.data.empty()) {
+			if (auto it = connections.find(ev.fd); it != connections.end())
+				it->second.in.append(ev.data.data(), ev.data.size());
+		}
+	}
+
+	freeze.sessions[shard_index] = export_sessions();
+	freeze.exported.count_down();
+	bool handed_off = freeze.result.get();
+	freeze.released.count_down();  // Дальше freeze может быть уже разрушен.
+	if (!handed_off) {
+		loop.resume();
+		for (const LoopEvent& ev : received)
+			if (!ev.data.empty())
+				handle_client_input(ev.fd, loop);
+		return;
+	}
+	connections.clear();
+	clients.clear();
+	pending_auth.clear();
+	dirty_fds.clear();
+	timers.clear();
+	shard_running = false;
+}
+
+/**
+ * @brief Комнаты для передачи: участники в порядке входа и говорящий.
+ */
+std::vector<HandoffRoom> export_rooms() {
+	std::vector<HandoffRoom> out;
+	for (const auto& entry : rooms.list()) {
+		std::shared_ptr<const RoomRoster> roster = rooms.roster(entry.first);
+		if (!roster)
+			continue;
+		HandoffRoom room;
+		room.name = entry.first;
+		for (const RoomMember& m : roster->members) {
+			if (rooms.speaker_roster(entry.first, m.ref))
+				room.speaker = static_cast<uint32_t>(room.members.size());
+			room.members.push_back(user_name(m.id));
+		}
+		out.push_back(std::move(room));
+	}
+	return out;
+}
+
+/**
+ * @brief Передать сокеты и сессии новому процессу.
+ *
+ * Выполняется в потоке передачи. Шарды останавливаются, очередь истории
+ * дописывается на диск, состояние уходит в @p peer. Если новый процесс
+ * не подтвердил приём, история и шарды продолжают работу.
+ *
+ * @param peer                  Подключённый новый процесс.
+ * @param history_sync          Политика истории (для возобновления).
+ * @param history_sync_interval Интервал fdatasync() истории (для возобновления).
+ * @return true, если новый процесс принял состояние.
+ */
+bool hand_off_to(int peer, HistoryDurability history_sync, std::chrono::milliseconds history_sync_interval) {
+	// Зависший новый процесс не должен остановить сервер навсегда.
+	timeval timeout{HANDOFF_ACK_TIMEOUT_SEC, 0};
+	setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	auto frozen_at = std::chrono::steady_clock::now();
+	HandoffFreeze freeze(shards.size());
+	for (auto& shard : shards)
+		shard->inbox.post([&freeze] { pending_freeze = &freeze; });
+	freeze.exported.wait();
+
+	HandoffState state;
+	state.frozen_at_ns =
+	    std::chrono::duration_cast<std::chrono::nanoseconds>(frozen_at.time_since_epoch()).count();
+	for (auto& shard : shards)
+		state.listeners.push_back(shard->listener);
+	for (auto& part : freeze.sessions)
+		std::move(part.begin(), part.end(), std::back_inserter(state.sessions));
+	state.rooms = export_rooms();
+	// Новый процесс дописывает те же журналы: очередь истории должна быть пуста.
+	bool compacting = history_compactor() != nullptr;
+	stop_history_compactor();
+	stop_history_writer();
+	close_history_files();
+
+	int64_t bytes = send_handoff(peer, state);
+	char ack = 0;
+	bool accepted = bytes >= 0 && recv(peer, &ack, 1, 0) == 1 && ack == HANDOFF_ACK;
+	freeze.outcome.set_value(accepted);
+	freeze.released.wait();
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+	                                                                     frozen_at);
+	if (!accepted) {
+		start_history_writer(history_sync, history_sync_interval, &history_append_us);
+		if (compacting)
+			start_history_compactor(HistoryCompactor::DEFAULT_INTERVAL, report_compaction);
+		std::cerr << "Handoff failed after " << elapsed.count() << " ms, resuming service\n";
+		return false;
+	}
+	std::cout << "Handed off " << state.sessions.size() << " connections and " << state.listeners.size()
+	          << " listeners (" << bytes << " bytes of state) in " << elapsed.count() << " ms" << std::endl;
+	return true;
+}
+
+/**
+ * @brief Поток передачи: ждёт новый процесс на Unix-сокете.
+ *
+ * После успешной передачи процесс сразу завершается (std::_Exit): клиентов
+ * уже обслуживает новый процесс, а консоль заблокирована в чтении stdin.
+ * Порт метрик освобождается заранее, чтобы новый процесс мог его занять.
+ *
+ * @param listener              Слушающий Unix-сокет (listen_handoff_socket()).
+ * @param history_sync          Политика истории.
+ * @param history_sync_interval Интервал fdatasync() истории.
+ * @param metrics_endpoint      Эндпоинт метрик этого процесса.
+ */
+void serve_handoff(int listener, HistoryDurability history_sync,
+                   std::chrono::milliseconds history_sync_interval, MetricsEndpoint& metrics_endpoint) {
+	while (true) {
+		int peer = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (peer == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;  // Сокет остановлен при /shutdown.
+		}
+		if (!handoff_peer_allowed(peer)) {
+			std::cerr << "Handoff request from another user rejected\n";
+			close(peer);
+			continue;
+		}
+		if (hand_off_to(peer, history_sync, history_sync_interval)) {
+			metrics_endpoint.stop();
+			std::cout.flush();
+			std::_Exit(0);
+		}
+		close(peer);
+	}
+}
+
+/**
+ * @struct AdoptedSession
+ * @brief Сессия от прежнего процесса и номер её соединения в этом процессе.
+ */
+struct AdoptedSession {
+	HandoffSession session;
+	uint64_t conn_id = 0;
+};
+
+/**
+ * @brief Принять одно соединение от прежнего процесса в свой шард.
+ *
+ * Неотправленные байты ставятся в очередь, недочитанная строка — в буфер
+ * ввода; таймеры (простой, срок кода, запрос /connect) ставятся заново.
+ *
+ * @param s       Сессия.
+ * @param conn_id Номер соединения (уже записан в справочник).
+ * @param loop    Цикл событий шарда.
+ */
+void adopt_session(HandoffSession& s, uint64_t conn_id, EventLoop& loop) {
+	int fd = s.fd;
+	if (!loop.add(fd, CLIENT_EVENTS)) {
+		std::cerr << "Cannot watch inherited fd " << fd << " with " << loop.name() << ", dropping client\n";
+		if (!s.user.empty())
+			unregister_client(user_ids.intern(s.user), ClientRef{shard_index, fd, conn_id});
+		close(fd);
+		return;
+	}
+	Connection& conn = connections.try_emplace(fd).first->second;
+	conn.id = conn_id;
+	conn.binary = s.binary;
+	conn.last_active = std::chrono::steady_clock::now();
+	conn.in.append(s.input.data(), s.input.size());
+	connections_gauge.add(1);
+	schedule_idle_check(fd, conn, idle_timeout, loop);
+	if (!s.output.empty())
+		queue_raw(fd, std::move(s.output));
+
+	if (!s.user.empty()) {
+		ClientInfo& c = clients[fd];
+		c = ClientInfo{fd, user_ids.intern(s.user)};
+		if (!s.partner.empty())
+			c.connected_to = user_ids.intern(s.partner);
+		c.is_speaking = s.is_speaking;
+		if (rooms.roster(s.room))
+			c.room = s.room;
+		authorized_gauge.add(1);
+		if (!s.pending_request_from.empty()) {
+			UserId requester_id = user_ids.intern(s.pending_request_from);
+			if (std::optional<ClientRef> requester = find_client(requester_id))
+				arm_connect_request(c, *requester, requester_id);
+		}
+	} else if (!s.pending_auth.empty() && !s.auth_code.empty()) {
+		await_login_code(fd, conn_id, s.pending_auth, s.auth_code);
+	} else if (s.auth_interrupted) {
+		queue_packet(fd, "The server restarted while sending your code. Enter your ID\n");
+	}
+}
+
+/**
+ * @brief Принять сессии от прежнего процесса.
+ *
+ * Справочник клиентов и комнаты заполняются сразу, соединения раздаются
+ * шардам задачами (по шарду прежнего процесса); функция возвращается,
+ * когда все шарды их приняли.
+ *
+ * @param state Состояние из recv_handoff().
+ * @param loop  Цикл событий однопоточного режима (тесты); шарды используют свои.
+ */
+void adopt_sessions(HandoffState& state, EventLoop& loop) {
+	size_t shard_count = std::max<size_t>(1, shards.size());
+	std::vector<std::vector<AdoptedSession>> batches(shard_count);
+	for (HandoffSession& s : state.sessions) {
+		size_t shard = s.shard % shard_count;
+		uint64_t conn_id = next_connection_id++;
+		if (!s.user.empty())
+			register_client(user_ids.intern(s.user), ClientRef{shard, s.fd, conn_id});
+		batches[shard].push_back({std::move(s), conn_id});
+	}
+
+	for (const HandoffRoom& r : state.rooms) {
+		std::vector<RoomMember> members;
+		size_t speaker = 0;
+		for (size_t i = 0; i < r.members.size(); ++i) {
+			UserId id = user_ids.intern(r.members[i]);
+			if (std::optional<ClientRef> ref = find_client(id)) {
+				if (i == r.speaker)
+					speaker = members.size();
+				members.push_back({id, *ref});
+			}
+		}
+		rooms.restore(r.name, std::move(members), speaker);
+	}
+
+	std::latch adopted(static_cast<std::ptrdiff_t>(shard_count));
+	for (size_t i = 0; i < shard_count; ++i) {
+		PooledTask task([&adopted, &loop, batch = std::move(batches[i])]() mutable {
+			EventLoop& shard_loop = shards.empty() ? loop : *shards[shard_index]->loop;
+			for (AdoptedSession& a : batch)
+				adopt_session(a.session, a.conn_id, shard_loop);
+			// Прежний процесс мог принять строки, но не успеть их разобрать.
+			for (AdoptedSession& a : batch)
+				if (!a.session.input.empty())
+					handle_client_input(a.session.fd, shard_loop);
+			adopted.count_down();
+		});
+		if (shards.empty())
+			task();
+		else
+			shards[i]->inbox.post(std::move(task));
+	}
+	adopted.wait();
+}
+
+/**
+ * @brief Цикл событий шарда.
+ *
+ * Принимает соединения со своего слушающего сокета, обслуживает своих
+ * клиентов, результаты доставки кодов и задачи из входящего ящика.
+ *
+ * @param index Номер шарда.
+ */
+void run_shard(size_t index) {
+	shard_index = index;
+	Shard& shard = *shards[index];
+	EventLoop& loop = *shard.loop;
+	auth_delivery = std::move(shard.auth);
+
+	std::vector<LoopEvent> events;
+	while (shard_running) {
+		// Просыпаемся к смене минуты (метка времени сообщений) и к ближайшему таймеру.
+		int timeout = timestamp_cache.ms_until_rollover();
+		if (int next_timer = timers.ms_until_next(); next_timer >= 0)
+			timeout = std::min(timeout, next_timer);
+		if (loop.wait(events, timeout) == -1) {
+			perror(loop.name());
+			break;
+		}
+		timestamp_cache.refresh();
+
+		for (const LoopEvent& ev : events) {
+			int fd = ev.fd;
+			if (fd == shard.inbox.notify_fd()) {
+				shard.inbox.run_pending();
+				if (!shard_running)
+					return;
+				continue;
+			}
+			if (fd == shard.listener) {
+				if (ev.accepted >= 0)
+					admit_client(ev.accepted, loop);
+				else
+					accept_clients(shard.listener, loop);
+				continue;
+			}
+			if (fd == auth_delivery->notify_fd()) {
+				handle_auth_results(*auth_delivery);
+				continue;
+			}
+			if (ev.events & LOOP_CLOSED) {
+				disconnect_client(fd, loop);
+				continue;
+			}
+			if (ev.events & LOOP_WRITE)
+				flush_client(fd, loop);
+			if (!ev.data.empty())
+				handle_client_data(fd, ev.data, loop);
+			else if ((ev.events & LOOP_READ) && connections.count(fd))
+				handle_client_readable(fd, loop);
+		}
+
+		timers.advance();
+		flush_dirty_clients(loop);
+		if (pending_freeze)
+			freeze_for_handoff(shard, loop);
+	}
+}
+
+/**
+ * @brief Разобрать числовой аргумент командной строки.
+ *
+ * @param text Аргумент.
+ * @param out  Результат.
+ * @return false, если @p text не целиком десятичное число, помещающееся в T.
+ */
+template <typename T>
+bool parse_number_arg(const char* text, T& out) {
+	const char* end = text + std::strlen(text);
+	auto [ptr, ec] = std::from_chars(text, end, out);
+	return ec == std::errc() && ptr == end;
+}
+
+/**
+ * @brief Точка входа сервера.
+ *
+ * Запускает потоки-реакторы на общем порту и обрабатывает команды
+ * консоли до получения /shutdown.
+ *
+ * Аргументы командной строки:
+ *  - --select                  использовать select() вместо epoll (отладка, тесты);
+ *  - --io-uring                использовать io_uring вместо epoll (сборка с MESSENGER_IO_URING;
+ *                              иначе или на старом ядре — epoll);
+ *  - --port <N>                порт (по умолчанию 9090);
+ *  - --threads <N>             число потоков-реакторов (по умолчанию — число ядер);
+ *  - --max-queue <байт>        порог очереди исходящих данных клиента;
+ *  - --slow-policy <политика>  disconnect (по умолчанию) или drop;
+ *  - --telegram-url <url>      базовый адрес Bot API (например, локальная заглушка);
+ *  - --auth-workers <N>        число потоков доставки кодов (делятся между шардами);
+ *  - --history-sync <политика> none, interval (по умолчанию) или batch;
+ *  - --history-sync-ms <мс>    интервал fdatasync() для политики interval;
+ *  - --history-compress        сжимать старую часть журналов истории (сборка с zlib);
+ *  - --history-max-age <дни>   удалять историю старше заданного возраста (0 — без ограничения);
+ *  - --history-max-bytes <байт> предел объёма истории одной переписки (0 — без ограничения);
+ *  - --history-quota <байт>    общий предел объёма истории; сверх него удаляются
+ *                              старейшие сегменты всех переписок (0 — без ограничения);
+ *  - --history-segment-bytes <байт> объём записей в сегменте истории (по умолчанию 4 МиБ);
+ *  - --history-segment-hours <ч> время, за которое пишется один сегмент
+ *                              (по умолчанию 24, 0 — без ограничения);
+ *  - --metrics-port <N>        локальный порт метрик Prometheus (по умолчанию 9091, 0 — выключить);
+ *  - --code-ttl <с>            время жизни кода авторизации (по умолчанию 300, 0 — бессрочно);
+ *  - --connect-timeout <с>     ожидание ответа на /connect (по умолчанию 60, 0 — без ограничения);
+ *  - --idle-timeout <с>        отключение невошедшего клиента без входящих данных (по умолчанию 1800,
+ *                              0 — выключить);
+ *  - --handoff-socket <путь>   Unix-сокет горячего перезапуска (по умолчанию SERVER_SETTINGS/handoff.sock,
+ *                              none — выключить);
+ *  - --takeover                принять сокеты и сессии у сервера, слушающего --handoff-socket.
+ *
+ * Команды консоли сервера: /shutdown, /queues, /auth, /disk, /stats.
+ *
+ * @return 0 при корректном завершении, иначе код ошибки.
+ */
+int main(int argc, char* argv[]) {
+	LoopBackend backend = LoopBackend::Epoll;
+	int port = PORT;
+	int metrics_port = METRICS_PORT;
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	bool threads_given = false;
+	bool takeover = false;
+	bool history_compress = false;
+	HistoryRetention retention;
+	size_t auth_workers = 4;
+	HistoryDurability history_sync = HistoryDurability::Interval;
+	std::chrono::milliseconds history_sync_interval = HistoryWriter::DEFAULT_SYNC_INTERVAL;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		// Числовое значение флага; не число — справка, как и для неизвестного флага.
+		uint64_t n = 0;
+		bool number = i + 1 < argc && parse_number_arg(argv[i + 1], n);
+		if (arg == "--select") {
+			backend = LoopBackend::Select;
+		} else if (arg == "--io-uring") {
+			backend = LoopBackend::Uring;
+		} else if (arg == "--port" && i + 1 < argc && parse_number_arg(argv[i + 1], port)) {
+			++i;
+		} else if (arg == "--threads" && number) {
+			threads = std::max<size_t>(1, n);
+			threads_given = true;
+			++i;
+		} else if (arg == "--max-queue" && number) {
+			max_queue_bytes = n;
+			++i;
+		} else if (arg == "--slow-policy" && i + 1 < argc && std::string(argv[i + 1]) == "drop") {
+			slow_client_policy = SlowClientPolicy::Drop;
+			++i;
+		} else if (arg == "--slow-policy" && i + 1 < argc && std::string(argv[i + 1]) == "disconnect") {
+			slow_client_policy = SlowClientPolicy::Disconnect;
+			++i;
+		} else if (arg == "--telegram-url" && i + 1 < argc) {
+			set_telegram_api_url(argv[++i]);
+		} else if (arg == "--auth-workers" && number) {
+			auth_workers = n;
+			++i;
+		} else if (arg == "--history-sync" && i + 1 < argc && std::string(argv[i + 1]) == "none") {
+			history_sync = HistoryDurability::None;
+			++i;
+		} else if (arg == "--history-sync" && i + 1 < argc && std::string(argv[i + 1]) == "interval") {
+			history_sync = HistoryDurability::Interval;
+			++i;
+		} else if (arg == "--history-sync" && i + 1 < argc && std::string(argv[i + 1]) == "batch") {
+			history_sync = HistoryDurability::PerBatch;
+			++i;
+		} else if (arg == "--history-sync-ms" && number) {
+			history_sync_interval = std::chrono::milliseconds(n);
+			++i;
+		} else if (arg == "--history-compress") {
+			history_compress = true;
+		} else if (arg == "--history-max-age" && number && n <= UINT32_MAX) {
+			retention.max_age = static_cast<int64_t>(n) * 24 * 3600;
+			++i;
+		} else if (arg == "--history-max-bytes" && number) {
+			retention.max_bytes = n;
+			++i;
+		} else if (arg == "--history-quota" && number) {
+			retention.quota = n;
+			++i;
+		} else if (arg == "--history-segment-bytes" && number) {
+			retention.segment_bytes = std::max<uint64_t>(1, n);
+			++i;
+		} else if (arg == "--history-segment-hours" && number && n <= UINT32_MAX) {
+			retention.segment_seconds = static_cast<int64_t>(n) * 3600;
+			++i;
+		} else if (arg == "--metrics-port" && i + 1 < argc && parse_number_arg(argv[i + 1], metrics_port)) {
+			++i;
+		} else if (arg == "--code-ttl" && number) {
+			auth_code_ttl = std::chrono::seconds(n);
+			++i;
+		} else if (arg == "--connect-timeout" && number) {
+			connect_request_timeout = std::chrono::seconds(n);
+			++i;
+		} else if (arg == "--idle-timeout" && number) {
+			idle_timeout = std::chrono::seconds(n);
+			++i;
+		} else if (arg == "--handoff-socket" && i + 1 < argc) {
+			handoff_socket_path = argv[++i];
+		} else if (arg == "--takeover") {
+			takeover = true;
+		} else {
+			std::cerr << "Usage: " << argv[0]
+			          << " [--select|--io-uring] [--port <N>] [--threads <N>] [--max-queue <bytes>]"
+			             " [--slow-policy disconnect|drop] [--telegram-url <url>] [--auth-workers <N>]"
+			             " [--history-sync none|interval|batch] [--history-sync-ms <ms>] [--history-compress]"
+			             " [--history-max-age <days>] [--history-max-bytes <bytes>] [--history-quota <bytes>]"
+			             " [--history-segment-bytes <bytes>] [--history-segment-hours <h>]"
+			             " [--metrics-port <N>] [--code-ttl <s>] [--connect-timeout <s>]"
+			             " [--idle-timeout <s>] [--handoff-socket <path>|none] [--takeover]\n";
+			return 1;
+		}
+	}
+
+	ensure_bot_token();
+
+	HandoffState inherited;
+	int predecessor = -1;
+	if (takeover) {
+		predecessor = connect_handoff_socket(handoff_socket_path);
+		if (predecessor == -1 || recv_handoff(predecessor, inherited) < 0 || inherited.listeners.empty()) {
+			std::cerr << "Cannot take over from the server at " << handoff_socket_path << "\n";
+			return 1;
+		}
+		if (!threads_given)
+			threads = inherited.listeners.size();
+		sockaddr_in addr{};
+		socklen_t len = sizeof(addr);
+		if (getsockname(inherited.listeners[0], (sockaddr*)&addr, &len) == 0)
+			port = ntohs(addr.sin_port);
+		// Лишние слушающие сокеты не нужны: остальные шарды примут их соединения.
+		for (size_t i = threads; i < inherited.listeners.size(); ++i)
+			close(inherited.listeners[i]);
+	}
+
+	size_t workers_per_shard = std::max<size_t>(1, (auth_workers + threads - 1) / threads);
+	for (size_t i = 0; i < threads; ++i) {
+		auto shard = std::make_unique<Shard>();
+		shard->listener = i < inherited.listeners.size() ? inherited.listeners[i] : open_listener(port);
+		if (shard->listener == -1)
+			return 1;
+		shard->loop = make_event_loop(backend);
+		if (!shard->loop && backend == LoopBackend::Uring) {
+			std::cerr << "io_uring is not available in this build or kernel, falling back to epoll\n";
+			backend = LoopBackend::Epoll;
+			shard->loop = make_event_loop(backend);
+		}
+		if (!shard->loop || !shard->loop->add(shard->listener, LOOP_READ | LOOP_EDGE | LOOP_ACCEPT) ||
+		    !shard->loop->add(shard->inbox.notify_fd(), LOOP_READ)) {
+			std::cerr << "Failed to initialize event loop\n";
+			return 1;
+		}
+		size_t auth_queue = AUTH_QUEUE_LIMIT / threads + 1;
+		shard->auth = std::make_unique<AuthDelivery>(workers_per_shard, auth_queue, timed_post_telegram_code);
+		if (!shard->loop->add(shard->auth->notify_fd(), LOOP_READ)) {
+			std::cerr << "Failed to watch auth delivery queue\n";
+			return 1;
+		}
+		shards.push_back(std::move(shard));
+	}
+	if (backend == LoopBackend::Uring)
+		history_store().use_io_ring();
+	if (history_compress && !history_store().compress_history())
+		std::cerr << "history compression is not available in this build, storing history uncompressed\n";
+	history_store().set_retention(retention);
+	start_history_writer(history_sync, history_sync_interval, &history_append_us);
+	if (retention.enabled())
+		start_history_compactor(HistoryCompactor::DEFAULT_INTERVAL, report_compaction);
+	for (size_t i = 0; i < shards.size(); ++i)
+		shards[i]->thread = std::thread(run_shard, i);
+
+	std::cout << "Server listening on port " << port << " (" << shards[0]->loop->name() << ", "
+	          << shards.size() << " threads)" << std::endl;
+
+	if (predecessor != -1) {
+		adopt_sessions(inherited, *shards[0]->loop);
+		auto pause = std::chrono::steady_clock::now() -
+		             std::chrono::steady_clock::time_point(std::chrono::nanoseconds(inherited.frozen_at_ns));
+		auto pause_us = std::chrono::duration_cast<std::chrono::microseconds>(pause).count();
+		handoff_pause_us.set(pause_us);
+		char ack = HANDOFF_ACK;
+		send(predecessor, &ack, 1, MSG_NOSIGNAL);
+		std::cout << "Took over " << inherited.sessions.size() << " connections, service paused for "
+		          << pause_us / 1000.0 << " ms" << std::endl;
+		// Прежний процесс закрывает сокет, завершаясь: после этого свободны порт метрик и путь передачи.
+		ssize_t n;
+		while ((n = recv(predecessor, &ack, 1, 0)) > 0 || (n < 0 && errno == EINTR)) {}
+		close(predecessor);
+	}
+
+	MetricsEndpoint metrics_endpoint([] { return metrics.prometheus(); });
+	if (metrics_port > 0) {
+		if (metrics_endpoint.start(metrics_port))
+			std::cout << "Metrics: http://127.0.0.1:" << metrics_endpoint.port() << "/metrics" << std::endl;
+		else
+			std::cerr << "Cannot open metrics port " << metrics_port << ", metrics endpoint disabled\n";
+	}
+
+	int handoff_listener = -1;
+	std::thread handoff_thread;
+	if (handoff_socket_path != "none") {
+		handoff_listener = listen_handoff_socket(handoff_socket_path);
+		if (handoff_listener != -1)
+			handoff_thread = std::thread(serve_handoff, handoff_listener, history_sync, history_sync_interval,
+			                             std::ref(metrics_endpoint));
+		else
+			std::cerr << "Cannot open handoff socket " << handoff_socket_path << ", hot restart disabled\n";
+	}
+
+	std::string cmd;
+	while (std::getline(std::cin, cmd)) {
+		if (cmd == "/shutdown") {
+			std::cout << "Shutting down server...\n";
+			if (handoff_thread.joinable()) {
+				shutdown(handoff_listener, SHUT_RDWR);
+				handoff_thread.join();
+				close(handoff_listener);
+				unlink(handoff_socket_path.c_str());
+			}
+			run_on_each_shard(shutdown_shard);
+			for (auto& shard : shards)
+				shard->thread.join();
+			metrics_endpoint.stop();
+			stop_history_compactor();
+			uint64_t pending = history_writer()->stats().queued;
+			stop_history_writer();
+			std::cout << "History drained (" << pending << " pending messages).\n";
+			std::cout << "Server stopped.\n";
+			return 0;
+		}
+		if (cmd == "/queues") {
+			run_on_each_shard(print_queue_stats);
+			print_pool_stats();
+		}
+		if (cmd == "/auth")
+			run_on_each_shard([] { print_auth_stats(*auth_delivery); });
+		if (cmd == "/disk") {
+			print_history_stats(*history_writer());
+			if (history_compactor())
+				print_compactor_stats(*history_compactor());
+		}
+		if (cmd == "/stats")
+			std::cout << metrics.summary();
+	}
+
+	// Консоль закрыта: сервер работает до завершения процесса.
+	for (auto& shard : shards)
+		shard->thread.join();
+	return 0;
+}
@@ -0,0 +1,35 @@
+#include "message_format.h"
+
+#include <ctime>
+
+TimestampCache::TimestampCache() {
+	refresh();
+}
+
+bool TimestampCache::refresh(std::chrono::system_clock::time_point now) {
+	int64_t minute = std::chrono::floor<std::chrono::minutes>(now).time_since_epoch().count();
+	if (minute == minute_)
+		return false;
+	minute_ = minute;
+
+	time_t seconds = std::chrono::system_clock::to_time_t(now);
+	tm local{};
+	localtime_r(&seconds, &local);
+	char buf[32];
+	size_t len = strftime(buf, sizeof(buf), FORMAT, &local);
+	text_.assign(buf, len);
+	++formats_;
+	return true;
+}
+
+int TimestampCache::ms_until_rollover(std::chrono::system_clock::time_point now) const {
+	auto next = std::chrono::floor<std::chrono::minutes>(now) + std::chrono::minutes(1);
+	return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(next - now).count());
+}
+
+size_t chat_line_size(std::string_view timestamp, std::string_view sender, std::string_view room,
+                      std::string_view text) {
+	// "[" ts "] " sender ["@" room] ": " text "\n"
+	return 1 + timestamp.size() + 2 + sender.size() + (room.empty() ? 0 : 1 + room.size()) + 2 +
+	       text.size() + 1;
+}
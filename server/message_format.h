@@ -0,0 +1,98 @@
+/**
+ * @file message_format.h
+ * @brief Форматирование строк чата: кэш метки времени и сборка сообщения.
+ *
+ * Механизм:
+ * - Метка "YYYY-MM-DD HH:MM" меняется раз в минуту, поэтому
+ *   TimestampCache форматирует её (localtime_r + strftime) только при
+ *   смене минуты. Обновление вызывает цикл событий шарда после каждого
+ *   ожидания; таймаут ожидания не превышает времени до следующей минуты.
+ * - append_chat_line() собирает "[метка] отправитель: текст\n" за одно
+ *   резервирование памяти вместо цепочки временных строк.
+ */
+
+#ifndef MESSAGE_FORMAT_H
+#define MESSAGE_FORMAT_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * @class TimestampCache
+ * @brief Отформатированная метка текущей минуты.
+ *
+ * Не потокобезопасен: у каждого потока-реактора свой экземпляр.
+ */
+class TimestampCache {
+public:
+	/// Формат метки (strftime).
+	static constexpr const char* FORMAT = "%Y-%m-%d %H:%M";
+
+	/// Сразу форматирует текущую минуту.
+	TimestampCache();
+
+	/**
+	 * @brief Обновить метку, если минута сменилась.
+	 *
+	 * @param now Текущее время.
+	 * @return true, если метка была переформатирована.
+	 */
+	bool refresh(std::chrono::system_clock::time_point now = std::chrono::system_clock::now());
+
+	/// Метка последней обновлённой минуты.
+	const std::string& current() const { return text_; }
+
+	/**
+	 * @brief Миллисекунд до начала следующей минуты (таймаут цикла событий).
+	 *
+	 * @param now Текущее время.
+	 */
+	int ms_until_rollover(std::chrono::system_clock::time_point now = std::chrono::system_clock::now()) const;
+
+	/// Сколько раз метка форматировалась (для тестов и диагностики).
+	uint64_t formats() const { return formats_; }
+
+private:
+	int64_t minute_ = -1;  ///< Номер минуты от эпохи, для которой сформирована метка.
+	std::string text_;
+	uint64_t formats_ = 0;
+};
+
+/**
+ * @brief Длина строки, которую допишет append_chat_line().
+ */
+size_t chat_line_size(std::string_view timestamp, std::string_view sender, std::string_view room,
+                      std::string_view text);
+
+/**
+ * @brief Дописать строку чата "[метка] отправитель@комната: текст\n".
+ *
+ * Память под строку резервируется один раз.
+ *
+ * @param out       Буфер (std::string или PooledBuffer), в конец которого
+ *                  дописывается строка.
+ * @param timestamp Метка времени.
+ * @param sender    Telegram ID отправителя.
+ * @param room      Имя комнаты; пустое — личная беседа (без "@комната").
+ * @param text      Текст сообщения.
+ */
+template <typename Out>
+void append_chat_line(Out& out, std::string_view timestamp, std::string_view sender, std::string_view room,
+                      std::string_view text) {
+	out.reserve(out.size() + chat_line_size(timestamp, sender, room, text));
+	out.push_back('[');
+	out.append(timestamp);
+	out.append("] ");
+	out.append(sender);
+	if (!room.empty()) {
+		out.push_back('@');
+		out.append(room);
+	}
+	out.append(": ");
+	out.append(text);
+	out.push_back('\n');
+}
+
+#endif  // MESSAGE_FORMAT_H
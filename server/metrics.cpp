@@ -0,0 +1,217 @@
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <sstream>
+
+#include "socket_utils.h"
+
+void Histogram::record(uint64_t value) {
+	buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(value, std::memory_order_relaxed);
+	uint64_t prev = max_.load(std::memory_order_relaxed);
+	while (prev < value && !max_.compare_exchange_weak(prev, value, std::memory_order_relaxed)) {
+	}
+}
+
+size_t Histogram::bucket_of(uint64_t value) {
+	if (value < SUB_BUCKETS)
+		return static_cast<size_t>(value);
+	// Старшие 5 бит значения: степень двойки и номер линейной корзины внутри неё.
+	size_t shift = static_cast<size_t>(std::bit_width(value)) - 5;
+	size_t bucket = (shift + 1) * SUB_BUCKETS + static_cast<size_t>((value >> shift) - SUB_BUCKETS);
+	return std::min(bucket, BUCKETS - 1);
+}
+
+uint64_t Histogram::upper_bound(size_t bucket) {
+	if (bucket < SUB_BUCKETS)
+		return bucket;
+	size_t shift = bucket / SUB_BUCKETS - 1;
+	uint64_t mantissa = SUB_BUCKETS + bucket % SUB_BUCKETS;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+	HistogramSnapshot st;
+	std::array<uint64_t, BUCKETS> counts;
+	for (size_t i = 0; i < BUCKETS; ++i) {
+		counts[i] = buckets_[i].load(std::memory_order_relaxed);
+		st.count += counts[i];
+	}
+	st.sum = sum_.load(std::memory_order_relaxed);
+	st.max = max_.load(std::memory_order_relaxed);
+	if (st.count == 0)
+		return st;
+
+	struct Target {
+		uint64_t per_mille;
+		uint64_t* out;
+	} targets[] = {{500, &st.p50}, {900, &st.p90}, {990, &st.p99}, {999, &st.p999}};
+	uint64_t seen = 0;
+	size_t next = 0;
+	for (size_t i = 0; i < BUCKETS && next < std::size(targets); ++i) {
+		seen += counts[i];
+		while (next < std::size(targets) && seen * 1000 >= st.count * targets[next].per_mille)
+			*targets[next++].out = std::min(upper_bound(i), st.max);
+	}
+	return st;
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	entries_.push_back({Kind::Counter, name, help, counters_.size()});
+	return counters_.emplace_back();
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	entries_.push_back({Kind::Gauge, name, help, gauges_.size()});
+	return gauges_.emplace_back();
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	entries_.push_back({Kind::Histogram, name, help, histograms_.size()});
+	return histograms_.emplace_back();
+}
+
+std::string MetricsRegistry::prometheus() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::ostringstream out;
+	for (const Entry& e : entries_) {
+		out << "# HELP " << e.name << ' ' << e.help << '\n';
+		if (e.kind == Kind::Counter) {
+			out << "# TYPE " << e.name << " counter\n" << e.name << ' ' << counters_[e.index].value() << '\n';
+		} else if (e.kind == Kind::Gauge) {
+			out << "# TYPE " << e.name << " gauge\n" << e.name << ' ' << gauges_[e.index].value() << '\n';
+		} else {
+			HistogramSnapshot st = histograms_[e.index].snapshot();
+			out << "# TYPE " << e.name << " summary\n"
+			    << e.name << "{quantile=\"0.5\"} " << st.p50 << '\n'
+			    << e.name << "{quantile=\"0.9\"} " << st.p90 << '\n'
+			    << e.name << "{quantile=\"0.99\"} " << st.p99 << '\n'
+			    << e.name << "{quantile=\"0.999\"} " << st.p999 << '\n'
+			    << e.name << "_sum " << st.sum << '\n'
+			    << e.name << "_count " << st.count << '\n'
+			    << "# HELP " << e.name << "_max Largest observed value\n"
+			    << "# TYPE " << e.name << "_max gauge\n"
+			    << e.name << "_max " << st.max << '\n';
+		}
+	}
+	return out.str();
+}
+
+std::string MetricsRegistry::summary() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::ostringstream out;
+	for (const Entry& e : entries_) {
+		out << e.name << ": ";
+		if (e.kind == Kind::Counter) {
+			out << counters_[e.index].value();
+		} else if (e.kind == Kind::Gauge) {
+			out << gauges_[e.index].value();
+		} else {
+			HistogramSnapshot st = histograms_[e.index].snapshot();
+			out << "count=" << st.count << " avg=" << st.avg() << " p50<=" << st.p50 << " p90<=" << st.p90
+			    << " p99<=" << st.p99 << " p999<=" << st.p999 << " max=" << st.max;
+		}
+		out << '\n';
+	}
+	return out.str();
+}
+
+MetricsEndpoint::MetricsEndpoint(Render render) : render_(std::move(render)) {}
+
+MetricsEndpoint::~MetricsEndpoint() {
+	stop();
+}
+
+bool MetricsEndpoint::start(int port, const std::string& address) {
+	stop();
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(static_cast<uint16_t>(port));
+	if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+		return false;
+
+	listener_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int opt = 1;
+	if (listener_ == -1 || setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+	    bind(listener_, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener_, 16) < 0) {
+		if (listener_ != -1)
+			close(listener_);
+		listener_ = -1;
+		return false;
+	}
+	socklen_t len = sizeof(addr);
+	getsockname(listener_, (sockaddr*)&addr, &len);
+	port_ = ntohs(addr.sin_port);
+
+	stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	thread_ = std::thread(&MetricsEndpoint::run, this);
+	return true;
+}
+
+void MetricsEndpoint::stop() {
+	if (thread_.joinable()) {
+		uint64_t one = 1;
+		ssize_t ignored = write(stop_fd_, &one, sizeof(one));
+		(void)ignored;
+		thread_.join();
+	}
+	if (listener_ != -1)
+		close(listener_);
+	if (stop_fd_ != -1)
+		close(stop_fd_);
+	listener_ = stop_fd_ = -1;
+}
+
+void MetricsEndpoint::run() {
+	while (true) {
+		pollfd pfds[2] = {{listener_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+		if (poll(pfds, 2, -1) < 0)
+			continue;
+		if (pfds[1].revents != 0)
+			return;
+		int fd = accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd == -1)
+			continue;
+		serve(fd);
+		close(fd);
+	}
+}
+
+void MetricsEndpoint::serve(int fd) {
+	// Сборщик присылает короткий запрос; ждём заголовки не дольше секунды.
+	timeval timeout{1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	std::string request;
+	char buf[1024];
+	while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n <= 0)
+			break;
+		request.append(buf, static_cast<size_t>(n));
+	}
+
+	std::string status = "200 OK";
+	std::string body;
+	if (request.starts_with("GET /metrics ") || request.starts_with("GET / ")) {
+		body = render_();
+	} else {
+		status = "404 Not Found";
+		body = "Use GET /metrics\n";
+	}
+	std::string response = "HTTP/1.1 " + status +
+	                       "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: " +
+	                       std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+	send_all(fd, response);
+}
@@ -0,0 +1,231 @@
+/**
+ * @file metrics.h
+ * @brief Метрики сервера: счётчики, показатели, гистограммы задержек и HTTP-точка для Prometheus.
+ *
+ * Механизм:
+ * - Counter и Gauge — атомарные значения без блокировок; их обновляют
+ *   потоки-реакторы и рабочие потоки на горячем пути.
+ * - Histogram — гистограмма в стиле HDR: каждая степень двойки делится на
+ *   SUB_BUCKETS линейных корзин, поэтому относительная погрешность
+ *   перцентилей не превышает 1/SUB_BUCKETS (~6%) во всём диапазоне
+ *   от микросекунд до суток. Запись — один fetch_add по корзине.
+ * - MetricsRegistry хранит именованные метрики и выводит их в текстовом
+ *   формате Prometheus (гистограммы — как summary с квантилями) и в виде
+ *   сводки для консоли сервера (/stats).
+ * - MetricsEndpoint — поток, отвечающий на HTTP GET на отдельном
+ *   локальном порту текстом от MetricsRegistry.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @class Counter
+ * @brief Монотонный счётчик событий.
+ */
+class Counter {
+public:
+	/// Увеличить счётчик на @p n.
+	void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+	/// Текущее значение.
+	uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> value_{0};
+};
+
+/**
+ * @class Gauge
+ * @brief Текущее значение величины (число клиентов, байт в очередях).
+ */
+class Gauge {
+public:
+	/// Изменить значение на @p delta.
+	void add(int64_t delta) { value_.fetch_add(delta, std::memory_order_relaxed); }
+	/// Уменьшить значение на @p delta.
+	void sub(int64_t delta) { value_.fetch_sub(delta, std::memory_order_relaxed); }
+	/// Установить значение.
+	void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+	/// Текущее значение.
+	int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<int64_t> value_{0};
+};
+
+/**
+ * @struct HistogramSnapshot
+ * @brief Согласованный снимок гистограммы.
+ *
+ * Перцентили равны верхней границе соответствующей корзины
+ * (но не больше максимума).
+ */
+struct HistogramSnapshot {
+	uint64_t count = 0;  ///< Число записанных значений.
+	uint64_t sum = 0;    ///< Сумма значений.
+	uint64_t max = 0;    ///< Наибольшее значение.
+	uint64_t p50 = 0;    ///< Медиана.
+	uint64_t p90 = 0;    ///< 90-й перцентиль.
+	uint64_t p99 = 0;    ///< 99-й перцентиль.
+	uint64_t p999 = 0;   ///< 99.9-й перцентиль.
+
+	/// Среднее значение (0 для пустой гистограммы).
+	uint64_t avg() const { return count == 0 ? 0 : sum / count; }
+};
+
+/**
+ * @class Histogram
+ * @brief Гистограмма неотрицательных значений (обычно задержек в мкс) в стиле HDR.
+ *
+ * record() потокобезопасен и не блокируется.
+ */
+class Histogram {
+public:
+	/// Линейных корзин на одну степень двойки.
+	static constexpr size_t SUB_BUCKETS = 16;
+	/// Всего корзин: значения до 2^48 (около 9 лет в мкс); большие попадают в последнюю.
+	static constexpr size_t BUCKETS = (48 - 4 + 1) * SUB_BUCKETS;
+
+	/**
+	 * @brief Записать значение.
+	 *
+	 * @param value Значение (например, задержка в микросекундах).
+	 */
+	void record(uint64_t value);
+
+	/**
+	 * @brief Снимок со сводными значениями и перцентилями.
+	 */
+	HistogramSnapshot snapshot() const;
+
+	/**
+	 * @brief Номер корзины для значения.
+	 */
+	static size_t bucket_of(uint64_t value);
+
+	/**
+	 * @brief Наибольшее значение, попадающее в корзину @p bucket.
+	 */
+	static uint64_t upper_bound(size_t bucket);
+
+private:
+	std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+	std::atomic<uint64_t> sum_{0};
+	std::atomic<uint64_t> max_{0};
+};
+
+/**
+ * @class MetricsRegistry
+ * @brief Набор именованных метрик с выводом для Prometheus и консоли.
+ *
+ * Метрики создаются при инициализации и живут столько же, сколько
+ * реестр; ссылки на них остаются действительными.
+ */
+class MetricsRegistry {
+public:
+	/**
+	 * @brief Зарегистрировать счётчик.
+	 *
+	 * @param name Имя в формате Prometheus (например, messenger_logins_total).
+	 * @param help Описание для строки # HELP.
+	 */
+	Counter& counter(const std::string& name, const std::string& help);
+
+	/**
+	 * @brief Зарегистрировать показатель.
+	 */
+	Gauge& gauge(const std::string& name, const std::string& help);
+
+	/**
+	 * @brief Зарегистрировать гистограмму.
+	 *
+	 * Единицу измерения принято указывать суффиксом имени (_us, _bytes).
+	 */
+	Histogram& histogram(const std::string& name, const std::string& help);
+
+	/**
+	 * @brief Все метрики в текстовом формате Prometheus (version 0.0.4).
+	 */
+	std::string prometheus() const;
+
+	/**
+	 * @brief Краткая сводка для консоли сервера.
+	 */
+	std::string summary() const;
+
+private:
+	enum class Kind { Counter, Gauge, Histogram };
+
+	struct Entry {
+		Kind kind;
+		std::string name;
+		std::string help;
+		size_t index;  ///< Позиция в соответствующем контейнере.
+	};
+
+	mutable std::mutex mutex_;
+	std::vector<Entry> entries_;
+	std::deque<Counter> counters_;
+	std::deque<Gauge> gauges_;
+	std::deque<Histogram> histograms_;
+};
+
+/**
+ * @class MetricsEndpoint
+ * @brief HTTP-точка для сбора метрик (GET /metrics) на отдельном порту.
+ *
+ * Запросы обслуживаются по одному в собственном потоке, поэтому медленный
+ * сборщик не влияет на циклы событий сервера.
+ */
+class MetricsEndpoint {
+public:
+	/// Функция, формирующая тело ответа.
+	using Render = std::function<std::string()>;
+
+	explicit MetricsEndpoint(Render render);
+	~MetricsEndpoint();
+
+	MetricsEndpoint(const MetricsEndpoint&) = delete;
+	MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+	/**
+	 * @brief Открыть порт и запустить поток.
+	 *
+	 * @param port    Порт; 0 — выбрать свободный (см. port()).
+	 * @param address IPv4-адрес; по умолчанию только локальные подключения.
+	 * @return false, если порт открыть не удалось.
+	 */
+	bool start(int port, const std::string& address = "127.0.0.1");
+
+	/**
+	 * @brief Порт, на котором принимаются запросы (после start()).
+	 */
+	int port() const { return port_; }
+
+	/**
+	 * @brief Остановить поток и закрыть порт. Повторный вызов ничего не делает.
+	 */
+	void stop();
+
+private:
+	void run();
+	void serve(int fd);
+
+	Render render_;
+	int listener_ = -1;
+	int stop_fd_ = -1;
+	int port_ = 0;
+	std::thread thread_;
+};
+
+#endif  // METRICS_H
@@ -0,0 +1,101 @@
+/**
+ * @file mpsc_queue.h
+ * @brief Неблокирующая очередь "много производителей — один потребитель".
+ *
+ * Механизм:
+ * - Производители добавляют узел в голову односвязного стека одной
+ *   операцией compare-exchange, без мьютексов.
+ * - Потребитель забирает весь стек одним exchange и разворачивает его,
+ *   восстанавливая порядок добавления (FIFO для каждого производителя
+ *   и общий порядок по моментам публикации).
+ * - push() сообщает, была ли очередь пуста: будить потребителя
+ *   (eventfd) нужно только при таком переходе.
+ * - Узлы берутся из общего пула (buffer_pool.h), а не из кучи.
+ */
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include "buffer_pool.h"
+
+/**
+ * @class MpscQueue
+ * @brief Очередь значений T для одного потребителя.
+ *
+ * push() потокобезопасен; take_all() вызывается только потребителем.
+ */
+template <typename T>
+class MpscQueue {
+public:
+	MpscQueue() = default;
+	~MpscQueue() {
+		Node* n = head_.exchange(nullptr, std::memory_order_acquire);
+		while (n != nullptr) {
+			Node* next = n->next;
+			delete n;
+			n = next;
+		}
+	}
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	/**
+	 * @brief Добавить значение.
+	 *
+	 * @return true, если до вызова очередь была пуста.
+	 */
+	bool push(T value) {
+		Node* node = new Node{std::move(value), nullptr};
+		// После публикации узел принадлежит потребителю: дальше смотрим только на prev.
+		Node* prev = head_.load(std::memory_order_relaxed);
+		do {
+			node->next = prev;
+		} while (
+		    !head_.compare_exchange_weak(prev, node, std::memory_order_release, std::memory_order_relaxed));
+		return prev == nullptr;
+	}
+
+	/**
+	 * @brief Забрать все значения в порядке добавления.
+	 *
+	 * @param out Вектор, в конец которого дописываются значения.
+	 * @return Число забранных значений.
+	 */
+	size_t take_all(std::vector<T>& out) {
+		Node* n = head_.exchange(nullptr, std::memory_order_acquire);
+		size_t first = out.size();
+		while (n != nullptr) {
+			out.push_back(std::move(n->value));
+			Node* next = n->next;
+			delete n;
+			n = next;
+		}
+		// Стек хранит значения в обратном порядке: разворачиваем.
+		std::reverse(out.begin() + static_cast<std::ptrdiff_t>(first), out.end());
+		return out.size() - first;
+	}
+
+	/**
+	 * @brief Пуста ли очередь (приблизительно, для диагностики).
+	 */
+	bool empty() const { return head_.load(std::memory_order_relaxed) == nullptr; }
+
+private:
+	struct Node {
+		T value;
+		Node* next;
+
+		static void* operator new(size_t size) { return buffer_pool().allocate(size); }
+		static void operator delete(void* p, size_t size) { buffer_pool().release(p, size); }
+	};
+
+	std::atomic<Node*> head_{nullptr};
+};
+
+#endif  // MPSC_QUEUE_H
@@ -0,0 +1,124 @@
+#include "rooms.h"
+
+#include <algorithm>
+#include <mutex>
+
+std::shared_ptr<const RoomRoster> RoomRegistry::make_roster(std::string name,
+                                                            std::vector<RoomMember> members) {
+	auto roster = std::make_shared<RoomRoster>();
+	roster->name = std::move(name);
+	roster->members = std::move(members);
+	for (const RoomMember& m : roster->members)
+		if (std::find(roster->shards.begin(), roster->shards.end(), m.ref.shard) == roster->shards.end())
+			roster->shards.push_back(m.ref.shard);
+	return roster;
+}
+
+std::shared_ptr<const RoomRoster> RoomRegistry::create(const std::string& name, const RoomMember& owner) {
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	auto [it, inserted] = rooms_.try_emplace(name);
+	if (!inserted)
+		return nullptr;
+	it->second.roster = make_roster(name, {owner});
+	it->second.speaker = owner.ref;
+	return it->second.roster;
+}
+
+bool RoomRegistry::restore(const std::string& name, std::vector<RoomMember> members, size_t speaker) {
+	if (speaker >= members.size())
+		return false;
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	auto [it, inserted] = rooms_.try_emplace(name);
+	if (!inserted)
+		return false;
+	it->second.speaker = members[speaker].ref;
+	it->second.roster = make_roster(name, std::move(members));
+	return true;
+}
+
+std::shared_ptr<const RoomRoster> RoomRegistry::join(const std::string& name, const RoomMember& member) {
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	auto it = rooms_.find(name);
+	if (it == rooms_.end())
+		return nullptr;
+	std::vector<RoomMember> members = it->second.roster->members;
+	members.push_back(member);
+	it->second.roster = make_roster(name, std::move(members));
+	return it->second.roster;
+}
+
+RoomUpdate RoomRegistry::leave(const std::string& name, const ClientRef& ref) {
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	auto it = rooms_.find(name);
+	if (it == rooms_.end())
+		return {};
+	Room& room = it->second;
+	const std::vector<RoomMember>& old = room.roster->members;
+	auto pos = std::find_if(old.begin(), old.end(), [&](const RoomMember& m) { return m.ref == ref; });
+	if (pos == old.end())
+		return {};
+	if (old.size() == 1) {
+		rooms_.erase(it);
+		return {};
+	}
+
+	size_t index = static_cast<size_t>(pos - old.begin());
+	std::vector<RoomMember> members = old;
+	members.erase(members.begin() + static_cast<std::ptrdiff_t>(index));
+	RoomUpdate update;
+	if (room.speaker == ref) {
+		// Право голоса переходит к тому, кто стоял следом за ушедшим.
+		const RoomMember& next = members[index % members.size()];
+		room.speaker = next.ref;
+		update.speaker = next;
+	}
+	room.roster = make_roster(name, std::move(members));
+	update.roster = room.roster;
+	return update;
+}
+
+std::optional<RoomMember> RoomRegistry::pass_speaker(const std::string& name, const ClientRef& ref) {
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	auto it = rooms_.find(name);
+	if (it == rooms_.end() || it->second.speaker != ref)
+		return std::nullopt;
+	const std::vector<RoomMember>& members = it->second.roster->members;
+	if (members.size() < 2)
+		return std::nullopt;
+	auto pos =
+	    std::find_if(members.begin(), members.end(), [&](const RoomMember& m) { return m.ref == ref; });
+	size_t next = (static_cast<size_t>(pos - members.begin()) + 1) % members.size();
+	it->second.speaker = members[next].ref;
+	return members[next];
+}
+
+std::shared_ptr<const RoomRoster> RoomRegistry::speaker_roster(const std::string& name,
+                                                               const ClientRef& ref) const {
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+	auto it = rooms_.find(name);
+	if (it == rooms_.end() || it->second.speaker != ref)
+		return nullptr;
+	return it->second.roster;
+}
+
+std::shared_ptr<const RoomRoster> RoomRegistry::roster(const std::string& name) const {
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+	auto it = rooms_.find(name);
+	return it == rooms_.end() ? nullptr : it->second.roster;
+}
+
+std::vector<std::pair<std::string, size_t>> RoomRegistry::list() const {
+	std::vector<std::pair<std::string, size_t>> out;
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex_);
+		for (const auto& [name, room] : rooms_)
+			out.emplace_back(name, room.roster->members.size());
+	}
+	std::sort(out.begin(), out.end());
+	return out;
+}
+
+void RoomRegistry::clear() {
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	rooms_.clear();
+}
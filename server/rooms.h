@@ -0,0 +1,179 @@
+/**
+ * @file rooms.h
+ * @brief Групповые беседы (комнаты) с одним говорящим.
+ *
+ * Механизм:
+ * - RoomRegistry — общий для всех шардов справочник комнат под
+ *   std::shared_mutex. Состав комнаты меняют только потоки шардов
+ *   самих участников (создание, вход, выход, отключение).
+ * - Состав хранится неизменяемым снимком RoomRoster в shared_ptr:
+ *   вход и выход строят новый снимок, а рассылка сообщения лишь копирует
+ *   указатель под блокировкой чтения, без копирования списка участников.
+ * - В снимке заранее посчитан список шардов участников, чтобы отправить
+ *   в каждый шард ровно одну задачу рассылки.
+ * - Право голоса (говорящий) хранится отдельно от снимка и передаётся
+ *   по кругу командой /vote; при выходе говорящего оно переходит
+ *   к следующему участнику.
+ */
+
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "user_ids.h"
+
+/**
+ * @struct ClientRef
+ * @brief Адрес авторизованного клиента в многопоточном сервере.
+ *
+ * @var ClientRef::shard
+ * Номер шарда, владеющего сокетом клиента.
+ * @var ClientRef::fd
+ * Дескриптор сокета клиента.
+ * @var ClientRef::conn
+ * Номер соединения (Connection::id): отличает клиента от нового
+ * владельца того же fd после переподключения.
+ */
+struct ClientRef {
+	size_t shard = 0;
+	int fd = -1;
+	uint64_t conn = 0;
+
+	bool operator==(const ClientRef&) const = default;
+};
+
+/**
+ * @struct RoomMember
+ * @brief Участник комнаты: номер пользователя и адрес.
+ */
+struct RoomMember {
+	UserId id = NO_USER;
+	ClientRef ref;
+};
+
+/**
+ * @struct RoomRoster
+ * @brief Неизменяемый снимок состава комнаты.
+ *
+ * @var RoomRoster::name
+ * Имя комнаты.
+ * @var RoomRoster::members
+ * Участники в порядке входа.
+ * @var RoomRoster::shards
+ * Номера шардов, где есть участники (без повторов).
+ */
+struct RoomRoster {
+	std::string name;
+	std::vector<RoomMember> members;
+	std::vector<size_t> shards;
+};
+
+/**
+ * @struct RoomUpdate
+ * @brief Результат выхода из комнаты.
+ *
+ * @var RoomUpdate::roster
+ * Состав после выхода; nullptr, если комната опустела и удалена
+ * (или участника в ней не было).
+ * @var RoomUpdate::speaker
+ * Новый говорящий, если право голоса перешло к другому участнику.
+ */
+struct RoomUpdate {
+	std::shared_ptr<const RoomRoster> roster;
+	std::optional<RoomMember> speaker;
+};
+
+/**
+ * @class RoomRegistry
+ * @brief Потокобезопасный справочник комнат.
+ */
+class RoomRegistry {
+public:
+	/**
+	 * @brief Создать комнату; создатель становится говорящим.
+	 *
+	 * @param name  Имя комнаты.
+	 * @param owner Создатель.
+	 * @return Состав новой комнаты; nullptr, если имя занято.
+	 */
+	std::shared_ptr<const RoomRoster> create(const std::string& name, const RoomMember& owner);
+
+	/**
+	 * @brief Войти в комнату слушателем.
+	 *
+	 * @return Состав после входа; nullptr, если комнаты нет.
+	 */
+	std::shared_ptr<const RoomRoster> join(const std::string& name, const RoomMember& member);
+
+	/**
+	 * @brief Выйти из комнаты.
+	 *
+	 * @param name Имя комнаты.
+	 * @param ref  Адрес выходящего участника.
+	 */
+	RoomUpdate leave(const std::string& name, const ClientRef& ref);
+
+	/**
+	 * @brief Передать право голоса следующему участнику.
+	 *
+	 * @param ref Адрес участника, отдающего право голоса.
+	 * @return Новый говорящий; std::nullopt, если @p ref не говорящий
+	 *         или в комнате больше никого нет.
+	 */
+	std::optional<RoomMember> pass_speaker(const std::string& name, const ClientRef& ref);
+
+	/**
+	 * @brief Состав комнаты, если @p ref — её говорящий.
+	 *
+	 * Используется при отправке сообщения: проверка права голоса
+	 * и снимок получателей за одну блокировку чтения.
+	 */
+	std::shared_ptr<const RoomRoster> speaker_roster(const std::string& name, const ClientRef& ref) const;
+
+	/**
+	 * @brief Текущий состав комнаты (nullptr, если комнаты нет).
+	 */
+	std::shared_ptr<const RoomRoster> roster(const std::string& name) const;
+
+	/**
+	 * @brief Имена комнат и число участников, по алфавиту.
+	 */
+	std::vector<std::pair<std::string, size_t>> list() const;
+
+	/**
+	 * @brief Восстановить комнату целиком (горячий перезапуск).
+	 *
+	 * @param name    Имя комнаты.
+	 * @param members Участники в порядке входа.
+	 * @param speaker Номер говорящего в @p members.
+	 * @return false, если имя занято, состав пуст или номер вне состава.
+	 */
+	bool restore(const std::string& name, std::vector<RoomMember> members, size_t speaker);
+
+	/**
+	 * @brief Удалить все комнаты (для тестов).
+	 */
+	void clear();
+
+private:
+	struct Room {
+		std::shared_ptr<const RoomRoster> roster;
+		ClientRef speaker;
+	};
+
+	static std::shared_ptr<const RoomRoster> make_roster(std::string name, std::vector<RoomMember> members);
+
+	mutable std::shared_mutex mutex_;
+	std::unordered_map<std::string, Room> rooms_;
+};
+
+#endif  // ROOMS_H
@@ -0,0 +1,551 @@
+#include "search_index.h"
+
+#include "history_store.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+
+namespace {
+
+	constexpr uint32_t MAGIC = 0x49534d43;  // "CMSI"
+	constexpr uint32_t VERSION = 1;
+
+	/// Заголовок сегмента; за ним словарь (TermEntry[terms]), строки слов и списки записей.
+	struct SegmentHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t first;
+		uint64_t end;
+		uint32_t terms;
+		uint32_t checksum;  ///< FNV-1a всего, что идёт после заголовка.
+		uint64_t strings;
+		uint64_t postings;
+	};
+
+	struct TermEntry {
+		uint64_t post_off;
+		uint64_t last;  ///< Последний номер записи в списке.
+		uint32_t post_len;
+		uint32_t count;
+		uint32_t str_off;
+		uint16_t str_len;
+		uint16_t reserved;
+	};
+
+	static_assert(sizeof(SegmentHeader) == 48 && sizeof(TermEntry) == 32);
+
+	/// Сегменты в файле дельт выравниваются на 8 байт.
+	size_t padded(size_t n) {
+		return (n + 7) & ~size_t{7};
+	}
+
+	uint32_t fnv1a(const char* data, size_t len) {
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < len; ++i) {
+			h ^= static_cast<uint8_t>(data[i]);
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	void put_varint(std::string& out, uint64_t v) {
+		while (v >= 0x80) {
+			out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+			v >>= 7;
+		}
+		out.push_back(static_cast<char>(v));
+	}
+
+	/// Прочитать varint с data[pos]; false, если он обрезан.
+	bool get_varint(const char* data, size_t len, size_t& pos, uint64_t& v) {
+		v = 0;
+		for (unsigned shift = 0; pos < len && shift < 64; shift += 7) {
+			uint8_t b = static_cast<uint8_t>(data[pos++]);
+			v |= uint64_t{b & 0x7fu} << shift;
+			if (!(b & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	bool write_all(int fd, const void* data, size_t len) {
+		const char* p = static_cast<const char*>(data);
+		while (len > 0) {
+			ssize_t n = ::write(fd, p, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			len -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	std::shared_ptr<const MappedRegion> map_file(const std::string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return nullptr;
+		struct stat st {};
+		fstat(fd, &st);
+		std::shared_ptr<const MappedRegion> region;
+		if (st.st_size > 0) {
+			region = std::make_shared<MappedRegion>(fd, 0, static_cast<size_t>(st.st_size));
+			if (!region->ok())
+				region.reset();
+		}
+		::close(fd);
+		return region;
+	}
+
+	/// Разобрать заголовок сегмента в начале data; размеры проверяются по avail.
+	bool parse_segment(const char* data, size_t avail, bool verify, SearchSegment& seg) {
+		SegmentHeader h;
+		if (avail < sizeof(h))
+			return false;
+		std::memcpy(&h, data, sizeof(h));
+		if (h.magic != MAGIC || h.version != VERSION || h.first > h.end)
+			return false;
+		uint64_t room = avail - sizeof(h);
+		if (h.terms > room / sizeof(TermEntry))
+			return false;
+		room -= uint64_t{h.terms} * sizeof(TermEntry);
+		if (h.strings > room || h.postings > room - h.strings)
+			return false;
+		size_t body = static_cast<size_t>(uint64_t{h.terms} * sizeof(TermEntry) + h.strings + h.postings);
+		if (verify && fnv1a(data + sizeof(h), body) != h.checksum)
+			return false;
+		seg.data = data;
+		seg.size = std::min(padded(sizeof(h) + body), avail);
+		seg.first = h.first;
+		seg.end = h.end;
+		seg.terms = h.terms;
+		seg.strings = h.strings;
+		return true;
+	}
+
+	TermEntry entry_at(const SearchSegment& seg, size_t i) {
+		TermEntry e;
+		std::memcpy(&e, seg.data + sizeof(SegmentHeader) + i * sizeof(TermEntry), sizeof(e));
+		return e;
+	}
+
+	const char* strings_of(const SearchSegment& seg) {
+		return seg.data + sizeof(SegmentHeader) + size_t{seg.terms} * sizeof(TermEntry);
+	}
+
+	const char* postings_of(const SearchSegment& seg) {
+		return strings_of(seg) + seg.strings;
+	}
+
+	std::string_view term_of(const SearchSegment& seg, const TermEntry& e) {
+		if (uint64_t{e.str_off} + e.str_len > seg.strings)
+			return {};
+		return std::string_view(strings_of(seg) + e.str_off, e.str_len);
+	}
+
+	/// Байты списка записей слова (пустые, если запись словаря повреждена).
+	std::string_view postings_of(const SearchSegment& seg, const TermEntry& e) {
+		const char* postings = postings_of(seg);
+		size_t limit = seg.size - static_cast<size_t>(postings - seg.data);
+		if (e.post_off > limit || e.post_len > limit - e.post_off)
+			return {};
+		return std::string_view(postings + e.post_off, e.post_len);
+	}
+
+	/// Список записей слова в сегменте (пустой, если слова нет).
+	std::string_view find_term(const SearchSegment& seg, std::string_view term) {
+		size_t lo = 0, hi = seg.terms;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			TermEntry e = entry_at(seg, mid);
+			int cmp = term_of(seg, e).compare(term);
+			if (cmp == 0)
+				return postings_of(seg, e);
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return {};
+	}
+
+	void decode_postings(std::string_view bytes, std::vector<uint64_t>& out) {
+		uint64_t record = 0;
+		size_t pos = 0;
+		uint64_t delta;
+		while (pos < bytes.size() && get_varint(bytes.data(), bytes.size(), pos, delta)) {
+			record += delta;
+			out.push_back(record);
+		}
+	}
+
+	/// Собрать сегмент: header, словарь, строки, списки; дополняется нулями до 8 байт.
+	std::string build_segment(uint64_t first, uint64_t end, const std::vector<TermEntry>& entries,
+	                          const std::string& strings, const std::string& postings) {
+		SegmentHeader h{MAGIC, VERSION, first, end, static_cast<uint32_t>(entries.size()), 0,
+		                strings.size(), postings.size()};
+		std::string out(sizeof(h), '\0');
+		out.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(TermEntry));
+		out += strings;
+		out += postings;
+		h.checksum = fnv1a(out.data() + sizeof(h), out.size() - sizeof(h));
+		std::memcpy(out.data(), &h, sizeof(h));
+		out.resize(padded(out.size()), '\0');
+		return out;
+	}
+
+}  // namespace
+
+void tokenize(std::string_view text, std::vector<std::string>& out) {
+	out.clear();
+	std::string word;
+	auto finish = [&] {
+		if (!word.empty())
+			out.push_back(std::move(word));
+		word.clear();
+	};
+	auto put = [&](char c) {
+		if (word.size() < SearchIndex::MAX_TERM)
+			word.push_back(c);
+	};
+	for (size_t i = 0; i < text.size(); ++i) {
+		uint8_t c = static_cast<uint8_t>(text[i]);
+		if (c < 0x80) {
+			if (c >= 'A' && c <= 'Z')
+				put(static_cast<char>(c - 'A' + 'a'));
+			else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+				put(static_cast<char>(c));
+			else
+				finish();
+			continue;
+		}
+		// Заглавные кириллицы в UTF-8: А–П = D0 90–9F, Р–Я = D0 A0–AF, Ё = D0 81.
+		uint8_t next = i + 1 < text.size() ? static_cast<uint8_t>(text[i + 1]) : 0;
+		if (c == 0xD0 && next >= 0x90 && next <= 0x9F) {
+			put('\xD0');
+			put(static_cast<char>(next + 0x20));
+			++i;
+		} else if (c == 0xD0 && next >= 0xA0 && next <= 0xAF) {
+			put('\xD1');
+			put(static_cast<char>(next - 0x20));
+			++i;
+		} else if (c == 0xD0 && next == 0x81) {
+			put('\xD1');
+			put('\x91');
+			++i;
+		} else {
+			put(static_cast<char>(c));
+		}
+	}
+	finish();
+}
+
+std::string_view message_body(std::string_view line) {
+	// "[YYYY-MM-DD HH:MM] sender: text"
+	if (line.size() < 20 || line[0] != '[' || line.compare(17, 2, "] ") != 0)
+		return line;
+	size_t colon = line.find(": ", 19);
+	if (colon == std::string_view::npos)
+		return line;
+	return line.substr(colon + 2);
+}
+
+SearchIndex::SearchIndex(std::string base) : base_(std::move(base)) {}
+
+SearchIndex::~SearchIndex() = default;
+
+void SearchIndex::drop_files() {
+	::unlink((base_ + ".six").c_str());
+	::unlink((base_ + ".sxd").c_str());
+	main_map_.reset();
+	delta_map_.reset();
+	main_ = SearchSegment{};
+	deltas_.clear();
+	disk_end_ = end_ = 0;
+	mem_.clear();
+	mem_postings_ = 0;
+}
+
+void SearchIndex::reload() {
+	main_ = SearchSegment{};
+	main_map_ = map_file(base_ + ".six");
+	bool valid = main_map_ && parse_segment(main_map_->data(), main_map_->size(), false, main_);
+	if (main_map_ && (!valid || main_.first != 0)) {
+		main_ = SearchSegment{};
+		main_map_.reset();
+		::unlink((base_ + ".six").c_str());
+	}
+
+	deltas_.clear();
+	delta_map_ = map_file(base_ + ".sxd");
+	uint64_t covered = main_.end;
+	size_t pos = 0;
+	bool broken = false;
+	while (delta_map_ && pos < delta_map_->size()) {
+		SearchSegment seg;
+		if (!parse_segment(delta_map_->data() + pos, delta_map_->size() - pos, true, seg))
+			break;
+		pos += seg.size;
+		// Сегменты, уже вошедшие в основной (сбой между шагами слияния), пропускаются.
+		if (seg.end <= main_.end)
+			continue;
+		if (seg.first != covered) {
+			broken = true;
+			break;
+		}
+		deltas_.push_back(seg);
+		covered = seg.end;
+	}
+	if (broken) {
+		drop_files();
+		return;
+	}
+	// Недописанный при сбое сегмент отрезается, чтобы следующий лёг за последним целым.
+	if (delta_map_ && pos < delta_map_->size() && ::truncate((base_ + ".sxd").c_str(), pos) != 0) {
+		drop_files();
+		return;
+	}
+	disk_end_ = covered;
+}
+
+void SearchIndex::open(uint64_t records) {
+	mem_.clear();
+	mem_postings_ = 0;
+	reload();
+	if (disk_end_ > records)
+		drop_files();
+	end_ = disk_end_;
+}
+
+void SearchIndex::add(uint64_t record, std::string_view line) {
+	if (record != end_)
+		return;
+	end_ = record + 1;
+	tokenize(message_body(line), scratch_);
+	std::sort(scratch_.begin(), scratch_.end());
+	scratch_.erase(std::unique(scratch_.begin(), scratch_.end()), scratch_.end());
+	for (std::string& term : scratch_)
+		mem_[std::move(term)].push_back(record);
+	mem_postings_ += scratch_.size();
+	if (mem_postings_ >= FLUSH_POSTINGS)
+		flush();
+}
+
+void SearchIndex::skip_to(uint64_t record) {
+	end_ = std::max(end_, record);
+}
+
+bool SearchIndex::flush() {
+	if (end_ == disk_end_)
+		return true;
+	std::vector<const std::pair<const std::string, std::vector<uint64_t>>*> terms;
+	terms.reserve(mem_.size());
+	for (const auto& item : mem_)
+		terms.push_back(&item);
+	std::sort(terms.begin(), terms.end(), [](auto* a, auto* b) { return a->first < b->first; });
+
+	std::vector<TermEntry> entries;
+	entries.reserve(terms.size());
+	std::string strings, postings;
+	for (auto* item : terms) {
+		TermEntry e{};
+		e.post_off = postings.size();
+		e.str_off = static_cast<uint32_t>(strings.size());
+		e.str_len = static_cast<uint16_t>(item->first.size());
+		e.count = static_cast<uint32_t>(item->second.size());
+		e.last = item->second.back();
+		uint64_t prev = 0;
+		for (uint64_t record : item->second) {
+			put_varint(postings, record - prev);
+			prev = record;
+		}
+		e.post_len = static_cast<uint32_t>(postings.size() - e.post_off);
+		strings += item->first;
+		entries.push_back(e);
+	}
+	std::string segment = build_segment(disk_end_, end_, entries, strings, postings);
+
+	int fd = ::open((base_ + ".sxd").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+	bool ok = write_all(fd, segment.data(), segment.size());
+	::close(fd);
+	if (!ok)
+		return false;
+
+	mem_.clear();
+	mem_postings_ = 0;
+	uint64_t flushed = end_;
+	reload();
+	// Файл могли повредить извне: всё, чего нет на диске, индексируется заново (см. end()).
+	end_ = disk_end_;
+	return disk_end_ == flushed;
+}
+
+void SearchIndex::postings(std::string_view term, std::vector<uint64_t>& out) const {
+	out.clear();
+	if (main_.data != nullptr)
+		decode_postings(find_term(main_, term), out);
+	for (const SearchSegment& seg : deltas_)
+		decode_postings(find_term(seg, term), out);
+	auto it = mem_.find(std::string(term));
+	if (it != mem_.end())
+		out.insert(out.end(), it->second.begin(), it->second.end());
+}
+
+std::vector<uint64_t> SearchIndex::search(std::string_view query, size_t limit, uint64_t* total,
+                                          uint64_t from) const {
+	std::vector<std::string> terms;
+	tokenize(query, terms);
+	std::sort(terms.begin(), terms.end());
+	terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+	std::vector<uint64_t> matches, list, both;
+	for (size_t i = 0; i < terms.size(); ++i) {
+		postings(terms[i], i == 0 ? matches : list);
+		if (i > 0) {
+			both.clear();
+			std::set_intersection(matches.begin(), matches.end(), list.begin(), list.end(),
+			                      std::back_inserter(both));
+			matches.swap(both);
+		}
+		if (matches.empty())
+			break;
+	}
+	matches.erase(matches.begin(), std::lower_bound(matches.begin(), matches.end(), from));
+	if (total != nullptr)
+		*total = matches.size();
+	size_t keep = std::min(limit, matches.size());
+	return std::vector<uint64_t>(matches.rbegin(), matches.rbegin() + static_cast<ptrdiff_t>(keep));
+}
+
+std::unique_ptr<SearchMerge> SearchIndex::plan_merge(size_t min_segments) const {
+	if (deltas_.empty() || deltas_.size() < min_segments)
+		return nullptr;
+	std::unique_ptr<SearchMerge> merge(new SearchMerge());
+	merge->base_ = base_;
+	merge->main_map_ = main_map_;
+	merge->delta_map_ = delta_map_;
+	if (main_.data != nullptr)
+		merge->segments_.push_back(main_);
+	merge->segments_.insert(merge->segments_.end(), deltas_.begin(), deltas_.end());
+	const SearchSegment& last = deltas_.back();
+	merge->delta_bytes_ = static_cast<uint64_t>(last.data + last.size - delta_map_->data());
+	return merge;
+}
+
+bool SearchMerge::run() {
+	struct Item {
+		std::string_view term;
+		size_t segment;
+		TermEntry entry;
+	};
+	std::vector<Item> items;
+	for (size_t s = 0; s < segments_.size(); ++s)
+		for (size_t i = 0; i < segments_[s].terms; ++i) {
+			TermEntry e = entry_at(segments_[s], i);
+			items.push_back(Item{term_of(segments_[s], e), s, e});
+		}
+	// Внутри слова сегменты идут по порядку записей: списки просто склеиваются.
+	std::stable_sort(items.begin(), items.end(),
+	                 [](const Item& a, const Item& b) { return a.term < b.term; });
+
+	std::vector<TermEntry> entries;
+	std::string strings, postings;
+	for (size_t i = 0; i < items.size();) {
+		TermEntry out{};
+		out.post_off = postings.size();
+		out.str_off = static_cast<uint32_t>(strings.size());
+		out.str_len = static_cast<uint16_t>(items[i].term.size());
+		strings += items[i].term;
+		bool any = false;
+		uint64_t last = 0;
+		size_t j = i;
+		for (; j < items.size() && items[j].term == items[i].term; ++j) {
+			const TermEntry& found = items[j].entry;
+			std::string_view bytes = postings_of(segments_[items[j].segment], found);
+			if (bytes.empty())
+				continue;
+			// Первое число списка хранится от нуля: перекодировать его разностью с предыдущим.
+			size_t pos = 0;
+			uint64_t head;
+			if (!get_varint(bytes.data(), bytes.size(), pos, head) || (any && head <= last))
+				continue;
+			put_varint(postings, any ? head - last : head);
+			postings.append(bytes.substr(pos));
+			out.count += found.count;
+			last = found.last;
+			any = true;
+		}
+		out.last = last;
+		out.post_len = static_cast<uint32_t>(postings.size() - out.post_off);
+		if (any)
+			entries.push_back(out);
+		else
+			strings.resize(out.str_off);
+		i = j;
+	}
+	std::string segment = build_segment(0, segments_.back().end, entries, strings, postings);
+
+	std::string tmp = base_ + ".six.tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+	bool ok = write_all(fd, segment.data(), segment.size()) && ::fsync(fd) == 0;
+	::close(fd);
+	if (!ok) {
+		::unlink(tmp.c_str());
+		return false;
+	}
+	written_ = true;
+	return true;
+}
+
+bool SearchMerge::commit() {
+	if (!written_)
+		return false;
+	written_ = false;
+	std::string delta = base_ + ".sxd";
+	int fd = ::open(delta.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st {};
+	if (fd == -1 || fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < delta_bytes_) {
+		// Индекс удалили, пока шло слияние: результат устарел.
+		if (fd != -1)
+			::close(fd);
+		::unlink((base_ + ".six.tmp").c_str());
+		return false;
+	}
+	// Сегменты, дописанные после plan_merge(), остаются в файле дельт.
+	std::string tail(static_cast<size_t>(st.st_size - delta_bytes_), '\0');
+	size_t got = 0;
+	while (got < tail.size()) {
+		ssize_t n = ::pread(fd, tail.data() + got, tail.size() - got, static_cast<off_t>(delta_bytes_ + got));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += static_cast<size_t>(n);
+	}
+	::close(fd);
+	tail.resize(got);
+
+	// Сначала основной сегмент: при сбое до замены дельт поглощённые сегменты пропускаются при загрузке.
+	if (::rename((base_ + ".six.tmp").c_str(), (base_ + ".six").c_str()) != 0)
+		return false;
+	if (tail.empty())
+		return ::unlink(delta.c_str()) == 0;
+	std::string tmp = delta + ".tmp";
+	fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+	bool ok = write_all(fd, tail.data(), tail.size());
+	::close(fd);
+	return ok && ::rename(tmp.c_str(), delta.c_str()) == 0;
+}
@@ -0,0 +1,214 @@
+/**
+ * @file search_index.h
+ * @brief Инвертированный индекс для поиска по истории одной переписки.
+ *
+ * Механизм:
+ * - Текст сообщения (без префикса "[время] отправитель: ") разбивается
+ *   на слова: буквы и цифры, ASCII и кириллица приводятся к нижнему регистру.
+ * - Для каждого слова хранится список номеров записей журнала (postings),
+ *   в которых оно встречается. Номера возрастают и хранятся разностями
+ *   в формате varint, поэтому частое слово занимает 1–2 байта на сообщение.
+ * - Новые сообщения индексируются при записи в память; когда в памяти
+ *   набирается FLUSH_POSTINGS вхождений (или журнал закрывается), они
+ *   дописываются сегментом в файл дельт base.sxd.
+ * - Сегменты дельт сливаются в основной сегмент base.six в фоне
+ *   (plan_merge(), SearchMerge): слияние — это склейка списков без
+ *   распаковки, с перекодированием только первого числа каждого.
+ * - Запрос ищет каждое слово двоичным поиском по словарю сегментов
+ *   (отображённых в память) и пересекает списки; журнал не читается.
+ * - Индекс восстанавливаем: повреждённый хвост файла дельт отрезается,
+ *   а записи, которых нет в индексе, HistoryStore досчитывает из журнала.
+ *
+ * Все числа записываются в порядке байт платформы, как и в журнале.
+ */
+
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class MappedRegion;
+
+/**
+ * @brief Разбить текст на слова для поиска.
+ *
+ * Слово — непрерывная последовательность букв и цифр (байты UTF-8 вне
+ * ASCII считаются буквами). Заглавные ASCII и кириллица (включая Ё)
+ * приводятся к строчным; слова длиннее MAX_TERM байт обрезаются.
+ *
+ * @param text Текст.
+ * @param out  Слова по порядку (с повторами); предыдущее содержимое стирается.
+ */
+void tokenize(std::string_view text, std::vector<std::string>& out);
+
+/**
+ * @brief Текст сообщения без префикса "[YYYY-MM-DD HH:MM] отправитель: ".
+ *
+ * Строки без префикса возвращаются целиком.
+ */
+std::string_view message_body(std::string_view line);
+
+/**
+ * @struct SearchSegment
+ * @brief Отображённый сегмент индекса (основной или один из дельт).
+ *
+ * @var SearchSegment::data
+ * Начало сегмента.
+ * @var SearchSegment::size
+ * Длина сегмента.
+ * @var SearchSegment::first
+ * Первая запись журнала, покрытая сегментом.
+ * @var SearchSegment::end
+ * Запись, следующая за последней покрытой.
+ * @var SearchSegment::terms
+ * Число слов в словаре.
+ * @var SearchSegment::strings
+ * Длина блока строк словаря.
+ */
+struct SearchSegment {
+	const char* data = nullptr;
+	size_t size = 0;
+	uint64_t first = 0;
+	uint64_t end = 0;
+	uint32_t terms = 0;
+	uint64_t strings = 0;
+};
+
+class SearchMerge;
+
+/**
+ * @class SearchIndex
+ * @brief Индекс одной переписки: основной сегмент, дельты и записи в памяти.
+ *
+ * Не потокобезопасен: HistoryStore вызывает его под своим мьютексом.
+ */
+class SearchIndex {
+public:
+	/// Наибольшая длина слова в байтах.
+	static constexpr size_t MAX_TERM = 64;
+	/// Сколько вхождений копится в памяти до записи сегмента дельт.
+	static constexpr size_t FLUSH_POSTINGS = 65536;
+	/// Сколько сегментов дельт допускается до слияния с основным.
+	static constexpr size_t MERGE_SEGMENTS = 8;
+
+	/**
+	 * @param base Путь журнала без расширения; индекс лежит в base.six и base.sxd.
+	 */
+	explicit SearchIndex(std::string base);
+	~SearchIndex();
+
+	SearchIndex(const SearchIndex&) = delete;
+	SearchIndex& operator=(const SearchIndex&) = delete;
+
+	/**
+	 * @brief Загрузить сегменты с диска.
+	 *
+	 * Повреждённый хвост файла дельт отрезается. Если индекс описывает
+	 * больше записей, чем есть в журнале (журнал был усечён), он удаляется
+	 * целиком и строится заново.
+	 *
+	 * @param records Число записей в журнале.
+	 */
+	void open(uint64_t records);
+
+	/// Перечитать файлы после слияния (записи в памяти сохраняются).
+	void reload();
+
+	/// Номер следующей записи, которую ждёт add(): всё до неё уже в индексе.
+	uint64_t end() const { return end_; }
+
+	/**
+	 * @brief Проиндексировать запись журнала.
+	 *
+	 * @param record Номер записи; должен быть равен end().
+	 * @param line   Строка сообщения (префикс отбрасывается message_body()).
+	 */
+	void add(uint64_t record, std::string_view line);
+
+	/**
+	 * @brief Пропустить записи до @p record (удалены из журнала политикой хранения).
+	 */
+	void skip_to(uint64_t record);
+
+	/// Вхождений в памяти, ещё не записанных в сегмент.
+	size_t pending() const { return mem_postings_; }
+
+	/**
+	 * @brief Дописать записи из памяти сегментом в файл дельт.
+	 *
+	 * @return false при ошибке ввода-вывода (записи остаются в памяти).
+	 */
+	bool flush();
+
+	/// Число сегментов дельт.
+	size_t delta_segments() const { return deltas_.size(); }
+
+	/**
+	 * @brief Найти записи, содержащие все слова запроса.
+	 *
+	 * @param query Слова через пробел (разбираются tokenize()).
+	 * @param limit Наибольшее число возвращаемых номеров.
+	 * @param total Если не nullptr — сюда записывается число всех совпадений.
+	 * @param from  Не возвращать и не считать записи с меньшими номерами (удалённые).
+	 * @return Номера записей, начиная с самой новой.
+	 */
+	std::vector<uint64_t> search(std::string_view query, size_t limit, uint64_t* total = nullptr,
+	                             uint64_t from = 0) const;
+
+	/**
+	 * @brief Подготовить слияние дельт с основным сегментом.
+	 *
+	 * @return nullptr, если дельт меньше @p min_segments.
+	 */
+	std::unique_ptr<SearchMerge> plan_merge(size_t min_segments = MERGE_SEGMENTS) const;
+
+private:
+	void postings(std::string_view term, std::vector<uint64_t>& out) const;
+	void drop_files();
+
+	std::string base_;
+	std::shared_ptr<const MappedRegion> main_map_;
+	std::shared_ptr<const MappedRegion> delta_map_;
+	SearchSegment main_;
+	std::vector<SearchSegment> deltas_;
+	uint64_t disk_end_ = 0;  ///< Конец записей, покрытых сегментами на диске.
+	uint64_t end_ = 0;
+	std::unordered_map<std::string, std::vector<uint64_t>> mem_;
+	size_t mem_postings_ = 0;
+	std::vector<std::string> scratch_;
+};
+
+/**
+ * @class SearchMerge
+ * @brief Слияние сегментов одного индекса, выполняемое вне блокировки.
+ *
+ * run() читает только отображения, снятые в plan_merge(), и пишет
+ * временный файл; commit() (под блокировкой владельца индекса) подменяет
+ * основной сегмент и оставляет в файле дельт только сегменты, дописанные
+ * после plan_merge(). После commit() индекс нужно перечитать (reload()).
+ */
+class SearchMerge {
+public:
+	/// Записать объединённый сегмент во временный файл.
+	bool run();
+	/// Подменить файлы индекса результатом run().
+	bool commit();
+
+private:
+	friend class SearchIndex;
+
+	std::string base_;
+	std::shared_ptr<const MappedRegion> main_map_;
+	std::shared_ptr<const MappedRegion> delta_map_;
+	std::vector<SearchSegment> segments_;  ///< Основной сегмент (если есть), затем дельты.
+	uint64_t delta_bytes_ = 0;              ///< Сколько байт файла дельт покрыто слиянием.
+	bool written_ = false;
+};
+
+#endif  // SEARCH_INDEX_H
@@ -0,0 +1,36 @@
+#include "shard_inbox.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+ShardInbox::ShardInbox() : event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+ShardInbox::~ShardInbox() {
+	if (event_fd_ != -1)
+		close(event_fd_);
+}
+
+void ShardInbox::post(Task task) {
+	posted_.fetch_add(1, std::memory_order_relaxed);
+	if (!queue_.push(std::move(task)))
+		return;
+	wakeups_.fetch_add(1, std::memory_order_relaxed);
+	uint64_t one = 1;
+	ssize_t ignored = write(event_fd_, &one, sizeof(one));
+	(void)ignored;
+}
+
+size_t ShardInbox::run_pending() {
+	uint64_t counter;
+	while (read(event_fd_, &counter, sizeof(counter)) > 0) {
+	}
+
+	size_t done = 0;
+	while (queue_.take_all(batch_) > 0) {
+		for (Task& task : batch_)
+			task();
+		done += batch_.size();
+		batch_.clear();
+	}
+	return done;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file shard_inbox.h
+ * @brief Входящая очередь задач шарда (потока цикла событий).
+ *
+ * Механизм:
+ * - Каждый поток-реактор владеет своей частью клиентов (шардом) и
+ *   единственным входящим ящиком.
+ * - Другие потоки не трогают чужое состояние, а присылают задачу
+ *   (замыкание) через post(): неблокирующая MpscQueue плюс eventfd.
+ * - eventfd взводится только при переходе очереди из пустого состояния,
+ *   поэтому поток задач из одного цикла стоит одного write().
+ * - Владелец регистрирует notify_fd() в своём цикле событий и по
+ *   готовности вызывает run_pending(), выполняя задачи в порядке прихода.
+ * - Задача — PooledTask: замыкание и узел очереди лежат в блоках пула,
+ *   поэтому пересылка между шардами не обращается к куче.
+ */
+
+#ifndef SHARD_INBOX_H
+#define SHARD_INBOX_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "mpsc_queue.h"
+
+/**
+ * @class ShardInbox
+ * @brief Очередь задач для потока-владельца с пробуждением через eventfd.
+ *
+ * post() потокобезопасен; run_pending() вызывается только владельцем.
+ */
+class ShardInbox {
+public:
+	/// Задача, выполняемая в потоке-владельце (замыкание может быть некопируемым).
+	using Task = PooledTask;
+
+	ShardInbox();
+	~ShardInbox();
+
+	ShardInbox(const ShardInbox&) = delete;
+	ShardInbox& operator=(const ShardInbox&) = delete;
+
+	/**
+	 * @brief Поставить задачу в очередь владельца.
+	 *
+	 * @param task Задача.
+	 */
+	void post(Task task);
+
+	/**
+	 * @brief Дескриптор eventfd, становящийся читаемым при появлении задач.
+	 */
+	int notify_fd() const { return event_fd_; }
+
+	/**
+	 * @brief Выполнить все накопившиеся задачи.
+	 *
+	 * Сбрасывает счётчик eventfd. Задачи, поставленные во время выполнения,
+	 * выполняются в этом же вызове.
+	 *
+	 * @return Число выполненных задач.
+	 */
+	size_t run_pending();
+
+	/**
+	 * @brief Всего поставлено задач (для статистики).
+	 */
+	uint64_t posted() const { return posted_.load(std::memory_order_relaxed); }
+
+	/**
+	 * @brief Число пробуждений владельца (записей в eventfd).
+	 */
+	uint64_t wakeups() const { return wakeups_.load(std::memory_order_relaxed); }
+
+private:
+	MpscQueue<Task> queue_;
+	std::vector<Task> batch_;  ///< Забранные задачи; ёмкость переиспользуется.
+	int event_fd_;
+	std::atomic<uint64_t> posted_{0};
+	std::atomic<uint64_t> wakeups_{0};
+};
+
+#endif  // SHARD_INBOX_H
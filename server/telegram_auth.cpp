@@ -2,6 +2,7 @@
 
 #include <cpr/cpr.h>
 
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
@@ -9,23 +10,27 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <string>
 
 std::string BOT_TOKEN;
 
+static std::string telegram_api_url = "https://api.telegram.org";
+
 std::map<std::string, std::string> auth_codes;
 
+// Коды сохраняют и проверяют потоки всех шардов сервера.
+static std::mutex auth_codes_mutex;
+
 std::string generate_auth_code() {
-	static bool seeded = false;
-	if (!seeded) {
-		std::srand(static_cast<unsigned int>(std::time(nullptr)));
-		seeded = true;
-	}
+	thread_local std::mt19937 rng{std::random_device{}()};
+	std::uniform_int_distribution<int> digit(0, 9);
 
 	std::string digits = "0123456789", code;
 	for (int i = 0; i < 6; ++i)
-		code += digits[std::rand() % 10];
+		code += digits[digit(rng)];
 	return code;
 }
 
@@ -52,16 +57,73 @@ void ensure_bot_token() {
 	}
 }
 
+void set_telegram_api_url(const std::string& url) {
+	telegram_api_url = url;
+}
+
+namespace {
+	/**
+	 * Постоянная HTTP-сессия потока: curl держит соединение с Bot API
+	 * открытым между запросами (keep-alive, HTTP/2 через ALPN, если сервер
+	 * его поддерживает), поэтому TLS-рукопожатие выполняется один раз.
+	 * После транспортной ошибки сессия пересоздаётся.
+	 */
+	struct BotSession {
+		std::unique_ptr<cpr::Session> session;
+
+		cpr::Session& get() {
+			if (!session) {
+				session = std::make_unique<cpr::Session>();
+				session->SetHttpVersion(cpr::HttpVersion{cpr::HttpVersionCode::VERSION_2_0_TLS});
+				session->SetConnectTimeout(cpr::ConnectTimeout{std::chrono::seconds(3)});
+				session->SetTimeout(cpr::Timeout{std::chrono::seconds(10)});
+			}
+			return *session;
+		}
+	};
+}  // namespace
+
+bool post_telegram_code(const std::string& chat_id, const std::string& code) {
+	thread_local BotSession bot;
+	cpr::Session& session = bot.get();
+	session.SetUrl(cpr::Url{telegram_api_url + "/bot" + BOT_TOKEN + "/sendMessage"});
+	session.SetPayload(cpr::Payload{{"chat_id", chat_id}, {"text", "Your code is: " + code}});
+	cpr::Response response = session.Post();
+	if (response.error)
+		bot.session.reset();
+	return response.text.find("\"ok\":true") != std::string::npos;
+}
+
+void store_auth_code(const std::string& chat_id, const std::string& code) {
+	std::lock_guard<std::mutex> lock(auth_codes_mutex);
+	auth_codes[chat_id] = code;
+}
+
 bool send_telegram_code(const std::string& chat_id, const std::string& code) {
-	cpr::Response response = cpr::Post(cpr::Url{"https://api.telegram.org/bot" + BOT_TOKEN + "/sendMessage"},
-	                                   cpr::Payload{{"chat_id", chat_id}, {"text", "Your code is: " + code}});
-	if (response.text.find("\"ok\":true") != std::string::npos) {
-		auth_codes[chat_id] = code;
+	if (post_telegram_code(chat_id, code)) {
+		store_auth_code(chat_id, code);
 		return true;
 	}
 	return false;
 }
 
 bool verify_auth_code(const std::string& chat_id, const std::string& code) {
-	return auth_codes.count(chat_id) && auth_codes[chat_id] == code;
+	std::lock_guard<std::mutex> lock(auth_codes_mutex);
+	auto it = auth_codes.find(chat_id);
+	return it != auth_codes.end() && it->second == code;
+}
+
+std::string stored_auth_code(const std::string& chat_id) {
+	std::lock_guard<std::mutex> lock(auth_codes_mutex);
+	auto it = auth_codes.find(chat_id);
+	return it != auth_codes.end() ? it->second : std::string();
+}
+
+bool forget_auth_code(const std::string& chat_id, const std::string& code) {
+	std::lock_guard<std::mutex> lock(auth_codes_mutex);
+	auto it = auth_codes.find(chat_id);
+	if (it == auth_codes.end() || it->second != code)
+		return false;
+	auth_codes.erase(it);
+	return true;
 }
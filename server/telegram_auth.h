@@ -4,7 +4,12 @@
  *
  * Описание:
  * - Использует Telegram Bot API для отправки одноразовых кодов авторизации.
- * - Хранит сгенерированные коды в глобальной карте auth_codes.
+ * - Хранит сгенерированные коды в глобальной карте auth_codes; функции
+ *   потокобезопасны и вызываются из всех потоков-реакторов сервера.
+ *   Срок жизни кода отсчитывает сервер: по таймеру шарда и после входа
+ *   код удаляется (forget_auth_code), так что карта не растёт.
+ * - Адрес Bot API настраивается (set_telegram_api_url), что позволяет
+ *   подменить Telegram локальным HTTP-сервером в тестах и бенчмарках.
  */
 
 #ifndef TELEGRAM_AUTH_H
@@ -21,10 +26,42 @@
  */
 std::string generate_auth_code();
 
+/**
+ * @brief Задать базовый адрес Telegram Bot API.
+ *
+ * По умолчанию "https://api.telegram.org". Запрос отправляется на
+ * <url>/bot<TOKEN>/sendMessage. Вызывать до запуска рабочих потоков.
+ *
+ * @param url Базовый адрес без завершающего '/'.
+ */
+void set_telegram_api_url(const std::string& url);
+
+/**
+ * @brief Отправить сообщение с кодом через Telegram Bot API, не сохраняя код.
+ *
+ * Выполняет только HTTP-запрос и не трогает auth_codes, поэтому может
+ * вызываться из рабочих потоков. Каждый поток переиспользует своё
+ * HTTP-соединение (keep-alive, HTTP/2 где доступно) между вызовами.
+ *
+ * @param chat_id Идентификатор Telegram-чата получателя.
+ * @param code    Код, который будет отправлен.
+ * @return true, если Bot API ответил "ok":true.
+ */
+bool post_telegram_code(const std::string& chat_id, const std::string& code);
+
+/**
+ * @brief Запомнить код, успешно доставленный пользователю.
+ *
+ * @param chat_id Идентификатор Telegram-чата.
+ * @param code    Отправленный код.
+ */
+void store_auth_code(const std::string& chat_id, const std::string& code);
+
 /**
  * @brief Отправить код авторизации через Telegram Bot API.
  *
- * Формирует и выполняет HTTP-запрос для отправки сообщения с одноразовым кодом.
+ * Синхронная обёртка: post_telegram_code() и, при успехе, store_auth_code().
+ * Блокирует поток на время HTTP-запроса; сервер использует AuthDelivery.
  *
  * @param chat_id Идентификатор Telegram-чата получателя.
  * @param code    Шестизначный код, который будет отправлен.
@@ -44,6 +81,27 @@ bool send_telegram_code(const std::string& chat_id, const std::string& code);
  */
 bool verify_auth_code(const std::string& chat_id, const std::string& code);
 
+/**
+ * @brief Сохранённый код для @p chat_id (пусто, если кода нет).
+ *
+ * Нужен при горячем перезапуске: код, которого ждёт клиент,
+ * передаётся новому процессу.
+ */
+std::string stored_auth_code(const std::string& chat_id);
+
+/**
+ * @brief Забыть код авторизации: он использован или истёк.
+ *
+ * Код удаляется, только если для @p chat_id сохранён именно он, поэтому
+ * более новый код того же чата (вход с другого соединения) не теряется.
+ * Сервер вызывает функцию после входа и по таймеру истечения кода.
+ *
+ * @param chat_id Идентификатор Telegram-чата.
+ * @param code    Код, который нужно забыть.
+ * @return true, если код был удалён.
+ */
+bool forget_auth_code(const std::string& chat_id, const std::string& code);
+
 /**
  * @brief Убедиться, что глобальный токен бота загружен.
  *
@@ -0,0 +1,153 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <climits>
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick, Clock::time_point start)
+    : tick_(std::max(tick, std::chrono::milliseconds(1))), start_(start), now_(start) {
+	heads_.fill(NIL);
+}
+
+TimerId TimerWheel::schedule(std::chrono::milliseconds delay, PooledTask task) {
+	uint32_t index;
+	if (free_ != NIL) {
+		index = free_;
+		free_ = nodes_[index].next;
+	} else {
+		index = static_cast<uint32_t>(nodes_.size());
+		nodes_.emplace_back();
+	}
+
+	// Текущий тик уже начался: отсчёт идёт от его конца, чтобы не сработать раньше срока.
+	uint64_t ticks = delay.count() <= 0 ? 0 : (delay.count() + tick_.count() - 1) / tick_.count();
+	Node& node = nodes_[index];
+	node.task = std::move(task);
+	node.expires = current_ + 1 + std::min<uint64_t>(ticks, MAX_TICKS - 1);
+	node.active = true;
+	link(index);
+	++active_;
+	return (uint64_t{node.generation} << 32) | index;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+	uint32_t index = static_cast<uint32_t>(id);
+	if (id == NO_TIMER || index >= nodes_.size())
+		return false;
+	Node& node = nodes_[index];
+	if (!node.active || node.generation != static_cast<uint32_t>(id >> 32))
+		return false;
+	unlink(index);
+	release(index);
+	return true;
+}
+
+size_t TimerWheel::advance(Clock::time_point now) {
+	if (now > now_)
+		now_ = now;
+	if (now < start_)
+		return 0;
+	uint64_t target = static_cast<uint64_t>((now - start_) / tick_);
+	size_t fired = 0;
+	while (current_ < target) {
+		if (active_ == 0) {
+			current_ = target;  // Пустое колесо: проматывать тики незачем.
+			break;
+		}
+		fired += step();
+	}
+	return fired;
+}
+
+int TimerWheel::ms_until_next(Clock::time_point now) const {
+	if (active_ == 0)
+		return -1;
+	// Не дальше ближайшего каскада: после него таймеры старших уровней окажутся на уровне 0.
+	uint64_t ticks = SLOTS - (current_ & (SLOTS - 1));
+	for (uint64_t i = 1; i < ticks; ++i) {
+		if (heads_[(current_ + i) & (SLOTS - 1)] != NIL) {
+			ticks = i;
+			break;
+		}
+	}
+	Clock::time_point deadline = start_ + tick_ * (current_ + ticks);
+	if (deadline <= now)
+		return 0;
+	auto ms = std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+	return static_cast<int>(std::min<int64_t>(ms, INT_MAX));
+}
+
+void TimerWheel::clear() {
+	nodes_.clear();
+	heads_.fill(NIL);
+	free_ = NIL;
+	active_ = 0;
+}
+
+void TimerWheel::link(uint32_t index) {
+	Node& node = nodes_[index];
+	uint64_t delta = node.expires > current_ ? node.expires - current_ : 0;
+	size_t level = 0;
+	while (level + 1 < LEVELS && delta >= (uint64_t{1} << (LEVEL_BITS * (level + 1))))
+		++level;
+	size_t slot = (node.expires >> (LEVEL_BITS * level)) & (SLOTS - 1);
+	node.bucket = static_cast<uint16_t>(level * SLOTS + slot);
+	node.prev = NIL;
+	node.next = heads_[node.bucket];
+	if (node.next != NIL)
+		nodes_[node.next].prev = index;
+	heads_[node.bucket] = index;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+	Node& node = nodes_[index];
+	if (node.prev != NIL)
+		nodes_[node.prev].next = node.next;
+	else
+		heads_[node.bucket] = node.next;
+	if (node.next != NIL)
+		nodes_[node.next].prev = node.prev;
+}
+
+void TimerWheel::release(uint32_t index) {
+	Node& node = nodes_[index];
+	node.task = PooledTask();
+	node.active = false;
+	if (++node.generation == 0)
+		node.generation = 1;
+	node.next = free_;
+	free_ = index;
+	--active_;
+}
+
+void TimerWheel::cascade(size_t level) {
+	size_t bucket = level * SLOTS + ((current_ >> (LEVEL_BITS * level)) & (SLOTS - 1));
+	uint32_t index = heads_[bucket];
+	heads_[bucket] = NIL;
+	while (index != NIL) {
+		uint32_t next = nodes_[index].next;
+		link(index);
+		index = next;
+	}
+}
+
+size_t TimerWheel::step() {
+	++current_;
+	// Уровень l разносится, когда младшие LEVEL_BITS * l бит тика обнулились; старшие — первыми.
+	size_t top = 0;
+	while (top + 1 < LEVELS && (current_ & ((uint64_t{1} << (LEVEL_BITS * (top + 1))) - 1)) == 0)
+		++top;
+	for (size_t level = top; level >= 1; --level)
+		cascade(level);
+
+	size_t fired = 0;
+	uint32_t& head = heads_[current_ & (SLOTS - 1)];
+	while (head != NIL) {
+		uint32_t index = head;
+		PooledTask task = std::move(nodes_[index].task);
+		unlink(index);
+		release(index);
+		task();  // Может ставить таймеры: ссылки на узлы после вызова недействительны.
+		++fired;
+	}
+	return fired;
+}
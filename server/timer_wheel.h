@@ -0,0 +1,138 @@
+/**
+ * @file timer_wheel.h
+ * @brief Иерархическое колесо таймеров для цикла событий шарда.
+ *
+ * Механизм:
+ * - Время делится на тики (по умолчанию 100 мс). Четыре уровня по 64
+ *   слота: уровень 0 покрывает ближайшие 64 тика, каждый следующий —
+ *   в 64 раза больше (до ~19 суток при тике 100 мс).
+ * - Таймер — узел двусвязного списка своего слота; постановка и отмена
+ *   занимают O(1). Когда младший уровень делает полный оборот, слот
+ *   старшего уровня разносится по младшим («каскад»), поэтому каждый
+ *   таймер переносится не больше трёх раз.
+ * - Узлы хранятся в векторе и переиспользуются через список свободных;
+ *   номер таймера содержит поколение узла, так что отмена уже
+ *   сработавшего таймера безопасна.
+ * - Цикл событий ограничивает ожидание ms_until_next() и после каждого
+ *   ожидания вызывает advance(), который выполняет истёкшие таймеры.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "buffer_pool.h"
+
+/// Номер таймера (0 — нет таймера).
+using TimerId = uint64_t;
+
+/// Значение TimerId, не соответствующее ни одному таймеру.
+inline constexpr TimerId NO_TIMER = 0;
+
+/**
+ * @class TimerWheel
+ * @brief Однопоточное иерархическое колесо таймеров.
+ *
+ * Не потокобезопасен: у каждого потока-реактора свой экземпляр.
+ * Обработчики выполняются внутри advance() и могут ставить и отменять
+ * таймеры.
+ */
+class TimerWheel {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	/// Бит номера слота на уровне.
+	static constexpr size_t LEVEL_BITS = 6;
+	/// Слотов на уровне.
+	static constexpr size_t SLOTS = size_t{1} << LEVEL_BITS;
+	/// Число уровней.
+	static constexpr size_t LEVELS = 4;
+	/// Наибольшая задержка в тиках; более длинные задержки сокращаются до неё.
+	static constexpr uint64_t MAX_TICKS = (uint64_t{1} << (LEVEL_BITS * LEVELS)) - 1;
+
+	/**
+	 * @param tick  Длительность тика (точность срабатывания).
+	 * @param start Момент нулевого тика.
+	 */
+	explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(100),
+	                    Clock::time_point start = Clock::now());
+
+	/**
+	 * @brief Поставить таймер.
+	 *
+	 * Обработчик выполнится не раньше чем через @p delay (с точностью
+	 * до тика) при очередном вызове advance().
+	 *
+	 * @param delay Задержка.
+	 * @param task  Обработчик.
+	 * @return Номер таймера для cancel().
+	 */
+	TimerId schedule(std::chrono::milliseconds delay, PooledTask task);
+
+	/**
+	 * @brief Отменить таймер.
+	 *
+	 * @return false, если таймер уже сработал, отменён или не существовал.
+	 */
+	bool cancel(TimerId id);
+
+	/**
+	 * @brief Выполнить все таймеры, истёкшие к моменту @p now.
+	 *
+	 * @return Число выполненных обработчиков.
+	 */
+	size_t advance(Clock::time_point now = Clock::now());
+
+	/**
+	 * @brief Миллисекунд до ближайшего тика, на котором нужно вызвать advance().
+	 *
+	 * Это срабатывание таймера уровня 0 или каскад старшего уровня.
+	 *
+	 * @return -1, если таймеров нет (ждать можно сколь угодно долго).
+	 */
+	int ms_until_next(Clock::time_point now = Clock::now()) const;
+
+	/// Момент, переданный последнему advance() (для обработчиков).
+	Clock::time_point now() const { return now_; }
+
+	/// Число поставленных и ещё не сработавших таймеров.
+	size_t size() const { return active_; }
+
+	/// Отменить все таймеры (обработчики не выполняются).
+	void clear();
+
+private:
+	static constexpr uint32_t NIL = UINT32_MAX;
+
+	struct Node {
+		PooledTask task;
+		uint64_t expires = 0;     ///< Тик срабатывания.
+		uint32_t prev = NIL;
+		uint32_t next = NIL;      ///< Следующий в слоте или в списке свободных.
+		uint32_t generation = 1;  ///< Меняется при каждом освобождении узла.
+		uint16_t bucket = 0;      ///< Уровень * SLOTS + слот.
+		bool active = false;
+	};
+
+	void link(uint32_t index);
+	void unlink(uint32_t index);
+	void release(uint32_t index);
+	void cascade(size_t level);
+	size_t step();
+
+	std::chrono::milliseconds tick_;
+	Clock::time_point start_;
+	Clock::time_point now_;
+	uint64_t current_ = 0;  ///< Последний обработанный тик.
+	std::array<uint32_t, LEVELS * SLOTS> heads_;
+	std::vector<Node> nodes_;
+	uint32_t free_ = NIL;
+	size_t active_ = 0;
+};
+
+#endif  // TIMER_WHEEL_H
@@ -0,0 +1,50 @@
+#include "user_ids.h"
+
+#include <mutex>
+
+UserIdTable::~UserIdTable() {
+	for (auto& chunk : chunks_)
+		delete[] chunk.load(std::memory_order_relaxed);
+}
+
+UserId UserIdTable::intern(std::string_view name) {
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex_);
+		auto it = index_.find(name);
+		if (it != index_.end())
+			return it->second;
+	}
+
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	auto it = index_.find(name);
+	if (it != index_.end())
+		return it->second;
+	uint32_t id = size_.load(std::memory_order_relaxed);
+	if (id >= CHUNK_SIZE * MAX_CHUNKS)
+		return NO_USER;
+
+	std::atomic<std::string*>& chunk = chunks_[id / CHUNK_SIZE];
+	std::string* strings = chunk.load(std::memory_order_relaxed);
+	if (strings == nullptr) {
+		strings = new std::string[CHUNK_SIZE];
+		chunk.store(strings, std::memory_order_release);
+	}
+	std::string& stored = strings[id % CHUNK_SIZE];
+	stored.assign(name);
+	index_.emplace(stored, id);
+	size_.store(id + 1, std::memory_order_release);
+	return id;
+}
+
+UserId UserIdTable::find(std::string_view name) const {
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+	auto it = index_.find(name);
+	return it == index_.end() ? NO_USER : it->second;
+}
+
+const std::string& UserIdTable::name(UserId id) const {
+	static const std::string none;
+	if (id >= size())
+		return none;
+	return chunks_[id / CHUNK_SIZE].load(std::memory_order_acquire)[id % CHUNK_SIZE];
+}
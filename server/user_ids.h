@@ -0,0 +1,85 @@
+/**
+ * @file user_ids.h
+ * @brief Таблица интернирования пользовательских ID (Telegram chat ID).
+ *
+ * Механизм:
+ * - Каждому встреченному Telegram ID выдаётся плотный 32-битный номер
+ *   (UserId) в порядке появления; состояние соединений, справочник
+ *   клиентов и комнаты хранят номера вместо строк.
+ * - Строки лежат в блоках по CHUNK_SIZE штук, которые никогда не
+ *   перемещаются, поэтому name() работает без блокировок: номер
+ *   публикуется только после записи строки.
+ * - Поиск по строке (intern(), find()) идёт через хеш-таблицу под
+ *   std::shared_mutex; он нужен только при входе и в /connect.
+ * - Номера не освобождаются: таблица растёт с числом различных
+ *   пользователей, а не подключений.
+ */
+
+#ifndef USER_IDS_H
+#define USER_IDS_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/// Плотный номер пользователя.
+using UserId = uint32_t;
+
+/// Отсутствие пользователя (нет собеседника, нет запроса).
+constexpr UserId NO_USER = UINT32_MAX;
+
+/**
+ * @class UserIdTable
+ * @brief Потокобезопасное отображение Telegram ID <-> UserId.
+ */
+class UserIdTable {
+public:
+	/// Строк в одном блоке.
+	static constexpr size_t CHUNK_SIZE = 4096;
+	/// Максимум блоков (предел таблицы — CHUNK_SIZE * MAX_CHUNKS пользователей).
+	static constexpr size_t MAX_CHUNKS = 4096;
+
+	UserIdTable() = default;
+	~UserIdTable();
+
+	UserIdTable(const UserIdTable&) = delete;
+	UserIdTable& operator=(const UserIdTable&) = delete;
+
+	/**
+	 * @brief Номер для строки; новая строка получает следующий номер.
+	 *
+	 * @return UserId или NO_USER, если таблица заполнена.
+	 */
+	UserId intern(std::string_view name);
+
+	/**
+	 * @brief Номер уже известной строки.
+	 *
+	 * @return UserId или NO_USER, если строка не встречалась.
+	 */
+	UserId find(std::string_view name) const;
+
+	/**
+	 * @brief Строка по номеру (без блокировок).
+	 *
+	 * @return Ссылка, действительная всё время жизни таблицы;
+	 *         пустая строка для NO_USER.
+	 */
+	const std::string& name(UserId id) const;
+
+	/// Число выданных номеров.
+	size_t size() const { return size_.load(std::memory_order_acquire); }
+
+private:
+	mutable std::shared_mutex mutex_;
+	std::unordered_map<std::string_view, UserId> index_;  ///< Ключи указывают на строки блоков.
+	std::array<std::atomic<std::string*>, MAX_CHUNKS> chunks_{};
+	std::atomic<uint32_t> size_{0};
+};
+
+#endif  // USER_IDS_H
@@ -6,17 +6,42 @@
  *  - send_all: отправить весь буфер данных;
  *  - send_packet: отправить пакет строки с маркером конца сообщения "*ENDM*";
  *  - send_line: отправить одну строку с терминатором '\n';
- *  - recv_line: получить одну строку до символа '\n'.
+ *  - recv_line: получить одну строку до символа '\n';
+ *  - encode_frame / send_frame: кадр двоичного протокола.
+ *
+ * а также классы для неблокирующих сокетов:
+ *  - LineBuffer: буфер входящих данных, вычитывает сокет крупными блоками
+ *    и выделяет из них готовые строки или кадры;
+ *  - OutputQueue: очередь исходящих данных, отправляемая по готовности
+ *    сокета к записи одним векторным вызовом; может ссылаться на чужую
+ *    память (например, отображённый файл) без копирования.
+ *
+ * Протоколы. Текстовый: строки, завершённые '\n'; ответ сервера
+ * заканчивается строкой-маркером "*ENDM*". Двоичный (согласуется
+ * строкой PROTOCOL_HELLO, сервер подтверждает строкой PROTOCOL_ACK):
+ * кадр = длина (varint LEB128, учитывает байт типа) + тип (FrameType)
+ * + данные. Данные не просматриваются побайтно и могут содержать
+ * любые символы, включая '\n' и "*ENDM*".
  */
 
 #ifndef SOCKET_UTILS_H
 #define SOCKET_UTILS_H
 
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 /**
  * @brief  Отправить всю строку целиком по TCP-сокету.
@@ -24,7 +49,8 @@
  * Функция многократно вызывает системный ::send(), пока не
  * будет передан каждый байт строки @p msg.  Рассчитана на
  * **блокирующий** сокет — ::send() внутри может подождать,
- * когда освободится буфер ядра.
+ * когда освободится буфер ядра. Для неблокирующего сокета
+ * при EAGAIN функция дожидается готовности через poll().
  *
  * @param fd   Дескриптор открытого TCP-сокета.
  * @param msg  Строка, которую нужно передать (без копирования —
@@ -40,7 +66,14 @@ inline bool send_all(
 	while (sent < msg.size()) {
 		ssize_t n = ::send(fd,
 		                   msg.c_str() + sent,  // адрес нужного байта
-		                   msg.size() - sent, 0);
+		                   msg.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			pollfd pfd{fd, POLLOUT, 0};
+			::poll(&pfd, 1, -1);
+			continue;
+		}
 		if (n <= 0)  // ошибка или разрыв
 			return false;
 		sent += static_cast<size_t>(n);
@@ -82,6 +115,69 @@ inline bool send_line(int fd, std::string message) {
 	return send_all(fd, message);
 }
 
+/// Маркер конца ответа сервера в текстовом протоколе.
+constexpr std::string_view END_MARKER = "*ENDM*";
+/// Первая строка клиента, запрашивающая двоичный протокол.
+constexpr std::string_view PROTOCOL_HELLO = "*BIN1*";
+/// Последняя текстовая строка сервера перед переходом на двоичный протокол.
+constexpr std::string_view PROTOCOL_ACK = "*BINARY*";
+/// Максимальная длина заголовка кадра: 5 байт varint + байт типа.
+constexpr size_t FRAME_HEADER_MAX = 6;
+
+/**
+ * @brief Тип кадра двоичного протокола.
+ */
+enum class FrameType : uint8_t {
+	Text = 1,    ///< Текст: строка клиента или сообщение сервера.
+	End = 2,     ///< Конец ответа сервера (аналог "*ENDM*"), без данных.
+	History = 3  ///< Пачка строк истории одним кадром.
+};
+
+/**
+ * @brief Дописать заголовок кадра.
+ *
+ * @param out         Строка, в конец которой пишется заголовок.
+ * @param type        Тип кадра.
+ * @param payload_len Длина данных кадра.
+ */
+template <typename Out>
+inline void append_frame_header(Out& out, FrameType type, size_t payload_len) {
+	uint64_t len = payload_len + 1;
+	while (len >= 0x80) {
+		out.push_back(static_cast<char>((len & 0x7f) | 0x80));
+		len >>= 7;
+	}
+	out.push_back(static_cast<char>(len));
+	out.push_back(static_cast<char>(type));
+}
+
+/**
+ * @brief Закодировать кадр целиком.
+ *
+ * @param type    Тип кадра.
+ * @param payload Данные.
+ * @return Заголовок и данные кадра.
+ */
+inline std::string encode_frame(FrameType type, std::string_view payload) {
+	std::string out;
+	out.reserve(FRAME_HEADER_MAX + payload.size());
+	append_frame_header(out, type, payload.size());
+	out.append(payload);
+	return out;
+}
+
+/**
+ * @brief Отправить один кадр через блокирующий сокет.
+ *
+ * @param fd      Дескриптор сокета.
+ * @param type    Тип кадра.
+ * @param payload Данные.
+ * @return true, если кадр отправлен, false при ошибке.
+ */
+inline bool send_frame(int fd, FrameType type, std::string_view payload) {
+	return send_all(fd, encode_frame(type, payload));
+}
+
 /**
  * @brief Прочитать одну строку из сокета до символа новой строки.
  *
@@ -106,4 +202,448 @@ inline bool recv_line(int fd, std::string& out) {
 	return true;
 }
 
+/**
+ * @brief Результат LineBuffer::fill().
+ */
+enum class ReadStatus {
+	Drained,  ///< Сокет вычитан до EAGAIN — ждать следующего события готовности.
+	Full,     ///< Достигнут лимит буфера — разобрать строки и вызвать fill() снова.
+	Closed,   ///< Удалённая сторона закрыла соединение.
+	Error     ///< Ошибка recv() или превышена длина строки.
+};
+
+/**
+ * @class LineBuffer
+ * @brief Буфер входящих данных сокета с разбиением на строки.
+ *
+ * Данные читаются из неблокирующего сокета крупными блоками
+ * (один ::recv() вместо одного вызова на байт), после чего из
+ * буфера извлекаются все завершённые строки. Незавершённая
+ * строка остаётся в буфере до следующего события готовности,
+ * поэтому медленный клиент не блокирует остальных.
+ *
+ * Буфер кольцевой в линейной развёртке: прочитанные строки сдвигают
+ * начало, а остаток переносится в начало памяти только когда в хвосте
+ * не хватает места для очередного чтения.
+ */
+class LineBuffer {
+public:
+	/// Размер одного чтения из сокета.
+	static constexpr size_t READ_CHUNK = 16 * 1024;
+
+	/**
+	 * @param max_line Максимальная длина строки; более длинная строка
+	 *                 считается ошибкой протокола.
+	 */
+	explicit LineBuffer(size_t max_line = 64 * 1024) : max_line_(max_line) {}
+
+	/**
+	 * @brief Прочитать из сокета всё, что доступно.
+	 *
+	 * Вызывает ::recv() блоками по READ_CHUNK до EAGAIN, но не
+	 * накапливает в буфере больше max_line + READ_CHUNK байт.
+	 *
+	 * @param fd Неблокирующий сокет.
+	 * @return Состояние сокета после чтения (см. ReadStatus).
+	 */
+	ReadStatus fill(int fd) {
+		while (true) {
+			if (size() >= max_line_ + READ_CHUNK)
+				return ReadStatus::Full;
+			reserve_tail(READ_CHUNK);
+			ssize_t n = ::recv(fd, buf_.data() + tail_, buf_.size() - tail_, 0);
+			if (n > 0) {
+				tail_ += static_cast<size_t>(n);
+				continue;
+			}
+			if (n == 0)
+				return ReadStatus::Closed;
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return ReadStatus::Drained;
+			return ReadStatus::Error;
+		}
+	}
+
+	/**
+	 * @brief Дописать данные в буфер вручную (без чтения из сокета).
+	 *
+	 * @param data Указатель на данные.
+	 * @param len  Длина данных.
+	 */
+	void append(const char* data, size_t len) {
+		reserve_tail(len);
+		std::memcpy(buf_.data() + tail_, data, len);
+		tail_ += len;
+	}
+
+	/**
+	 * @brief Извлечь следующую завершённую строку.
+	 *
+	 * Поиск '\n' выполняется memchr() и продолжается с места, где
+	 * остановился предыдущий поиск, поэтому каждый байт просматривается
+	 * один раз. Символ '\n' в строку не включается.
+	 *
+	 * @param out Представление строки; действительно до следующего
+	 *            вызова fill() или append().
+	 * @return true, если строка извлечена; false, если завершённых строк нет.
+	 */
+	bool next_line(std::string_view& out) {
+		if (scan_ == tail_)
+			return false;
+		const char* base = buf_.data();
+		const void* nl = std::memchr(base + scan_, '\n', tail_ - scan_);
+		if (nl == nullptr) {
+			scan_ = tail_;
+			return false;
+		}
+		size_t end = static_cast<size_t>(static_cast<const char*>(nl) - base);
+		out = std::string_view(base + head_, end - head_);
+		head_ = scan_ = end + 1;
+		if (head_ == tail_)
+			head_ = scan_ = tail_ = 0;
+		return true;
+	}
+
+	/**
+	 * @brief Извлечь следующий полный кадр двоичного протокола.
+	 *
+	 * Заголовок разбирается за O(1), данные не просматриваются.
+	 * Кадр длиннее max_line или с испорченной длиной помечает буфер
+	 * как переполненный (overflow()).
+	 *
+	 * @param type    Тип кадра.
+	 * @param payload Данные кадра; действительны до следующего
+	 *                вызова fill() или append().
+	 * @return true, если кадр извлечён; false, если полного кадра нет.
+	 */
+	bool next_frame(FrameType& type, std::string_view& payload) {
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(buf_.data()) + head_;
+		size_t avail = tail_ - head_;
+		uint64_t len = 0;
+		size_t used = 0;
+		for (int shift = 0;; shift += 7) {
+			if (used == avail)
+				return false;
+			if (used == FRAME_HEADER_MAX - 1) {
+				bad_frame_ = true;
+				return false;
+			}
+			unsigned char byte = p[used++];
+			len |= static_cast<uint64_t>(byte & 0x7f) << shift;
+			if ((byte & 0x80) == 0)
+				break;
+		}
+		if (len == 0 || len > max_line_ + 1) {
+			bad_frame_ = true;
+			return false;
+		}
+		if (avail - used < len)
+			return false;
+		type = static_cast<FrameType>(p[used]);
+		payload = std::string_view(buf_.data() + head_ + used + 1, len - 1);
+		head_ += used + len;
+		scan_ = std::max(scan_, head_);
+		if (head_ == tail_)
+			head_ = scan_ = tail_ = 0;
+		return true;
+	}
+
+	/**
+	 * @brief Превышена ли допустимая длина незавершённой строки
+	 *        (или получен некорректный кадр).
+	 */
+	bool overflow() const { return bad_frame_ || (tail_ - head_ > max_line_ && scan_ == tail_); }
+
+	/**
+	 * @brief Число байт в буфере, ещё не выданных через next_line().
+	 */
+	size_t size() const { return tail_ - head_; }
+
+	/**
+	 * @brief Байты, ещё не выданные через next_line() (передача при перезапуске).
+	 */
+	std::string_view pending() const { return {buf_.data() + head_, size()}; }
+
+private:
+	void reserve_tail(size_t want) {
+		if (buf_.size() - tail_ >= want)
+			return;
+		if (head_ > 0) {
+			std::memmove(buf_.data(), buf_.data() + head_, tail_ - head_);
+			tail_ -= head_;
+			scan_ -= head_;
+			head_ = 0;
+		}
+		if (buf_.size() - tail_ < want)
+			buf_.resize(tail_ + want);
+	}
+
+	std::vector<char> buf_;
+	size_t head_ = 0;  ///< Начало непрочитанных данных.
+	size_t scan_ = 0;  ///< До этой позиции '\n' уже искали.
+	size_t tail_ = 0;  ///< Конец записанных данных.
+	size_t max_line_;
+	bool bad_frame_ = false;
+};
+
+/**
+ * @brief Результат OutputQueue::flush().
+ */
+enum class FlushStatus {
+	Drained,  ///< Очередь отправлена полностью.
+	Pending,  ///< Буфер ядра заполнен — дождаться готовности к записи.
+	Error     ///< Соединение разорвано.
+};
+
+/**
+ * @class BufferLease
+ * @brief Право владения внешним буфером очереди отправки.
+ *
+ * Перемещаемое; при разрушении вызывает release(ctx). В отличие от
+ * shared_ptr не требует отдельного блока управления.
+ */
+class BufferLease {
+public:
+	BufferLease() = default;
+	BufferLease(void (*release)(void*), void* ctx) : release_(release), ctx_(ctx) {}
+	BufferLease(BufferLease&& other) noexcept
+	    : release_(std::exchange(other.release_, nullptr)), ctx_(std::exchange(other.ctx_, nullptr)) {}
+	BufferLease& operator=(BufferLease&& other) noexcept {
+		if (this != &other) {
+			reset();
+			release_ = std::exchange(other.release_, nullptr);
+			ctx_ = std::exchange(other.ctx_, nullptr);
+		}
+		return *this;
+	}
+	BufferLease(const BufferLease&) = delete;
+	BufferLease& operator=(const BufferLease&) = delete;
+	~BufferLease() { reset(); }
+
+	/// Освободить буфер сейчас.
+	void reset() {
+		if (release_)
+			release_(ctx_);
+		release_ = nullptr;
+		ctx_ = nullptr;
+	}
+
+	explicit operator bool() const { return release_ != nullptr; }
+
+private:
+	void (*release_)(void*) = nullptr;
+	void* ctx_ = nullptr;
+};
+
+/**
+ * @class OutputQueue
+ * @brief Очередь исходящих данных неблокирующего сокета.
+ *
+ * Сообщения не отправляются сразу, а складываются в цепочку буферов.
+ * flush() передаёт сразу несколько буферов одним вызовом sendmsg()
+ * (аналог writev() с флагом MSG_NOSIGNAL) и останавливается на EAGAIN,
+ * не блокируя поток. Счётчики позволяют отслеживать медленных клиентов.
+ *
+ * Буфер может быть как собственной строкой очереди, так и ссылкой на
+ * разделяемую память (push_shared()): владелец памяти удерживается
+ * shared_ptr, пока буфер не отправлен, поэтому одни и те же данные
+ * можно поставить в очереди нескольких клиентов без копирования.
+ * push_lease() делает то же без shared_ptr — для буферов из пула.
+ *
+ * Буферы хранятся в кольце, которое только растёт: в установившемся
+ * режиме постановка и отправка не выделяют память.
+ */
+class OutputQueue {
+public:
+	/// Сколько буферов передаётся за один системный вызов.
+	static constexpr size_t IOV_BATCH = 64;
+
+	/**
+	 * @brief Добавить данные в конец очереди.
+	 *
+	 * @param data Данные; пустая строка игнорируется.
+	 */
+	void push(std::string data) {
+		if (data.empty())
+			return;
+		bytes_ += data.size();
+		peak_ = std::max(peak_, bytes_);
+		push_chunk().owned = std::move(data);
+	}
+
+	/**
+	 * @brief Добавить в очередь ссылку на чужие данные без копирования.
+	 *
+	 * @param owner Владелец памяти; удерживается до отправки буфера.
+	 * @param data  Данные внутри памяти @p owner; пустые игнорируются.
+	 */
+	void push_shared(std::shared_ptr<const void> owner, std::string_view data) {
+		if (data.empty())
+			return;
+		bytes_ += data.size();
+		peak_ = std::max(peak_, bytes_);
+		Chunk& chunk = push_chunk();
+		chunk.owner = std::move(owner);
+		chunk.shared = data;
+	}
+
+	/**
+	 * @brief Добавить в очередь ссылку на внешний буфер, освобождаемый через @p lease.
+	 *
+	 * @param lease Право владения; отпускается, когда буфер отправлен
+	 *              (или очередь разрушена).
+	 * @param data  Данные внутри буфера; пустые игнорируются (и @p lease
+	 *              отпускается сразу).
+	 */
+	void push_lease(BufferLease lease, std::string_view data) {
+		if (data.empty())
+			return;
+		bytes_ += data.size();
+		peak_ = std::max(peak_, bytes_);
+		Chunk& chunk = push_chunk();
+		chunk.lease = std::move(lease);
+		chunk.shared = data;
+	}
+
+	/**
+	 * @brief Добавить в очередь ссылку на неизменяемые данные без владельца.
+	 *
+	 * @param data Данные со статическим временем жизни (литерал, constexpr-таблица).
+	 */
+	void push_static(std::string_view data) { push_lease(BufferLease([](void*) {}, nullptr), data); }
+
+	/**
+	 * @brief Учесть сообщение, отброшенное из-за переполнения очереди.
+	 */
+	void count_drop() { ++dropped_; }
+
+	/**
+	 * @brief Отправить как можно больше данных из очереди.
+	 *
+	 * @param fd Неблокирующий сокет.
+	 * @return Состояние очереди после отправки (см. FlushStatus).
+	 */
+	FlushStatus flush(int fd) {
+		while (count_ > 0) {
+			iovec iov[IOV_BATCH];
+			msghdr msg{};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = gather(iov, IOV_BATCH);
+			ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return FlushStatus::Pending;
+				return FlushStatus::Error;
+			}
+			consume(static_cast<size_t>(n));
+		}
+		return FlushStatus::Drained;
+	}
+
+	/**
+	 * @brief Описать начало очереди для отправки вне flush() (пакетная отправка цикла событий).
+	 *
+	 * @param iov Массив, который заполняется буферами из головы очереди.
+	 * @param max Размер массива.
+	 * @return Число заполненных элементов; после отправки вызвать consume().
+	 */
+	size_t gather(iovec* iov, size_t max) const {
+		size_t count = 0;
+		for (; count < count_ && count < max; ++count) {
+			std::string_view data = chunk(count).view();
+			size_t skip = count == 0 ? offset_ : 0;
+			iov[count].iov_base = const_cast<char*>(data.data()) + skip;
+			iov[count].iov_len = data.size() - skip;
+		}
+		return count;
+	}
+
+	/**
+	 * @brief Убрать из головы очереди @p n отправленных байт.
+	 */
+	void consume(size_t n) {
+		sent_ += n;
+		bytes_ -= n;
+		while (n > 0) {
+			size_t left = chunk(0).view().size() - offset_;
+			if (n < left) {
+				offset_ += n;
+				return;
+			}
+			n -= left;
+			offset_ = 0;
+			pop_chunk();
+		}
+	}
+
+	/// Байт в очереди, ожидающих отправки.
+	size_t size() const { return bytes_; }
+	/// Пустая ли очередь.
+	bool empty() const { return count_ == 0; }
+	/// Максимальный размер очереди за время жизни соединения.
+	size_t peak() const { return peak_; }
+	/// Всего байт, переданных ядру.
+	uint64_t sent() const { return sent_; }
+	/// Число сообщений, отброшенных из-за переполнения.
+	uint64_t dropped() const { return dropped_; }
+
+	/**
+	 * @brief Склеить содержимое очереди в одну строку (передача при перезапуске, тесты).
+	 */
+	std::string contents() const {
+		std::string out;
+		for (size_t i = 0; i < count_; ++i)
+			out.append(chunk(i).view().substr(i == 0 ? offset_ : 0));
+		return out;
+	}
+
+private:
+	struct Chunk {
+		std::string owned;
+		std::shared_ptr<const void> owner;  ///< Владелец внешних данных (push_shared()).
+		BufferLease lease;                  ///< Владелец внешних данных (push_lease()).
+		std::string_view shared;
+
+		std::string_view view() const { return owner || lease ? shared : std::string_view(owned); }
+	};
+
+	Chunk& chunk(size_t i) { return ring_[(head_ + i) & (ring_.size() - 1)]; }
+	const Chunk& chunk(size_t i) const { return ring_[(head_ + i) & (ring_.size() - 1)]; }
+
+	/// Свободный слот в конце кольца (при заполнении кольцо удваивается).
+	Chunk& push_chunk() {
+		if (count_ == ring_.size()) {
+			std::vector<Chunk> bigger(std::max<size_t>(8, 2 * ring_.size()));
+			for (size_t i = 0; i < count_; ++i)
+				bigger[i] = std::move(chunk(i));
+			ring_.swap(bigger);
+			head_ = 0;
+		}
+		return chunk(count_++);
+	}
+
+	void pop_chunk() {
+		Chunk& front = chunk(0);
+		std::string().swap(front.owned);
+		front.owner.reset();
+		front.lease.reset();
+		front.shared = {};
+		head_ = (head_ + 1) & (ring_.size() - 1);
+		--count_;
+	}
+
+	std::vector<Chunk> ring_;  ///< Кольцо буферов; размер — степень двойки.
+	size_t head_ = 0;
+	size_t count_ = 0;
+	size_t offset_ = 0;  ///< Уже отправленная часть первого буфера.
+	size_t bytes_ = 0;
+	size_t peak_ = 0;
+	uint64_t sent_ = 0;
+	uint64_t dropped_ = 0;
+};
+
 #endif  // SOCKET_UTILS_H
@@ -0,0 +1,193 @@
+/**
+ * @file mock_telegram.h
+ * @brief Локальная HTTP-заглушка Telegram Bot API для тестов.
+ *
+ * Слушает 127.0.0.1 на свободном порту в отдельном потоке, принимает
+ * POST-запросы sendMessage (с keep-alive) и отвечает {"ok":true} либо
+ * {"ok":false}. Сохраняет тела запросов, последний код для каждого chat_id
+ * и число принятых TCP-соединений. Используется также в bench_server.
+ */
+
+#ifndef MOCK_TELEGRAM_H
+#define MOCK_TELEGRAM_H
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MockTelegram {
+public:
+	MockTelegram() {
+		listener_ = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+		bind(listener_, (sockaddr*)&addr, sizeof(addr));
+		listen(listener_, SOMAXCONN);
+		socklen_t len = sizeof(addr);
+		getsockname(listener_, (sockaddr*)&addr, &len);
+		port_ = ntohs(addr.sin_port);
+		if (pipe(wake_) != 0)
+			wake_[0] = wake_[1] = -1;
+		thread_ = std::thread([this] { run(); });
+	}
+
+	~MockTelegram() {
+		stop_ = true;
+		ssize_t ignored = write(wake_[1], "x", 1);
+		(void)ignored;
+		thread_.join();
+		for (auto& [fd, buf] : conns_)
+			close(fd);
+		close(listener_);
+		close(wake_[0]);
+		close(wake_[1]);
+	}
+
+	/// Базовый адрес для set_telegram_api_url().
+	std::string url() const { return "http://127.0.0.1:" + std::to_string(port_); }
+
+	/// Отвечать {"ok":true} (по умолчанию) или {"ok":false}.
+	void set_ok(bool ok) { ok_ = ok; }
+
+	/// Задержка перед каждым ответом.
+	void set_delay(std::chrono::milliseconds delay) { delay_ms_ = static_cast<int>(delay.count()); }
+
+	/// Тела всех принятых запросов.
+	std::vector<std::string> bodies() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return bodies_;
+	}
+
+	/// Последний код (последняя группа цифр текста), отправленный в @p chat_id; пусто, если не было.
+	std::string code_for(const std::string& chat_id) const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = codes_.find(chat_id);
+		return it != codes_.end() ? it->second : std::string();
+	}
+
+	/// Число принятых TCP-соединений.
+	int connections() const { return accepted_; }
+
+private:
+	void run() {
+		while (!stop_) {
+			std::vector<pollfd> fds{{wake_[0], POLLIN, 0}, {listener_, POLLIN, 0}};
+			for (auto& [fd, buf] : conns_)
+				fds.push_back({fd, POLLIN, 0});
+			if (poll(fds.data(), fds.size(), -1) < 0)
+				continue;
+			if (fds[1].revents & POLLIN) {
+				int fd = accept(listener_, nullptr, nullptr);
+				if (fd != -1) {
+					conns_[fd];
+					++accepted_;
+				}
+			}
+			for (size_t i = 2; i < fds.size(); ++i)
+				if (fds[i].revents)
+					serve(fds[i].fd);
+		}
+	}
+
+	void serve(int fd) {
+		char chunk[4096];
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0) {
+			close(fd);
+			conns_.erase(fd);
+			return;
+		}
+		std::string& buf = conns_[fd];
+		buf.append(chunk, n);
+
+		while (true) {
+			size_t head_end = buf.find("\r\n\r\n");
+			if (head_end == std::string::npos)
+				return;
+			std::string head = buf.substr(0, head_end);
+			for (char& c : head)
+				c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			size_t length = 0;
+			size_t pos = head.find("content-length:");
+			if (pos != std::string::npos)
+				length = std::stoul(head.substr(pos + 15));
+			if (buf.size() < head_end + 4 + length)
+				return;
+
+			{
+				std::string body = buf.substr(head_end + 4, length);
+				std::lock_guard<std::mutex> lock(mutex_);
+				remember_code(body);
+				bodies_.push_back(std::move(body));
+			}
+			buf.erase(0, head_end + 4 + length);
+
+			if (delay_ms_ > 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
+			std::string body = ok_ ? "{\"ok\":true}" : "{\"ok\":false}";
+			std::string resp = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+			                   std::to_string(body.size()) + "\r\n\r\n" + body;
+			ssize_t ignored = send(fd, resp.data(), resp.size(), MSG_NOSIGNAL);
+			(void)ignored;
+		}
+	}
+
+	// Значение поля формы application/x-www-form-urlencoded.
+	static std::string form_field(const std::string& body, const std::string& name) {
+		std::string key = name + "=";
+		size_t pos = body.starts_with(key) ? 0 : body.find("&" + key);
+		if (pos == std::string::npos)
+			return {};
+		pos += body[pos] == '&' ? key.size() + 1 : key.size();
+		std::string value;
+		for (; pos < body.size() && body[pos] != '&'; ++pos) {
+			if (body[pos] == '+') {
+				value += ' ';
+			} else if (body[pos] == '%' && pos + 2 < body.size()) {
+				value += static_cast<char>(std::stoi(body.substr(pos + 1, 2), nullptr, 16));
+				pos += 2;
+			} else {
+				value += body[pos];
+			}
+		}
+		return value;
+	}
+
+	// Код — последняя группа цифр в тексте сообщения.
+	void remember_code(const std::string& body) {
+		std::string chat_id = form_field(body, "chat_id");
+		std::string text = form_field(body, "text");
+		size_t end = text.find_last_of("0123456789");
+		if (chat_id.empty() || end == std::string::npos)
+			return;
+		size_t begin = text.find_last_not_of("0123456789", end) + 1;
+		codes_[chat_id] = text.substr(begin, end - begin + 1);
+	}
+
+	int listener_ = -1;
+	int port_ = 0;
+	int wake_[2] = {-1, -1};
+	std::thread thread_;
+	std::atomic<bool> stop_{false};
+	std::atomic<bool> ok_{true};
+	std::atomic<int> delay_ms_{0};
+	std::atomic<int> accepted_{0};
+	std::map<int, std::string> conns_;
+	mutable std::mutex mutex_;
+	std::vector<std::string> bodies_;
+	std::map<std::string, std::string> codes_;
+};
+
+#endif  // MOCK_TELEGRAM_H
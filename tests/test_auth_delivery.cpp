@@ -0,0 +1,173 @@
+#include <poll.h>
+
+#include "../server/auth_delivery.h"
+#include "../server/telegram_auth.h"
+#include "doctest/doctest.h"
+#include "mock_telegram.h"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+extern std::string BOT_TOKEN;
+
+namespace {
+	// Дождаться сигнала eventfd и забрать результаты (до timeout_ms).
+	std::vector<AuthResult> wait_results(AuthDelivery& delivery, size_t want, int timeout_ms = 5000) {
+		std::vector<AuthResult> all;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+		while (all.size() < want && std::chrono::steady_clock::now() < deadline) {
+			pollfd pfd{delivery.notify_fd(), POLLIN, 0};
+			poll(&pfd, 1, 100);
+			for (auto& r : delivery.take_results())
+				all.push_back(std::move(r));
+		}
+		return all;
+	}
+}  // namespace
+
+TEST_SUITE("auth_delivery") {
+	TEST_CASE("jobs complete off the calling thread and wake the eventfd") {
+		std::atomic<int> calls{0};
+		AuthDelivery delivery(2, 16, [&](const std::string& chat_id, const std::string&) {
+			++calls;
+			return chat_id != "bad";
+		});
+
+		REQUIRE(delivery.submit({7, 1, "42", "123456"}));
+		REQUIRE(delivery.submit({8, 2, "bad", "654321"}));
+
+		auto results = wait_results(delivery, 2);
+		REQUIRE(results.size() == 2);
+		CHECK(calls == 2);
+		for (const auto& r : results)
+			CHECK(r.delivered == (r.job.chat_id == "42"));
+	}
+
+	TEST_CASE("bounded queue rejects jobs when full") {
+		std::atomic<bool> release{false};
+		AuthDelivery delivery(1, 1, [&](const std::string&, const std::string&) {
+			while (!release)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			return true;
+		});
+
+		REQUIRE(delivery.submit({1, 1, "a", "1"}));
+		// Первое задание забирается рабочим потоком, второе занимает очередь.
+		while (delivery.queued() != 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		REQUIRE(delivery.submit({2, 2, "b", "2"}));
+		CHECK_FALSE(delivery.submit({3, 3, "c", "3"}));
+
+		release = true;
+		CHECK(wait_results(delivery, 2).size() == 2);
+	}
+
+	TEST_CASE("delivers through a local Bot API stand-in with connection reuse") {
+		MockTelegram mock;
+		set_telegram_api_url(mock.url());
+		BOT_TOKEN = "test-token";
+
+		AuthDelivery delivery(1, 16, post_telegram_code);
+		REQUIRE(delivery.submit({5, 1, "1001", "111111"}));
+		REQUIRE(delivery.submit({6, 2, "1002", "222222"}));
+		auto results = wait_results(delivery, 2);
+		REQUIRE(results.size() == 2);
+		CHECK(results[0].delivered);
+		CHECK(results[1].delivered);
+
+		auto bodies = mock.bodies();
+		REQUIRE(bodies.size() == 2);
+		CHECK(bodies[0].find("chat_id=1001") != std::string::npos);
+		CHECK(bodies[0].find("111111") != std::string::npos);
+		CHECK(mock.code_for("1002") == "222222");
+		CHECK(mock.code_for("1003").empty());
+		CHECK(mock.connections() == 1);
+
+		mock.set_ok(false);
+		REQUIRE(delivery.submit({7, 3, "1003", "333333"}));
+		results = wait_results(delivery, 1);
+		REQUIRE(results.size() == 1);
+		CHECK_FALSE(results[0].delivered);
+
+		delivery.stop();
+		set_telegram_api_url("https://api.telegram.org");
+	}
+
+	TEST_CASE("zero workers still start one thread") {
+		AuthDelivery delivery(0, 16, [](const std::string&, const std::string&) { return true; });
+		REQUIRE(delivery.submit({1, 1, "a", "1"}));
+		REQUIRE(wait_results(delivery, 1).size() == 1);
+		CHECK(delivery.queued() == 0);
+	}
+
+	TEST_CASE("stats count latency, failures and rejected jobs") {
+		AuthDelivery delivery(1, 64, [](const std::string& chat_id, const std::string&) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			return chat_id != "bad";
+		});
+		REQUIRE(delivery.submit({1, 1, "a", "1"}));
+		REQUIRE(delivery.submit({2, 2, "bad", "2"}));
+		REQUIRE(wait_results(delivery, 2).size() == 2);
+
+		AuthDeliveryStats st = delivery.stats();
+		CHECK(st.requests == 2);
+		CHECK(st.failures == 1);
+		CHECK(st.failure_rate == doctest::Approx(0.5));
+		CHECK(st.avg_latency_us >= 2000);
+		CHECK(st.max_latency_us >= st.avg_latency_us);
+		CHECK(st.p50_latency_us > 0);
+		CHECK(st.p99_latency_us <= st.max_latency_us);
+	}
+
+	TEST_CASE("a burst is taken by a worker as one batch") {
+		std::atomic<bool> release{false};
+		AuthDelivery delivery(
+		    1, 64,
+		    [&](const std::string&, const std::string&) {
+			    while (!release)
+				    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			    return true;
+		    },
+		    8);
+
+		REQUIRE(delivery.submit({0, 0, "first", "0"}));
+		while (delivery.queued() != 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		for (int i = 1; i <= 10; ++i)
+			REQUIRE(delivery.submit({i, static_cast<uint64_t>(i), std::to_string(i), "0"}));
+
+		release = true;
+		REQUIRE(wait_results(delivery, 11).size() == 11);
+		AuthDeliveryStats st = delivery.stats();
+		CHECK(st.max_batch == 8);
+		CHECK(st.batches == 3);
+	}
+
+	TEST_CASE("each result of a batch is published as soon as its request returns") {
+		std::atomic<bool> gate{false};
+		std::atomic<bool> release{false};
+		AuthDelivery delivery(1, 64, [&](const std::string& chat_id, const std::string&) {
+			while ((chat_id == "gate" && !gate) || (chat_id == "slow" && !release))
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			return true;
+		});
+
+		REQUIRE(delivery.submit({0, 0, "gate", "0"}));
+		while (delivery.queued() != 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		// "fast" и "slow" уходят одной пачкой; "fast" не ждёт "slow".
+		REQUIRE(delivery.submit({1, 1, "fast", "1"}));
+		REQUIRE(delivery.submit({2, 2, "slow", "2"}));
+		gate = true;
+		std::vector<AuthResult> first = wait_results(delivery, 2);
+		REQUIRE(first.size() == 2);
+		CHECK(first[1].job.chat_id == "fast");
+
+		release = true;
+		std::vector<AuthResult> last = wait_results(delivery, 1);
+		REQUIRE(last.size() == 1);
+		CHECK(last[0].job.chat_id == "slow");
+		CHECK(delivery.stats().max_batch == 2);
+	}
+}
@@ -0,0 +1,94 @@
+#include "../server/buffer_pool.h"
+
+#include <memory>
+#include <string>
+
+#include "doctest/doctest.h"
+
+TEST_SUITE("buffer_pool::BufferPool") {
+	TEST_CASE("sizes round up to power-of-two classes") {
+		CHECK(BufferPool::block_size(1) == 64);
+		CHECK(BufferPool::block_size(64) == 64);
+		CHECK(BufferPool::block_size(65) == 128);
+		CHECK(BufferPool::block_size(4096) == 4096);
+		CHECK(BufferPool::block_size(4097) == 8192);
+		CHECK(BufferPool::block_size(BufferPool::MAX_BLOCK) == BufferPool::MAX_BLOCK);
+		CHECK(BufferPool::block_size(BufferPool::MAX_BLOCK + 1) == BufferPool::MAX_BLOCK + 1);
+	}
+
+	TEST_CASE("released blocks are reused within their class") {
+		BufferPool pool(2);
+		void* a = pool.allocate(100);
+		void* b = pool.allocate(100);
+		void* c = pool.allocate(100);
+		CHECK(pool.stats().heap_allocs == 3);
+		pool.release(a, 100);
+		pool.release(b, 128);
+		pool.release(c, 100);  // Сверх лимита класса — обратно в кучу.
+		CHECK(pool.stats().cached == 2);
+		CHECK(pool.stats().cached_bytes == 256);
+
+		void* d = pool.allocate(120);
+		CHECK((d == a || d == b));
+		CHECK(pool.allocate(10) != a);  // Другой класс.
+		CHECK(pool.stats().reuses == 1);
+	}
+}
+
+TEST_SUITE("buffer_pool::PooledBuffer") {
+	TEST_CASE("append grows and keeps contents") {
+		PooledBuffer buf(4);
+		CHECK(buf.capacity() >= 4);
+		buf.append("hello");
+		buf.push_back(' ');
+		std::string big(300, 'x');
+		buf.append(big);
+		CHECK(buf.view() == "hello " + big);
+		CHECK(buf.capacity() >= buf.size());
+		CHECK(buf.use_count() == 1);
+	}
+
+	TEST_CASE("shared block is returned to the pool once, by the last reference") {
+		PooledBuffer buf(32);
+		buf.append("line\n");
+		PooledBuffer second = buf.share();
+		CHECK(second.view().data() == buf.view().data());
+		CHECK(buf.use_count() == 2);
+
+		BufferLease lease = std::move(second).lease();
+		CHECK(second.empty());
+		uint64_t cached = buffer_pool().stats().cached;
+		buf.reset();
+		CHECK(buffer_pool().stats().cached == cached);
+		lease.reset();
+		CHECK(buffer_pool().stats().cached == cached + 1);
+	}
+
+	TEST_CASE("moved buffer leaves the source empty") {
+		PooledBuffer a(16);
+		a.append("abc");
+		PooledBuffer b = std::move(a);
+		CHECK(a.empty());
+		CHECK(a.use_count() == 0);
+		CHECK(b.view() == "abc");
+	}
+}
+
+TEST_SUITE("buffer_pool::PooledTask") {
+	TEST_CASE("holds move-only closures and destroys unrun ones") {
+		auto owned = std::make_unique<int>(7);
+		int seen = 0;
+		PooledTask task([p = std::move(owned), &seen] { seen = *p; });
+		PooledTask moved = std::move(task);
+		CHECK_FALSE(task);
+		moved();
+		CHECK(seen == 7);
+
+		auto tracked = std::make_shared<int>(1);
+		{
+			PooledTask unrun([tracked] {});
+			CHECK(tracked.use_count() == 2);
+		}
+		CHECK(tracked.use_count() == 1);
+	}
+}
@@ -0,0 +1,60 @@
+#include "../server/commands.h"
+
+#include <string>
+
+#include "doctest/doctest.h"
+
+// Разбор выполняется и на этапе компиляции.
+static_assert(parse_command("/vote").id == Command::Vote);
+static_assert(parse_command("/connect 42").args == "42");
+
+TEST_SUITE("commands::parse_command") {
+	TEST_CASE("every table entry is found by its name") {
+		for (const CommandSpec& c : COMMANDS) {
+			std::string msg(c.name);
+			if (c.args == CommandArgs::Required)
+				msg += " x";
+			CHECK(parse_command(msg).id == c.id);
+		}
+	}
+
+	TEST_CASE("argument forms follow the table") {
+		CHECK(parse_command("/connect 123").id == Command::Connect);
+		CHECK(parse_command("/connect 123").args == "123");
+		CHECK(parse_command("/connect").id == Command::Unknown);
+		CHECK(parse_command("/connect ").id == Command::Connect);
+
+		CHECK(parse_command("/vote now").id == Command::Unknown);
+		CHECK(parse_command("/history").id == Command::History);
+		CHECK(parse_command("/history 10 5").args == "10 5");
+		CHECK(parse_command("/room join lobby").args == "join lobby");
+		CHECK(parse_command("/room").id == Command::Unknown);
+		CHECK(parse_command("/rooms").id == Command::Rooms);
+	}
+
+	TEST_CASE("unknown names and prefixes are rejected") {
+		CHECK(parse_command("").id == Command::Unknown);
+		CHECK(parse_command("/").id == Command::Unknown);
+		CHECK(parse_command("/vot").id == Command::Unknown);
+		CHECK(parse_command("/votes").id == Command::Unknown);
+		CHECK(parse_command("/Vote").id == Command::Unknown);
+		CHECK(parse_command("hello").id == Command::Unknown);
+	}
+}
+
+TEST_SUITE("commands::texts") {
+	TEST_CASE("help lists every command with aligned summaries") {
+		CHECK(HELP_TEXT.starts_with("Available commands:\n"));
+		CHECK(HELP_TEXT.find("/connect <ID> - request chat with user\n") != std::string_view::npos);
+		CHECK(HELP_TEXT.find("/vote         - pass speaker role\n") != std::string_view::npos);
+		for (const CommandSpec& c : COMMANDS)
+			CHECK(HELP_TEXT.find(c.summary) != std::string_view::npos);
+		CHECK(HELP_TEXT.back() == '\n');
+	}
+
+	TEST_CASE("unknown command reply names every command") {
+		CHECK(UNKNOWN_COMMAND_TEXT ==
+		      "Only /connect <ID>, /vote, /end, /room create|join <name>, /rooms, /history <n> [before], "
+		      "/search <words>, /exit, /help are allowed.\n");
+	}
+}
@@ -0,0 +1,186 @@
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../server/event_loop.h"
+#include "doctest/doctest.h"
+#include <string>
+#include <vector>
+
+namespace {
+	struct SocketPair {
+		int a = -1, b = -1;
+		SocketPair() {
+			int sv[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+				a = sv[0];
+				b = sv[1];
+			}
+		}
+		~SocketPair() {
+			close(a);
+			close(b);
+		}
+	};
+
+	void check_backend(LoopBackend backend) {
+		auto loop = make_event_loop(backend);
+		REQUIRE(loop != nullptr);
+
+		SocketPair sp;
+		REQUIRE(loop->add(sp.a, LOOP_READ | LOOP_EDGE));
+
+		std::vector<LoopEvent> events;
+		CHECK(loop->wait(events, 0) == 0);
+
+		REQUIRE(write(sp.b, "x", 1) == 1);
+		REQUIRE(loop->wait(events, 1000) == 1);
+		CHECK(events[0].fd == sp.a);
+		CHECK((events[0].events & LOOP_READ) != 0);
+
+		REQUIRE(loop->modify(sp.a, LOOP_WRITE));
+		REQUIRE(loop->wait(events, 1000) == 1);
+		CHECK((events[0].events & LOOP_WRITE) != 0);
+
+		loop->remove(sp.a);
+		loop->remove(sp.a);
+		CHECK(loop->wait(events, 0) == 0);
+	}
+}  // namespace
+
+TEST_SUITE("event_loop") {
+	TEST_CASE("epoll backend reports readiness") {
+		check_backend(LoopBackend::Epoll);
+	}
+
+	TEST_CASE("select backend reports readiness") {
+		check_backend(LoopBackend::Select);
+	}
+
+	TEST_CASE("select rejects descriptors beyond FD_SETSIZE") {
+		auto loop = make_event_loop(LoopBackend::Select);
+		CHECK_FALSE(loop->add(FD_SETSIZE, LOOP_READ));
+	}
+
+	TEST_CASE("edge-triggered epoll does not repeat pending data") {
+		auto loop = make_event_loop(LoopBackend::Epoll);
+		SocketPair sp;
+		REQUIRE(loop->add(sp.a, LOOP_READ | LOOP_EDGE));
+		REQUIRE(write(sp.b, "xy", 2) == 2);
+
+		std::vector<LoopEvent> events;
+		CHECK(loop->wait(events, 1000) == 1);
+		CHECK(loop->wait(events, 0) == 0);
+	}
+
+	TEST_CASE("send_batch reports bytes taken and a full socket buffer") {
+		auto loop = make_event_loop(LoopBackend::Epoll);
+		SocketPair first, second;
+		std::string big(4 << 20, 'x');
+		iovec small{const_cast<char*>("hi"), 2};
+		iovec large{big.data(), big.size()};
+		LoopSend sends[] = {{first.a, &small, 1}, {second.a, &large, 1}};
+		loop->send_batch(sends);
+		CHECK(sends[0].result == 2);
+		CHECK(sends[1].result > 0);
+		CHECK(sends[1].result < static_cast<ssize_t>(big.size()));
+
+		loop->send_batch(std::span<LoopSend>(sends + 1, 1));
+		CHECK(sends[1].result == -EAGAIN);
+	}
+}
+
+// Цикл io_uring есть не в каждой сборке и не на каждом ядре: тогда проверки пропускаются.
+TEST_SUITE("event_loop::io_uring") {
+	TEST_CASE("io_uring backend reports readiness") {
+		if (!make_event_loop(LoopBackend::Uring))
+			return;
+		check_backend(LoopBackend::Uring);
+	}
+
+	TEST_CASE("accepts and receives are delivered in events") {
+		auto loop = make_event_loop(LoopBackend::Uring);
+		if (!loop)
+			return;
+		int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		REQUIRE(bind(listener, (sockaddr*)&addr, sizeof(addr)) == 0);
+		REQUIRE(listen(listener, 8) == 0);
+		REQUIRE(getsockname(listener, (sockaddr*)&addr, &len) == 0);
+		REQUIRE(loop->add(listener, LOOP_READ | LOOP_EDGE | LOOP_ACCEPT));
+
+		int client = socket(AF_INET, SOCK_STREAM, 0);
+		REQUIRE(connect(client, (sockaddr*)&addr, sizeof(addr)) == 0);
+		std::vector<LoopEvent> events;
+		REQUIRE(loop->wait(events, 1000) == 1);
+		CHECK(events[0].fd == listener);
+		int accepted = events[0].accepted;
+		REQUIRE(accepted >= 0);
+
+		REQUIRE(loop->add(accepted, LOOP_READ | LOOP_EDGE | LOOP_RECV));
+		REQUIRE(write(client, "hello\n", 6) == 6);
+		REQUIRE(loop->wait(events, 1000) == 1);
+		CHECK(events[0].fd == accepted);
+		CHECK(events[0].data == "hello\n");
+
+		close(client);
+		REQUIRE(loop->wait(events, 1000) == 1);
+		CHECK(events[0].fd == accepted);
+		CHECK((events[0].events & LOOP_CLOSED) != 0);
+
+		loop->remove(accepted);
+		loop->remove(listener);
+		close(accepted);
+		close(listener);
+	}
+
+	TEST_CASE("send_batch sends every socket's buffers in one submission") {
+		auto loop = make_event_loop(LoopBackend::Uring);
+		if (!loop)
+			return;
+		SocketPair first, second;
+		iovec one[] = {{const_cast<char*>("ab"), 2}, {const_cast<char*>("cd"), 2}};
+		iovec two{const_cast<char*>("xyz"), 3};
+		LoopSend sends[] = {{first.a, one, 2}, {second.a, &two, 1}};
+		loop->send_batch(sends);
+		CHECK(sends[0].result == 4);
+		CHECK(sends[1].result == 3);
+		char buf[8] = {};
+		CHECK(read(first.b, buf, sizeof(buf)) == 4);
+		CHECK(std::string(buf, 4) == "abcd");
+
+		std::string big(4 << 20, 'x');
+		iovec large{big.data(), big.size()};
+		LoopSend full{second.a, &large, 1};
+		loop->send_batch(std::span<LoopSend>(&full, 1));
+		CHECK(full.result > 0);
+		CHECK(full.result < static_cast<ssize_t>(big.size()));
+		loop->send_batch(std::span<LoopSend>(&full, 1));
+		CHECK(full.result == -EAGAIN);
+	}
+
+	TEST_CASE("suspend hands back received bytes and resume re-arms") {
+		auto loop = make_event_loop(LoopBackend::Uring);
+		if (!loop)
+			return;
+		SocketPair sp;
+		REQUIRE(loop->add(sp.a, LOOP_READ | LOOP_EDGE | LOOP_RECV));
+		std::vector<LoopEvent> events;
+		CHECK(loop->wait(events, 0) == 0);
+
+		REQUIRE(write(sp.b, "queued", 6) == 6);
+		loop->suspend(events);
+		REQUIRE(events.size() == 1);
+		CHECK(events[0].data == "queued");
+
+		// Приостановленный цикл данные не забирает: они остаются в сокете.
+		REQUIRE(write(sp.b, "later", 5) == 5);
+		loop->resume();
+		REQUIRE(loop->wait(events, 1000) == 1);
+		CHECK(events[0].data == "later");
+	}
+}
@@ -0,0 +1,130 @@
+#include "../server/handoff.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "doctest/doctest.h"
+
+static HandoffState sample_state() {
+	HandoffState state;
+	state.frozen_at_ns = 123456789;
+	state.listeners = {3, 4};
+	HandoffSession alice;
+	alice.fd = 10;
+	alice.shard = 1;
+	alice.user = "111";
+	alice.partner = "222";
+	alice.is_speaking = true;
+	alice.input = "half a li";
+	alice.output = std::string("queued\0bytes", 12);
+	HandoffSession guest;
+	guest.fd = 11;
+	guest.binary = true;
+	guest.pending_auth = "333";
+	guest.auth_code = "424242";
+	state.sessions = {alice, guest};
+	state.rooms = {HandoffRoom{"lobby", {"111", "444"}, 1}};
+	return state;
+}
+
+TEST_SUITE("handoff::encode_handoff") {
+	TEST_CASE("state survives a round trip, descriptors aside") {
+		HandoffState state = sample_state();
+		HandoffState back;
+		REQUIRE(decode_handoff(encode_handoff(state), back));
+		CHECK(back.frozen_at_ns == 123456789);
+		CHECK(back.listeners.size() == 2);
+		REQUIRE(back.sessions.size() == 2);
+		const HandoffSession& alice = back.sessions[0];
+		CHECK(alice.shard == 1);
+		CHECK(alice.user == "111");
+		CHECK(alice.partner == "222");
+		CHECK(alice.is_speaking);
+		CHECK(alice.input == "half a li");
+		CHECK(alice.output == std::string("queued\0bytes", 12));
+		CHECK(back.sessions[1].binary);
+		CHECK(back.sessions[1].pending_auth == "333");
+		CHECK(back.sessions[1].auth_code == "424242");
+		REQUIRE(back.rooms.size() == 1);
+		CHECK(back.rooms[0].members == std::vector<std::string>{"111", "444"});
+		CHECK(back.rooms[0].speaker == 1);
+	}
+
+	TEST_CASE("truncated, padded or foreign data is rejected") {
+		std::string blob = encode_handoff(sample_state());
+		HandoffState back;
+		for (size_t len = 0; len < blob.size(); ++len)
+			CHECK_FALSE(decode_handoff(std::string_view(blob).substr(0, len), back));
+		CHECK_FALSE(decode_handoff(blob + "x", back));
+		std::string foreign = blob;
+		foreign[4] = 9;  // Версия.
+		CHECK_FALSE(decode_handoff(foreign, back));
+	}
+}
+
+TEST_SUITE("handoff::send_handoff") {
+	TEST_CASE("descriptors cross the socket in batches and stay usable") {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+		// Больше одной пачки: два слушающих и 260 клиентских дескрипторов.
+		HandoffState state;
+		std::vector<int> write_ends;
+		for (int i = 0; i < 262; ++i) {
+			int p[2];
+			REQUIRE(pipe(p) == 0);
+			write_ends.push_back(p[1]);
+			if (i < 2) {
+				state.listeners.push_back(p[0]);
+			} else {
+				HandoffSession s;
+				s.fd = p[0];
+				s.user = std::to_string(i);
+				state.sessions.push_back(s);
+			}
+		}
+
+		int64_t sent = 0;
+		std::thread sender([&] { sent = send_handoff(sv[0], state); });
+		HandoffState got;
+		int64_t received = recv_handoff(sv[1], got);
+		sender.join();
+		REQUIRE(received > 0);
+		CHECK(received == sent);
+		REQUIRE(got.sessions.size() == 260);
+		CHECK(got.sessions[259].user == "261");
+
+		// Полученный дескриптор — тот же канал, что у отправителя.
+		REQUIRE(write(write_ends[261], "z", 1) == 1);
+		char c = 0;
+		CHECK(read(got.sessions[259].fd, &c, 1) == 1);
+		CHECK(c == 'z');
+		CHECK((fcntl(got.listeners[0], F_GETFD) & FD_CLOEXEC) != 0);
+
+		for (int fd : got.listeners)
+			close(fd);
+		for (const HandoffSession& s : got.sessions)
+			close(s.fd);
+		for (int fd : state.listeners)
+			close(fd);
+		for (const HandoffSession& s : state.sessions)
+			close(s.fd);
+		for (int fd : write_ends)
+			close(fd);
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	TEST_CASE("a broken stream yields an error and leaks nothing") {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+		REQUIRE(write(sv[0], "CMHO", 4) == 4);
+		close(sv[0]);
+		HandoffState got;
+		CHECK(recv_handoff(sv[1], got) == -1);
+		close(sv[1]);
+	}
+}
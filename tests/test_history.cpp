@@ -15,6 +15,7 @@ static struct HistoryBackup {
 			fs::copy("HISTORY", "HISTORY.bak", fs::copy_options::recursive);
 	}
 	~HistoryBackup() {
+		close_history_files();
 		fs::remove_all("HISTORY");
 		if (fs::exists("HISTORY.bak"))
 			fs::rename("HISTORY.bak", "HISTORY");
@@ -23,6 +24,7 @@ static struct HistoryBackup {
 
 TEST_SUITE("history") {
 	TEST_CASE("append + load basic") {
+		close_history_files();
 		fs::remove_all("HISTORY");
 
 		append_message_to_history("123", "456", "Hello");
@@ -34,6 +36,7 @@ TEST_SUITE("history") {
 	}
 
 	TEST_CASE("order of IDs irrelevant") {
+		close_history_files();
 		fs::remove_all("HISTORY");
 
 		append_message_to_history("123", "456", "Ping");
@@ -44,11 +47,13 @@ TEST_SUITE("history") {
 	}
 
 	TEST_CASE("empty history → empty string") {
+		close_history_files();
 		fs::remove_all("HISTORY");
 		CHECK(load_history_for_users("999", "888").empty());
 	}
 
 	TEST_CASE("separate chats don’t mix") {
+		close_history_files();
 		fs::remove_all("HISTORY");
 
 		append_message_to_history("123", "456", "msg_1");
@@ -59,11 +64,12 @@ TEST_SUITE("history") {
 	}
 
 	TEST_CASE("file created on disk") {
+		close_history_files();
 		fs::remove_all("HISTORY");
 
 		append_message_to_history("123", "456", "Hi");
 
-		const fs::path expected = "HISTORY/history_123_456.txt";
-		CHECK(fs::exists(expected));
+		CHECK(fs::exists("HISTORY/history_123_456.log"));
+		CHECK(fs::exists("HISTORY/history_123_456.idx"));
 	}
 }
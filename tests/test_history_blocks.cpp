@@ -0,0 +1,197 @@
+#include "../server/history_blocks.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "doctest/doctest.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+	const std::string DIR = "HISTORY_BLOCKS_TEST";
+	const std::string BASE = DIR + "/history_1_2";
+	const std::string SEGMENT0 = BASE + ".0.blk";
+
+	void reset_dir() {
+		fs::remove_all(DIR);
+		fs::create_directories(DIR);
+	}
+
+	std::string sample(size_t len, char tag) {
+		std::string raw;
+		while (raw.size() < len)
+			raw += std::string("[2024-01-01 10:00] 1: message ") + tag + "\n";
+		raw.resize(len);
+		return raw;
+	}
+}  // namespace
+
+TEST_SUITE("history_blocks") {
+	TEST_CASE("compress round trip") {
+		if (!HistoryBlocks::available())
+			return;
+		std::string raw = sample(10000, 'a'), packed, out;
+		REQUIRE(HistoryBlocks::compress(raw, packed));
+		CHECK(packed.size() < raw.size() / 4);
+		REQUIRE(HistoryBlocks::decompress(packed, raw.size(), out));
+		CHECK(out == raw);
+		CHECK_FALSE(HistoryBlocks::decompress(packed, raw.size() + 1, out));
+		packed[packed.size() / 2] ^= 0x55;
+		CHECK_FALSE(HistoryBlocks::decompress(packed, raw.size(), out));
+	}
+
+	TEST_CASE("blocks are found by record and survive reopening") {
+		if (!HistoryBlocks::available())
+			return;
+		reset_dir();
+		{
+			HistoryBlocks blocks(BASE);
+			blocks.open();
+			CHECK_FALSE(fs::exists(BASE + ".bix"));
+			REQUIRE(blocks.append(10, sample(3000, 'a'), true));
+			REQUIRE(blocks.append(5, sample(2000, 'b'), true));
+			REQUIRE(blocks.sync());
+		}
+		HistoryBlocks blocks(BASE);
+		blocks.open();
+		REQUIRE(blocks.blocks().size() == 2);
+		CHECK(blocks.records() == 15);
+		CHECK(blocks.log_bytes() == 5000);
+		CHECK(blocks.packed_bytes() == fs::file_size(SEGMENT0));
+		CHECK(blocks.packed_bytes() < blocks.log_bytes());
+		CHECK(blocks.find(0) == 0);
+		CHECK(blocks.find(9) == 0);
+		CHECK(blocks.find(10) == 1);
+		CHECK(blocks.find(14) == 1);
+
+		std::string raw;
+		REQUIRE(blocks.read(1, raw));
+		CHECK(raw == sample(2000, 'b'));
+		CHECK(blocks.blocks()[1].log_offset == 3000);
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("torn block tail is cut off on open") {
+		if (!HistoryBlocks::available())
+			return;
+		reset_dir();
+		{
+			HistoryBlocks blocks(BASE);
+			blocks.open();
+			REQUIRE(blocks.append(3, sample(500, 'a'), true));
+			REQUIRE(blocks.append(4, sample(700, 'b'), true));
+		}
+		// Индекс второго блока записан, а сам блок — нет.
+		auto size = fs::file_size(SEGMENT0);
+		fs::resize_file(SEGMENT0, size - 1);
+
+		HistoryBlocks blocks(BASE);
+		blocks.open();
+		REQUIRE(blocks.blocks().size() == 1);
+		CHECK(blocks.records() == 3);
+		CHECK(fs::file_size(BASE + ".bix") == sizeof(HistoryBlock));
+		CHECK(fs::file_size(SEGMENT0) == blocks.packed_bytes());
+		REQUIRE(blocks.append(2, sample(100, 'c'), true));
+		CHECK(blocks.records() == 5);
+
+		HistoryBlocks::remove(BASE);
+		CHECK_FALSE(fs::exists(SEGMENT0));
+		CHECK_FALSE(fs::exists(BASE + ".bix"));
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("uncompressed blocks are stored as is") {
+		reset_dir();
+		HistoryBlocks blocks(BASE);
+		blocks.open();
+		REQUIRE(blocks.append(4, sample(900, 'a'), false));
+		CHECK(blocks.blocks()[0].packed == 900);
+		CHECK(fs::file_size(SEGMENT0) == 900);
+		std::string raw;
+		REQUIRE(blocks.read(0, raw));
+		CHECK(raw == sample(900, 'a'));
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("segments rotate and old ones are dropped whole") {
+		reset_dir();
+		{
+			HistoryBlocks blocks(BASE);
+			blocks.open();
+			REQUIRE(blocks.append(2, sample(100, 'a'), false));
+			REQUIRE(blocks.append(3, sample(200, 'b'), false));
+			REQUIRE(blocks.append(4, sample(300, 'c'), false, true));
+			REQUIRE(blocks.append(5, sample(400, 'd'), false, true));
+			REQUIRE(blocks.sync());
+			CHECK(blocks.segment() == 2);
+			CHECK(blocks.segment_raw() == 400);
+			CHECK(fs::file_size(SEGMENT0) == 300);
+			CHECK(fs::file_size(HistoryBlocks::segment_path(BASE, 1)) == 300);
+
+			std::vector<std::string> trash;
+			// Текущий сегмент не удаляется, даже если попросить.
+			CHECK(blocks.drop_segments(10, trash) == 600);
+			REQUIRE(trash.size() == 2);
+			CHECK_FALSE(fs::exists(SEGMENT0));
+			CHECK(fs::exists(trash[0]));
+			for (const auto& path : trash)
+				fs::remove(path);
+			REQUIRE(blocks.blocks().size() == 1);
+			CHECK(blocks.first() == 9);
+			CHECK(blocks.records() == 14);
+			CHECK(blocks.log_bytes() == 1000);
+			CHECK(blocks.packed_bytes() == 400);
+			CHECK(blocks.find(9) == 0);
+			CHECK(blocks.drop_segments(10, trash) == 0);
+			REQUIRE(blocks.append(1, sample(50, 'e'), false));
+		}
+		HistoryBlocks blocks(BASE);
+		blocks.open();
+		REQUIRE(blocks.blocks().size() == 2);
+		CHECK(blocks.first() == 9);
+		CHECK(blocks.records() == 15);
+		CHECK(blocks.segment() == 2);
+		CHECK(blocks.segment_raw() == 450);
+		std::string raw;
+		REQUIRE(blocks.read(1, raw));
+		CHECK(raw == sample(50, 'e'));
+		REQUIRE(blocks.append(2, sample(60, 'f'), false, true));
+		CHECK(fs::file_size(HistoryBlocks::segment_path(BASE, 3)) == 60);
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("segment started without an index entry is removed on open") {
+		reset_dir();
+		{
+			HistoryBlocks blocks(BASE);
+			blocks.open();
+			REQUIRE(blocks.append(2, sample(100, 'a'), false));
+			REQUIRE(blocks.append(2, sample(100, 'b'), false, true));
+		}
+		// Сегмент 1 записан, а его элемент индекса — нет.
+		fs::resize_file(BASE + ".bix", sizeof(HistoryBlock));
+		HistoryBlocks blocks(BASE);
+		blocks.open();
+		CHECK(blocks.records() == 2);
+		CHECK(blocks.segment() == 0);
+		CHECK_FALSE(fs::exists(HistoryBlocks::segment_path(BASE, 1)));
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("single block file of the old format becomes segment 0") {
+		reset_dir();
+		{
+			HistoryBlocks blocks(BASE);
+			blocks.open();
+			REQUIRE(blocks.append(3, sample(300, 'a'), false));
+		}
+		fs::rename(SEGMENT0, BASE + ".blk");
+		HistoryBlocks blocks(BASE);
+		blocks.open();
+		CHECK(blocks.records() == 3);
+		CHECK(fs::exists(SEGMENT0));
+		CHECK_FALSE(fs::exists(BASE + ".blk"));
+		fs::remove_all(DIR);
+	}
+}
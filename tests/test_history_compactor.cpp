@@ -0,0 +1,90 @@
+#include "../server/history_blocks.h"
+#include "../server/history_compactor.h"
+#include "doctest/doctest.h"
+#include <atomic>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+	const std::string ROOT = "HISTORY_COMPACTOR_TEST";
+
+	void fill(HistoryStore& store, int from, int count) {
+		std::vector<HistoryRecord> batch;
+		for (int i = from; i < from + count; ++i) {
+			std::string text = "message " + std::to_string(i) + " lorem ipsum\n";
+			batch.push_back(HistoryRecord{1700000000 + i, "1", text});
+			if (batch.size() == 100) {
+				REQUIRE(store.append_batch("1", "2", batch));
+				batch.clear();
+			}
+		}
+		REQUIRE(store.append_batch("1", "2", batch));
+	}
+
+	/// Дождаться @p passes проходов (не дольше нескольких секунд).
+	bool wait_passes(const HistoryCompactor& compactor, uint64_t passes) {
+		for (int i = 0; i < 500 && compactor.stats().passes < passes; ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		return compactor.stats().passes >= passes;
+	}
+}  // namespace
+
+TEST_SUITE("history_compactor") {
+	TEST_CASE("passes apply the retention policy and are reported") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		HistoryRetention retention;
+		retention.segment_bytes = HistoryBlocks::BLOCK_BYTES;
+		retention.max_bytes = 300 * 1024;
+		store.set_retention(retention);
+		fill(store, 0, 12000);
+
+		std::atomic<uint64_t> reported_segments{0};
+		std::atomic<uint64_t> reported_bytes{0};
+		HistoryCompactor compactor(store, std::chrono::hours(1),
+		                           [&](const HistoryCompaction& pass, std::chrono::microseconds took) {
+			                           CHECK(took.count() >= 0);
+			                           reported_segments += pass.segments;
+			                           reported_bytes = pass.bytes;
+		                           });
+		// Первый проход — сразу после запуска.
+		REQUIRE(wait_passes(compactor, 1));
+		HistoryCompactorStats st = compactor.stats();
+		CHECK(st.segments > 0);
+		CHECK(st.reclaimed_bytes > 0);
+		CHECK(st.bytes <= retention.max_bytes);
+		CHECK(st.max_us >= st.last_us);
+		CHECK(reported_segments == st.segments);
+		CHECK(reported_bytes == st.bytes);
+		CHECK(store.map_page("1", "2", UINT64_MAX).first > 0);
+
+		// Следующий проход не ждёт часового интервала после wake().
+		fill(store, 12000, 6000);
+		compactor.wake();
+		REQUIRE(wait_passes(compactor, 2));
+		CHECK(compactor.stats().segments > st.segments);
+
+		compactor.stop();
+		compactor.stop();
+		CHECK(compactor.stats().passes == 2);
+		CHECK(store.message_count("1", "2") == 18000);
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("stop does not wait for the interval") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		auto started = std::chrono::steady_clock::now();
+		{
+			HistoryCompactor compactor(store, std::chrono::hours(1));
+			REQUIRE(wait_passes(compactor, 1));
+			// Без ограничений проход ничего не удаляет.
+			CHECK(compactor.stats().segments == 0);
+		}
+		CHECK(std::chrono::steady_clock::now() - started < std::chrono::seconds(5));
+		fs::remove_all(ROOT);
+	}
+}
@@ -0,0 +1,545 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../server/history_blocks.h"
+#include "../server/history_store.h"
+#include "doctest/doctest.h"
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+	const std::string ROOT = "HISTORY_STORE_TEST";
+
+	HistoryRecord make(const std::string& sender, const std::string& text, int64_t ts = 1700000000) {
+		return HistoryRecord{ts, sender, text};
+	}
+
+	const int64_t T0 = 1700000000;
+
+	std::string retention_line(int i) {
+		return "[2024-01-01 10:00] 1: message " + std::to_string(i) + " lorem ipsum\n";
+	}
+
+	/// Записать @p count сообщений с меткой времени T0 + номер + @p shift.
+	void fill(HistoryStore& store, const std::string& partner, int count, int64_t shift = 0) {
+		for (int b = 0; b < count; b += 100) {
+			std::vector<HistoryRecord> batch;
+			for (int i = b; i < b + 100 && i < count; ++i)
+				batch.push_back(make("1", retention_line(i), T0 + i + shift));
+			REQUIRE(store.append_batch("1", partner, batch));
+		}
+	}
+
+	/// Номер первого оставшегося сообщения переписки.
+	uint64_t first_record(HistoryStore& store, const std::string& partner) {
+		return store.map_page("1", partner, UINT64_MAX).first;
+	}
+}  // namespace
+
+TEST_SUITE("history_store") {
+	TEST_CASE("encode/decode round trip") {
+		std::string buf;
+		HistoryStore::encode(make("123", "[2024-01-01 10:00] 123: hi\n"), buf);
+		HistoryStore::encode(make("", "raw"), buf);
+
+		size_t pos = 0;
+		HistoryRecord rec;
+		REQUIRE(HistoryStore::decode(buf.data(), buf.size(), pos, rec));
+		CHECK(rec.sender == "123");
+		CHECK(rec.timestamp == 1700000000);
+		CHECK(rec.text == "[2024-01-01 10:00] 123: hi\n");
+		REQUIRE(HistoryStore::decode(buf.data(), buf.size(), pos, rec));
+		CHECK(rec.text == "raw");
+		CHECK(pos == buf.size());
+
+		pos = 0;
+		CHECK_FALSE(HistoryStore::decode(buf.data(), HistoryStore::RECORD_HEADER + 5, pos, rec));
+		CHECK(pos == 0);
+	}
+
+	TEST_CASE("append keeps order and index") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		for (int i = 0; i < 10; ++i)
+			REQUIRE(store.append("1", "2", make("1", "m" + std::to_string(i) + "\n")));
+
+		CHECK(store.message_count("2", "1") == 10);
+		auto records = store.load_records("1", "2");
+		REQUIRE(records.size() == 10);
+		CHECK(records[9].text == "m9\n");
+		CHECK(fs::file_size(ROOT + "/history_1_2.idx") == 10 * HistoryStore::INDEX_ENTRY);
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("LRU keeps a bounded number of files open") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT, 2);
+		store.append("1", "2", make("1", "a\n"));
+		store.append("1", "3", make("1", "b\n"));
+		store.append("1", "4", make("1", "c\n"));
+		CHECK(store.open_writers() == 2);
+
+		store.append("1", "2", make("1", "d\n"));
+		CHECK(store.load_text("1", "2") == "a\nd\n");
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("torn write is repaired on reopen") {
+		fs::remove_all(ROOT);
+		{
+			HistoryStore store(ROOT);
+			store.append("1", "2", make("1", "first\n"));
+			store.append("1", "2", make("1", "second\n"));
+		}
+		// Обрезать последнюю запись посередине, индекс оставить как есть.
+		fs::resize_file(ROOT + "/history_1_2.log", fs::file_size(ROOT + "/history_1_2.log") - 3);
+
+		HistoryStore store(ROOT);
+		store.append("1", "2", make("1", "third\n"));
+		CHECK(store.load_text("1", "2") == "first\nthird\n");
+		CHECK(store.message_count("1", "2") == 2);
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("append_batch writes one index entry per record") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		std::vector<HistoryRecord> batch = {make("1", "one\n"), make("2", "two\n"), make("1", "three\n")};
+		REQUIRE(store.append_batch("1", "2", batch, true));
+		REQUIRE(store.append("1", "2", make("2", "four\n")));
+		CHECK(store.sync_all() == 1);
+		CHECK(store.sync_all() == 0);
+
+		HistoryPage page = store.load_page("1", "2", 2);
+		CHECK(page.total == 4);
+		CHECK(page.text == "three\nfour\n");
+		store.close_all();
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("io_uring writes and syncs land like plain writes") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		if (!store.use_io_ring())
+			return;  // сборка без MESSENGER_IO_URING или ядро без io_uring
+		std::vector<HistoryRecord> batch = {make("1", "one\n"), make("2", "two\n")};
+		REQUIRE(store.append_batch("1", "2", batch, true));
+		REQUIRE(store.append("1", "2", make("1", "three\n")));
+		REQUIRE(store.append("1", "3", make("3", "other\n")));
+		CHECK(store.sync_all() == 2);
+
+		HistoryPage page = store.load_page("1", "2", 10);
+		CHECK(page.total == 3);
+		CHECK(page.text == "one\ntwo\nthree\n");
+		store.close_all();
+
+		// Индекс, записанный через кольцо, согласован с журналом после повторного открытия.
+		HistoryStore reopened(ROOT);
+		REQUIRE(reopened.append("1", "2", make("2", "four\n")));
+		CHECK(reopened.load_page("1", "2", 1).text == "four\n");
+		CHECK(reopened.load_page("1", "3", 10).text == "other\n");
+		reopened.close_all();
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("load_page reads the tail through the index") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		for (int i = 0; i < 100; ++i)
+			store.append("1", "2", make("1", std::to_string(i) + "\n"));
+
+		HistoryPage page = store.load_page("1", "2", 3);
+		CHECK(page.total == 100);
+		CHECK(page.first == 97);
+		CHECK(page.count == 3);
+		CHECK(page.text == "97\n98\n99\n");
+
+		page = store.load_page("2", "1", 2, 10);
+		CHECK(page.first == 8);
+		CHECK(page.text == "8\n9\n");
+
+		page = store.load_page("1", "2", 5, 2);
+		CHECK(page.first == 0);
+		CHECK(page.text == "0\n1\n");
+
+		// Ограничение по байтам: каждая запись занимает заголовок + "1" + "NN\n".
+		page = store.load_page("1", "2", 50, UINT64_MAX, 2 * (HistoryStore::RECORD_HEADER + 4));
+		CHECK(page.text == "98\n99\n");
+		page = store.load_page("1", "2", 50, UINT64_MAX, 1);
+		CHECK(page.count == 1);
+
+		CHECK(store.load_page("1", "3", 10).count == 0);
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("map_page references the mapped log") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		// Записи длиннее страницы, чтобы начало фрагмента не совпадало с её границей.
+		for (int i = 0; i < 20; ++i)
+			store.append("1", "2", make("1", std::to_string(i) + std::string(1000, '.') + "\n"));
+
+		HistoryView view = store.map_page("1", "2", 3, 10);
+		REQUIRE(view.region);
+		REQUIRE(view.lines.size() == 3);
+		CHECK(view.first == 7);
+		CHECK(view.total == 20);
+		CHECK(view.lines[0].starts_with("7."));
+		CHECK(view.lines[2].starts_with("9."));
+		CHECK(view.bytes == 3 * 1002);
+		for (std::string_view line : view.lines) {
+			CHECK(line.data() >= view.region->data());
+			CHECK(line.data() + line.size() <= view.region->data() + view.region->size());
+		}
+
+		// Отображение переживает закрытие хранилища и дописывание журнала.
+		store.append("1", "2", make("1", "late\n"));
+		store.close_all();
+		CHECK(view.lines[1].starts_with("8."));
+
+		CHECK_FALSE(store.map_page("1", "9", 5).region);
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("record_from_text extracts sender") {
+		HistoryRecord rec = record_from_text("[2024-05-06 07:08] 42: hello: world\n", 5);
+		CHECK(rec.sender == "42");
+		CHECK(rec.text == "[2024-05-06 07:08] 42: hello: world\n");
+		CHECK(rec.timestamp != 5);
+
+		rec = record_from_text("plain", 5);
+		CHECK(rec.sender.empty());
+		CHECK(rec.timestamp == 5);
+	}
+
+	TEST_CASE("text history migration") {
+		fs::remove_all(ROOT);
+		fs::create_directories(ROOT);
+		std::ofstream(ROOT + "/history_1_2.txt")
+		    << "[2024-01-01 10:00] 1: old\n[2024-01-01 10:01] 2: older\n";
+		{
+			HistoryStore store(ROOT);
+			store.append("1", "2", make("1", "new\n"));
+		}
+
+		CHECK(migrate_text_history(ROOT) == 1);
+		CHECK(migrate_text_history(ROOT) == 0);
+		CHECK(fs::exists(ROOT + "/history_1_2.txt.migrated"));
+
+		HistoryStore store(ROOT);
+		CHECK(store.load_text("1", "2") ==
+		      "[2024-01-01 10:00] 1: old\n[2024-01-01 10:01] 2: older\nnew\n");
+		auto records = store.load_records("1", "2");
+		REQUIRE(records.size() == 3);
+		CHECK(records[1].sender == "2");
+		CHECK(store.message_count("1", "2") == 3);
+		// Номера записей сдвинулись: поисковый индекс перестроен по новому журналу.
+		CHECK(store.search("1", "2", "new", 10).records == std::vector<uint64_t>{2});
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("blocks of a log replaced by write_log are dropped after a crash") {
+		fs::remove_all(ROOT);
+		const std::string base = ROOT + "/history_1_2";
+		HistoryRetention retention;
+		retention.max_bytes = UINT64_MAX;  // только перенос в блоки, без удаления
+		{
+			HistoryStore store(ROOT);
+			store.set_retention(retention);
+			fill(store, "2", 4000);
+		}
+		REQUIRE(fs::exists(base + ".bix"));
+
+		// Сбой после замены журнала: блоки прежнего журнала остались на месте.
+		const std::string saved = ROOT + "/saved";
+		fs::create_directories(saved);
+		for (const char* name : {"history_1_2.bix", "history_1_2.0.blk"})
+			fs::copy_file(ROOT + "/" + name, saved + "/" + name);
+		std::vector<HistoryRecord> records = HistoryStore::read_log(base);
+		REQUIRE(records.size() == 4000);
+		records.insert(records.begin(), make("2", "prepended\n"));
+		REQUIRE(HistoryStore::write_log(base, records));
+		CHECK_FALSE(fs::exists(base + ".bix"));
+		for (const auto& entry : fs::directory_iterator(saved))
+			fs::copy_file(entry.path(), ROOT + "/" + entry.path().filename().string());
+
+		HistoryStore store(ROOT);
+		CHECK(store.load_records("1", "2").size() == 4001);
+		CHECK_FALSE(fs::exists(base + ".bix"));
+		CHECK(store.message_count("1", "2") == 4001);
+		HistoryView page = store.map_page("1", "2", 2, 2);
+		REQUIRE(page.lines.size() == 2);
+		CHECK(page.lines[0] == "prepended\n");
+		CHECK(page.lines[1] == retention_line(0));
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("search reads matching records through the index") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		std::vector<HistoryRecord> batch;
+		for (int i = 0; i < 30; ++i)
+			batch.push_back(make("1", "[2024-01-01 10:00] 1: msg " + std::to_string(i % 3) + " tail\n"));
+		REQUIRE(store.append_batch("1", "2", batch));
+
+		HistoryMatches found = store.search("2", "1", "MSG 1", 4);
+		CHECK(found.total == 10);
+		CHECK(found.records == std::vector<uint64_t>{19, 22, 25, 28});
+		REQUIRE(found.lines.size() == 4);
+		CHECK(found.lines[3] == "[2024-01-01 10:00] 1: msg 1 tail\n");
+		// Имя отправителя из префикса не индексируется.
+		CHECK(store.search("1", "2", "1 tail", 100).total == 10);
+		CHECK(store.search("1", "2", "absent", 10).total == 0);
+
+		CHECK(store.search("1", "3", "msg", 10).total == 0);
+		CHECK_FALSE(fs::exists(ROOT + "/history_1_3.log"));
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("search index catches up with the log on open") {
+		fs::remove_all(ROOT);
+		const std::string delta = ROOT + "/history_1_2.sxd";
+		{
+			HistoryStore store(ROOT);
+			store.append("1", "2", make("1", "alpha\n"));
+			store.append("1", "2", make("1", "beta\n"));
+		}
+		REQUIRE(fs::exists(delta));
+		auto covered = fs::file_size(delta);
+		{
+			HistoryStore store(ROOT);
+			store.append("1", "2", make("1", "alpha again\n"));
+		}
+		// Сегмент последней записи потерян: она индексируется заново по журналу.
+		fs::resize_file(delta, covered);
+		{
+			HistoryStore store(ROOT);
+			store.append("1", "2", make("1", "gamma\n"));
+			CHECK(store.search("1", "2", "alpha", 10).records == std::vector<uint64_t>{0, 2});
+			CHECK(store.search("1", "2", "gamma", 10).records == std::vector<uint64_t>{3});
+		}
+		fs::remove(delta);
+		HistoryStore store(ROOT);
+		CHECK(store.search("1", "2", "alpha", 10).records == std::vector<uint64_t>{0, 2});
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("merge_indexes folds delta segments into the main one") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT, 1);
+		for (int i = 0; i < 5; ++i) {
+			store.append("1", "2", make("1", "word" + std::to_string(i) + " common\n"));
+			store.append("1", "3", make("1", "other\n"));  // вытесняет 1_2: индекс пишет сегмент
+		}
+		store.append("1", "2", make("1", "last common\n"));
+		CHECK(store.merge_indexes(3) == 1);
+		CHECK(fs::exists(ROOT + "/history_1_2.six"));
+		CHECK(store.search("1", "2", "common", 10).records == std::vector<uint64_t>{0, 1, 2, 3, 4, 5});
+		CHECK(store.search("1", "2", "word3", 10).records == std::vector<uint64_t>{3});
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("compressed history reads like the plain log") {
+		if (!HistoryBlocks::available())
+			return;
+		fs::remove_all(ROOT);
+		const std::string log = ROOT + "/history_1_2.log";
+		auto line = [](int i) {
+			return "[2024-01-01 10:00] 1: message " + std::to_string(i) + " lorem ipsum\n";
+		};
+		std::string expected;
+		HistoryStore store(ROOT);
+		REQUIRE(store.compress_history());
+		for (int b = 0; b < 60; ++b) {
+			std::vector<HistoryRecord> batch;
+			for (int i = b * 100; i < (b + 1) * 100; ++i) {
+				batch.push_back(make("1", line(i)));
+				expected += line(i);
+			}
+			REQUIRE(store.append_batch("1", "2", batch));
+		}
+		REQUIRE(fs::exists(ROOT + "/history_1_2.0.blk"));
+
+		// Сжатая часть освобождена в журнале: файл разреженный, размер прежний.
+		struct stat st {};
+		REQUIRE(::stat(log.c_str(), &st) == 0);
+		uint64_t record_bytes = (HistoryStore::RECORD_HEADER + 1) * 6000 + expected.size();  // + отправитель
+		CHECK(static_cast<uint64_t>(st.st_size) == record_bytes);
+		CHECK(static_cast<uint64_t>(st.st_blocks) * 512 < static_cast<uint64_t>(st.st_size) / 2);
+
+		CHECK(store.load_text("1", "2") == expected);
+		CHECK(store.load_records("1", "2").size() == 6000);
+		CHECK(store.message_count("1", "2") == 6000);
+
+		HistoryView old = store.map_page("1", "2", 3, 10);
+		CHECK_FALSE(old.region);
+		REQUIRE(old.lines.size() == 3);
+		CHECK(old.first == 7);
+		CHECK(old.lines[0] == line(7));
+		CHECK(old.owner() == old.unpacked);
+
+		// Фрагмент через границу сжатой части и хвоста.
+		HistoryView all = store.map_page("1", "2", 6000);
+		REQUIRE(all.lines.size() == 6000);
+		CHECK(all.region);
+		CHECK(all.unpacked);
+		CHECK(all.bytes == expected.size());
+		CHECK(all.lines[5999] == line(5999));
+		size_t fit = 1000 / (HistoryStore::RECORD_HEADER + 1 + line(5000).size());
+		CHECK(store.map_page("1", "2", 6000, UINT64_MAX, 1000).lines.size() == fit);
+
+		CHECK(store.search("1", "2", "message 5", 10).records == std::vector<uint64_t>{5});
+		CHECK(store.search("1", "2", "message 5999", 10).lines == std::vector<std::string>{line(5999)});
+
+		// Выданное отображение хвоста остаётся читаемым, пока хвост сжимается дальше.
+		HistoryView tail = store.map_page("1", "2", 1);
+		for (int i = 6000; i < 9000; ++i)
+			REQUIRE(store.append("1", "2", make("1", line(i))));
+		CHECK(tail.lines[0] == line(5999));
+		store.close_all();
+
+		HistoryStore reopened(ROOT);
+		CHECK(reopened.message_count("1", "2") == 9000);
+		CHECK(reopened.load_page("1", "2", 2, 5001).text == line(4999) + line(5000));
+		REQUIRE(reopened.append("1", "2", make("1", line(9000))));
+		CHECK(reopened.map_page("1", "2", 2).lines.back() == line(9000));
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("mapped pages survive eviction and reopening of the log") {
+		fs::remove_all(ROOT);
+		HistoryRetention retention;
+		retention.max_bytes = UINT64_MAX;  // только перенос в блоки, без удаления
+		HistoryStore store(ROOT, 1);
+		store.set_retention(retention);
+		fill(store, "2", 2000);
+		HistoryView view = store.map_page("1", "2", 100);
+		REQUIRE(view.region);
+		std::vector<std::string> expected(view.lines.begin(), view.lines.end());
+
+		// Отображённые записи уходят в блоки, журнал вытесняется и открывается снова.
+		fill(store, "2", 8000);
+		store.append("1", "3", make("1", "other\n"));
+		CHECK(store.open_writers() == 1);
+		CHECK(store.message_count("1", "2") == 10000);
+		REQUIRE(store.map_page("1", "2", 1).lines.size() == 1);
+		std::vector<std::string> lines(view.lines.begin(), view.lines.end());
+		CHECK(lines == expected);
+
+		// Когда отображение закрыто, место освобождается при следующем переносе.
+		view = HistoryView{};
+		fill(store, "2", 2000);
+		struct stat st {};
+		REQUIRE(::stat((ROOT + "/history_1_2.log").c_str(), &st) == 0);
+		CHECK(static_cast<uint64_t>(st.st_blocks) * 512 < static_cast<uint64_t>(st.st_size) / 4);
+		REQUIRE(::stat((ROOT + "/history_1_2.idx").c_str(), &st) == 0);
+		CHECK(static_cast<uint64_t>(st.st_blocks) * 512 < static_cast<uint64_t>(st.st_size) / 2);
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("max_bytes drops the oldest segments of a conversation") {
+		fs::remove_all(ROOT);
+		HistoryRetention retention;
+		retention.segment_bytes = HistoryBlocks::BLOCK_BYTES;
+		retention.max_bytes = 400 * 1024;
+		HistoryStore store(ROOT);
+		store.set_retention(retention);
+		fill(store, "2", 12000);
+		REQUIRE(fs::exists(ROOT + "/history_1_2.3.blk"));
+
+		HistoryCompaction pass = store.compact(T0 + 12000);
+		CHECK(pass.segments > 0);
+		CHECK(pass.reclaimed_bytes > 0);
+		CHECK(pass.bytes <= retention.max_bytes);
+		CHECK(pass.bytes > retention.max_bytes - 2 * HistoryBlocks::BLOCK_BYTES);
+		CHECK_FALSE(fs::exists(ROOT + "/history_1_2.0.blk"));
+
+		// Номера записей не сдвигаются: удалённые просто пропадают из чтения и поиска.
+		uint64_t first = first_record(store, "2");
+		CHECK(first > 0);
+		CHECK(store.message_count("1", "2") == 12000);
+		auto records = store.load_records("1", "2");
+		REQUIRE(records.size() == 12000 - first);
+		CHECK(records.front().text == retention_line(static_cast<int>(first)));
+		CHECK(store.map_page("1", "2", 10, first + 5).lines.size() == 5);
+		CHECK(store.search("1", "2", "message 3", 10).records.empty());
+		CHECK(store.search("1", "2", "message 11999", 10).records == std::vector<uint64_t>{11999});
+
+		CHECK(store.compact(T0 + 12000).segments == 0);
+		store.close_all();
+		HistoryStore reopened(ROOT);
+		CHECK(first_record(reopened, "2") == first);
+		CHECK(reopened.message_count("1", "2") == 12000);
+		REQUIRE(reopened.append("1", "2", make("1", retention_line(12000))));
+		CHECK(reopened.map_page("1", "2", 1).lines[0] == retention_line(12000));
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("max_age drops segments whose newest message is too old") {
+		fs::remove_all(ROOT);
+		HistoryRetention retention;
+		retention.segment_bytes = HistoryBlocks::BLOCK_BYTES;
+		retention.max_age = 1000;
+		HistoryStore store(ROOT);
+		store.set_retention(retention);
+		fill(store, "2", 8000);
+
+		CHECK(store.compact(T0 + 1000).segments == 0);
+		HistoryCompaction pass = store.compact(T0 + 6000);
+		CHECK(pass.segments > 0);
+		// Удаляются только сегменты, целиком старше T0 + 5000.
+		uint64_t first = first_record(store, "2");
+		CHECK(first <= 5000);
+		CHECK(first > 5000 - HistoryBlocks::BLOCK_BYTES / retention_line(5000).size());
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("segments by time and compaction of idle logs") {
+		fs::remove_all(ROOT);
+		{
+			HistoryStore store(ROOT);
+			fill(store, "2", 8000, 0);
+		}
+		CHECK_FALSE(fs::exists(ROOT + "/history_1_2.bix"));
+
+		// Журнал без блоков переносится в сегменты самим проходом.
+		HistoryRetention retention;
+		retention.segment_seconds = 1000;
+		retention.max_age = 3600;
+		HistoryStore store(ROOT);
+		store.set_retention(retention);
+		HistoryCompaction pass = store.compact(T0 + 7000 + 3600);
+		CHECK(pass.sealed_blocks > 0);
+		CHECK(fs::exists(ROOT + "/history_1_2.5.blk"));
+		CHECK(pass.segments > 0);
+		uint64_t first = first_record(store, "2");
+		CHECK(first > 5000);
+		CHECK(first <= 7000);
+		CHECK(store.load_text("1", "2").rfind(retention_line(7999)) != std::string::npos);
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("quota drops the globally oldest segments first") {
+		fs::remove_all(ROOT);
+		HistoryRetention retention;
+		retention.segment_bytes = HistoryBlocks::BLOCK_BYTES;
+		HistoryStore store(ROOT);
+		store.set_retention(retention);
+		fill(store, "2", 8000);
+		fill(store, "3", 8000, 100000);
+		uint64_t total = store.compact(T0).bytes;
+		CHECK(total == 0);  // без ограничений проход ничего не делает
+
+		retention.quota = 900 * 1024;
+		store.set_retention(retention);
+		HistoryCompaction pass = store.compact(T0 + 200000);
+		CHECK(pass.segments > 0);
+		CHECK(pass.bytes <= retention.quota);
+		CHECK(first_record(store, "2") > 0);
+		CHECK(first_record(store, "3") == 0);
+		fs::remove_all(ROOT);
+	}
+}
@@ -0,0 +1,158 @@
+#include "../server/history_writer.h"
+#include "doctest/doctest.h"
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+	const std::string ROOT = "HISTORY_WRITER_TEST";
+
+	HistoryRecord make(const std::string& sender, const std::string& text) {
+		return HistoryRecord{1700000000, sender, text};
+	}
+}  // namespace
+
+TEST_SUITE("history_writer") {
+	TEST_CASE("flush makes submitted messages visible in order") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		HistoryWriter writer(store, HistoryDurability::None);
+
+		for (int i = 0; i < 200; ++i) {
+			REQUIRE(writer.submit("1", "2", make("1", "a" + std::to_string(i) + "\n")));
+			REQUIRE(writer.submit("3", "1", make("3", "b" + std::to_string(i) + "\n")));
+		}
+		writer.flush();
+
+		std::string expect_a, expect_b;
+		for (int i = 0; i < 200; ++i) {
+			expect_a += "a" + std::to_string(i) + "\n";
+			expect_b += "b" + std::to_string(i) + "\n";
+		}
+		CHECK(store.load_text("2", "1") == expect_a);
+		CHECK(store.load_text("1", "3") == expect_b);
+		CHECK(store.message_count("1", "2") == 200);
+
+		HistoryWriterStats st = writer.stats();
+		CHECK(st.records == 400);
+		CHECK(st.queued == 0);
+		CHECK(st.max_queued >= 1);
+		CHECK(st.batches >= 2);
+		CHECK(st.batches <= 400);
+		CHECK(st.errors == 0);
+
+		writer.stop();
+		store.close_all();
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("append histogram times every batch written to the store") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		Histogram append_us;
+		HistoryWriter writer(store, HistoryDurability::None, std::chrono::milliseconds(1000), &append_us);
+
+		for (int i = 0; i < 100; ++i) {
+			REQUIRE(writer.submit("1", "2", make("1", "a\n")));
+			REQUIRE(writer.submit("1", "3", make("1", "b\n")));
+		}
+		writer.flush("1", "3");
+		writer.flush();
+		CHECK(append_us.snapshot().count == writer.stats().batches);
+		CHECK(append_us.snapshot().count >= 2);
+
+		writer.stop();
+		store.close_all();
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("concurrent producers keep per-producer order") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		HistoryWriter writer(store, HistoryDurability::Interval, std::chrono::milliseconds(5));
+
+		std::vector<std::thread> producers;
+		for (int p = 0; p < 4; ++p)
+			producers.emplace_back([&writer, p] {
+				std::string id = std::to_string(10 + p);
+				for (int i = 0; i < 500; ++i)
+					writer.submit(id, "0", make(id, std::to_string(i) + "\n"));
+			});
+		for (auto& t : producers)
+			t.join();
+		writer.flush();
+
+		for (int p = 0; p < 4; ++p) {
+			std::string expect;
+			for (int i = 0; i < 500; ++i)
+				expect += std::to_string(i) + "\n";
+			CHECK(store.load_text(std::to_string(10 + p), "0") == expect);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		CHECK(writer.stats().syncs >= 1);
+
+		writer.stop();
+		store.close_all();
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("flush of one conversation writes its messages in order without the writer thread") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		HistoryWriter writer(store, HistoryDurability::PerBatch);
+
+		// Производитель пишет в две переписки, читатель всё время дописывает одну из них сам.
+		std::thread producer([&writer] {
+			for (int i = 0; i < 2000; ++i) {
+				writer.submit("1", "2", make("1", std::to_string(i) + "\n"));
+				writer.submit("3", "4", make("3", std::to_string(i) + "\n"));
+			}
+			writer.submit("1", "2", make("1", "last\n"));
+		});
+		bool seen_last = false;
+		while (!seen_last) {
+			writer.flush("2", "1");
+			seen_last = store.message_count("1", "2") == 2001;
+		}
+		producer.join();
+		CHECK(store.map_page("1", "2", 1).lines[0] == "last\n");
+
+		writer.flush();
+		std::string expect;
+		for (int i = 0; i < 2000; ++i)
+			expect += std::to_string(i) + "\n";
+		CHECK(store.load_text("1", "2") == expect + "last\n");
+		CHECK(store.load_text("3", "4") == expect);
+		CHECK(writer.stats().records == 4001);
+		CHECK(writer.stats().queued == 0);
+
+		// Записанное читателем синхронизирует поток записи.
+		for (int i = 0; i < 500 && writer.stats().syncs == 0; ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		CHECK(writer.stats().syncs >= 1);
+
+		writer.stop();
+		store.close_all();
+		fs::remove_all(ROOT);
+	}
+
+	TEST_CASE("stop drains the queue and rejects new messages") {
+		fs::remove_all(ROOT);
+		HistoryStore store(ROOT);
+		{
+			HistoryWriter writer(store, HistoryDurability::PerBatch);
+			for (int i = 0; i < 50; ++i)
+				writer.submit("1", "2", make("1", "x\n"));
+			writer.stop();
+			CHECK(store.message_count("1", "2") == 50);
+			CHECK(writer.stats().syncs >= 1);
+			CHECK_FALSE(writer.submit("1", "2", make("1", "late\n")));
+			writer.stop();
+		}
+		CHECK(store.message_count("1", "2") == 50);
+		store.close_all();
+		fs::remove_all(ROOT);
+	}
+}
@@ -6,6 +6,7 @@
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -53,3 +54,189 @@ TEST_CASE("get_config reparses invalid file and saves user input") {
 	CHECK(cfg.port == 8080);
 	reset_cfg_dir();
 }
+
+TEST_CASE("render_incoming switches from lines to frames after the ack") {
+	LineBuffer in;
+	bool binary = false;
+	size_t answers = 0;
+	std::string out;
+
+	std::string wire = "Enter your ID\n*ENDM*\n" + std::string(PROTOCOL_ACK) + "\n" +
+	                   encode_frame(FrameType::Text, "body with *ENDM*\n") + encode_frame(FrameType::End, "");
+	// Второй кадр приходит не полностью.
+	std::string history = encode_frame(FrameType::History, "[t] a: 1\n[t] a: 2\n");
+	wire += history.substr(0, 5);
+	in.append(wire.data(), wire.size());
+
+	CHECK(render_incoming(in, binary, answers, out));
+	CHECK(binary);
+	CHECK(answers == 1);
+	CHECK(out == "Enter your ID\n> body with *ENDM*\n> ");
+
+	in.append(history.data() + 5, history.size() - 5);
+	CHECK(render_incoming(in, binary, answers, out));
+	CHECK(out == "Enter your ID\n> body with *ENDM*\n> [t] a: 1\n[t] a: 2\n");
+}
+
+namespace {
+	/// Прочитать из канала всё до закрытия пишущего конца.
+	std::string read_pipe(int fd) {
+		std::string text;
+		char buf[4096];
+		ssize_t n;
+		while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+			text.append(buf, static_cast<size_t>(n));
+		return text;
+	}
+}  // namespace
+
+TEST_CASE("receive_messages prints what arrived and returns when the server closes") {
+	int sv[2];
+	int out[2];
+	REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	REQUIRE(pipe(out) == 0);
+	int done_fd = eventfd(0, EFD_CLOEXEC);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+	std::string wire = std::string(PROTOCOL_ACK) + "\n";
+	std::string expected;
+	for (int i = 0; i < 2000; ++i) {
+		std::string line = "[t] a: message " + std::to_string(i) + "\n";
+		wire += encode_frame(FrameType::History, line);
+		expected += line;
+	}
+	wire += encode_frame(FrameType::End, "");
+	expected += "> ";
+	std::thread receiver(receive_messages, sv[0], out[1], done_fd, nullptr);
+	REQUIRE(send_all(sv[1], wire));
+	close(sv[1]);
+	receiver.join();
+	close(out[1]);
+
+	CHECK(read_pipe(out[0]) == expected);
+	uint64_t done = 0;
+	CHECK(::read(done_fd, &done, sizeof(done)) == sizeof(done));
+	CHECK(done == 1);
+	close(out[0]);
+	close(sv[0]);
+	close(done_fd);
+}
+
+TEST_CASE("receive_messages stops on shutdown from the client side") {
+	int sv[2];
+	REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	int done_fd = eventfd(0, EFD_CLOEXEC);
+	int null_fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+	// Сервер молчит: поток приёма ждёт в poll(), пока main() не закроет сокет.
+	std::thread receiver(receive_messages, sv[0], null_fd, done_fd, nullptr);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	::shutdown(sv[0], SHUT_RDWR);
+	receiver.join();
+
+	pollfd pfd{done_fd, POLLIN, 0};
+	CHECK(::poll(&pfd, 1, 0) == 1);
+	close(sv[0]);
+	close(sv[1]);
+	close(null_fd);
+	close(done_fd);
+}
+
+TEST_CASE("the handshake waits for the server's answer to the protocol hello") {
+	struct Case {
+		std::string wire;
+		Handshake::Result expected;
+		bool answered;  ///< Итог известен до закрытия соединения.
+	};
+	const Case cases[] = {
+	    // Сервер с двоичным протоколом: приветствие, затем подтверждение.
+	    {"Enter your ID\n*ENDM*\n" + std::string(PROTOCOL_ACK) + "\n", Handshake::Result::Binary, true},
+	    // Сервер без него отвечает на PROTOCOL_HELLO как на обычную строку.
+	    {"Enter your ID\n*ENDM*\nInvalid ID\n*ENDM*\n", Handshake::Result::Text, true},
+	    // Соединение закрыто до ответа.
+	    {"Enter your ID\n*ENDM*\n", Handshake::Result::Text, false},
+	};
+	for (const Case& c : cases) {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+		int done_fd = eventfd(0, EFD_CLOEXEC);
+		int null_fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+		fcntl(sv[0], F_SETFL, O_NONBLOCK);
+		Handshake handshake;
+
+		std::thread receiver(receive_messages, sv[0], null_fd, done_fd, &handshake);
+		REQUIRE(send_all(sv[1], c.wire));
+		if (c.answered)
+			CHECK(handshake.wait() == c.expected);
+		close(sv[1]);
+		receiver.join();
+		CHECK(handshake.wait() == c.expected);
+		close(sv[0]);
+		close(null_fd);
+		close(done_fd);
+	}
+}
+
+TEST_CASE("read_input notices a disconnect while a line is only partly typed") {
+	int in[2];
+	REQUIRE(pipe(in) == 0);
+	int done_fd = eventfd(0, EFD_CLOEXEC);
+	ConsoleInput console;
+	std::string line;
+
+	REQUIRE(::write(in[1], "hel", 3) == 3);
+	std::thread server([&] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		uint64_t one = 1;
+		CHECK(::write(done_fd, &one, sizeof(one)) == sizeof(one));
+	});
+	CHECK(read_input(in[0], done_fd, console, line) == InputEvent::Disconnected);
+	server.join();
+	close(in[0]);
+	close(in[1]);
+	close(done_fd);
+}
+
+TEST_CASE("read_input splits lines and returns the last one without a newline") {
+	int in[2];
+	REQUIRE(pipe(in) == 0);
+	int done_fd = eventfd(0, EFD_CLOEXEC);
+	ConsoleInput console;
+	console.buffer.append("hel", 3);
+	std::string line;
+
+	REQUIRE(::write(in[1], "lo\n\nworld", 9) == 9);
+	close(in[1]);
+	CHECK(read_input(in[0], done_fd, console, line) == InputEvent::Line);
+	CHECK(line == "hello");
+	CHECK(read_input(in[0], done_fd, console, line) == InputEvent::Line);
+	CHECK(line.empty());
+	CHECK(read_input(in[0], done_fd, console, line) == InputEvent::Line);
+	CHECK(line == "world");
+	CHECK(read_input(in[0], done_fd, console, line) == InputEvent::End);
+	close(in[0]);
+	close(done_fd);
+}
+
+TEST_CASE("read_input drops a line longer than the buffer") {
+	int in[2];
+	REQUIRE(pipe(in) == 0);
+	int done_fd = eventfd(0, EFD_CLOEXEC);
+	ConsoleInput console;
+	std::string line;
+
+	std::thread user([&] {
+		std::string text(3 * ConsoleInput::MAX_LINE, 'x');
+		text += "\nok\n";
+		CHECK(write_all(in[1], text));
+		close(in[1]);
+	});
+	CHECK(read_input(in[0], done_fd, console, line) == InputEvent::TooLong);
+	CHECK(read_input(in[0], done_fd, console, line) == InputEvent::Line);
+	CHECK(line == "ok");
+	CHECK(read_input(in[0], done_fd, console, line) == InputEvent::End);
+	user.join();
+	close(in[0]);
+	close(done_fd);
+}
@@ -1,104 +1,818 @@
-#include <sys/select.h>
+#include <poll.h>
 #include <unistd.h>
 
-#include <map>
+#include <cstdlib>
+#include <filesystem>
+#include <new>
 #include <string>
 #include <vector>
 
-static std::map<int, std::string> g_sent;
-
-inline int send_packet(int fd, const char* data) {
-	g_sent[fd] += data;
-	return 0;
-}
-inline int send_all(int fd, const char* data) {
-	g_sent[fd] += data;
-	return 0;
-}
-
 #define main main_server_entry
 #include "../server/main_server.cpp"
 #undef main
 
 #include "doctest/doctest.h"
 
+// Выделения памяти в куче текущим потоком: замена глобального operator new
+// для всего тестового бинарника (проверка пути пересылки без выделений).
+static thread_local uint64_t heap_allocations = 0;
+
+void* operator new(size_t size) {
+	++heap_allocations;
+	if (void* p = std::malloc(size == 0 ? 1 : size))
+		return p;
+	throw std::bad_alloc();
+}
+
+// GCC сопоставляет встроенные new-выражения с free() и ошибочно считает пару несогласованной.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	std::free(p);
+}
+#pragma GCC diagnostic pop
+
 static void clear_state() {
 	clients.clear();
-	id_to_fd.clear();
-	g_sent.clear();
+	directory.clear();
+	rooms.clear();
+	pending_auth.clear();
+	connections.clear();
+	dirty_fds.clear();
+	max_queue_bytes = 4 * 1024 * 1024;
+	slow_client_policy = SlowClientPolicy::Disconnect;
+	auth_delivery.reset();
+	timers = TimerWheel();
+	auth_code_ttl = std::chrono::seconds(300);
+	connect_request_timeout = std::chrono::seconds(60);
+	idle_timeout = std::chrono::seconds(1800);
+}
+
+// Номер пользователя для Telegram ID (интернирует при первом обращении).
+static UserId uid(const std::string& id) {
+	return user_ids.intern(id);
+}
+
+// Всё, что сервер поставил в очередь отправки клиенту fd.
+static std::string sent_to(int fd) {
+	return connections[fd].out.contents();
 }
 
 TEST_SUITE("main_server::handle_client_command") {
 	TEST_CASE("connect sets pending_request_from") {
 		clear_state();
-		fd_set master;
-		FD_ZERO(&master);
+		auto loop = make_event_loop(LoopBackend::Select);
 
 		int fd1 = 1, fd2 = 2;
-		clients[fd1] = {fd1, "123"};
-		clients[fd2] = {fd2, "456"};
-		id_to_fd["123"] = fd1;
-		id_to_fd["456"] = fd2;
+		clients[fd1] = {fd1, uid("123")};
+		clients[fd2] = {fd2, uid("456")};
+		register_client(uid("123"), local_ref(fd1));
+		register_client(uid("456"), local_ref(fd2));
+		connections.try_emplace(fd1);
+		connections.try_emplace(fd2);
 
-		handle_client_command(fd1, "/connect 456", master);
-		REQUIRE(clients[fd2].pending_request_from == "123");
+		handle_client_command(fd1, "/connect 456", *loop);
+		REQUIRE(clients[fd2].pending_request_from == uid("123"));
 	}
 
 	TEST_CASE("vote transfers speaking role") {
 		clear_state();
-		fd_set master;
-		FD_ZERO(&master);
+		auto loop = make_event_loop(LoopBackend::Select);
 
 		int fd1 = 3, fd2 = 4;
-		clients[fd1] = {fd1, "123", "456", true};
-		clients[fd2] = {fd2, "456", "123", false};
-		id_to_fd["123"] = fd1;
-		id_to_fd["456"] = fd2;
+		clients[fd1] = {fd1, uid("123"), uid("456"), true};
+		clients[fd2] = {fd2, uid("456"), uid("123"), false};
+		register_client(uid("123"), local_ref(fd1));
+		register_client(uid("456"), local_ref(fd2));
+		connections.try_emplace(fd1);
+		connections.try_emplace(fd2);
 
-		handle_client_command(fd1, "/vote", master);
+		handle_client_command(fd1, "/vote", *loop);
 		CHECK_FALSE(clients[fd1].is_speaking);
 		CHECK(clients[fd2].is_speaking);
 	}
 
 	TEST_CASE("end clears connection for both sides") {
 		clear_state();
-		fd_set master;
-		FD_ZERO(&master);
+		auto loop = make_event_loop(LoopBackend::Select);
 
 		int fd1 = 5, fd2 = 6;
-		clients[fd1] = {fd1, "123", "456", true};
-		clients[fd2] = {fd2, "456", "123", false};
-		id_to_fd["123"] = fd1;
-		id_to_fd["456"] = fd2;
+		clients[fd1] = {fd1, uid("123"), uid("456"), true};
+		clients[fd2] = {fd2, uid("456"), uid("123"), false};
+		register_client(uid("123"), local_ref(fd1));
+		register_client(uid("456"), local_ref(fd2));
+		connections.try_emplace(fd1);
+		connections.try_emplace(fd2);
 
-		handle_client_command(fd1, "/end", master);
-		CHECK(clients[fd1].connected_to.empty());
-		CHECK(clients[fd2].connected_to.empty());
+		handle_client_command(fd1, "/end", *loop);
+		CHECK(clients[fd1].connected_to == NO_USER);
+		CHECK(clients[fd2].connected_to == NO_USER);
 	}
 
 	TEST_CASE("help sends help text") {
 		clear_state();
-		fd_set master;
-		FD_ZERO(&master);
+		auto loop = make_event_loop(LoopBackend::Select);
 
 		int fd1 = 7;
-		clients[fd1] = {fd1, "123"};
-		id_to_fd["123"] = fd1;
+		clients[fd1] = {fd1, uid("123")};
+		register_client(uid("123"), local_ref(fd1));
+		connections.try_emplace(fd1);
 
-		handle_client_command(fd1, "/help", master);
-		CHECK(g_sent[fd1].find("Available commands") != std::string::npos);
+		handle_client_command(fd1, "/help", *loop);
+		CHECK(sent_to(fd1).find("Available commands") != std::string::npos);
 	}
 
 	TEST_CASE("unknown command replies error") {
 		clear_state();
-		fd_set master;
-		FD_ZERO(&master);
+		auto loop = make_event_loop(LoopBackend::Select);
 
 		int fd1 = 8;
-		clients[fd1] = {fd1, "123"};
-		id_to_fd["123"] = fd1;
+		clients[fd1] = {fd1, uid("123")};
+		register_client(uid("123"), local_ref(fd1));
+		connections.try_emplace(fd1);
+
+		handle_client_command(fd1, "/foo", *loop);
+		CHECK(sent_to(fd1).find("Only /connect") != std::string::npos);
+	}
+
+	TEST_CASE("disconnect closes unauthorized socket") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+		connections.try_emplace(sv[0]);
+		pending_auth[sv[0]] = "123";
+		REQUIRE(loop->add(sv[0], LOOP_READ));
+
+		disconnect_client(sv[0], *loop);
+		CHECK(connections.count(sv[0]) == 0);
+		CHECK(pending_auth.count(sv[0]) == 0);
 
-		handle_client_command(fd1, "/foo", master);
-		CHECK(g_sent[fd1].find("Only /connect") != std::string::npos);
+		char ch;
+		CHECK(recv(sv[1], &ch, 1, 0) == 0);
+		close(sv[1]);
 	}
-}
\ No newline at end of file
+
+	TEST_CASE("partial line is kept until the rest arrives") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+		int fd = sv[0];
+		connections.try_emplace(fd);
+		clients[fd] = {fd, uid("123")};
+		register_client(uid("123"), local_ref(fd));
+
+		REQUIRE(write(sv[1], "/he", 3) == 3);
+		handle_client_readable(fd, *loop);
+		CHECK(sent_to(fd).empty());
+
+		REQUIRE(write(sv[1], "lp\n/foo\n", 8) == 8);
+		handle_client_readable(fd, *loop);
+		CHECK(sent_to(fd).find("Available commands") != std::string::npos);
+		CHECK(sent_to(fd).find("Only /connect") != std::string::npos);
+
+		connections.clear();
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	TEST_CASE("messages are queued, not written inline") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int fd1 = 9;
+		clients[fd1] = {fd1, uid("123")};
+		register_client(uid("123"), local_ref(fd1));
+		connections.try_emplace(fd1);
+
+		handle_client_command(fd1, "/help", *loop);
+		handle_client_command(fd1, "/foo", *loop);
+		CHECK(dirty_fds.size() == 1);
+		CHECK(sent_to(fd1).find("*ENDM*\n") != std::string::npos);
+	}
+
+	TEST_CASE("slow client over the high-water mark") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int fd1 = 10;
+		connections.try_emplace(fd1);
+		max_queue_bytes = 16;
+
+		SUBCASE("drop policy discards new messages") {
+			slow_client_policy = SlowClientPolicy::Drop;
+			queue_all(fd1, "0123456789");
+			queue_all(fd1, "0123456789");
+			CHECK(connections[fd1].out.size() == 10);
+			CHECK(connections[fd1].out.dropped() == 1);
+			CHECK_FALSE(connections[fd1].closing);
+		}
+
+		SUBCASE("disconnect policy marks the client for closing") {
+			queue_all(fd1, "0123456789");
+			queue_all(fd1, "0123456789");
+			CHECK(connections[fd1].closing);
+		}
+	}
+
+	TEST_CASE("flush writes the queue to the socket") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+		connections.try_emplace(sv[0]);
+		REQUIRE(loop->add(sv[0], LOOP_READ));
+
+		queue_packet(sv[0], "hello");
+		flush_dirty_clients(*loop);
+		CHECK(dirty_fds.empty());
+		CHECK(connections[sv[0]].out.empty());
+
+		char buf[64];
+		ssize_t n = recv(sv[1], buf, sizeof(buf), 0);
+		CHECK(std::string(buf, n > 0 ? n : 0) == "hello\n*ENDM*\n");
+
+		connections.clear();
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	TEST_CASE("login code is delivered asynchronously") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+		auth_delivery = std::make_unique<AuthDelivery>(
+		    1, 4, [](const std::string& chat_id, const std::string&) { return chat_id == "555"; });
+
+		int fd = 11;
+		connections.try_emplace(fd).first->second.id = 77;
+		handle_client_message(fd, "555", *loop);
+		CHECK(connections[fd].auth_in_flight);
+		CHECK(pending_auth.count(fd) == 0);
+
+		handle_client_message(fd, "555", *loop);
+		CHECK(sent_to(fd).find("Please wait") != std::string::npos);
+
+		pollfd pfd{auth_delivery->notify_fd(), POLLIN, 0};
+		REQUIRE(poll(&pfd, 1, 5000) == 1);
+		handle_auth_results(*auth_delivery);
+		CHECK_FALSE(connections[fd].auth_in_flight);
+		CHECK(pending_auth[fd] == "555");
+		CHECK(sent_to(fd).find("Telegram code sent") != std::string::npos);
+		auth_delivery.reset();
+	}
+
+	TEST_CASE("delivery result for a reused fd is ignored") {
+		clear_state();
+		auth_delivery = std::make_unique<AuthDelivery>(
+		    1, 4, [](const std::string&, const std::string&) { return true; });
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int fd = 12;
+		connections.try_emplace(fd).first->second.id = 1;
+		handle_client_message(fd, "555", *loop);
+		connections.erase(fd);
+		connections.try_emplace(fd).first->second.id = 2;
+
+		pollfd pfd{auth_delivery->notify_fd(), POLLIN, 0};
+		REQUIRE(poll(&pfd, 1, 5000) == 1);
+		handle_auth_results(*auth_delivery);
+		CHECK(pending_auth.count(fd) == 0);
+		CHECK(sent_to(fd).empty());
+		auth_delivery.reset();
+	}
+
+	TEST_CASE("history command pages through the conversation") {
+		clear_state();
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int fd1 = 13, fd2 = 14;
+		clients[fd1] = {fd1, uid("123"), uid("456"), true};
+		clients[fd2] = {fd2, uid("456"), uid("123"), false};
+		register_client(uid("123"), local_ref(fd1));
+		register_client(uid("456"), local_ref(fd2));
+		connections.try_emplace(fd1);
+		connections.try_emplace(fd2);
+		for (int i = 0; i < 5; ++i)
+			append_message_to_history("123", "456", "msg" + std::to_string(i) + "\n");
+
+		handle_client_command(fd1, "/history 2 3", *loop);
+		std::string out = sent_to(fd1);
+		CHECK(out.find("msg1\nmsg2\n") != std::string::npos);
+		CHECK(out.find("msg3") == std::string::npos);
+		CHECK(out.find("Older messages: /history 50 1") != std::string::npos);
+
+		handle_client_command(fd2, "/history 0", *loop);
+		CHECK(sent_to(fd2).find("Usage: /history") != std::string::npos);
+
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+	}
+
+	TEST_CASE("search command lists numbered matches of the conversation") {
+		clear_state();
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int fd1 = 13, fd2 = 14;
+		clients[fd1] = {fd1, uid("123"), uid("456"), true};
+		clients[fd2] = {fd2, uid("456"), NO_USER, false};
+		connections.try_emplace(fd1);
+		connections.try_emplace(fd2);
+		append_message_to_history("123", "456", "[2024-01-01 10:00] 123: Meet at noon\n");
+		append_message_to_history("123", "456", "[2024-01-01 10:01] 456: ok\n");
+		append_message_to_history("123", "456", "[2024-01-01 10:02] 456: noon is fine, meet there\n");
+
+		handle_client_command(fd1, "/search MEET noon", *loop);
+		CHECK(sent_to(fd1) == "Found 2 message(s):\n#1 [2024-01-01 10:00] 123: Meet at noon\n"
+		                      "#3 [2024-01-01 10:02] 456: noon is fine, meet there\n*ENDM*\n");
+		handle_client_command(fd1, "/search lunch", *loop);
+		CHECK(sent_to(fd1).find("No messages found.") != std::string::npos);
+		handle_client_command(fd1, "/search ?!", *loop);
+		CHECK(sent_to(fd1).find("Usage: /search") != std::string::npos);
+		handle_client_command(fd2, "/search noon", *loop);
+		CHECK(sent_to(fd2).find("You are not in a conversation.") != std::string::npos);
+
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+	}
+
+	TEST_CASE("accepting a connection sends only the history tail") {
+		clear_state();
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+
+		int fd1 = 15, fd2 = 16;
+		clients[fd1] = {fd1, uid("123")};
+		clients[fd2] = {fd2, uid("456")};
+		clients[fd2].pending_request_from = uid("123");
+		register_client(uid("123"), local_ref(fd1));
+		register_client(uid("456"), local_ref(fd2));
+		connections.try_emplace(fd1);
+		connections.try_emplace(fd2);
+		for (uint64_t i = 0; i < HISTORY_ON_CONNECT + 10; ++i)
+			append_message_to_history("123", "456", "line" + std::to_string(i) + "\n");
+
+		handle_pending_response(fd2, "yes");
+		std::string out = sent_to(fd1);
+		CHECK(out.find("line9\n") == std::string::npos);
+		CHECK(out.find("line10\n") != std::string::npos);
+		CHECK(out.find("Older messages") != std::string::npos);
+		CHECK(clients[fd1].connected_to == uid("456"));
+
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+	}
+	TEST_CASE("messages to a client on another shard go through its inbox") {
+		clear_state();
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+		auto loop = make_event_loop(LoopBackend::Select);
+		shards.push_back(std::make_unique<Shard>());
+		shards.push_back(std::make_unique<Shard>());
+
+		// Оба клиента живут в картах тестового потока, но "456" числится за шардом 1.
+		int fd1 = 17, fd2 = 18;
+		clients[fd1] = {fd1, uid("123")};
+		clients[fd2] = {fd2, uid("456")};
+		connections.try_emplace(fd1).first->second.id = 1;
+		connections.try_emplace(fd2).first->second.id = 2;
+		register_client(uid("123"), local_ref(fd1));
+		register_client(uid("456"), ClientRef{1, fd2, 2});
+
+		auto run_shard1 = [] {
+			shard_index = 1;
+			size_t n = shards[1]->inbox.run_pending();
+			shard_index = 0;
+			return n;
+		};
+
+		handle_client_command(fd1, "/connect 456", *loop);
+		CHECK(clients[fd2].pending_request_from == NO_USER);
+		CHECK(run_shard1() == 1);
+		CHECK(clients[fd2].pending_request_from == uid("123"));
+		CHECK(sent_to(fd2).find("wants to connect") != std::string::npos);
+
+		shard_index = 1;
+		handle_pending_response(fd2, "yes");
+		shard_index = 0;
+		CHECK(clients[fd2].connected_to == uid("123"));
+		CHECK(clients[fd1].connected_to == NO_USER);
+		CHECK(shards[0]->inbox.run_pending() == 1);
+		CHECK(clients[fd1].connected_to == uid("456"));
+		CHECK(clients[fd1].is_speaking);
+
+		handle_client_message(fd1, "hello", *loop);
+		CHECK(sent_to(fd2).find("123: hello") == std::string::npos);
+		CHECK(run_shard1() == 1);
+		CHECK(sent_to(fd2).find("123: hello") != std::string::npos);
+
+		handle_client_command(fd1, "/vote", *loop);
+		CHECK_FALSE(clients[fd1].is_speaking);
+		CHECK(run_shard1() == 1);
+		CHECK(clients[fd2].is_speaking);
+
+		// Соединение на шарде 1 сменилось: задача для старого адреса не выполняется.
+		connections[fd2].id = 3;
+		handle_client_command(fd1, "/end", *loop);
+		CHECK(run_shard1() == 1);
+		CHECK(clients[fd2].connected_to == uid("123"));
+
+		shards.clear();
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+	}
+	TEST_CASE("hello line switches the connection to binary frames") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+		int fd = sv[0];
+		connections.try_emplace(fd);
+		clients[fd] = {fd, uid("123")};
+
+		// Авторизованный клиент протокол не меняет: приветствие — обычная строка.
+		std::string wire = std::string(PROTOCOL_HELLO) + "\n";
+		REQUIRE(write(sv[1], wire.data(), wire.size()) == static_cast<ssize_t>(wire.size()));
+		handle_client_readable(fd, *loop);
+		CHECK_FALSE(connections[fd].binary);
+		CHECK(sent_to(fd).find("not in a conversation") != std::string::npos);
+
+		clients.clear();
+		connections.erase(fd);
+		connections.try_emplace(fd);
+		queue_packet(fd, "Enter your ID");
+		// Приветствие и первая строка приходят одним чтением.
+		wire = std::string(PROTOCOL_HELLO) + "\n" + encode_frame(FrameType::Text, "");
+		REQUIRE(write(sv[1], wire.data(), wire.size()) == static_cast<ssize_t>(wire.size()));
+		handle_client_readable(fd, *loop);
+		CHECK(connections[fd].binary);
+
+		std::string expect = "Enter your ID\n*ENDM*\n" + std::string(PROTOCOL_ACK) + "\n" +
+		                     encode_frame(FrameType::Text, "Chat ID cannot be empty. Try again\n") +
+		                     encode_frame(FrameType::End, "");
+		CHECK(sent_to(fd) == expect);
+
+		connections.clear();
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	TEST_CASE("history goes out as one bulk frame to binary clients") {
+		clear_state();
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+
+		int fd = 19;
+		connections.try_emplace(fd).first->second.binary = true;
+		for (int i = 0; i < 3; ++i)
+			append_message_to_history("123", "456", "m" + std::to_string(i) + "\n");
+
+		queue_history(fd, map_history_page("123", "456", 2), true);
+		std::string expect = encode_frame(FrameType::Text, "Chat history (2-3 of 3):\n") +
+		                     encode_frame(FrameType::History, "m1\nm2\n") +
+		                     encode_frame(FrameType::Text, "Older messages: /history 50 1\n") +
+		                     encode_frame(FrameType::End, "");
+		CHECK(sent_to(fd) == expect);
+
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+	}
+}
+
+TEST_SUITE("main_server::rooms") {
+	TEST_CASE("room message is fanned out from one shared buffer") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+		shards.push_back(std::make_unique<Shard>());
+		shards.push_back(std::make_unique<Shard>());
+
+		// "c" числится за шардом 1 и говорит по двоичному протоколу.
+		int fa = 21, fb = 22, fc = 23;
+		clients[fa] = {fa, uid("a")};
+		clients[fb] = {fb, uid("b")};
+		clients[fc] = {fc, uid("c")};
+		connections.try_emplace(fa).first->second.id = 1;
+		connections.try_emplace(fb).first->second.id = 2;
+		connections.try_emplace(fc).first->second.id = 3;
+		connections[fc].binary = true;
+
+		handle_client_command(fa, "/room create lobby", *loop);
+		CHECK(clients[fa].room == "lobby");
+		handle_client_command(fb, "/room join lobby", *loop);
+		CHECK(sent_to(fa).find("User 'b' joined the room.\n*ENDM*\n") != std::string::npos);
+		shard_index = 1;
+		handle_client_command(fc, "/room join lobby", *loop);
+		shard_index = 0;
+		CHECK(clients[fc].room == "lobby");
+		connections[fa].out = OutputQueue();
+		connections[fb].out = OutputQueue();
+		connections[fc].out = OutputQueue();
+
+		handle_client_message(fb, "not my turn", *loop);
+		CHECK(sent_to(fb).find("current speaker") != std::string::npos);
+		connections[fb].out = OutputQueue();
+
+		handle_client_message(fa, "hi all", *loop);
+		std::string text = sent_to(fb);
+		CHECK(text.ends_with("a@lobby: hi all\n"));
+		CHECK(sent_to(fa).empty());
+		CHECK(sent_to(fc).empty());
+		shard_index = 1;
+		CHECK(shards[1]->inbox.run_pending() == 1);
+		shard_index = 0;
+		CHECK(sent_to(fc) == encode_frame(FrameType::Text, text));
+
+		handle_client_command(fa, "/vote", *loop);
+		CHECK(sent_to(fb).find("You are now speaking.") != std::string::npos);
+		handle_client_message(fb, "my turn", *loop);
+		CHECK(sent_to(fa).find("b@lobby: my turn\n") != std::string::npos);
+
+		shards.clear();
+	}
+	TEST_CASE("speaker leaving or disconnecting hands the room over") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int fa = 24, fb = 25;
+		clients[fa] = {fa, uid("a")};
+		clients[fb] = {fb, uid("b")};
+		connections.try_emplace(fa).first->second.id = 1;
+		connections.try_emplace(fb).first->second.id = 2;
+		register_client(uid("a"), local_ref(fa));
+
+		handle_client_command(fa, "/room create lobby", *loop);
+		handle_client_command(fb, "/room create lobby", *loop);
+		CHECK(sent_to(fb).find("already exists") != std::string::npos);
+		handle_client_command(fb, "/room join lobby", *loop);
+		handle_client_command(fb, "/connect a", *loop);
+		CHECK(sent_to(fb).find("Leave the room first") != std::string::npos);
+
+		handle_client_command(fb, "/rooms", *loop);
+		CHECK(sent_to(fb).find("lobby (2 members)") != std::string::npos);
+
+		handle_client_command(fa, "/end", *loop);
+		CHECK(clients[fa].room.empty());
+		CHECK(sent_to(fb).find("User 'a' left the room.") != std::string::npos);
+		CHECK(sent_to(fb).find("You are now speaking.") != std::string::npos);
+
+		disconnect_client(fb, *loop);
+		CHECK(rooms.list().empty());
+	}
+}
+
+TEST_SUITE("main_server::relay") {
+	TEST_CASE("steady-state private message relay makes no heap allocations") {
+		clear_state();
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+		start_history_writer(HistoryDurability::None);
+		auto loop = make_event_loop(LoopBackend::Select);
+
+		int a[2], b[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, a) == 0);
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, b) == 0);
+		int fa = a[0], fb = b[0];
+		clients[fa] = {fa, uid("123"), uid("456"), true};
+		clients[fb] = {fb, uid("456"), uid("123"), false};
+		connections.try_emplace(fa).first->second.id = 1;
+		connections.try_emplace(fb).first->second.id = 2;
+		register_client(uid("123"), local_ref(fa));
+		register_client(uid("456"), local_ref(fb));
+
+		const std::string msg = "a message long enough to leave the small string buffer";
+		char sink[4096];
+		ssize_t last = 0;
+		auto relay = [&] {
+			handle_client_message(fa, msg, *loop);
+			flush_dirty_clients(*loop);
+			// Поток истории возвращает свои ссылки в пул до следующего сообщения.
+			history_writer()->flush();
+			last = read(b[1], sink, sizeof(sink));
+		};
+
+		// Прогрев: пул, кольцо очереди и векторы набирают ёмкость.
+		uint64_t warmup = heap_allocations;
+		for (int i = 0; i < 64; ++i)
+			relay();
+		CHECK(heap_allocations > warmup);
+		uint64_t before = heap_allocations;
+		for (int i = 0; i < 1000; ++i)
+			relay();
+		uint64_t allocations = heap_allocations - before;
+
+		CHECK(allocations == 0);
+		REQUIRE(last > 0);
+		CHECK(std::string(sink, static_cast<size_t>(last)).ends_with("] 123: " + msg + "\n"));
+		CHECK(history_writer()->stats().records == 1064);
+
+		stop_history_writer();
+		close(a[0]);
+		close(a[1]);
+		close(b[0]);
+		close(b[1]);
+		close_history_files();
+		std::filesystem::remove_all("HISTORY");
+	}
+}
+
+extern std::map<std::string, std::string> auth_codes;
+
+TEST_SUITE("main_server::timers") {
+	using namespace std::chrono_literals;
+
+	TEST_CASE("unanswered connect request expires, an answered one is cancelled") {
+		clear_state();
+		auto loop = make_event_loop(LoopBackend::Select);
+		int fd1 = 31, fd2 = 32;
+		clients[fd1] = {fd1, uid("123")};
+		clients[fd2] = {fd2, uid("456")};
+		register_client(uid("123"), local_ref(fd1));
+		register_client(uid("456"), local_ref(fd2));
+		connections.try_emplace(fd1);
+		connections.try_emplace(fd2);
+		auto now = std::chrono::steady_clock::now();
+
+		handle_client_command(fd1, "/connect 456", *loop);
+		CHECK(timers.advance(now + 59s) == 0);
+		CHECK(timers.advance(now + 61s) == 1);
+		CHECK(clients[fd2].pending_request_from == NO_USER);
+		CHECK(sent_to(fd2).find("Connection request from '123' expired.") != std::string::npos);
+		CHECK(sent_to(fd1).find("User did not respond") != std::string::npos);
+
+		// Новый запрос проходит, ответ на него снимает таймер.
+		handle_client_command(fd1, "/connect 456", *loop);
+		REQUIRE(clients[fd2].pending_request_from == uid("123"));
+		handle_client_message(fd2, "no", *loop);
+		CHECK(timers.size() == 0);
+	}
+
+	TEST_CASE("idle client is evicted only after a full quiet period") {
+		clear_state();
+		idle_timeout = 10s;
+		auto loop = make_event_loop(LoopBackend::Select);
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+		int fd = sv[0];
+		auto now = std::chrono::steady_clock::now();
+		Connection& conn = connections.try_emplace(fd).first->second;
+		conn.last_active = now;
+		schedule_idle_check(fd, conn, idle_timeout, *loop);
+
+		conn.last_active = now + 8s;  // Клиент что-то прислал.
+		timers.advance(now + 11s);
+		REQUIRE(connections.count(fd) == 1);
+		CHECK(connections[fd].idle_timer != NO_TIMER);
+
+		timers.advance(now + 19s);
+		CHECK(connections.count(fd) == 0);
+		CHECK(timers.size() == 0);
+		char buf[256] = {};
+		ssize_t n = read(sv[1], buf, sizeof(buf) - 1);
+		REQUIRE(n > 0);
+		CHECK(std::string(buf, n).find("no activity for 10 seconds") != std::string::npos);
+		close(sv[1]);
+	}
+
+	TEST_CASE("idle timeout does not evict a logged-in user who only reads") {
+		clear_state();
+		idle_timeout = 10s;
+		auto loop = make_event_loop(LoopBackend::Select);
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+		int fd1 = 41, fd2 = sv[0];
+		auto now = std::chrono::steady_clock::now();
+		for (int fd : {fd1, fd2}) {
+			Connection& conn = connections.try_emplace(fd).first->second;
+			conn.last_active = now;
+			schedule_idle_check(fd, conn, idle_timeout, *loop);
+		}
+		// fd1 вошёл и читает переписку, fd2 так и не ввёл ID.
+		clients[fd1] = {fd1, uid("123")};
+		register_client(uid("123"), local_ref(fd1));
+
+		timers.advance(now + 1h);
+		CHECK(connections.count(fd1) == 1);
+		CHECK(clients.contains(fd1));
+		CHECK(connections[fd1].idle_timer == NO_TIMER);
+		CHECK(connections.count(fd2) == 0);
+		CHECK(timers.size() == 0);
+		close(sv[1]);
+	}
+
+	TEST_CASE("unused login code expires and the client is asked for the ID again") {
+		clear_state();
+		auth_codes.clear();
+		auto loop = make_event_loop(LoopBackend::Select);
+		auth_delivery = std::make_unique<AuthDelivery>(
+		    1, 4, [](const std::string&, const std::string&) { return true; });
+
+		int fd = 33;
+		connections.try_emplace(fd).first->second.id = 5;
+		handle_client_message(fd, "555", *loop);
+		pollfd pfd{auth_delivery->notify_fd(), POLLIN, 0};
+		REQUIRE(poll(&pfd, 1, 5000) == 1);
+		auto now = std::chrono::steady_clock::now();
+		handle_auth_results(*auth_delivery);
+		REQUIRE(pending_auth.count(fd) == 1);
+		CHECK(auth_codes.count("555") == 1);
+
+		timers.advance(now + 301s);
+		CHECK(pending_auth.count(fd) == 0);
+		CHECK(auth_codes.empty());
+		CHECK(sent_to(fd).find("The code has expired. Enter your ID") != std::string::npos);
+		auth_delivery.reset();
+	}
+}
+
+TEST_SUITE("main_server::handoff") {
+	TEST_CASE("exported sessions are adopted with chats, rooms and pending logins") {
+		clear_state();
+		auth_codes.clear();
+		auto loop = make_event_loop(LoopBackend::Select);
+		int sv[3][2];
+		for (auto& pair : sv)
+			REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) == 0);
+		int fa = sv[0][0], fb = sv[1][0], fg = sv[2][0];
+
+		clients[fa] = {fa, uid("a"), uid("b"), true};
+		clients[fb] = {fb, uid("b"), uid("a"), false};
+		register_client(uid("a"), local_ref(fa));
+		register_client(uid("b"), local_ref(fb));
+		connections.try_emplace(fa).first->second.id = 1;
+		connections.try_emplace(fb).first->second.id = 2;
+		connections.try_emplace(fg).first->second.id = 3;
+		connections[fb].binary = true;
+		connections[fa].in.append("partial", 7);
+		queue_packet(fb, "not sent yet\n");
+		rooms.create("lobby", {uid("a"), local_ref(fa)});
+		clients[fa].room = "lobby";
+		pending_auth[fg] = "777";
+		store_auth_code("777", "123456");
+
+		HandoffState state;
+		state.sessions = export_sessions();
+		state.rooms = export_rooms();
+		std::string unsent = sent_to(fb);
+		REQUIRE(state.sessions.size() == 3);
+		CHECK(clients.size() == 2);  // Выгрузка ничего не меняет.
+
+		clear_state();
+		timers = TimerWheel();
+		adopt_sessions(state, *loop);
+		REQUIRE(clients.size() == 2);
+		CHECK(clients[fa].connected_to == uid("b"));
+		CHECK(clients[fa].is_speaking);
+		CHECK(clients[fa].room == "lobby");
+		CHECK(clients[fb].connected_to == uid("a"));
+		CHECK(find_client(uid("b"))->fd == fb);
+		CHECK(rooms.speaker_roster("lobby", *find_client(uid("a"))));
+		CHECK(connections[fa].in.pending() == "partial");
+		CHECK(connections[fb].binary);
+		CHECK(sent_to(fb) == unsent);
+		CHECK(pending_auth[fg] == "777");
+		CHECK(timers.size() == 4);  // Три проверки простоя и срок кода.
+
+		handle_client_message(fg, "123456", *loop);
+		CHECK(clients.contains(fg));
+		for (auto& pair : sv) {
+			close(pair[0]);
+			close(pair[1]);
+		}
+	}
+}
+
+TEST_SUITE("main_server::arguments") {
+	TEST_CASE("numeric flags are parsed whole") {
+		uint64_t n = 0;
+		CHECK(parse_number_arg("1800", n));
+		CHECK(n == 1800);
+		CHECK_FALSE(parse_number_arg("abc", n));
+		CHECK_FALSE(parse_number_arg("12s", n));
+		CHECK_FALSE(parse_number_arg("", n));
+		CHECK_FALSE(parse_number_arg("-1", n));
+		CHECK_FALSE(parse_number_arg("99999999999999999999", n));
+		int port = 0;
+		CHECK_FALSE(parse_number_arg("4294967296", port));
+	}
+
+	TEST_CASE("a bad numeric value prints the usage instead of throwing") {
+		for (const char* flag : {"--idle-timeout", "--port", "--threads", "--history-max-age"}) {
+			std::string program = "server", name = flag, value = "abc";
+			char* argv[] = {program.data(), name.data(), value.data()};
+			CHECK(main_server_entry(3, argv) == 1);
+		}
+		clear_state();
+	}
+}
@@ -0,0 +1,44 @@
+#include "../server/message_format.h"
+#include "doctest/doctest.h"
+#include <chrono>
+#include <string>
+
+using std::chrono::system_clock;
+
+TEST_SUITE("message_format::TimestampCache") {
+	TEST_CASE("timestamp is reformatted only when the minute changes") {
+		TimestampCache cache;
+		system_clock::time_point minute = system_clock::from_time_t(1700000040);  // начало минуты
+		cache.refresh(minute);
+		uint64_t formats = cache.formats();
+		std::string first = cache.current();
+		CHECK(first.size() == 16);  // YYYY-MM-DD HH:MM
+
+		CHECK_FALSE(cache.refresh(minute + std::chrono::seconds(59)));
+		CHECK(cache.formats() == formats);
+		CHECK(cache.refresh(minute + std::chrono::seconds(60)));
+		CHECK(cache.formats() == formats + 1);
+		CHECK(cache.current() != first);
+	}
+
+	TEST_CASE("reactor timeout ends at the next minute") {
+		TimestampCache cache;
+		system_clock::time_point minute = system_clock::from_time_t(1700000040);
+		CHECK(cache.ms_until_rollover(minute) == 60000);
+		CHECK(cache.ms_until_rollover(minute + std::chrono::milliseconds(59500)) == 500);
+	}
+}
+
+TEST_SUITE("message_format::append_chat_line") {
+	TEST_CASE("formats private and room lines into one reservation") {
+		std::string out;
+		append_chat_line(out, "2024-01-02 03:04", "123", {}, "hello");
+		CHECK(out == "[2024-01-02 03:04] 123: hello\n");
+		CHECK(out.size() == chat_line_size("2024-01-02 03:04", "123", {}, "hello"));
+
+		std::string room = "prefix";
+		append_chat_line(room, "2024-01-02 03:04", "123", "lobby", "hi");
+		CHECK(room == "prefix[2024-01-02 03:04] 123@lobby: hi\n");
+		CHECK(room.size() == 6 + chat_line_size("2024-01-02 03:04", "123", "lobby", "hi"));
+	}
+}
@@ -0,0 +1,124 @@
+#include "../server/metrics.h"
+#include "doctest/doctest.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+// Полный HTTP-ответ точки метрик на запрос request.
+static std::string http_get(int port, const std::string& request) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(static_cast<uint16_t>(port));
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return {};
+	}
+	send(fd, request.data(), request.size(), 0);
+	std::string response;
+	char buf[4096];
+	ssize_t n;
+	while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+		response.append(buf, static_cast<size_t>(n));
+	close(fd);
+	return response;
+}
+
+TEST_SUITE("metrics::Histogram") {
+	TEST_CASE("buckets cover values with bounded relative error") {
+		for (uint64_t v : {0ull, 1ull, 15ull, 16ull, 17ull, 100ull, 1000ull, 123456ull, 1ull << 40}) {
+			size_t b = Histogram::bucket_of(v);
+			uint64_t upper = Histogram::upper_bound(b);
+			CHECK(upper >= v);
+			CHECK(upper - v <= v / Histogram::SUB_BUCKETS);
+			if (b > 0)
+				CHECK(Histogram::upper_bound(b - 1) < v);
+		}
+		CHECK(Histogram::bucket_of(~0ull) == Histogram::BUCKETS - 1);
+	}
+
+	TEST_CASE("snapshot reports count, sum, max and percentiles") {
+		Histogram h;
+		CHECK(h.snapshot().count == 0);
+		CHECK(h.snapshot().p50 == 0);
+
+		for (uint64_t v = 1; v <= 1000; ++v)
+			h.record(v);
+		HistogramSnapshot st = h.snapshot();
+		CHECK(st.count == 1000);
+		CHECK(st.sum == 500500);
+		CHECK(st.max == 1000);
+		CHECK(st.avg() == 500);
+		CHECK(st.p50 >= 500);
+		CHECK(st.p50 <= 500 + 500 / Histogram::SUB_BUCKETS);
+		CHECK(st.p90 >= 900);
+		CHECK(st.p99 >= 990);
+		CHECK(st.p999 <= st.max);
+	}
+
+	TEST_CASE("concurrent records are not lost") {
+		Histogram h;
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t)
+			threads.emplace_back([&h] {
+				for (uint64_t i = 0; i < 10000; ++i)
+					h.record(i % 300);
+			});
+		for (auto& t : threads)
+			t.join();
+		CHECK(h.snapshot().count == 40000);
+		CHECK(h.snapshot().max == 299);
+	}
+}
+
+TEST_SUITE("metrics::MetricsRegistry") {
+	TEST_CASE("prometheus text lists every metric with its type") {
+		MetricsRegistry registry;
+		Counter& logins = registry.counter("test_logins_total", "Logins");
+		Gauge& clients = registry.gauge("test_clients", "Clients");
+		Histogram& latency = registry.histogram("test_latency_us", "Latency");
+		logins.add(3);
+		clients.add(5);
+		clients.sub(2);
+		latency.record(40);
+
+		std::string text = registry.prometheus();
+		CHECK(text.find("# TYPE test_logins_total counter\ntest_logins_total 3\n") != std::string::npos);
+		CHECK(text.find("# TYPE test_clients gauge\ntest_clients 3\n") != std::string::npos);
+		CHECK(text.find("# TYPE test_latency_us summary\n") != std::string::npos);
+		CHECK(text.find("test_latency_us{quantile=\"0.99\"} 40\n") != std::string::npos);
+		CHECK(text.find("test_latency_us_count 1\n") != std::string::npos);
+		CHECK(text.find("test_latency_us_max 40\n") != std::string::npos);
+
+		std::string summary = registry.summary();
+		CHECK(summary.find("test_clients: 3\n") != std::string::npos);
+		CHECK(summary.find("test_latency_us: count=1") != std::string::npos);
+	}
+}
+
+TEST_SUITE("metrics::MetricsEndpoint") {
+	TEST_CASE("serves GET /metrics and rejects other paths") {
+		MetricsRegistry registry;
+		registry.counter("test_requests_total", "Requests").add(7);
+		MetricsEndpoint endpoint([&registry] { return registry.prometheus(); });
+		REQUIRE(endpoint.start(0));
+		REQUIRE(endpoint.port() > 0);
+
+		std::string ok = http_get(endpoint.port(), "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+		CHECK(ok.starts_with("HTTP/1.1 200 OK\r\n"));
+		CHECK(ok.find("test_requests_total 7\n") != std::string::npos);
+
+		std::string missing = http_get(endpoint.port(), "GET /other HTTP/1.1\r\n\r\n");
+		CHECK(missing.starts_with("HTTP/1.1 404"));
+
+		int port = endpoint.port();
+		endpoint.stop();
+		CHECK(http_get(port, "GET /metrics HTTP/1.1\r\n\r\n").empty());
+	}
+}
@@ -0,0 +1,80 @@
+#include "../server/rooms.h"
+#include "doctest/doctest.h"
+
+static RoomMember member(UserId id, size_t shard, int fd) {
+	return RoomMember{id, ClientRef{shard, fd, static_cast<uint64_t>(fd)}};
+}
+
+TEST_SUITE("rooms::RoomRegistry") {
+	TEST_CASE("create makes the owner the only member and speaker") {
+		RoomRegistry rooms;
+		auto roster = rooms.create("lobby", member(1, 0, 1));
+		REQUIRE(roster);
+		CHECK(roster->name == "lobby");
+		CHECK(roster->members.size() == 1);
+		CHECK(rooms.speaker_roster("lobby", ClientRef{0, 1, 1}) == roster);
+		CHECK_FALSE(rooms.create("lobby", member(2, 0, 2)));
+		CHECK_FALSE(rooms.join("missing", member(2, 0, 2)));
+	}
+
+	TEST_CASE("join publishes a new snapshot and keeps old ones intact") {
+		RoomRegistry rooms;
+		auto first = rooms.create("lobby", member(1, 0, 1));
+		auto second = rooms.join("lobby", member(2, 1, 2));
+		auto third = rooms.join("lobby", member(3, 1, 3));
+		REQUIRE(third);
+		CHECK(first->members.size() == 1);
+		CHECK(second->members.size() == 2);
+		CHECK(third->members.size() == 3);
+		CHECK(third->shards == std::vector<size_t>{0, 1});
+		CHECK(rooms.roster("lobby") == third);
+		CHECK_FALSE(rooms.speaker_roster("lobby", ClientRef{1, 2, 2}));
+	}
+
+	TEST_CASE("speaker role goes round the members") {
+		RoomRegistry rooms;
+		rooms.create("lobby", member(1, 0, 1));
+		rooms.join("lobby", member(2, 0, 2));
+		rooms.join("lobby", member(3, 0, 3));
+
+		CHECK_FALSE(rooms.pass_speaker("lobby", ClientRef{0, 2, 2}));
+		CHECK(rooms.pass_speaker("lobby", ClientRef{0, 1, 1})->id == 2);
+		CHECK(rooms.pass_speaker("lobby", ClientRef{0, 2, 2})->id == 3);
+		CHECK(rooms.pass_speaker("lobby", ClientRef{0, 3, 3})->id == 1);
+	}
+
+	TEST_CASE("leaving speaker hands over the role; last member removes the room") {
+		RoomRegistry rooms;
+		rooms.create("lobby", member(1, 0, 1));
+		rooms.join("lobby", member(2, 0, 2));
+		rooms.join("lobby", member(3, 0, 3));
+
+		RoomUpdate listener_left = rooms.leave("lobby", ClientRef{0, 3, 3});
+		REQUIRE(listener_left.roster);
+		CHECK(listener_left.roster->members.size() == 2);
+		CHECK_FALSE(listener_left.speaker);
+
+		RoomUpdate speaker_left = rooms.leave("lobby", ClientRef{0, 1, 1});
+		REQUIRE(speaker_left.speaker);
+		CHECK(speaker_left.speaker->id == 2);
+		CHECK(rooms.speaker_roster("lobby", ClientRef{0, 2, 2}));
+
+		// Чужой адрес (новое соединение на том же fd) ничего не меняет.
+		CHECK_FALSE(rooms.leave("lobby", ClientRef{0, 2, 7}).roster);
+		CHECK(rooms.list() == std::vector<std::pair<std::string, size_t>>{{"lobby", 1}});
+
+		RoomUpdate last = rooms.leave("lobby", ClientRef{0, 2, 2});
+		CHECK_FALSE(last.roster);
+		CHECK_FALSE(rooms.roster("lobby"));
+		CHECK(rooms.list().empty());
+	}
+
+	TEST_CASE("restore rebuilds a room with its speaker") {
+		RoomRegistry rooms;
+		CHECK_FALSE(rooms.restore("empty", {}, 0));
+		REQUIRE(rooms.restore("lobby", {member(1, 0, 1), member(2, 1, 2)}, 1));
+		CHECK(rooms.speaker_roster("lobby", ClientRef{1, 2, 2}));
+		CHECK(rooms.roster("lobby")->shards == std::vector<size_t>{0, 1});
+		CHECK_FALSE(rooms.restore("lobby", {member(3, 0, 3)}, 0));
+	}
+}
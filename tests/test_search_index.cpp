@@ -0,0 +1,185 @@
+#include "../server/search_index.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "doctest/doctest.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+	const std::string DIR = "SEARCH_INDEX_TEST";
+	const std::string BASE = DIR + "/history_1_2";
+
+	void reset_dir() {
+		fs::remove_all(DIR);
+		fs::create_directories(DIR);
+	}
+
+	std::vector<std::string> words(std::string_view text) {
+		std::vector<std::string> out;
+		tokenize(text, out);
+		return out;
+	}
+}  // namespace
+
+TEST_SUITE("search_index::tokenize") {
+	TEST_CASE("splits on punctuation and lowercases ASCII and Cyrillic") {
+		CHECK(words("Hello, WORLD! 42x  ") == std::vector<std::string>{"hello", "world", "42x"});
+		CHECK(words("Привет, ЁЖИК и Мир") == std::vector<std::string>{"привет", "ёжик", "и", "мир"});
+		CHECK(words("...").empty());
+	}
+
+	TEST_CASE("long words are truncated") {
+		std::vector<std::string> out = words(std::string(100, 'A'));
+		REQUIRE(out.size() == 1);
+		CHECK(out[0] == std::string(SearchIndex::MAX_TERM, 'a'));
+	}
+
+	TEST_CASE("message_body skips the timestamp and sender") {
+		CHECK(message_body("[2024-01-01 10:00] 123: hi there\n") == "hi there\n");
+		CHECK(message_body("raw line\n") == "raw line\n");
+	}
+}
+
+TEST_SUITE("search_index::SearchIndex") {
+	TEST_CASE("search intersects words and returns the newest first") {
+		reset_dir();
+		SearchIndex index(BASE);
+		index.open(0);
+		index.add(0, "[2024-01-01 10:00] 1: red apple\n");
+		index.add(1, "[2024-01-01 10:00] 2: green apple\n");
+		index.add(2, "[2024-01-01 10:00] 1: red car\n");
+		index.add(5, "out of order is ignored\n");
+		index.add(3, "[2024-01-01 10:00] 2: Red APPLE pie\n");
+		CHECK(index.end() == 4);
+
+		uint64_t total = 0;
+		CHECK(index.search("apple red", 10, &total) == std::vector<uint64_t>{3, 0});
+		CHECK(total == 2);
+		CHECK(index.search("apple", 2, &total) == std::vector<uint64_t>{3, 1});
+		CHECK(total == 3);
+		CHECK(index.search("apple bike", 10).empty());
+		CHECK(index.search("  ", 10).empty());
+		CHECK(index.search("1", 10).empty());  // отправитель не индексируется
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("records below from and skipped records are left out") {
+		reset_dir();
+		SearchIndex index(BASE);
+		index.open(0);
+		// Записи до 10 удалены политикой хранения: индекс продолжает с 10.
+		index.skip_to(10);
+		CHECK(index.end() == 10);
+		index.add(3, "too old\n");
+		index.add(10, "apple\n");
+		index.add(11, "apple pie\n");
+		index.add(12, "apple juice\n");
+		index.skip_to(5);
+		CHECK(index.end() == 13);
+
+		uint64_t total = 0;
+		CHECK(index.search("apple", 10, &total, 11) == std::vector<uint64_t>{12, 11});
+		CHECK(total == 2);
+		CHECK(index.search("old", 10).empty());
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("flushed segments survive reopening") {
+		reset_dir();
+		{
+			SearchIndex index(BASE);
+			index.open(0);
+			index.add(0, "one two\n");
+			REQUIRE(index.flush());
+			index.add(1, "two three\n");
+			index.add(2, "!!!\n");
+			REQUIRE(index.flush());
+			CHECK(index.pending() == 0);
+			CHECK(index.delta_segments() == 2);
+		}
+		SearchIndex index(BASE);
+		index.open(3);
+		CHECK(index.end() == 3);
+		CHECK(index.search("two", 10) == std::vector<uint64_t>{1, 0});
+		index.add(3, "two\n");
+		CHECK(index.search("two", 10) == std::vector<uint64_t>{3, 1, 0});
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("merge concatenates postings and keeps later deltas") {
+		reset_dir();
+		SearchIndex index(BASE);
+		index.open(0);
+		for (uint64_t r = 0; r < 400; ++r) {
+			index.add(r, r % 2 == 0 ? "even common\n" : "odd common\n");
+			if (r % 100 == 99)
+				REQUIRE(index.flush());
+		}
+		CHECK(index.plan_merge(5) == nullptr);
+		std::unique_ptr<SearchMerge> merge = index.plan_merge(4);
+		REQUIRE(merge != nullptr);
+		REQUIRE(merge->run());
+
+		// Сегмент, записанный во время слияния, остаётся в файле дельт.
+		index.add(400, "late common\n");
+		REQUIRE(index.flush());
+		REQUIRE(merge->commit());
+		index.reload();
+		CHECK(index.delta_segments() == 1);
+
+		uint64_t total = 0;
+		std::vector<uint64_t> found = index.search("common", 3, &total);
+		CHECK(total == 401);
+		CHECK(found == std::vector<uint64_t>{400, 399, 398});
+		CHECK(index.search("even", 500, &total).back() == 0);
+		CHECK(total == 200);
+
+		SearchIndex reopened(BASE);
+		reopened.open(401);
+		CHECK(reopened.end() == 401);
+		CHECK(reopened.search("late", 10) == std::vector<uint64_t>{400});
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("torn delta tail is cut off on open") {
+		reset_dir();
+		{
+			SearchIndex index(BASE);
+			index.open(0);
+			index.add(0, "kept\n");
+			REQUIRE(index.flush());
+			index.add(1, "lost\n");
+			REQUIRE(index.flush());
+		}
+		auto size = fs::file_size(BASE + ".sxd");
+		fs::resize_file(BASE + ".sxd", size - 10);  // больше, чем выравнивание сегмента
+
+		SearchIndex index(BASE);
+		index.open(2);
+		CHECK(index.end() == 1);
+		CHECK(index.delta_segments() == 1);
+		CHECK(index.search("kept", 10) == std::vector<uint64_t>{0});
+		CHECK(index.search("lost", 10).empty());
+		CHECK(fs::file_size(BASE + ".sxd") < size - 10);
+		fs::remove_all(DIR);
+	}
+
+	TEST_CASE("index covering more records than the log is dropped") {
+		reset_dir();
+		{
+			SearchIndex index(BASE);
+			index.open(0);
+			index.add(0, "a\n");
+			index.add(1, "b\n");
+			REQUIRE(index.flush());
+		}
+		SearchIndex index(BASE);
+		index.open(1);
+		CHECK(index.end() == 0);
+		CHECK_FALSE(fs::exists(BASE + ".sxd"));
+		fs::remove_all(DIR);
+	}
+}
@@ -0,0 +1,65 @@
+#include "../server/shard_inbox.h"
+#include "doctest/doctest.h"
+#include <poll.h>
+#include <thread>
+#include <vector>
+
+TEST_SUITE("shard_inbox") {
+	TEST_CASE("tasks run on the owner in posting order") {
+		ShardInbox inbox;
+		std::vector<int> seen;
+		for (int i = 0; i < 10; ++i)
+			inbox.post([&seen, i] { seen.push_back(i); });
+
+		pollfd pfd{inbox.notify_fd(), POLLIN, 0};
+		REQUIRE(poll(&pfd, 1, 0) == 1);
+		CHECK(inbox.run_pending() == 10);
+		CHECK(seen == std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+		CHECK(inbox.wakeups() == 1);
+		CHECK(inbox.posted() == 10);
+
+		pfd.revents = 0;
+		CHECK(poll(&pfd, 1, 0) == 0);
+		CHECK(inbox.run_pending() == 0);
+	}
+
+	TEST_CASE("tasks posted while running are executed in the same call") {
+		ShardInbox inbox;
+		int count = 0;
+		inbox.post([&] {
+			++count;
+			inbox.post([&] { ++count; });
+		});
+		CHECK(inbox.run_pending() == 2);
+		CHECK(count == 2);
+	}
+
+	TEST_CASE("posts from other threads keep per-thread order") {
+		ShardInbox inbox;
+		std::vector<std::vector<int>> seen(4);
+		std::vector<std::thread> producers;
+		for (int p = 0; p < 4; ++p)
+			producers.emplace_back([&inbox, &seen, p] {
+				for (int i = 0; i < 1000; ++i)
+					inbox.post([&seen, p, i] { seen[p].push_back(i); });
+			});
+
+		size_t done = 0;
+		while (done < 4000) {
+			pollfd pfd{inbox.notify_fd(), POLLIN, 0};
+			poll(&pfd, 1, 10);
+			done += inbox.run_pending();
+		}
+		for (auto& t : producers)
+			t.join();
+		done += inbox.run_pending();
+
+		CHECK(done == 4000);
+		std::vector<int> expect(1000);
+		for (int i = 0; i < 1000; ++i)
+			expect[i] = i;
+		for (const auto& v : seen)
+			CHECK(v == expect);
+		CHECK(inbox.wakeups() <= inbox.posted());
+	}
+}
@@ -0,0 +1,246 @@
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../socket_utils.h"
+#include "doctest/doctest.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+	std::vector<std::string> drain_lines(LineBuffer& buf) {
+		std::vector<std::string> lines;
+		std::string_view line;
+		while (buf.next_line(line))
+			lines.emplace_back(line);
+		return lines;
+	}
+}  // namespace
+
+TEST_SUITE("socket_utils::LineBuffer") {
+	TEST_CASE("splits several lines from one chunk") {
+		LineBuffer buf;
+		buf.append("one\ntwo\nthr", 11);
+
+		auto lines = drain_lines(buf);
+		REQUIRE(lines.size() == 2);
+		CHECK(lines[0] == "one");
+		CHECK(lines[1] == "two");
+		CHECK(buf.size() == 3);
+
+		buf.append("ee\n", 3);
+		lines = drain_lines(buf);
+		REQUIRE(lines.size() == 1);
+		CHECK(lines[0] == "three");
+		CHECK(buf.size() == 0);
+	}
+
+	TEST_CASE("empty lines are preserved") {
+		LineBuffer buf;
+		buf.append("\n\nx\n", 4);
+		auto lines = drain_lines(buf);
+		REQUIRE(lines.size() == 3);
+		CHECK(lines[0].empty());
+		CHECK(lines[2] == "x");
+	}
+
+	TEST_CASE("overlong partial line is reported") {
+		LineBuffer buf(8);
+		buf.append("0123456789", 10);
+		CHECK(drain_lines(buf).empty());
+		CHECK(buf.overflow());
+	}
+
+	TEST_CASE("fill reads non-blocking socket until EAGAIN") {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+		fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+		std::string big(2000, 'a');
+		REQUIRE(send_all(sv[1], big + "\npartial"));
+
+		LineBuffer buf;
+		CHECK(buf.fill(sv[0]) == ReadStatus::Drained);
+		auto lines = drain_lines(buf);
+		REQUIRE(lines.size() == 1);
+		CHECK(lines[0] == big);
+		CHECK(buf.size() == 7);
+
+		close(sv[1]);
+		CHECK(buf.fill(sv[0]) == ReadStatus::Closed);
+		close(sv[0]);
+	}
+}
+
+TEST_SUITE("socket_utils::OutputQueue") {
+	TEST_CASE("flush sends queued chunks in order") {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+
+		OutputQueue q;
+		q.push("abc");
+		q.push("");
+		q.push("def\n");
+		CHECK(q.size() == 7);
+		CHECK(q.flush(sv[0]) == FlushStatus::Drained);
+		CHECK(q.empty());
+		CHECK(q.sent() == 7);
+
+		char buf[16];
+		CHECK(recv(sv[1], buf, sizeof(buf), 0) == 7);
+		CHECK(std::string(buf, 7) == "abcdef\n");
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	TEST_CASE("full socket leaves the rest pending") {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+
+		OutputQueue q;
+		for (int i = 0; i < 64; ++i)
+			q.push(std::string(64 * 1024, 'x'));
+		CHECK(q.flush(sv[0]) == FlushStatus::Pending);
+		CHECK(q.size() > 0);
+		CHECK(q.peak() == 64u * 64 * 1024);
+		CHECK(q.sent() + q.size() == q.peak());
+
+		// Частично отправленный буфер продолжается с нужного байта.
+		std::string rest = q.contents();
+		CHECK(rest.size() == q.size());
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	TEST_CASE("shared chunks keep their owner alive until sent") {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+
+		auto owner = std::make_shared<std::string>("hello shared world\n");
+		std::weak_ptr<std::string> watch = owner;
+		OutputQueue q;
+		q.push("> ");
+		q.push_shared(owner, std::string_view(*owner).substr(6, 6));
+		q.push_shared(owner, std::string_view(*owner).substr(12));
+		owner.reset();
+		CHECK_FALSE(watch.expired());
+		CHECK(q.contents() == "> shared world\n");
+
+		CHECK(q.flush(sv[0]) == FlushStatus::Drained);
+		CHECK(watch.expired());
+		char buf[32];
+		CHECK(recv(sv[1], buf, sizeof(buf), 0) == 15);
+		CHECK(std::string(buf, 15) == "> shared world\n");
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	TEST_CASE("leased chunks are released once sent, across ring growth") {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+
+		static const std::string data = "0123456789";
+		int released = 0;
+		OutputQueue q;
+		for (int i = 0; i < 10; ++i)
+			q.push_lease(BufferLease([](void* ctx) { ++*static_cast<int*>(ctx); }, &released),
+			             std::string_view(data).substr(i, 1));
+		q.push_lease(BufferLease([](void* ctx) { ++*static_cast<int*>(ctx); }, &released), {});
+		CHECK(released == 1);
+		CHECK(q.contents() == data);
+
+		CHECK(q.flush(sv[0]) == FlushStatus::Drained);
+		CHECK(released == 11);
+		char buf[16];
+		CHECK(recv(sv[1], buf, sizeof(buf), 0) == 10);
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	TEST_CASE("gather describes the head and consume advances it") {
+		OutputQueue q;
+		q.push("abc");
+		q.push("defg");
+		q.push("h");
+		iovec iov[2];
+		REQUIRE(q.gather(iov, 2) == 2);
+		CHECK(std::string_view(static_cast<char*>(iov[0].iov_base), iov[0].iov_len) == "abc");
+		CHECK(std::string_view(static_cast<char*>(iov[1].iov_base), iov[1].iov_len) == "defg");
+
+		q.consume(5);
+		CHECK(q.size() == 3);
+		CHECK(q.sent() == 5);
+		REQUIRE(q.gather(iov, 2) == 2);
+		CHECK(std::string_view(static_cast<char*>(iov[0].iov_base), iov[0].iov_len) == "fg");
+		CHECK(q.contents() == "fgh");
+	}
+
+	TEST_CASE("closed peer is reported as error") {
+		int sv[2];
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+		close(sv[1]);
+
+		OutputQueue q;
+		q.push("data");
+		CHECK(q.flush(sv[0]) == FlushStatus::Error);
+		close(sv[0]);
+	}
+}
+
+TEST_SUITE("socket_utils::frames") {
+	TEST_CASE("frames round-trip through LineBuffer") {
+		std::string big(300, 'x');
+		std::string wire = encode_frame(FrameType::Text, "a\n*ENDM*\nb") + encode_frame(FrameType::End, "") +
+		                   encode_frame(FrameType::History, big);
+		CHECK(wire[0] == 11);                // длина однобайтовая: 10 байт данных + тип
+		CHECK(encode_frame(FrameType::History, big).size() == 2 + 1 + 300);
+
+		LineBuffer in;
+		FrameType type;
+		std::string_view payload;
+		// Кадры приходят по байту: до полного кадра next_frame() ничего не выдаёт.
+		std::vector<std::pair<FrameType, std::string>> got;
+		for (char c : wire) {
+			in.append(&c, 1);
+			while (in.next_frame(type, payload))
+				got.emplace_back(type, std::string(payload));
+		}
+		REQUIRE(got.size() == 3);
+		CHECK(got[0] == std::make_pair(FrameType::Text, std::string("a\n*ENDM*\nb")));
+		CHECK(got[1] == std::make_pair(FrameType::End, std::string()));
+		CHECK(got[2] == std::make_pair(FrameType::History, big));
+		CHECK(in.size() == 0);
+		CHECK_FALSE(in.overflow());
+	}
+
+	TEST_CASE("lines and frames share one buffer") {
+		LineBuffer in;
+		std::string wire = std::string(PROTOCOL_HELLO) + "\n" + encode_frame(FrameType::Text, "/help");
+		in.append(wire.data(), wire.size());
+
+		std::string_view line;
+		REQUIRE(in.next_line(line));
+		CHECK(line == PROTOCOL_HELLO);
+		FrameType type;
+		REQUIRE(in.next_frame(type, line));
+		CHECK(type == FrameType::Text);
+		CHECK(line == "/help");
+	}
+
+	TEST_CASE("oversized or malformed frame is reported as overflow") {
+		LineBuffer small(16);
+		std::string frame = encode_frame(FrameType::Text, std::string(17, 'y'));
+		small.append(frame.data(), frame.size());
+		FrameType type;
+		std::string_view payload;
+		CHECK_FALSE(small.next_frame(type, payload));
+		CHECK(small.overflow());
+
+		LineBuffer bad;
+		const char garbage[] = "\xff\xff\xff\xff\xff\xff";
+		bad.append(garbage, 6);
+		CHECK_FALSE(bad.next_frame(type, payload));
+		CHECK(bad.overflow());
+	}
+}
@@ -28,4 +28,16 @@ TEST_SUITE("telegram_auth") {
 		CHECK_FALSE(verify_auth_code("42", "000000"));
 		CHECK_FALSE(verify_auth_code("99", "123456"));
 	}
+
+	TEST_CASE("forget_auth_code drops only the matching code") {
+		auth_codes.clear();
+		store_auth_code("42", "111111");
+		store_auth_code("42", "222222");  // Новый код того же чата.
+
+		CHECK_FALSE(forget_auth_code("42", "111111"));
+		CHECK(verify_auth_code("42", "222222"));
+		CHECK(forget_auth_code("42", "222222"));
+		CHECK_FALSE(verify_auth_code("42", "222222"));
+		CHECK(auth_codes.empty());
+	}
 }
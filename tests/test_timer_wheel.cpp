@@ -0,0 +1,106 @@
+#include "../server/timer_wheel.h"
+
+#include <functional>
+#include <vector>
+
+#include "doctest/doctest.h"
+
+using namespace std::chrono_literals;
+
+TEST_SUITE("timer_wheel::TimerWheel") {
+	const TimerWheel::Clock::time_point t0{};
+
+	TEST_CASE("timers fire in deadline order, not before their delay") {
+		TimerWheel wheel(100ms, t0);
+		std::vector<int> fired;
+		wheel.schedule(250ms, [&] { fired.push_back(2); });
+		wheel.schedule(100ms, [&] { fired.push_back(1); });
+		CHECK(wheel.size() == 2);
+
+		CHECK(wheel.advance(t0 + 199ms) == 0);
+		CHECK(wheel.advance(t0 + 200ms) == 1);
+		CHECK(wheel.advance(t0 + 399ms) == 0);
+		CHECK(wheel.advance(t0 + 400ms) == 1);
+		CHECK(fired == std::vector<int>{1, 2});
+		CHECK(wheel.size() == 0);
+	}
+
+	TEST_CASE("long delays cascade down through every level") {
+		TimerWheel wheel(1ms, t0);
+		std::vector<int64_t> at;
+		const std::vector<int64_t> delays = {5, 63, 64, 65, 4095, 4096, 5000, 262144, 300000};
+		for (int64_t d : delays)
+			wheel.schedule(std::chrono::milliseconds(d), [&, d] { at.push_back(d); });
+
+		for (int64_t d : delays) {
+			CHECK(wheel.advance(t0 + std::chrono::milliseconds(d)) == 0);
+			CHECK(wheel.advance(t0 + std::chrono::milliseconds(d + 1)) == 1);
+		}
+		CHECK(at == delays);
+	}
+
+	TEST_CASE("cancel is exact and stale ids are rejected") {
+		TimerWheel wheel(10ms, t0);
+		int runs = 0;
+		TimerId a = wheel.schedule(50ms, [&] { ++runs; });
+		TimerId b = wheel.schedule(50ms, [&] { ++runs; });
+		CHECK(wheel.cancel(a));
+		CHECK_FALSE(wheel.cancel(a));
+		CHECK_FALSE(wheel.cancel(NO_TIMER));
+
+		// Узел a переиспользуется, но старый номер его не отменяет.
+		TimerId c = wheel.schedule(50ms, [&] { runs += 10; });
+		CHECK(static_cast<uint32_t>(c) == static_cast<uint32_t>(a));
+		CHECK_FALSE(wheel.cancel(a));
+
+		wheel.advance(t0 + 1s);
+		CHECK(runs == 11);
+		CHECK_FALSE(wheel.cancel(b));
+	}
+
+	TEST_CASE("handlers may reschedule and cancel other due timers") {
+		TimerWheel wheel(10ms, t0);
+		int rearmed = 0;
+		std::function<void()> rearm = [&] {
+			if (++rearmed < 3)
+				wheel.schedule(10ms, rearm);
+		};
+		wheel.schedule(10ms, rearm);
+
+		// Два таймера одного тика отменяют друг друга: выполняется ровно один.
+		TimerId first = NO_TIMER, second = NO_TIMER;
+		int ran = 0;
+		first = wheel.schedule(10ms, [&] { ran += wheel.cancel(second) ? 1 : 100; });
+		second = wheel.schedule(10ms, [&] { ran += wheel.cancel(first) ? 1 : 100; });
+
+		wheel.advance(t0 + 1s);
+		CHECK(rearmed == 3);
+		CHECK(ran == 1);
+		CHECK(wheel.size() == 0);
+	}
+
+	TEST_CASE("event loop timeout tracks the next due slot") {
+		TimerWheel wheel(100ms, t0);
+		CHECK(wheel.ms_until_next(t0) == -1);
+
+		wheel.schedule(300ms, [] {});
+		CHECK(wheel.ms_until_next(t0) == 400);
+		CHECK(wheel.ms_until_next(t0 + 50ms) == 350);
+		CHECK(wheel.ms_until_next(t0 + 1s) == 0);
+
+		// Дальний таймер: просыпаемся к каскаду уровня 0 (64 тика).
+		TimerWheel far(100ms, t0);
+		far.schedule(1h, [] {});
+		CHECK(far.ms_until_next(t0) == 6400);
+	}
+
+	TEST_CASE("an idle wheel skips elapsed time at once") {
+		TimerWheel wheel(1ms, t0);
+		CHECK(wheel.advance(t0 + 24h) == 0);
+		int runs = 0;
+		wheel.schedule(1ms, [&] { ++runs; });
+		wheel.advance(t0 + 24h + 2ms);
+		CHECK(runs == 1);
+		CHECK(wheel.now() == t0 + 24h + 2ms);
+	}
+}
@@ -0,0 +1,73 @@
+#include "../server/fd_table.h"
+#include "../server/user_ids.h"
+#include "doctest/doctest.h"
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_SUITE("user_ids::UserIdTable") {
+	TEST_CASE("ids are dense and stable") {
+		UserIdTable ids;
+		CHECK(ids.find("123") == NO_USER);
+		UserId a = ids.intern("123");
+		UserId b = ids.intern("456");
+		CHECK(a == 0);
+		CHECK(b == 1);
+		CHECK(ids.intern("123") == a);
+		CHECK(ids.find("456") == b);
+		CHECK(ids.name(a) == "123");
+		CHECK(ids.name(NO_USER).empty());
+		CHECK(ids.size() == 2);
+	}
+
+	TEST_CASE("names stay valid when new chunks are added") {
+		UserIdTable ids;
+		const std::string& first = ids.name(ids.intern("first"));
+		for (size_t i = 0; i < UserIdTable::CHUNK_SIZE * 2; ++i)
+			ids.intern("user" + std::to_string(i));
+		CHECK(first == "first");
+		CHECK(ids.name(ids.find("user5000")) == "user5000");
+		CHECK(ids.size() == UserIdTable::CHUNK_SIZE * 2 + 1);
+	}
+
+	TEST_CASE("concurrent interning agrees on one id per name") {
+		UserIdTable ids;
+		std::vector<std::vector<UserId>> seen(4);
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < 4; ++t)
+			threads.emplace_back([&ids, &seen, t] {
+				for (int i = 0; i < 1000; ++i)
+					seen[t].push_back(ids.intern(std::to_string(i)));
+			});
+		for (auto& th : threads)
+			th.join();
+		CHECK(ids.size() == 1000);
+		for (size_t t = 1; t < 4; ++t)
+			CHECK(seen[t] == seen[0]);
+		CHECK(ids.name(seen[0][42]) == "42");
+	}
+}
+
+TEST_SUITE("fd_table::FdTable") {
+	TEST_CASE("insert, find, erase and iterate by fd") {
+		FdTable<std::string> table;
+		CHECK_FALSE(table.contains(5));
+		CHECK(table.find(-1) == nullptr);
+		table[5] = "five";
+		table[2] = "two";
+		CHECK(table.size() == 2);
+		REQUIRE(table.find(5) != nullptr);
+		CHECK(*table.find(5) == "five");
+		CHECK_FALSE(table.contains(3));
+
+		std::vector<int> fds;
+		table.for_each([&fds](int fd, std::string&) { fds.push_back(fd); });
+		CHECK(fds == std::vector<int>{2, 5});
+
+		CHECK(table.erase(5));
+		CHECK_FALSE(table.erase(5));
+		CHECK(table.size() == 1);
+		table.clear();
+		CHECK(table.empty());
+	}
+}